@@ -0,0 +1,385 @@
+/* asr-bench.c
+ * Runs the bundled speech-like fixtures through the model, the line
+ * generator and history the way the live captioning path does, and writes
+ * the realtime factor, per-chunk latency, peak memory and allocations as
+ * JSON so that runs can be compared over time.
+ *
+ * Usage: asr-bench [--model PATH] [--fixture NAME]... [--json PATH] [--no-vad]
+ *
+ * Audio goes through voice activity detection first, as it does by default
+ * when captioning. --no-vad feeds everything that is not long silence.
+ *
+ * The model defaults to APRIL_MODEL_PATH or the bundled model. Exits with 77
+ * (skipped) if no model can be loaded.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <glib.h>
+#include <april_api.h>
+
+#include "bench-alloc.h"
+#include "bench-layout.h"
+#include "speech-fixture.h"
+#include "latency.h"
+#include "line-gen.h"
+#include "history.h"
+#include "pcm-level.h"
+#include "vad.h"
+#include "common.h"
+
+#define EXIT_SKIPPED 77
+
+// The size capture callbacks usually hand over
+#define CHUNK_MS 50
+
+struct fixture_result {
+    const struct speech_fixture *fixture;
+
+    double audio_seconds;
+    double fed_seconds;
+    double processing_seconds;
+
+    size_t chunks;
+    size_t samples_fed;
+    size_t flushes;
+    size_t partials;
+    size_t finals;
+    size_t silences;
+
+    struct latency_summary chunk_latency;
+    int64_t allocations;
+};
+
+struct bench_session {
+    struct line_generator line;
+    struct fixture_result *result;
+};
+
+// Does what april_result_handler in asrproc does, minus the UI
+static void bench_result_handler(void *userdata, AprilResultType result, size_t count, const AprilToken *tokens) {
+    struct bench_session *session = userdata;
+
+    switch(result) {
+        case APRIL_RESULT_RECOGNITION_PARTIAL:
+        case APRIL_RESULT_RECOGNITION_FINAL:
+            line_generator_update(&session->line, count, tokens);
+
+            if(result == APRIL_RESULT_RECOGNITION_FINAL) {
+                line_generator_finalize(&session->line);
+                commit_tokens_to_current_history(tokens, count);
+                session->result->finals++;
+            } else {
+                session->result->partials++;
+            }
+            break;
+
+        case APRIL_RESULT_SILENCE:
+            line_generator_break(&session->line);
+            save_silence_to_history();
+            session->result->silences++;
+            break;
+
+        default:
+            break;
+    }
+}
+
+static bool is_silent(const short *data, size_t count) {
+    struct pcm_level level;
+    pcm_level_scan(data, count, &level);
+    return pcm_level_is_silent(&level, SILENCE_THRESHOLD);
+}
+
+// Feeds what the vad takes for speech like feed_speech does, holding the
+// part of a frame that is left over until the next chunk
+static void feed_speech(AprilASRSession april_session, struct vad *vad, short *frame, size_t *frame_fill,
+                        short *preroll, const short *data, size_t count, struct fixture_result *result) {
+    size_t frame_samples = vad_frame_samples(vad);
+
+    while(count > 0) {
+        size_t take = MIN(frame_samples - *frame_fill, count);
+        memcpy(&frame[*frame_fill], data, take * sizeof(short));
+
+        *frame_fill += take;
+        data += take;
+        count -= take;
+
+        if(*frame_fill < frame_samples) break;
+        *frame_fill = 0;
+
+        switch(vad_process_frame(vad, frame)) {
+            case VAD_SPEECH_START: {
+                size_t preroll_count = vad_take_preroll(vad, preroll);
+                aas_feed_pcm16(april_session, preroll, preroll_count);
+                result->samples_fed += preroll_count;
+                break;
+            }
+
+            case VAD_SPEECH:
+                aas_feed_pcm16(april_session, frame, frame_samples);
+                result->samples_fed += frame_samples;
+                break;
+
+            case VAD_SPEECH_END:
+                aas_flush(april_session);
+                result->flushes++;
+                break;
+
+            case VAD_SILENCE:
+                break;
+        }
+    }
+}
+
+static void run_fixture(AprilASRModel model, const struct speech_fixture *fixture, bool use_vad, struct fixture_result *result) {
+    int sample_rate = (int)aam_get_sample_rate(model);
+
+    memset(result, 0, sizeof(*result));
+    result->fixture = fixture;
+
+    size_t num_samples = speech_fixture_samples(fixture, sample_rate);
+    short *audio = malloc(num_samples * sizeof(short));
+
+    struct speech_synth synth;
+    speech_synth_init(&synth, fixture, sample_rate);
+    speech_synth_fill(&synth, audio, num_samples);
+
+    struct bench_session session;
+    session.result = result;
+    line_generator_init(&session.line);
+
+    int max_text_width;
+    PangoLayout *layout = bench_create_layout(&max_text_width);
+    line_generator_set_layout(&session.line, layout, max_text_width, 1);
+
+    // Synchronous, so every result is handled within the feed that caused it
+    // and the time of a feed covers all of the work for that chunk
+    AprilConfig config = {
+        .handler = bench_result_handler,
+        .userdata = &session,
+        .flags = APRIL_CONFIG_FLAG_ZERO_BIT
+    };
+
+    AprilASRSession april_session = aas_create_session(model, config);
+    g_assert(april_session != NULL);
+
+    static struct latency_histogram chunk_latency;
+    latency_histogram_reset(&chunk_latency);
+
+    size_t chunk_samples = (size_t)sample_rate * CHUNK_MS / 1000;
+    size_t silence_counter = 0;
+
+    static struct vad vad;
+    static short vad_frame[VAD_MAX_FRAME];
+    static short vad_preroll[VAD_MAX_PREROLL_FRAMES * VAD_MAX_FRAME];
+    size_t vad_frame_fill = 0;
+    vad_init(&vad, sample_rate, false);
+
+    int64_t allocations_before = bench_alloc_count();
+    gint64 begin = g_get_monotonic_time();
+
+    for(size_t pos=0; pos<num_samples; pos+=chunk_samples) {
+        size_t count = MIN(chunk_samples, num_samples - pos);
+
+        gint64 chunk_begin = g_get_monotonic_time();
+
+        if(use_vad) {
+            feed_speech(april_session, &vad, vad_frame, &vad_frame_fill, vad_preroll, &audio[pos], count, result);
+        } else {
+            // Long silences get flushed instead of fed, like feed_audio does
+            silence_counter = is_silent(&audio[pos], count) ? (silence_counter + count) : 0;
+            if(silence_counter >= SILENCE_FLUSH_SAMPLES) {
+                silence_counter = SILENCE_FLUSH_SAMPLES;
+                aas_flush(april_session);
+                result->flushes++;
+            } else {
+                aas_feed_pcm16(april_session, &audio[pos], count);
+                result->samples_fed += count;
+            }
+        }
+
+        latency_histogram_record(&chunk_latency, g_get_monotonic_time() - chunk_begin);
+        result->chunks++;
+    }
+
+    aas_flush(april_session);
+
+    gint64 end = g_get_monotonic_time();
+    int64_t allocations_after = bench_alloc_count();
+
+    result->audio_seconds = (double)num_samples / (double)sample_rate;
+    result->fed_seconds = (double)result->samples_fed / (double)sample_rate;
+    result->processing_seconds = (double)(end - begin) / 1000000.0;
+    result->allocations = (allocations_before < 0) ? -1 : (allocations_after - allocations_before);
+    latency_histogram_summarize(&chunk_latency, &result->chunk_latency);
+
+    aas_free(april_session);
+    line_generator_free(&session.line);
+    free(audio);
+}
+
+static void json_append_string(GString *json, const char *text) {
+    g_string_append_c(json, '"');
+    for(const char *p = text; *p; p++) {
+        unsigned char c = (unsigned char)*p;
+        if((c == '"') || (c == '\\')) g_string_append_printf(json, "\\%c", c);
+        else if(c < 0x20) g_string_append_printf(json, "\\u%04x", c);
+        else g_string_append_c(json, (char)c);
+    }
+    g_string_append_c(json, '"');
+}
+
+static void json_append_result(GString *json, const struct fixture_result *r, const char *indent) {
+    double rtf = (r->audio_seconds > 0.0) ? (r->processing_seconds / r->audio_seconds) : 0.0;
+    double speed = (r->processing_seconds > 0.0) ? (r->audio_seconds / r->processing_seconds) : 0.0;
+
+    g_string_append_printf(json, "%s\"audio_seconds\": %.3f,\n", indent, r->audio_seconds);
+    g_string_append_printf(json, "%s\"fed_seconds\": %.3f,\n", indent, r->fed_seconds);
+    g_string_append_printf(json, "%s\"processing_seconds\": %.3f,\n", indent, r->processing_seconds);
+    g_string_append_printf(json, "%s\"realtime_factor\": %.4f,\n", indent, rtf);
+    g_string_append_printf(json, "%s\"speed\": %.3f,\n", indent, speed);
+    g_string_append_printf(json, "%s\"chunks\": %zu,\n", indent, r->chunks);
+    g_string_append_printf(json, "%s\"chunk_latency_ms\": { \"mean\": %.3f, \"p50\": %.3f, \"p99\": %.3f, \"max\": %.3f },\n",
+                           indent, r->chunk_latency.mean_ms, r->chunk_latency.p50_ms, r->chunk_latency.p99_ms, r->chunk_latency.max_ms);
+    g_string_append_printf(json, "%s\"partials\": %zu,\n", indent, r->partials);
+    g_string_append_printf(json, "%s\"finals\": %zu,\n", indent, r->finals);
+    g_string_append_printf(json, "%s\"silences\": %zu,\n", indent, r->silences);
+    g_string_append_printf(json, "%s\"flushes\": %zu,\n", indent, r->flushes);
+    g_string_append_printf(json, "%s\"allocations\": %" G_GINT64_FORMAT "\n", indent, r->allocations);
+}
+
+int main(int argc, char **argv) {
+    const char *model_path = NULL;
+    const char *json_path = "asr-bench.json";
+    const char *fixture_names[argc];
+    size_t num_fixture_names = 0;
+    bool use_vad = true;
+
+    for(int i=1; i<argc; i++) {
+        if((strcmp(argv[i], "--model") == 0) && ((i + 1) < argc)) {
+            model_path = argv[++i];
+        } else if((strcmp(argv[i], "--fixture") == 0) && ((i + 1) < argc)) {
+            fixture_names[num_fixture_names++] = argv[++i];
+        } else if((strcmp(argv[i], "--json") == 0) && ((i + 1) < argc)) {
+            json_path = argv[++i];
+        } else if(strcmp(argv[i], "--no-vad") == 0) {
+            use_vad = false;
+        } else {
+            fprintf(stderr, "Usage: %s [--model PATH] [--fixture NAME]... [--json PATH] [--no-vad]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if(model_path == NULL) model_path = GET_MODEL_PATH();
+
+    const struct speech_fixture *fixtures[num_speech_fixtures + num_fixture_names];
+    size_t num_fixtures = 0;
+    if(num_fixture_names == 0) {
+        for(size_t i=0; i<num_speech_fixtures; i++) fixtures[num_fixtures++] = &speech_fixtures[i];
+    } else {
+        for(size_t i=0; i<num_fixture_names; i++) {
+            fixtures[num_fixtures] = speech_fixture_find(fixture_names[i]);
+            if(fixtures[num_fixtures] == NULL) {
+                fprintf(stderr, "Unknown fixture %s\n", fixture_names[i]);
+                return 2;
+            }
+            num_fixtures++;
+        }
+    }
+
+    aam_api_init(APRIL_VERSION);
+
+    AprilASRModel model = aam_create_model(model_path);
+    if(model == NULL) {
+        printf("Loading model %s failed, skipping. Set APRIL_MODEL_PATH or pass --model.\n", model_path);
+        return EXIT_SKIPPED;
+    }
+
+    history_init();
+
+    struct fixture_result results[num_fixtures];
+    struct fixture_result total = { 0 };
+    for(size_t i=0; i<num_fixtures; i++) {
+        run_fixture(model, fixtures[i], use_vad, &results[i]);
+
+        const struct fixture_result *r = &results[i];
+        printf("%-14s %6.1f s audio %6.1f s fed %7.2fx realtime  chunk p50 %6.2f ms p99 %6.2f ms  %zu partials %zu finals\n",
+               r->fixture->name, r->audio_seconds, r->fed_seconds, r->audio_seconds / r->processing_seconds,
+               r->chunk_latency.p50_ms, r->chunk_latency.p99_ms, r->partials, r->finals);
+
+        total.audio_seconds += r->audio_seconds;
+        total.fed_seconds += r->fed_seconds;
+        total.processing_seconds += r->processing_seconds;
+        total.chunks += r->chunks;
+        total.partials += r->partials;
+        total.finals += r->finals;
+        total.silences += r->silences;
+        total.flushes += r->flushes;
+        total.allocations = (r->allocations < 0) ? -1 : (total.allocations + r->allocations);
+    }
+
+    GString *json = g_string_new("{\n");
+
+    g_string_append(json, "  \"model\": ");
+    json_append_string(json, aam_get_name(model));
+    g_string_append(json, ",\n  \"model_path\": ");
+    json_append_string(json, model_path);
+    g_string_append_printf(json, ",\n  \"sample_rate\": %zu,\n", aam_get_sample_rate(model));
+    g_string_append_printf(json, "  \"chunk_ms\": %d,\n", CHUNK_MS);
+    g_string_append_printf(json, "  \"vad\": %s,\n", use_vad ? "true" : "false");
+    g_string_append_printf(json, "  \"peak_rss_kib\": %" G_GINT64_FORMAT ",\n", bench_peak_rss_kib());
+
+    g_string_append(json, "  \"fixtures\": [\n");
+    for(size_t i=0; i<num_fixtures; i++) {
+        g_string_append(json, "    {\n      \"name\": ");
+        json_append_string(json, results[i].fixture->name);
+        g_string_append(json, ",\n");
+        json_append_result(json, &results[i], "      ");
+        g_string_append_printf(json, "    }%s\n", ((i + 1) < num_fixtures) ? "," : "");
+    }
+    g_string_append(json, "  ],\n");
+
+    // Percentiles do not add up across fixtures, the total leaves them out
+    double total_rtf = total.processing_seconds / total.audio_seconds;
+    g_string_append(json, "  \"total\": {\n");
+    g_string_append_printf(json, "    \"audio_seconds\": %.3f,\n", total.audio_seconds);
+    g_string_append_printf(json, "    \"fed_seconds\": %.3f,\n", total.fed_seconds);
+    g_string_append_printf(json, "    \"processing_seconds\": %.3f,\n", total.processing_seconds);
+    g_string_append_printf(json, "    \"realtime_factor\": %.4f,\n", total_rtf);
+    g_string_append_printf(json, "    \"speed\": %.3f,\n", 1.0 / total_rtf);
+    g_string_append_printf(json, "    \"partials\": %zu,\n", total.partials);
+    g_string_append_printf(json, "    \"finals\": %zu,\n", total.finals);
+    g_string_append_printf(json, "    \"allocations\": %" G_GINT64_FORMAT "\n", total.allocations);
+    g_string_append(json, "  }\n}\n");
+
+    int ret = 0;
+    if(!g_file_set_contents(json_path, json->str, (gssize)json->len, NULL)) {
+        fprintf(stderr, "Writing %s failed\n", json_path);
+        ret = 1;
+    } else {
+        printf("Results written to %s\n", json_path);
+    }
+
+    g_string_free(json, TRUE);
+    aam_free(model);
+
+    return ret;
+}
@@ -0,0 +1,112 @@
+/* bench-alloc.c
+ * Implements allocation counting by defining the malloc family in the
+ * executable. The dynamic linker resolves every library's calls to these,
+ * and they forward to glibc's own implementation. The whole family is
+ * defined, free included, so nothing else gets to replace only part of it.
+ * Sanitizers bring their own allocator, so counting is left out there.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench-alloc.h"
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <sys/resource.h>
+
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#define BENCH_ALLOC_SANITIZED
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(thread_sanitizer) || __has_feature(memory_sanitizer)
+#define BENCH_ALLOC_SANITIZED
+#endif
+#endif
+
+#if defined(__GLIBC__) && !defined(BENCH_ALLOC_SANITIZED)
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static atomic_int_least64_t allocations = 0;
+
+void *malloc(size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) {
+    // memalign would round these up instead of failing
+    if((alignment < sizeof(void *)) || (alignment & (alignment - 1)) != 0) return EINVAL;
+
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    void *ptr = __libc_memalign(alignment, size);
+    if(ptr == NULL) return ENOMEM;
+
+    *out = ptr;
+    return 0;
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+int64_t bench_alloc_count(void) {
+    return atomic_load_explicit(&allocations, memory_order_relaxed);
+}
+
+#else
+
+int64_t bench_alloc_count(void) {
+    return -1;
+}
+
+#endif
+
+int64_t bench_peak_rss_kib(void) {
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0) return -1;
+
+#ifdef __APPLE__
+    // Bytes on macOS, KiB everywhere else
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
@@ -0,0 +1,31 @@
+/* bench-alloc.h
+ * Counts heap allocations made by the benchmark process, including the
+ * ones made inside GLib, Pango and april-asr.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// Number of malloc, calloc, realloc and aligned allocation calls so far.
+// Returns -1 where they cannot be counted, which is anywhere but glibc, and
+// in sanitizer builds.
+int64_t bench_alloc_count(void);
+
+// Peak resident set size of the process so far, in KiB
+int64_t bench_peak_rss_kib(void);
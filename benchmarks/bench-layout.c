@@ -0,0 +1,49 @@
+/* bench-layout.c
+ * Implements bench_create_layout
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench-layout.h"
+
+#include <pango/pangocairo.h>
+
+static const char width_template[] = "This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License";
+
+PangoLayout *bench_create_layout(int *max_text_width) {
+    // Not freed, layouts copied from this one keep referring to it
+    static PangoContext *context = NULL;
+    if(context == NULL) {
+        PangoFontMap *font_map = pango_cairo_font_map_new();
+        context = pango_font_map_create_context(font_map);
+        g_object_unref(font_map);
+    }
+
+    PangoLayout *layout = pango_layout_new(context);
+
+    PangoFontDescription *desc = pango_font_description_from_string(BENCH_FONT);
+    pango_layout_set_font_description(layout, desc);
+    pango_font_description_free(desc);
+
+    int width, height;
+    pango_layout_set_width(layout, -1);
+    pango_layout_set_text(layout, width_template, BENCH_LINE_WIDTH);
+    pango_layout_get_size(layout, &width, &height);
+
+    *max_text_width = width / PANGO_SCALE;
+
+    return layout;
+}
@@ -0,0 +1,30 @@
+/* bench-layout.h
+ * Makes a PangoLayout for the line generator without a display, set up the
+ * way LiveCaptionsWindow sets up its own with the default settings.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <pango/pango.h>
+
+#define BENCH_FONT "Sans Regular 24"
+#define BENCH_LINE_WIDTH 50
+
+// Returns a new layout and sets max_text_width to the width in pixels of
+// BENCH_LINE_WIDTH characters of text, as the window does
+PangoLayout *bench_create_layout(int *max_text_width);
@@ -0,0 +1,244 @@
+/* line-markup-bench.c
+ * Compares setting caption lines as markup, which Pango has to parse again
+ * on every update, against what the line generator does now: plain text
+ * with an attribute list. An utterance grows by a couple of tokens per
+ * partial on a line wide enough to hold all of it, as when someone talks
+ * for a while without a pause.
+ *
+ * The markup side is a copy of how lines used to be built, kept here as a
+ * reference. The other side runs line_generator_update and
+ * line_generator_set_text themselves. Setting a label needs a display, so
+ * without one the labels are left out of both sides.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <glib.h>
+#include <gtk/gtk.h>
+#include <pango/pango.h>
+#include <april_api.h>
+
+#include "bench-layout.h"
+#include "line-gen.h"
+#include "render-config.h"
+
+// Stays under AC_MAX_TOKENS, and under AC_LINE_MAX bytes on one line
+#define BENCH_TOKENS 800
+#define BENCH_ROUNDS 5
+
+// How much an utterance grows per partial
+#define TOKENS_PER_PARTIAL 2
+
+#define NUM_PARTIALS ((BENCH_TOKENS + TOKENS_PER_PARTIAL - 1) / TOKENS_PER_PARTIAL)
+
+#define ALPHA_LEVELS 64
+#define ALPHA_MIN 10000
+#define ALPHA_MAX 65535
+
+static const char *vocabulary[] = {
+    " THE", " AND", " HE", "LLO", " WOR", "LD", " SH", "IT", " SHI", "FT",
+    " IT'S", " TODAY", " WE", "'RE", " A", " MOTHER", " SCUNTHORPE", " CL",
+    "ASS", "IC", " 2022",
+};
+
+#define VOCABULARY_SIZE (sizeof(vocabulary) / sizeof(vocabulary[0]))
+
+// Spans take far more room than the text they wrap, so the markup of the
+// whole utterance gets a bigger line than the text does
+#define MARKUP_LINE_MAX (AC_LINE_MAX * 16)
+
+struct markup_line {
+    char text[MARKUP_LINE_MAX];
+    size_t head;
+};
+
+static uint16_t token_alpha(float logprob) {
+    int alpha = (int)((logprob + 2.0) / 8.0 * 65536.0);
+    alpha /= 2.0;
+    alpha += 32768;
+    if(alpha < ALPHA_MIN) alpha = ALPHA_MIN;
+    if(alpha > ALPHA_MAX) alpha = ALPHA_MAX;
+
+    int level = ((alpha - ALPHA_MIN) * (ALPHA_LEVELS - 1) + (ALPHA_MAX - ALPHA_MIN) / 2) / (ALPHA_MAX - ALPHA_MIN);
+    return (uint16_t)(ALPHA_MIN + (level * (ALPHA_MAX - ALPHA_MIN)) / (ALPHA_LEVELS - 1));
+}
+
+// The old way for one partial: a formatted span for every token, which
+// gtk_label_set_markup parses back into text and attributes, and the
+// plaintext parsed out of the markup once more for streaming
+static size_t render_markup(struct markup_line *lines, const AprilToken *tokens, size_t count, char *output, char *plaintext, GtkLabel *label) {
+    size_t j = 0;
+    for(int l=0; l<AC_LINE_COUNT; l++){
+        struct markup_line *curr = &lines[l];
+        curr->head = 0;
+        curr->text[0] = '\0';
+
+        for(; j<count; j++){
+            if(curr->head > (MARKUP_LINE_MAX - 256)) break;
+
+            curr->head += sprintf(&curr->text[curr->head], "<span fgalpha=\"%d\">%s</span>", token_alpha(tokens[j].logprob), tokens[j].token);
+        }
+    }
+
+    char *head = output;
+    *head = '\0';
+    for(int l=0; l<AC_LINE_COUNT; l++){
+        head += sprintf(head, "%s", lines[l].text);
+        if(l != AC_LINE_COUNT - 1) head += sprintf(head, "\n");
+    }
+
+    if(label != NULL) {
+        gtk_label_set_markup(label, output);
+    } else {
+        PangoAttrList *attrs = NULL;
+        char *text = NULL;
+        if(!pango_parse_markup(output, -1, 0, &attrs, &text, NULL, NULL)) {
+            printf("Invalid markup\n");
+            exit(1);
+        }
+        g_free(text);
+        pango_attr_list_unref(attrs);
+    }
+
+    head = plaintext;
+    *head = '\0';
+    for(int l=0; l<AC_LINE_COUNT; l++){
+        bool inside_markup = false;
+        for(size_t i=0; i<lines[l].head; i++) {
+            if(lines[l].text[i] == '<') {
+                inside_markup = true;
+                continue;
+            }else if(lines[l].text[i] == '>') {
+                inside_markup = false;
+                continue;
+            }else if(inside_markup) {
+                continue;
+            }
+
+            *head++ = lines[l].text[i];
+        }
+        if(l != AC_LINE_COUNT - 1) *head++ = '\n';
+    }
+    *head = '\0';
+
+    return (size_t)(head - plaintext);
+}
+
+static size_t run_markup(struct markup_line *lines, const AprilToken *tokens, char *output, char *plaintext, GtkLabel *label) {
+    size_t written = 0;
+
+    for(size_t shown = TOKENS_PER_PARTIAL; shown < BENCH_TOKENS + TOKENS_PER_PARTIAL; shown += TOKENS_PER_PARTIAL)
+        written += render_markup(lines, tokens, MIN(shown, BENCH_TOKENS), output, plaintext, label);
+
+    return written;
+}
+
+// What april_result_handler and the UI update that follows do now
+static size_t run_line_generator(struct line_generator *lg, const AprilToken *tokens, GtkLabel *label, PangoAttrList *base_attrs) {
+    size_t written = 0;
+
+    for(size_t shown = TOKENS_PER_PARTIAL; shown < BENCH_TOKENS + TOKENS_PER_PARTIAL; shown += TOKENS_PER_PARTIAL) {
+        line_generator_update(lg, MIN(shown, BENCH_TOKENS), tokens);
+
+        if(label != NULL) line_generator_set_text(lg, label, base_attrs);
+        written += strlen(line_generator_get_plaintext(lg));
+    }
+
+    // The next round starts a new utterance on a fresh line
+    line_generator_finalize(lg);
+    line_generator_break(lg);
+
+    return written;
+}
+
+static void report(const char *name, gint64 elapsed_us, size_t written) {
+    double partials = (double)NUM_PARTIALS * BENCH_ROUNDS;
+    printf("%-24s %8.2f ms %10.1f ns/partial  %zu bytes per round\n", name, (double)elapsed_us / 1000.0,
+           (double)elapsed_us * 1000.0 / partials, written / BENCH_ROUNDS);
+}
+
+int main(int argc, char **argv) {
+    AprilToken *tokens = calloc(BENCH_TOKENS, sizeof(AprilToken));
+    struct markup_line *lines = calloc(AC_LINE_COUNT, sizeof(struct markup_line));
+    char *output = malloc(MARKUP_LINE_MAX * AC_LINE_COUNT);
+    char *plaintext = malloc(MARKUP_LINE_MAX * AC_LINE_COUNT);
+
+    // Fixed seed so that runs are comparable
+    GRand *rand = g_rand_new_with_seed(2022);
+    for(size_t i=0; i<BENCH_TOKENS; i++){
+        tokens[i].token = vocabulary[g_rand_int_range(rand, 0, VOCABULARY_SIZE)];
+        tokens[i].flags = (tokens[i].token[0] == ' ') ? APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT : 0;
+
+        // Mostly confident, as real results are
+        tokens[i].logprob = (g_rand_int_range(rand, 0, 4) == 0) ? (float)g_rand_double_range(rand, -6.0, 0.0) : 0.0f;
+    }
+    g_rand_free(rand);
+
+    GtkLabel *label = NULL;
+    if(gtk_init_check()) {
+        label = GTK_LABEL(g_object_ref_sink(gtk_label_new(NULL)));
+    } else {
+        printf("No display, labels are not set\n");
+    }
+
+    PangoFontDescription *desc = pango_font_description_from_string(BENCH_FONT);
+    PangoAttrList *base_attrs = pango_attr_list_new();
+    pango_attr_list_insert(base_attrs, pango_attr_font_desc_new(desc));
+    pango_font_description_free(desc);
+
+    // As the markup did: the text as it is, with every token faded
+    struct render_config config = { .use_fade = true, .use_lowercase = false, .filter_mode = FILTER_NONE };
+    render_config_publish(&config);
+
+    struct line_generator *lg = calloc(1, sizeof(struct line_generator));
+    line_generator_init(lg);
+
+    // Wide enough that the whole utterance stays on one line
+    int max_text_width;
+    PangoLayout *layout = bench_create_layout(&max_text_width);
+    line_generator_set_layout(lg, layout, G_MAXINT, 1);
+
+    // One round each to warm up, including the width cache of the line
+    // generator, which stays warm while captioning
+    run_markup(lines, tokens, output, plaintext, label);
+    run_line_generator(lg, tokens, label, base_attrs);
+
+    size_t written = 0;
+    gint64 start = g_get_monotonic_time();
+    for(int r=0; r<BENCH_ROUNDS; r++) written += run_markup(lines, tokens, output, plaintext, label);
+    report("markup (old)", g_get_monotonic_time() - start, written);
+
+    written = 0;
+    start = g_get_monotonic_time();
+    for(int r=0; r<BENCH_ROUNDS; r++) written += run_line_generator(lg, tokens, label, base_attrs);
+    report("line generator", g_get_monotonic_time() - start, written);
+
+    line_generator_free(lg);
+    free(lg);
+
+    if(label != NULL) g_object_unref(label);
+    pango_attr_list_unref(base_attrs);
+    free(plaintext);
+    free(output);
+    free(lines);
+    free(tokens);
+
+    return 0;
+}
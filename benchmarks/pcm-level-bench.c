@@ -0,0 +1,163 @@
+/* pcm-level-bench.c
+ * Compares pcm_level_scan, in every implementation the CPU can run, against
+ * the loop that used to check capture buffers for silence. That loop stops
+ * at the first loud sample, so it is timed on speech and on quiet audio,
+ * where it has to look at everything. Exits with 1 if the implementations
+ * disagree on any buffer.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <glib.h>
+
+#include "pcm-level.h"
+#include "speech-fixture.h"
+#include "common.h"
+
+#define SAMPLE_RATE 16000
+#define AUDIO_SECONDS 30
+#define BENCH_ROUNDS 20
+
+// A capture callback's worth at 48 kHz, and what the feeder reads at once
+static const size_t buffer_sizes[] = { 480, 2048 };
+
+#define NUM_BUFFER_SIZES (sizeof(buffer_sizes) / sizeof(buffer_sizes[0]))
+
+// What feed_audio did before, kept as the baseline
+static bool found_nonzero(const short *data, size_t count) {
+    for(size_t i=0; i<count; i++){
+        if((data[i] > SILENCE_THRESHOLD) || (data[i] < -SILENCE_THRESHOLD)){
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static volatile size_t sink;
+
+static void report(const char *audio_name, const char *name, size_t buffer_size, size_t samples, gint64 elapsed_us) {
+    double ns_per_buffer = (double)elapsed_us * 1000.0 / ((double)samples / (double)buffer_size);
+    double samples_per_ns = (elapsed_us > 0) ? ((double)samples / ((double)elapsed_us * 1000.0)) : 0.0;
+
+    printf("%-8s %-10s %5zu samples %9.1f ns/buffer %7.2f samples/ns\n",
+           audio_name, name, buffer_size, ns_per_buffer, samples_per_ns);
+}
+
+static void bench_audio(const char *audio_name, const short *audio, size_t num_samples) {
+    size_t num_impls;
+    const struct pcm_level_impl *impls = pcm_level_get_impls(&num_impls);
+
+    for(size_t b=0; b<NUM_BUFFER_SIZES; b++) {
+        size_t size = buffer_sizes[b];
+        size_t usable = num_samples - (num_samples % size);
+
+        gint64 start = g_get_monotonic_time();
+        size_t loud = 0;
+        for(int r=0; r<BENCH_ROUNDS; r++)
+            for(size_t pos=0; pos<usable; pos+=size) loud += found_nonzero(&audio[pos], size);
+        sink = loud;
+        report(audio_name, "old loop", size, usable * BENCH_ROUNDS, g_get_monotonic_time() - start);
+
+        for(size_t i=0; i<num_impls; i++) {
+            start = g_get_monotonic_time();
+            loud = 0;
+            for(int r=0; r<BENCH_ROUNDS; r++) {
+                for(size_t pos=0; pos<usable; pos+=size) {
+                    struct pcm_level level;
+                    impls[i].scan(&audio[pos], size, &level);
+                    loud += !pcm_level_is_silent(&level, SILENCE_THRESHOLD);
+                }
+            }
+            sink = loud;
+            report(audio_name, impls[i].name, size, usable * BENCH_ROUNDS, g_get_monotonic_time() - start);
+        }
+    }
+}
+
+// Odd lengths and offsets hit the scalar tails, full scale samples the
+// overflow cases of the vector sums
+static bool check_impls(void) {
+    size_t num_impls;
+    const struct pcm_level_impl *impls = pcm_level_get_impls(&num_impls);
+
+    short buffer[4096 + 16];
+    GRand *rand = g_rand_new_with_seed(2022);
+    bool ok = true;
+
+    for(int t=0; (t<5000) && ok; t++) {
+        size_t length = (size_t)g_rand_int_range(rand, 0, 4097);
+        size_t offset = (size_t)g_rand_int_range(rand, 0, 16);
+
+        for(size_t i=0; i<length + offset; i++) {
+            switch(t % 4) {
+                case 0: buffer[i] = (short)g_rand_int_range(rand, -32768, 32768); break;
+                case 1: buffer[i] = (short)g_rand_int_range(rand, -SILENCE_THRESHOLD, SILENCE_THRESHOLD + 1); break;
+                case 2: buffer[i] = -32768; break;
+                default: buffer[i] = g_rand_boolean(rand) ? 32767 : -32768; break;
+            }
+        }
+
+        struct pcm_level expected;
+        impls[0].scan(&buffer[offset], length, &expected);
+
+        for(size_t i=1; i<num_impls; i++) {
+            struct pcm_level level;
+            impls[i].scan(&buffer[offset], length, &level);
+
+            if((level.peak != expected.peak) || (level.sum_squares != expected.sum_squares) || (level.count != expected.count)) {
+                printf("%s disagrees with %s on %zu samples: peak %d, expected %d\n",
+                       impls[i].name, impls[0].name, length, level.peak, expected.peak);
+                ok = false;
+            }
+        }
+    }
+
+    g_rand_free(rand);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    size_t num_impls;
+    const struct pcm_level_impl *impls = pcm_level_get_impls(&num_impls);
+
+    printf("Implementations:");
+    for(size_t i=0; i<num_impls; i++) printf(" %s", impls[i].name);
+    printf(", using %s\n", impls[num_impls - 1].name);
+
+    if(!check_impls()) return 1;
+
+    size_t num_samples = SAMPLE_RATE * AUDIO_SECONDS;
+    short *audio = malloc(num_samples * sizeof(short));
+
+    struct speech_synth synth;
+    speech_synth_init(&synth, speech_fixture_find("conversation"), SAMPLE_RATE);
+    speech_synth_fill(&synth, audio, num_samples);
+    bench_audio("speech", audio, num_samples);
+
+    // Quiet enough to count as silence throughout
+    GRand *rand = g_rand_new_with_seed(2023);
+    for(size_t i=0; i<num_samples; i++) audio[i] = (short)g_rand_int_range(rand, -SILENCE_THRESHOLD, SILENCE_THRESHOLD + 1);
+    g_rand_free(rand);
+    bench_audio("quiet", audio, num_samples);
+
+    free(audio);
+    return 0;
+}
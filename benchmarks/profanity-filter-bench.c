@@ -0,0 +1,265 @@
+/* profanity-filter-bench.c
+ * Compares the compiled profanity filter against the scanner it replaced,
+ * which went through every rule for every character of every word.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <april_api.h>
+
+#include "profanity-filter.h"
+#include "history.h"
+
+#define BENCH_TOKENS 100000
+#define BENCH_ROUNDS 20
+#define BENCH_LIST_WORDS 5000
+
+// Word pieces as the model gives them, a leading space starts a word
+static const char *vocabulary[] = {
+    " THE", " AND", " HE", "LLO", " WOR", "LD", " SH", "IT", " SHI", "FT",
+    " FU", "CK", "ING", " HOMO", "GEN", "EOUS", " HOMO", " SEX", "TANT",
+    " COCK", "PIT", " DI", "CK", "ENS", " ASS", "ESS", " CUM", "ULATIVE",
+    " PEN", "IS", " IT'S", " TODAY", " WE", "'RE", " BIT", "CH", " A",
+    " MOTHER", "FUCKER", " SCUNTHORPE", " CL", "ASS", "IC", " 2022",
+};
+
+#define VOCABULARY_SIZE (sizeof(vocabulary) / sizeof(vocabulary[0]))
+
+#define LEGACY_MAX_CURSE_WORD_LENGTH 64
+
+#define LEGACY_NUM_CURSE_WORDS 22
+static const char legacy_curse_words[LEGACY_NUM_CURSE_WORDS][LEGACY_MAX_CURSE_WORD_LENGTH] = {
+    "FAG*", "HOMO", "SLUT*", "NIGG*", "PUSSY*", "TRANN*", "\1", "CUM*",
+    "SEX*", "FUCK*", "SHIT*", "DICK*", "PORN*", "COCK*", "BITCH*", "DILDO*",
+    "PENIS*", "VAGINA*", "ORGASM*", "BULLSH*", "MOTHERFUC*", "MASTURBAT*",
+};
+
+// The scanner as it was before the filter was compiled
+typedef enum WordState {
+    WORD_STILL_SCANNING = 0,
+    WORD_NON_MATCHING = 1,
+    WORD_MATCHED = 2
+} WordState;
+
+static size_t legacy_get_filter_skip(const AprilToken *tokens, size_t curr_idx, size_t count, FilterMode mode) {
+    if(mode <= FILTER_NONE) return 0;
+
+    WordState is_match[LEGACY_NUM_CURSE_WORDS] = { 0 };
+
+    size_t num_to_skip = 0;
+    size_t curr_character = 0;
+    bool matched_badword = false;
+    bool still_scanning_any = true;
+    for(size_t i=curr_idx; i<count; i++){
+        if((i > curr_idx) && (tokens[i].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT)) {
+            // Once we've arrived at the next word, stop looking.
+            // we only want to filter the word starting at curr_idx
+            break;
+        }
+
+        num_to_skip++;
+
+        if(matched_badword) continue;
+
+        still_scanning_any = false;
+        size_t token_len = strlen(tokens[i].token);
+        for(size_t c=0; c<token_len; c++){
+            if(curr_character >= LEGACY_MAX_CURSE_WORD_LENGTH) break;
+
+            if((c == 0) && (tokens[i].token[c] == ' ')) continue;
+
+            for(size_t j=0; j<LEGACY_NUM_CURSE_WORDS; j++){
+                const char *rule = legacy_curse_words[j];
+                if((rule[0] == '\1') && mode < FILTER_PROFANITY) break;
+
+                if(is_match[j] == WORD_STILL_SCANNING) {
+                    still_scanning_any = true;
+
+                    if(rule[curr_character] != tokens[i].token[c]) {
+                        is_match[j] = WORD_NON_MATCHING;
+                        continue;
+                    }
+
+                    if(rule[curr_character + 1] == '*') {
+                        is_match[j] = WORD_MATCHED;
+                        matched_badword = true;
+                        break;
+                    }else if(rule[curr_character + 1] == '\0') {
+                        // if doesn't end in *, must be the end of word to match
+                        if(((i + 1) >= count) || (tokens[i + 1].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT)) {
+                            is_match[j] = WORD_MATCHED;
+                            matched_badword = true;
+                            break;
+                        }else{
+                            is_match[j] = WORD_NON_MATCHING;
+                            continue;
+                        }
+                    }
+                }
+            }
+
+            curr_character++;
+        }
+
+        if(!still_scanning_any) break;
+    }
+
+
+    if(matched_badword) return num_to_skip;
+    else return 0;
+}
+
+// The history variant used to copy every token of the entry for each call
+static size_t legacy_get_filter_skip_history(const struct history_token *tokens, size_t curr_idx, size_t count, FilterMode mode) {
+    AprilToken *a_tokens = calloc(sizeof(AprilToken), count);
+    for(size_t i=0; i<count; i++){
+        a_tokens[i].token   = history_token_text(&tokens[i]);
+        a_tokens[i].flags   = tokens[i].flags;
+        a_tokens[i].logprob = history_token_logprob(&tokens[i]);
+    }
+
+    size_t result = legacy_get_filter_skip(a_tokens, curr_idx, count, mode);
+
+    free(a_tokens);
+
+    return result;
+}
+
+
+typedef size_t (*april_filter_fn)(const AprilToken *tokens, size_t curr_idx, size_t count, FilterMode mode);
+typedef size_t (*history_filter_fn)(const struct history_token *tokens, size_t curr_idx, size_t count, FilterMode mode);
+
+// Filters the tokens in entries of HISTORY_MAX_TOKENS like the caption and
+// history code does, returning the number of tokens filtered
+static size_t run_april(april_filter_fn fn, const AprilToken *tokens, size_t count, FilterMode mode) {
+    size_t filtered = 0;
+    for(size_t start=0; start<count; start+=HISTORY_MAX_TOKENS) {
+        size_t n = MIN(HISTORY_MAX_TOKENS, count - start);
+        for(size_t i=0; i<n;) {
+            size_t skip = (tokens[start + i].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT) ? fn(tokens + start, i, n, mode) : 0;
+            filtered += skip;
+            i += (skip > 0) ? skip : 1;
+        }
+    }
+
+    return filtered;
+}
+
+static size_t run_history(history_filter_fn fn, const struct history_token *tokens, size_t count, FilterMode mode) {
+    size_t filtered = 0;
+    for(size_t start=0; start<count; start+=HISTORY_MAX_TOKENS) {
+        size_t n = MIN(HISTORY_MAX_TOKENS, count - start);
+        for(size_t i=0; i<n;) {
+            size_t skip = (tokens[start + i].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT) ? fn(tokens + start, i, n, mode) : 0;
+            filtered += skip;
+            i += (skip > 0) ? skip : 1;
+        }
+    }
+
+    return filtered;
+}
+
+static void report(const char *name, gint64 elapsed_us, size_t filtered) {
+    double ns_per_token = (double)elapsed_us * 1000.0 / ((double)BENCH_TOKENS * BENCH_ROUNDS);
+    printf("%-24s %8.2f ms %8.2f ns/token  %zu tokens filtered\n", name, (double)elapsed_us / 1000.0, ns_per_token, filtered / BENCH_ROUNDS);
+}
+
+int main(int argc, char **argv) {
+    AprilToken *tokens = calloc(BENCH_TOKENS, sizeof(AprilToken));
+    struct history_token *h_tokens = calloc(BENCH_TOKENS, sizeof(struct history_token));
+
+    // Fixed seed so that runs are comparable
+    GRand *rand = g_rand_new_with_seed(2022);
+    for(size_t i=0; i<BENCH_TOKENS; i++){
+        tokens[i].token = vocabulary[g_rand_int_range(rand, 0, VOCABULARY_SIZE)];
+        tokens[i].flags = (tokens[i].token[0] == ' ') ? APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT : 0;
+        tokens[i].logprob = -1.0f;
+
+        history_token_set(&h_tokens[i], &tokens[i]);
+    }
+    g_rand_free(rand);
+
+    for(FilterMode mode = FILTER_SLURS; mode <= FILTER_PROFANITY; mode++) {
+        printf("%s:\n", (mode == FILTER_SLURS) ? "Slurs" : "Profanity");
+
+        size_t filtered = 0;
+        gint64 start = g_get_monotonic_time();
+        for(int r=0; r<BENCH_ROUNDS; r++) filtered += run_april(legacy_get_filter_skip, tokens, BENCH_TOKENS, mode);
+        report("  scanner", g_get_monotonic_time() - start, filtered);
+
+        filtered = 0;
+        start = g_get_monotonic_time();
+        for(int r=0; r<BENCH_ROUNDS; r++) filtered += run_april(get_filter_skip, tokens, BENCH_TOKENS, mode);
+        report("  trie", g_get_monotonic_time() - start, filtered);
+
+        filtered = 0;
+        start = g_get_monotonic_time();
+        for(int r=0; r<BENCH_ROUNDS; r++) filtered += run_history(legacy_get_filter_skip_history, h_tokens, BENCH_TOKENS, mode);
+        report("  scanner (history)", g_get_monotonic_time() - start, filtered);
+
+        filtered = 0;
+        start = g_get_monotonic_time();
+        for(int r=0; r<BENCH_ROUNDS; r++) filtered += run_history(get_filter_skip_history, h_tokens, BENCH_TOKENS, mode);
+        report("  trie (history)", g_get_monotonic_time() - start, filtered);
+    }
+
+    // Site-specific lists can have thousands of words
+    profanity_filter large = profanity_filter_new();
+    profanity_filter_add_builtin(large);
+
+    rand = g_rand_new_with_seed(2023);
+    for(size_t i=0; i<BENCH_LIST_WORDS; i++){
+        char rule[16];
+        int length = g_rand_int_range(rand, 4, 11);
+        for(int c=0; c<length; c++) rule[c] = (char)g_rand_int_range(rand, 'A', 'Z' + 1);
+
+        rule[length] = (g_rand_int_range(rand, 0, 4) == 0) ? '*' : '\0';
+        rule[length + 1] = '\0';
+
+        profanity_filter_add(large, rule, FILTER_SLURS);
+    }
+    g_rand_free(rand);
+
+    profanity_filter_finish(large);
+
+    printf("Profanity and %d more words:\n", BENCH_LIST_WORDS);
+
+    size_t filtered = 0;
+    gint64 start = g_get_monotonic_time();
+    for(int r=0; r<BENCH_ROUNDS; r++){
+        for(size_t i=0; i<BENCH_TOKENS;) {
+            size_t n = MIN(HISTORY_MAX_TOKENS, BENCH_TOKENS - i);
+            for(size_t j=0; j<n;) {
+                size_t skip = (tokens[i + j].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT) ? profanity_filter_skip(large, tokens + i, j, n, FILTER_PROFANITY) : 0;
+                filtered += skip;
+                j += (skip > 0) ? skip : 1;
+            }
+            i += n;
+        }
+    }
+    report("  trie", g_get_monotonic_time() - start, filtered);
+
+    profanity_filter_unref(large);
+
+    free(tokens);
+    free(h_tokens);
+
+    return 0;
+}
@@ -0,0 +1,418 @@
+/* render-bench.c
+ * Replays sequences of partial and final results through the code that
+ * runs for every partial on the way from the model to the screen: the line
+ * generator with a headless Pango layout, the capitalizer, the profanity
+ * filter, the transcript text and the plaintext used for streaming. Reports
+ * ns and allocations per partial, and partials per second.
+ *
+ * The sequences follow the shape of real sessions: an utterance grows a
+ * token or two per partial, its last tokens are sometimes revised, and it
+ * ends with a final carrying every token. Costs are given per partial,
+ * with the finals and silences in between counted in.
+ *
+ * With --trace FILE the results of a recorded session are replayed instead.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <glib.h>
+#include <april_api.h>
+
+#include "bench-alloc.h"
+#include "bench-layout.h"
+#include "line-gen.h"
+#include "profanity-filter.h"
+#include "token-trace.h"
+
+#define BENCH_UTTERANCES 400
+#define BENCH_ROUNDS 5
+
+static const char *sentences[] = {
+    "GOOD MORNING EVERYONE AND WELCOME TO TODAY'S MEETING",
+    "I THINK WE SHOULD START WITH THE QUARTERLY NUMBERS",
+    "THE BUILD HAS BEEN FAILING SINCE TUESDAY",
+    "CAN YOU HEAR ME OKAY",
+    "LET'S TAKE A LOOK AT THE SECOND SLIDE",
+    "THAT'S A REALLY GOOD POINT ACTUALLY",
+    "WE SHIPPED VERSION 2022 LAST WEEK",
+    "SO THE IDEA IS THAT EVERYTHING RUNS LOCALLY ON YOUR COMPUTER",
+    "NOTHING IS SENT TO A SERVER",
+    "HE SAID THE SHIPMENT WOULD ARRIVE BY FRIDAY",
+    "OKAY",
+    "YEAH",
+    "I'M NOT SURE THAT'S WHAT HE MEANT BUT WE CAN ASK",
+    "THE WEATHER IN SCUNTHORPE IS USUALLY PRETTY MILD",
+    "PLEASE MAKE SURE TO MUTE YOUR MICROPHONE WHEN YOU'RE NOT SPEAKING",
+    "WHAT THE HELL HAPPENED TO THE SHIFT SCHEDULE",
+    "THIS IS A CLASSIC EXAMPLE OF A RACE CONDITION",
+    "THANK YOU ALL FOR COMING",
+};
+
+#define NUM_SENTENCES (sizeof(sentences) / sizeof(sentences[0]))
+
+// Pieces a model could have produced instead while it is unsure
+static const char *alternatives[] = { " THE", " A", "S", "ED", " AND", "ING", " TO", "ER" };
+
+#define NUM_ALTERNATIVES (sizeof(alternatives) / sizeof(alternatives[0]))
+
+struct bench_event {
+    AprilResultType type;
+    size_t count;
+    AprilToken *tokens;
+};
+
+struct bench_sequence {
+    GArray *events;
+    GStringChunk *strings;
+
+    size_t partials;
+    size_t tokens;
+};
+
+static AprilToken make_token(struct bench_sequence *seq, const char *text, size_t length, int flags, float logprob) {
+    AprilToken token = { 0 };
+    token.token = g_string_chunk_insert_len(seq->strings, text, (gssize)length);
+    token.flags = flags;
+    token.logprob = logprob;
+    return token;
+}
+
+// Splits words into pieces of two to four characters, the first of a word
+// starting with a space, like the word pieces of the model
+static GArray *tokenize(struct bench_sequence *seq, GRand *rand, const char *sentence) {
+    GArray *tokens = g_array_new(FALSE, FALSE, sizeof(AprilToken));
+
+    gchar **words = g_strsplit(sentence, " ", -1);
+    for(size_t w=0; words[w] != NULL; w++) {
+        char piece[64];
+        const char *word = words[w];
+        size_t length = strlen(word);
+
+        for(size_t pos=0; pos<length;) {
+            size_t size = MIN(length - pos, (size_t)g_rand_int_range(rand, 2, 5));
+            int flags = 0;
+            size_t p = 0;
+
+            if(pos == 0) {
+                piece[p++] = ' ';
+                flags |= APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT;
+            }
+
+            memcpy(&piece[p], &word[pos], size);
+            p += size;
+            pos += size;
+
+            // Mostly confident, as real results are
+            float logprob = (g_rand_int_range(rand, 0, 4) == 0) ? (float)g_rand_double_range(rand, -6.0, 0.0) : 0.0f;
+
+            AprilToken token = make_token(seq, piece, p, flags, logprob);
+            g_array_append_val(tokens, token);
+        }
+    }
+    g_strfreev(words);
+
+    if(tokens->len > 0)
+        g_array_index(tokens, AprilToken, tokens->len - 1).flags |= APRIL_TOKEN_FLAG_SENTENCE_END_BIT;
+
+    return tokens;
+}
+
+static void add_event(struct bench_sequence *seq, AprilResultType type, const AprilToken *tokens, size_t count) {
+    struct bench_event event;
+    event.type = type;
+    event.count = count;
+    event.tokens = g_memdup2(tokens, count * sizeof(AprilToken));
+
+    g_array_append_val(seq->events, event);
+
+    if(type == APRIL_RESULT_RECOGNITION_PARTIAL) seq->partials++;
+    if(type != APRIL_RESULT_SILENCE) seq->tokens += count;
+}
+
+static void build_sequence(struct bench_sequence *seq) {
+    seq->events = g_array_new(FALSE, FALSE, sizeof(struct bench_event));
+    seq->strings = g_string_chunk_new(4096);
+    seq->partials = 0;
+    seq->tokens = 0;
+
+    // Fixed seed so that runs are comparable
+    GRand *rand = g_rand_new_with_seed(2022);
+
+    for(int u=0; u<BENCH_UTTERANCES; u++) {
+        GArray *tokens = tokenize(seq, rand, sentences[g_rand_int_range(rand, 0, NUM_SENTENCES)]);
+        AprilToken *final = (AprilToken *)tokens->data;
+        AprilToken partial[tokens->len];
+
+        for(size_t shown = 0; shown < tokens->len;) {
+            shown = MIN(tokens->len, shown + (size_t)g_rand_int_range(rand, 1, 3));
+            memcpy(partial, final, shown * sizeof(AprilToken));
+
+            // The newest piece is still a guess some of the time
+            if((shown < tokens->len) && (g_rand_int_range(rand, 0, 4) == 0)) {
+                const char *alt = alternatives[g_rand_int_range(rand, 0, NUM_ALTERNATIVES)];
+                partial[shown - 1] = make_token(seq, alt, strlen(alt), (alt[0] == ' ') ? APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT : 0, -3.0f);
+            }
+
+            add_event(seq, APRIL_RESULT_RECOGNITION_PARTIAL, partial, shown);
+        }
+
+        add_event(seq, APRIL_RESULT_RECOGNITION_FINAL, final, tokens->len);
+
+        if(g_rand_int_range(rand, 0, 6) == 0) add_event(seq, APRIL_RESULT_SILENCE, NULL, 0);
+
+        g_array_free(tokens, TRUE);
+    }
+
+    g_rand_free(rand);
+}
+
+static bool load_sequence(struct bench_sequence *seq, const char *path) {
+    token_trace_reader reader = token_trace_reader_new(path);
+    if(reader == NULL) return false;
+
+    seq->events = g_array_new(FALSE, FALSE, sizeof(struct bench_event));
+    seq->strings = g_string_chunk_new(4096);
+    seq->partials = 0;
+    seq->tokens = 0;
+
+    struct token_trace_event event;
+    while(token_trace_reader_next(reader, &event)) {
+        if(event.type == APRIL_RESULT_ERROR_CANT_KEEP_UP) continue;
+
+        // The texts belong to the reader
+        AprilToken tokens[event.count + 1];
+        for(size_t i=0; i<event.count; i++) {
+            tokens[i] = event.tokens[i];
+            tokens[i].token = g_string_chunk_insert_const(seq->strings, event.tokens[i].token);
+        }
+
+        add_event(seq, event.type, tokens, event.count);
+    }
+
+    token_trace_reader_free(reader);
+    return true;
+}
+
+static void free_sequence(struct bench_sequence *seq) {
+    for(guint i=0; i<seq->events->len; i++) g_free(g_array_index(seq->events, struct bench_event, i).tokens);
+    g_array_free(seq->events, TRUE);
+    g_string_chunk_free(seq->strings);
+}
+
+
+typedef size_t (*stage_fn)(const struct bench_sequence *seq, void *state);
+
+struct line_state {
+    struct line_generator lg;
+    GString *text;
+};
+
+// What april_result_handler does to the caption lines
+static size_t run_line_generator(const struct bench_sequence *seq, void *userdata) {
+    struct line_state *state = userdata;
+    size_t work = 0;
+
+    for(guint i=0; i<seq->events->len; i++) {
+        const struct bench_event *event = &g_array_index(seq->events, struct bench_event, i);
+        if(event->type == APRIL_RESULT_SILENCE) {
+            line_generator_break(&state->lg);
+            continue;
+        }
+
+        line_generator_update(&state->lg, event->count, event->tokens);
+        if(event->type == APRIL_RESULT_RECOGNITION_FINAL) line_generator_finalize(&state->lg);
+
+        work += event->count;
+    }
+
+    return work;
+}
+
+static size_t run_capitalizer(const struct bench_sequence *seq, void *userdata) {
+    size_t capitalized = 0;
+
+    for(guint i=0; i<seq->events->len; i++) {
+        const struct bench_event *event = &g_array_index(seq->events, struct bench_event, i);
+
+        struct token_capitalizer tcap;
+        token_capitalizer_init(&tcap);
+        for(size_t t=0; t<event->count; t++) {
+            const char *next_tok = (t + 1) < event->count ? event->tokens[t+1].token : NULL;
+            int next_flags = (t + 1) < event->count ? event->tokens[t+1].flags : 0;
+            capitalized += token_capitalizer_next(&tcap, event->tokens[t].token, event->tokens[t].flags, next_tok, next_flags);
+        }
+    }
+
+    return capitalized;
+}
+
+static size_t run_filter(const struct bench_sequence *seq, void *userdata) {
+    size_t filtered = 0;
+
+    for(guint i=0; i<seq->events->len; i++) {
+        const struct bench_event *event = &g_array_index(seq->events, struct bench_event, i);
+
+        for(size_t t=0; t<event->count;) {
+            size_t skip = (event->tokens[t].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT) ? get_filter_skip(event->tokens, t, event->count, FILTER_PROFANITY) : 0;
+            filtered += skip;
+            t += (skip > 0) ? skip : 1;
+        }
+    }
+
+    return filtered;
+}
+
+// The live region of the transcript is rebuilt from every partial
+static size_t run_transcript_text(const struct bench_sequence *seq, void *userdata) {
+    struct line_state *state = userdata;
+    size_t written = 0;
+
+    for(guint i=0; i<seq->events->len; i++) {
+        const struct bench_event *event = &g_array_index(seq->events, struct bench_event, i);
+        if(event->type == APRIL_RESULT_SILENCE) continue;
+
+        g_string_truncate(state->text, 0);
+        build_text_from_tokens(state->text, event->count, event->tokens);
+        written += state->text->len;
+    }
+
+    return written;
+}
+
+// Every UI update with the text stream on
+static size_t run_plaintext(const struct bench_sequence *seq, void *userdata) {
+    struct line_state *state = userdata;
+    size_t written = 0;
+
+    for(guint i=0; i<seq->events->len; i++) {
+        const struct bench_event *event = &g_array_index(seq->events, struct bench_event, i);
+        if(event->type == APRIL_RESULT_SILENCE) {
+            line_generator_break(&state->lg);
+            continue;
+        }
+
+        line_generator_update(&state->lg, event->count, event->tokens);
+        written += strlen(line_generator_get_plaintext(&state->lg));
+
+        if(event->type == APRIL_RESULT_RECOGNITION_FINAL) line_generator_finalize(&state->lg);
+    }
+
+    return written;
+}
+
+// Everything above for every result, as with the transcript and text
+// stream both on
+static size_t run_pipeline(const struct bench_sequence *seq, void *userdata) {
+    struct line_state *state = userdata;
+    size_t written = 0;
+
+    for(guint i=0; i<seq->events->len; i++) {
+        const struct bench_event *event = &g_array_index(seq->events, struct bench_event, i);
+        if(event->type == APRIL_RESULT_SILENCE) {
+            line_generator_break(&state->lg);
+            continue;
+        }
+
+        line_generator_update(&state->lg, event->count, event->tokens);
+
+        g_string_truncate(state->text, 0);
+        build_text_from_tokens(state->text, event->count, event->tokens);
+
+        if(event->type == APRIL_RESULT_RECOGNITION_FINAL) line_generator_finalize(&state->lg);
+
+        written += strlen(line_generator_get_plaintext(&state->lg)) + state->text->len;
+    }
+
+    return written;
+}
+
+static void run_stage(const char *name, stage_fn fn, const struct bench_sequence *seq, void *state) {
+    // One round to warm up caches, including the width cache of the line
+    // generator, which stays warm while captioning
+    size_t result = fn(seq, state);
+
+    int64_t allocations = bench_alloc_count();
+    gint64 start = g_get_monotonic_time();
+
+    for(int r=0; r<BENCH_ROUNDS; r++) result += fn(seq, state);
+
+    gint64 elapsed_us = g_get_monotonic_time() - start;
+    int64_t allocated = (allocations < 0) ? -1 : (bench_alloc_count() - allocations);
+
+    double partials = (double)seq->partials * BENCH_ROUNDS;
+    double ns_per_partial = (double)elapsed_us * 1000.0 / partials;
+    double per_second = (elapsed_us > 0) ? (partials * 1000000.0 / (double)elapsed_us) : 0.0;
+
+    if(allocated < 0) {
+        printf("%-18s %10.1f ns/partial %12.0f partials/s  allocations not counted  (%zu)\n",
+               name, ns_per_partial, per_second, result);
+    } else {
+        printf("%-18s %10.1f ns/partial %12.0f partials/s %8.2f allocs/partial  (%zu)\n",
+               name, ns_per_partial, per_second, (double)allocated / partials, result);
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *trace_path = NULL;
+    for(int i=1; i<argc; i++) {
+        if((strcmp(argv[i], "--trace") == 0) && ((i + 1) < argc)) trace_path = argv[++i];
+    }
+
+    struct bench_sequence seq;
+    if(trace_path != NULL) {
+        if(!load_sequence(&seq, trace_path)) return 1;
+    } else {
+        build_sequence(&seq);
+    }
+
+    if(seq.partials == 0) {
+        printf("There are no partials to replay\n");
+        return 1;
+    }
+
+    printf("%u results, %zu of them partials, %.1f tokens per result\n",
+           seq.events->len, seq.partials, (double)seq.tokens / (double)seq.events->len);
+
+    struct line_state *state = calloc(1, sizeof(struct line_state));
+    line_generator_init(&state->lg);
+    state->text = g_string_new(NULL);
+
+    int max_text_width;
+    PangoLayout *layout = bench_create_layout(&max_text_width);
+    line_generator_set_layout(&state->lg, layout, max_text_width, 1);
+
+    run_stage("line generator", run_line_generator, &seq, state);
+    run_stage("capitalizer", run_capitalizer, &seq, state);
+    run_stage("profanity filter", run_filter, &seq, state);
+    run_stage("transcript text", run_transcript_text, &seq, state);
+    run_stage("plaintext", run_plaintext, &seq, state);
+    run_stage("pipeline", run_pipeline, &seq, state);
+
+    size_t hits, misses;
+    line_generator_get_width_cache_stats(&state->lg, &hits, &misses);
+    printf("width cache: %zu hits, %zu misses\n", hits, misses);
+
+    line_generator_free(&state->lg);
+    g_string_free(state->text, TRUE);
+    free(state);
+    free_sequence(&seq);
+
+    return 0;
+}
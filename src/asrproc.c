@@ -19,6 +19,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
 #include <signal.h>
 #include <math.h>
@@ -30,20 +31,76 @@
 #include <time.h>
 
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <april_api.h>
 
 #include "asrproc.h"
+#include "audio-ring.h"
+#include "latency.h"
+#include "pcm-level.h"
+#include "vad.h"
 #include "line-gen.h"
+#include "render-config.h"
 #include "livecaptions-window.h"
 #include "livecaptions-application.h"
 #include "history.h"
+#include "token-trace.h"
 #include "common.h"
 
+// Enough to cover the audio buffer at typical callback sizes. Older stamps are
+// overwritten, their audio is then counted from the next stamp instead.
+#define CAPTURE_STAMPS 64
+
+// When the samples up to end_pos were handed over by the capture callback
+struct capture_stamp {
+    atomic_size_t end_pos;
+    atomic_int_least64_t time;
+};
+
 struct asr_thread_i {
     volatile size_t sound_counter;
     size_t silence_counter;
 
     GThread * thread_id;
+    GThread * feeder_thread_id;
+
+    // Capture callbacks only copy into this ring, the feeder thread drains it
+    // into the session
+    struct audio_ring ring;
+    GMutex feed_mutex;
+    size_t reported_overruns;
+
+    // Written by the capture callback, read by the feeder
+    struct capture_stamp capture_stamps[CAPTURE_STAMPS];
+    atomic_size_t capture_stamps_head;
+    size_t capture_stamps_tail;
+
+    // When the oldest audio that has not gotten a result yet was fed, and
+    // when the oldest result that has not been painted yet came in. 0 if
+    // there is none.
+    atomic_int_least64_t pending_feed_time;
+    atomic_int_least64_t pending_result_time;
+
+    struct latency_histogram latency[LATENCY_NUM_STAGES];
+
+    // Used by the feeder with feed_mutex held. Audio is split into frames
+    // for it, the last one is filled across feeds. vad_enabled is only
+    // changed with the lock held too, but the settings read it without.
+    atomic_bool vad_enabled;
+    bool vad_flatness;
+    struct vad vad;
+    short vad_frame[VAD_MAX_FRAME];
+    size_t vad_frame_fill;
+    short vad_preroll[VAD_MAX_PREROLL_FRAMES * VAD_MAX_FRAME];
+
+    atomic_size_t vad_samples_seen;
+    atomic_size_t vad_samples_fed;
+    atomic_size_t vad_utterances;
+
+    // Level of what the feeder read since the meter last looked
+    atomic_int level_peak;
+    atomic_uint_least64_t level_sum_squares;
+    atomic_size_t level_samples;
 
     struct line_generator line;
 
@@ -53,9 +110,41 @@ struct asr_thread_i {
     AprilASRModel model;
     AprilASRSession session;
 
+    // Only the main thread dereferences the window. It is cleared under
+    // text_mutex when the window is destroyed.
     LiveCaptionsWindow *window;
 
+    // What the ASR thread needs from the window, handed over by the main
+    // thread under text_mutex. next_layout is a copy of the window's font
+    // layout that the next result takes ownership of.
+    size_t window_layout_counter;
     size_t layout_counter;
+    PangoLayout *next_layout;
+    int next_max_text_width;
+    bool transcript_shown;
+
+    // Set by the ASR thread, the warning is shown with the next UI update
+    atomic_bool slow_warning;
+
+    // Results only mark the UI as dirty. At most one update is pending at a
+    // time, and it is applied on the next frame of the main window.
+    atomic_bool update_pending;
+    atomic_size_t coalesced_updates;
+
+    // The idle source is added from any thread, so its id is stored under
+    // update_mutex, or the idle could run and clear it before it is stored.
+    // The tick callback belongs to the main thread. Both clear their id when
+    // they run.
+    GMutex update_mutex;
+    guint update_idle_id;
+    guint update_tick_id;
+
+    // Transcript text waiting to be applied, protected by text_mutex.
+    // Finalized text is appended to transcript_final and gets locked in;
+    // transcript_live is the latest partial that replaces the live region.
+    GString *transcript_final;
+    GString *transcript_live;
+    bool transcript_dirty;
 
     volatile bool text_stream_active;
     volatile bool pause;
@@ -65,44 +154,28 @@ struct asr_thread_i {
     volatile bool ending;
 
     bool errored;
+
+    // Every result is written here while recording
+    _Atomic(token_trace_writer) trace_writer;
+
+    // Set when results come from a trace instead of a model
+    token_trace_reader replay;
+    bool replay_max_speed;
+    GThread * replay_thread_id;
 };
 
 
-static gboolean main_thread_update_label(void *userdata);
-typedef struct {
-    asr_thread data;
-    char *text;        // newly built streaming text for live tail
-    gboolean is_final; // whether to lock the live mark at end
-} TranscriptUpdate;
-
-static gboolean apply_transcript_update(void *userdata) {
-    TranscriptUpdate *u = (TranscriptUpdate*)userdata;
-    asr_thread data = u->data;
-    if(data && data->window && data->window->transcript_view && data->window->transcript_live_start) {
-        GtkTextBuffer *buf = gtk_text_view_get_buffer(data->window->transcript_view);
-        if(buf) {
-            GtkTextIter start_iter, end_iter;
-            gtk_text_buffer_get_iter_at_mark(buf, &start_iter, data->window->transcript_live_start);
-            gtk_text_buffer_get_end_iter(buf, &end_iter);
-            gtk_text_buffer_delete(buf, &start_iter, &end_iter);
-            gtk_text_buffer_get_end_iter(buf, &end_iter);
-            gtk_text_buffer_insert(buf, &end_iter, u->text ? u->text : "", -1);
-
-            // Keep view scrolled to end
-            GtkTextMark *tmp = gtk_text_buffer_create_mark(buf, NULL, &end_iter, FALSE);
-            gtk_text_view_scroll_mark_onscreen(data->window->transcript_view, tmp);
-            gtk_text_buffer_delete_mark(buf, tmp);
-
-            if(u->is_final) {
-                // Lock-in the current live region by moving the mark to the end
-                gtk_text_buffer_get_end_iter(buf, &end_iter);
-                gtk_text_buffer_move_mark(buf, data->window->transcript_live_start, &end_iter);
-            }
-        }
+static void request_ui_update(asr_thread data);
+
+static void report_audio_overruns(asr_thread data) {
+    struct audio_ring_stats stats;
+    audio_ring_get_stats(&data->ring, &stats);
+
+    if(stats.overruns != data->reported_overruns) {
+        printf("Audio buffer overrun: %zu overruns, %zu samples dropped so far\n",
+               stats.overruns, stats.dropped_samples);
+        data->reported_overruns = stats.overruns;
     }
-    if(u->text) g_free(u->text);
-    g_free(u);
-    return G_SOURCE_REMOVE;
 }
 
 static void *run_asr_thread(void *userdata){
@@ -111,6 +184,8 @@ static void *run_asr_thread(void *userdata){
     while(!data->ending){
         sleep(1);
 
+        report_audio_overruns(data);
+
         if(data->last_silence_time == 0) continue;
 
         time_t current_time = time(NULL);
@@ -120,7 +195,7 @@ static void *run_asr_thread(void *userdata){
             data->last_silence_time = 0;
             for(int i=1; i<AC_LINE_COUNT; i++) line_generator_break(&data->line);
             g_mutex_unlock(&data->text_mutex);
-            g_idle_add(main_thread_update_label, data);
+            request_ui_update(data);
         }
     }
 
@@ -133,116 +208,198 @@ static void *run_asr_thread(void *userdata){
     return NULL;
 }
 
-static gboolean main_thread_update_label(void *userdata){
-    asr_thread data = userdata;
+// Runs on the main thread with text_mutex held
+static void apply_transcript_update(asr_thread data) {
+    if(!data->transcript_dirty) return;
+    data->transcript_dirty = false;
+
+    if(data->window->transcript == NULL) return;
+
+    transcript_buffer_update(data->window->transcript,
+                             data->transcript_final->str, data->transcript_final->len,
+                             data->transcript_live->str, data->transcript_live->len);
 
-    if((data->window == NULL) || (data->pause)) return G_SOURCE_REMOVE;
+    g_string_truncate(data->transcript_final, 0);
+}
+
+// Runs on the main thread with text_mutex held. Copies the window's font
+// layout for the ASR thread whenever the window has made a new one.
+static void publish_window_state(asr_thread data, bool force) {
+    LiveCaptionsWindow *window = data->window;
+
+    data->transcript_shown = (window->transcript != NULL);
+
+    if(!force && (data->window_layout_counter == window->font_layout_counter)) return;
+    data->window_layout_counter = window->font_layout_counter;
+
+    if(data->next_layout != NULL) g_object_unref(data->next_layout);
+    data->next_layout = pango_layout_copy((PangoLayout *)window->font_layout);
+    data->next_max_text_width = window->max_text_width;
+}
+
+static void apply_ui_update(asr_thread data) {
+    // Clear this first, so a result that arrives while we are applying the
+    // update schedules another one instead of being lost
+    atomic_store_explicit(&data->update_pending, false, memory_order_release);
+
+    gint64 result_time = atomic_exchange_explicit(&data->pending_result_time, 0, memory_order_acq_rel);
+
+    if((data->window == NULL) || (data->pause)) return;
+
+    if(atomic_exchange_explicit(&data->slow_warning, false, memory_order_relaxed))
+        livecaptions_window_warn_slow(data->window);
 
     g_mutex_lock(&data->text_mutex);
-    line_generator_set_text(&data->line, data->window->label);
-    // Transcript streaming is handled directly in the result handler to avoid duplication
-    
+    publish_window_state(data, false);
+    line_generator_set_text(&data->line, data->window->label, data->window->font_attrs);
+    apply_transcript_update(data);
+
+    if(result_time != 0)
+        latency_histogram_record(&data->latency[LATENCY_RESULT_TO_PAINT], g_get_monotonic_time() - result_time);
+
     if(data->text_stream_active) {
         LiveCaptionsApplication *application = LIVECAPTIONS_APPLICATION(gtk_window_get_application(GTK_WINDOW(data->window)));
         livecaptions_application_stream_text(application, line_generator_get_plaintext(&data->line));
     }
 
     g_mutex_unlock(&data->text_mutex);
+}
+
+static gboolean on_frame_tick(GtkWidget *widget, GdkFrameClock *frame_clock, gpointer userdata) {
+    asr_thread data = userdata;
 
+    data->update_tick_id = 0;
+    apply_ui_update(data);
     return G_SOURCE_REMOVE;
 }
 
-static void build_text_from_tokens(asr_thread data, GString *acc, size_t count, const AprilToken* tokens) {
-    gboolean text_uppercase = g_settings_get_boolean(data->window->settings, "text-uppercase");
-    gboolean use_lowercase = !text_uppercase;
+// Removes a tick callback that is still waiting on the window's frame clock
+static bool drop_update_tick(asr_thread data, GtkWidget *widget) {
+    if(data->update_tick_id == 0) return false;
+
+    gtk_widget_remove_tick_callback(widget, data->update_tick_id);
+    data->update_tick_id = 0;
+    return true;
+}
+
+// The frame clock stops once the window is hidden, so an update waiting on
+// it is applied right away instead, as it would be while hidden
+static void on_window_unmap(GtkWidget *widget, gpointer userdata) {
+    asr_thread data = userdata;
+
+    if(drop_update_tick(data, widget)) apply_ui_update(data);
+}
+
+// Nothing is left to update, but the next result has to schedule again
+static void on_window_destroy(GtkWidget *widget, gpointer userdata) {
+    asr_thread data = userdata;
+
+    if(drop_update_tick(data, widget))
+        atomic_store_explicit(&data->update_pending, false, memory_order_release);
+
+    g_mutex_lock(&data->text_mutex);
+    data->window = NULL;
+    g_mutex_unlock(&data->text_mutex);
+}
+
+static gboolean main_thread_schedule_update(void *userdata) {
+    asr_thread data = userdata;
+
+    g_mutex_lock(&data->update_mutex);
+    data->update_idle_id = 0;
+    g_mutex_unlock(&data->update_mutex);
 
-    bool should_capitalize[count > 0 ? count : 1];
-    struct token_capitalizer tcap;
-    token_capitalizer_init(&tcap);
-    for(size_t i = 0; i < count; i++) {
-        const char *next_tok = (i + 1) < count ? tokens[i+1].token : NULL;
-        int next_flags = (i + 1) < count ? tokens[i+1].flags : 0;
-        should_capitalize[i] = token_capitalizer_next(&tcap, tokens[i].token, tokens[i].flags, next_tok, next_flags);
+    if((data->window != NULL) && gtk_widget_get_mapped(GTK_WIDGET(data->window))) {
+        data->update_tick_id = gtk_widget_add_tick_callback(GTK_WIDGET(data->window), on_frame_tick, data, NULL);
+    } else {
+        // There is no frame clock to wait for while the window is hidden,
+        // but text streaming still needs to happen
+        apply_ui_update(data);
     }
-    char scratch[256];
-    for(size_t i = 0; i < count; i++) {
-        const char *src = tokens[i].token;
-        if(!src) continue;
-        if(use_lowercase) {
-            const char *p = src;
-            char *out = scratch;
-            bool cap = should_capitalize[i];
-            while(*p) {
-                gunichar c = g_utf8_get_char_validated(p, -1);
-                if(c == (gunichar)-1 || c == (gunichar)-2) break;
-                c = g_unichar_tolower(c);
-                if(cap) {
-                    gunichar uc = g_unichar_toupper(c);
-                    if(uc != c) {
-                        c = uc; cap = false;
-                    }
-                }
-                out += g_unichar_to_utf8(c, out);
-                if((out + 8) >= (scratch + sizeof(scratch))) break;
-                p = g_utf8_next_char(p);
-            }
-            *out = '\0';
-            g_string_append(acc, scratch);
-        } else {
-            g_string_append(acc, src);
-        }
+
+    return G_SOURCE_REMOVE;
+}
+
+// Marks the label and transcript as needing a refresh. Can be called from any
+// thread. If an update is already pending it will pick up the new state, so
+// nothing else needs to be scheduled.
+static void request_ui_update(asr_thread data) {
+    if(atomic_exchange_explicit(&data->update_pending, true, memory_order_acq_rel)) {
+        atomic_fetch_add_explicit(&data->coalesced_updates, 1, memory_order_relaxed);
+        return;
     }
-    // Replace any newlines with space (safety)
-    for(guint i = 0; i < acc->len; ++i) if(acc->str[i] == '\n') acc->str[i] = ' ';
+
+    g_mutex_lock(&data->update_mutex);
+    data->update_idle_id = g_idle_add(main_thread_schedule_update, data);
+    g_mutex_unlock(&data->update_mutex);
 }
 
 static void april_result_handler(void* userdata, AprilResultType result, size_t count, const AprilToken* tokens) {
     asr_thread data = userdata;
+
+    token_trace_writer trace_writer = atomic_load_explicit(&data->trace_writer, memory_order_acquire);
+    if(trace_writer != NULL) token_trace_writer_add(trace_writer, result, count, tokens);
+
     if((data->window == NULL) || (data->pause)) return;
 
     switch(result) {
         case APRIL_RESULT_RECOGNITION_PARTIAL:
         case APRIL_RESULT_RECOGNITION_FINAL:
         {
-            g_mutex_lock(&data->text_mutex);
-            data->last_silence_time = 0;
+            gint64 now = g_get_monotonic_time();
+            gint64 feed_time = atomic_exchange_explicit(&data->pending_feed_time, 0, memory_order_acq_rel);
+            if(feed_time != 0)
+                latency_histogram_record(&data->latency[LATENCY_FEED_TO_RESULT], now - feed_time);
 
-            if((data->layout_counter != data->window->font_layout_counter) || (data->line.layout == NULL)) {
-                if(data->line.layout != NULL) g_object_unref(data->line.layout);
+            // Only the first result since the last paint counts, later ones
+            // are painted together with it
+            gint64 no_result = 0;
+            atomic_compare_exchange_strong_explicit(&data->pending_result_time, &no_result, now,
+                                                    memory_order_acq_rel, memory_order_relaxed);
+
+            g_mutex_lock(&data->text_mutex);
+            if(data->window == NULL) {
+                g_mutex_unlock(&data->text_mutex);
+                break;
+            }
 
-                data->line.layout = pango_layout_copy(data->window->font_layout);
-                data->line.max_text_width = data->window->max_text_width;
+            data->last_silence_time = 0;
 
-                data->layout_counter = data->window->font_layout_counter;
+            if(data->next_layout != NULL) {
+                // Every new layout may measure text differently
+                line_generator_set_layout(&data->line, data->next_layout,
+                                          data->next_max_text_width, ++data->layout_counter);
+                data->next_layout = NULL;
             }
 
             line_generator_update(&data->line, count, tokens);
 
-            // Build current streaming text and schedule UI update on main thread
-            if(data->window && data->window->transcript_view && data->window->transcript_live_start) {
-                GString *acc = g_string_new(NULL);
-                build_text_from_tokens(data, acc, count, tokens);
-                TranscriptUpdate *upd = g_new0(TranscriptUpdate, 1);
-                upd->data = data;
-                upd->text = g_strdup(acc->str);
-                upd->is_final = (result == APRIL_RESULT_RECOGNITION_FINAL);
-                g_idle_add(apply_transcript_update, upd);
-                g_string_free(acc, TRUE);
+            // Build current streaming text, it gets applied with the next UI update
+            if(data->transcript_shown) {
+                g_string_truncate(data->transcript_live, 0);
+                build_text_from_tokens(data->transcript_live, count, tokens);
+
+                if(result == APRIL_RESULT_RECOGNITION_FINAL) {
+                    g_string_append_len(data->transcript_final, data->transcript_live->str, data->transcript_live->len);
+                    g_string_truncate(data->transcript_live, 0);
+                }
+
+                data->transcript_dirty = true;
             }
 
             if(result == APRIL_RESULT_RECOGNITION_FINAL) {
                 line_generator_finalize(&data->line);
                 commit_tokens_to_current_history(tokens, count);
-                // For UI locking of live region, handled in apply_transcript_update when is_final
             }
 
             g_mutex_unlock(&data->text_mutex);
-            g_idle_add(main_thread_update_label, data);
+            request_ui_update(data);
             break;
         }
 
         case APRIL_RESULT_ERROR_CANT_KEEP_UP: {
-            livecaptions_window_warn_slow(data->window);
+            atomic_store_explicit(&data->slow_warning, true, memory_order_relaxed);
+            request_ui_update(data);
             break;
         }
 
@@ -256,34 +413,246 @@ static void april_result_handler(void* userdata, AprilResultType result, size_t
             // Do not add line breaks on silence to keep text continuous
 
             g_mutex_unlock(&data->text_mutex);
-            g_idle_add(main_thread_update_label, data);
+            request_ui_update(data);
             break;
         }
     }
 }
 
-void asr_thread_enqueue_audio(asr_thread thread, short *data, size_t num_shorts) {
-    if((thread->window == NULL) || thread->pause) return;
-    if((thread->session == NULL) || (thread->model == NULL)) return;
+// Feeds only what the vad takes for speech, and flushes when an utterance
+// ends. Returns whether any audio went to the session.
+static bool feed_speech(asr_thread thread, short *data, size_t num_shorts) {
+    size_t frame_samples = vad_frame_samples(&thread->vad);
+    size_t fed = 0;
 
+    atomic_fetch_add_explicit(&thread->vad_samples_seen, num_shorts, memory_order_relaxed);
 
-    bool found_nonzero = false;
-    for(size_t i=0; i<num_shorts; i++){
-        if((data[i] > 16) || (data[i] < -16)){
-            found_nonzero = true;
-            break;
+    while(num_shorts > 0) {
+        size_t take = MIN(frame_samples - thread->vad_frame_fill, num_shorts);
+        memcpy(&thread->vad_frame[thread->vad_frame_fill], data, take * sizeof(short));
+
+        thread->vad_frame_fill += take;
+        data += take;
+        num_shorts -= take;
+
+        if(thread->vad_frame_fill < frame_samples) break;
+        thread->vad_frame_fill = 0;
+
+        switch(vad_process_frame(&thread->vad, thread->vad_frame)) {
+            case VAD_SPEECH_START: {
+                size_t count = vad_take_preroll(&thread->vad, thread->vad_preroll);
+                aas_feed_pcm16(thread->session, thread->vad_preroll, count);
+                fed += count;
+                break;
+            }
+
+            case VAD_SPEECH:
+                aas_feed_pcm16(thread->session, thread->vad_frame, frame_samples);
+                fed += frame_samples;
+                break;
+
+            case VAD_SPEECH_END:
+                aas_flush(thread->session);
+                atomic_fetch_add_explicit(&thread->vad_utterances, 1, memory_order_relaxed);
+                break;
+
+            case VAD_SILENCE:
+                break;
         }
     }
 
-    thread->silence_counter = found_nonzero ? 0 : (thread->silence_counter + num_shorts);
+    atomic_fetch_add_explicit(&thread->vad_samples_fed, fed, memory_order_relaxed);
+    thread->sound_counter += fed;
+
+    return fed > 0;
+}
 
-    if(thread->silence_counter >= 24000){
-        thread->silence_counter = 24000;
-        return aas_flush(thread->session);
+// Runs on the feeder thread with feed_mutex held. Returns whether the audio
+// went to the session.
+static bool feed_audio(asr_thread thread, short *data, size_t num_shorts, const struct pcm_level *level) {
+    if((thread->window == NULL) || thread->pause) return false;
+    if((thread->session == NULL) || (thread->model == NULL)) return false;
+
+    if(atomic_load_explicit(&thread->vad_enabled, memory_order_relaxed)) return feed_speech(thread, data, num_shorts);
+
+    thread->silence_counter = pcm_level_is_silent(level, SILENCE_THRESHOLD) ? (thread->silence_counter + num_shorts) : 0;
+
+    if(thread->silence_counter >= SILENCE_FLUSH_SAMPLES){
+        thread->silence_counter = SILENCE_FLUSH_SAMPLES;
+        aas_flush(thread->session);
+        return false;
     }
     
     thread->sound_counter += num_shorts;
     aas_feed_pcm16(thread->session, data, num_shorts); // TODO?
+    return true;
+}
+
+// Runs on the feeder thread once the samples up to end_pos have been read.
+// Every capture that ended in them is done with; if they were fed, its
+// latency is recorded.
+static void record_capture_latency(asr_thread thread, size_t start_pos, size_t end_pos, gint64 fed_time) {
+    size_t head = atomic_load_explicit(&thread->capture_stamps_head, memory_order_acquire);
+    if((head - thread->capture_stamps_tail) > CAPTURE_STAMPS)
+        thread->capture_stamps_tail = head - CAPTURE_STAMPS;
+
+    for(; thread->capture_stamps_tail != head; thread->capture_stamps_tail++) {
+        struct capture_stamp *stamp = &thread->capture_stamps[thread->capture_stamps_tail % CAPTURE_STAMPS];
+
+        size_t stamp_end = atomic_load_explicit(&stamp->end_pos, memory_order_relaxed);
+        gint64 stamp_time = atomic_load_explicit(&stamp->time, memory_order_relaxed);
+        if(stamp_end > end_pos) break;
+
+        // The producer may have lapped us while we were reading it
+        atomic_thread_fence(memory_order_acquire);
+        size_t new_head = atomic_load_explicit(&thread->capture_stamps_head, memory_order_acquire);
+        if((new_head - thread->capture_stamps_tail) >= CAPTURE_STAMPS) continue;
+
+        // Audio before start_pos was dropped or cleared without being fed
+        if((fed_time != 0) && (stamp_end > start_pos))
+            latency_histogram_record(&thread->latency[LATENCY_CAPTURE_TO_FEED], fed_time - stamp_time);
+    }
+}
+
+#define FEEDER_CHUNK_SAMPLES 2048
+#define FEEDER_IDLE_US 5000
+
+// About 17 minutes at 16 kHz, the sum of squares stays far from overflowing
+#define LEVEL_MAX_SAMPLES ((size_t)1 << 24)
+
+static void record_level(asr_thread thread, const struct pcm_level *level) {
+    // Nobody is watching the meter, start over
+    if(atomic_load_explicit(&thread->level_samples, memory_order_relaxed) >= LEVEL_MAX_SAMPLES) {
+        atomic_store_explicit(&thread->level_peak, 0, memory_order_relaxed);
+        atomic_store_explicit(&thread->level_sum_squares, 0, memory_order_relaxed);
+        atomic_store_explicit(&thread->level_samples, 0, memory_order_relaxed);
+    }
+
+    atomic_fetch_add_explicit(&thread->level_sum_squares, level->sum_squares, memory_order_relaxed);
+    atomic_fetch_add_explicit(&thread->level_samples, level->count, memory_order_relaxed);
+
+    int peak = atomic_load_explicit(&thread->level_peak, memory_order_relaxed);
+    while((level->peak > peak) && !atomic_compare_exchange_weak_explicit(&thread->level_peak, &peak, level->peak,
+                                                                         memory_order_relaxed, memory_order_relaxed));
+}
+
+static void *run_feeder_thread(void *userdata) {
+    asr_thread data = (asr_thread)userdata;
+
+    short chunk[FEEDER_CHUNK_SAMPLES];
+
+    while(!data->ending) {
+        size_t position = 0;
+        size_t count = audio_ring_read(&data->ring, chunk, FEEDER_CHUNK_SAMPLES, &position);
+        if(count == 0) {
+            g_usleep(FEEDER_IDLE_US);
+            continue;
+        }
+
+        // One pass for both the meter and the silence check
+        struct pcm_level level;
+        pcm_level_scan(chunk, count, &level);
+        record_level(data, &level);
+
+        g_mutex_lock(&data->feed_mutex);
+        bool fed = feed_audio(data, chunk, count, &level);
+        g_mutex_unlock(&data->feed_mutex);
+
+        gint64 fed_time = 0;
+        if(fed) {
+            fed_time = g_get_monotonic_time();
+
+            gint64 not_pending = 0;
+            atomic_compare_exchange_strong_explicit(&data->pending_feed_time, &not_pending, fed_time,
+                                                    memory_order_acq_rel, memory_order_relaxed);
+        }
+
+        record_capture_latency(data, position, position + count, fed_time);
+    }
+
+    return NULL;
+}
+
+// Called from the capture callbacks, which may be running on a realtime
+// thread. This must never wait on the model, so it only copies into the ring.
+void asr_thread_enqueue_audio(asr_thread thread, short *data, size_t num_shorts) {
+    if((thread->window == NULL) || thread->pause) return;
+
+    audio_ring_write(&thread->ring, data, num_shorts);
+
+    // Only this thread moves the head, the slot is published by storing it
+    size_t head = atomic_load_explicit(&thread->capture_stamps_head, memory_order_relaxed);
+    struct capture_stamp *stamp = &thread->capture_stamps[head % CAPTURE_STAMPS];
+    atomic_store_explicit(&stamp->end_pos, audio_ring_write_position(&thread->ring), memory_order_relaxed);
+    atomic_store_explicit(&stamp->time, g_get_monotonic_time(), memory_order_relaxed);
+    atomic_store_explicit(&thread->capture_stamps_head, head + 1, memory_order_release);
+}
+
+#define REPLAY_POLL_US 10000
+
+// Stands in for the model, handing the results of the trace to the handler
+static void *run_replay_thread(void *userdata) {
+    asr_thread data = (asr_thread)userdata;
+
+    // Results are dropped until there is a window to show them in
+    while(!data->ending && (data->window == NULL)) g_usleep(REPLAY_POLL_US);
+
+    struct token_trace_event event;
+    size_t replayed = 0;
+    gint64 start = g_get_monotonic_time();
+
+    while(!data->ending && token_trace_reader_next(data->replay, &event)) {
+        if(!data->replay_max_speed) {
+            gint64 wait;
+            while(!data->ending && ((wait = start + event.time_us - g_get_monotonic_time()) > 0))
+                g_usleep(MIN(wait, REPLAY_POLL_US));
+        }
+
+        april_result_handler(data, event.type, event.count, event.tokens);
+        replayed++;
+    }
+
+    gint64 elapsed_us = g_get_monotonic_time() - start;
+    printf("Replayed %zu results in %.3f s (%.0f results/s)\n", replayed, (double)elapsed_us / 1000000.0,
+           (elapsed_us > 0) ? ((double)replayed * 1000000.0 / (double)elapsed_us) : 0.0);
+
+    return NULL;
+}
+
+void asr_thread_get_audio_stats(asr_thread thread, struct audio_ring_stats *stats) {
+    audio_ring_get_stats(&thread->ring, stats);
+}
+
+size_t asr_thread_get_coalesced_updates(asr_thread thread) {
+    return atomic_load_explicit(&thread->coalesced_updates, memory_order_relaxed);
+}
+
+void asr_thread_get_latency(asr_thread thread, LatencyStage stage, struct latency_summary *summary) {
+    latency_histogram_summarize(&thread->latency[stage], summary);
+}
+
+void asr_thread_reset_latency(asr_thread thread) {
+    for(int i=0; i<LATENCY_NUM_STAGES; i++)
+        latency_histogram_reset(&thread->latency[i]);
+}
+
+void asr_thread_get_vad_stats(asr_thread thread, struct vad_stats *stats) {
+    stats->enabled = atomic_load_explicit(&thread->vad_enabled, memory_order_relaxed);
+    stats->samples_seen = atomic_load_explicit(&thread->vad_samples_seen, memory_order_relaxed);
+    stats->samples_fed = atomic_load_explicit(&thread->vad_samples_fed, memory_order_relaxed);
+    stats->utterances = atomic_load_explicit(&thread->vad_utterances, memory_order_relaxed);
+}
+
+void asr_thread_take_level(asr_thread thread, struct pcm_level *level) {
+    level->peak = atomic_exchange_explicit(&thread->level_peak, 0, memory_order_relaxed);
+    level->sum_squares = atomic_exchange_explicit(&thread->level_sum_squares, 0, memory_order_relaxed);
+    level->count = atomic_exchange_explicit(&thread->level_samples, 0, memory_order_relaxed);
+}
+
+void asr_thread_reset_vad_stats(asr_thread thread) {
+    atomic_store_explicit(&thread->vad_samples_seen, 0, memory_order_relaxed);
+    atomic_store_explicit(&thread->vad_samples_fed, 0, memory_order_relaxed);
+    atomic_store_explicit(&thread->vad_utterances, 0, memory_order_relaxed);
 }
 
 gpointer asr_thread_get_model(asr_thread thread) {
@@ -302,18 +671,123 @@ void asr_thread_set_text_stream_active(asr_thread thread, bool active) {
     thread->text_stream_active = active;
 }
 
+// Audio capture still runs while replaying, it just goes nowhere
+#define REPLAY_SAMPLE_RATE 16000
+
 int asr_thread_samplerate(asr_thread thread) {
+    if(thread->model == NULL) return REPLAY_SAMPLE_RATE;
     return aam_get_sample_rate(thread->model);
 }
 
-asr_thread create_asr_thread(const char *model_path){
+void asr_thread_set_vad(asr_thread thread, bool enabled, bool use_flatness) {
+    g_mutex_lock(&thread->feed_mutex);
+
+    // An utterance cut off by turning it off is ended here, as the silence
+    // check starts out counting from nothing
+    if(atomic_load_explicit(&thread->vad_enabled, memory_order_relaxed) && !enabled && (thread->session != NULL))
+        aas_flush(thread->session);
+
+    atomic_store_explicit(&thread->vad_enabled, enabled, memory_order_relaxed);
+    thread->vad_flatness = use_flatness;
+    thread->silence_counter = 0;
+
+    // Starts over with a new noise floor and nothing held back
+    vad_init(&thread->vad, asr_thread_samplerate(thread), use_flatness);
+    thread->vad_frame_fill = 0;
+
+    asr_thread_reset_vad_stats(thread);
+
+    g_mutex_unlock(&thread->feed_mutex);
+}
+
+static asr_thread new_asr_thread(void) {
     asr_thread data = calloc(1, sizeof(struct asr_thread_i));
 
+    g_mutex_init(&data->text_mutex);
+    g_mutex_init(&data->feed_mutex);
+    g_mutex_init(&data->update_mutex);
+
     line_generator_init(&data->line);
 
+    atomic_init(&data->update_pending, false);
+    atomic_init(&data->slow_warning, false);
+    atomic_init(&data->coalesced_updates, 0);
+    atomic_init(&data->capture_stamps_head, 0);
+    atomic_init(&data->pending_feed_time, 0);
+    atomic_init(&data->pending_result_time, 0);
+    asr_thread_reset_latency(data);
+    asr_thread_reset_vad_stats(data);
+    atomic_init(&data->level_peak, 0);
+    atomic_init(&data->level_sum_squares, 0);
+    atomic_init(&data->level_samples, 0);
+    atomic_init(&data->trace_writer, NULL);
+    data->transcript_final = g_string_new(NULL);
+    data->transcript_live = g_string_new(NULL);
+
+    // Changes later on come through asr_thread_set_vad
+    GSettings *settings = g_settings_new("net.sapples.LiveCaptions");
+    atomic_init(&data->vad_enabled, g_settings_get_boolean(settings, "voice-activity-detection"));
+    data->vad_flatness = g_settings_get_boolean(settings, "vad-spectral-flatness");
+    g_object_unref(G_OBJECT(settings));
+
+    return data;
+}
+
+// Frees what new_asr_thread and asr_thread_update_model set up, once no
+// thread is running anymore
+static void destroy_asr_thread(asr_thread data) {
+    if(data->session != NULL)
+        aas_free(data->session);
+
+    if(data->model != NULL)
+        aam_free(data->model);
+
+    if(data->replay != NULL) token_trace_reader_free(data->replay);
+
+    line_generator_free(&data->line);
+    if(data->next_layout != NULL) g_object_unref(data->next_layout);
+
+    audio_ring_free(&data->ring);
+
+    g_string_free(data->transcript_final, TRUE);
+    g_string_free(data->transcript_live, TRUE);
+
+    g_mutex_clear(&data->update_mutex);
+    g_mutex_clear(&data->feed_mutex);
+    g_mutex_clear(&data->text_mutex);
+
+    free(data);
+}
+
+static bool start_asr_thread(asr_thread data) {
+    GSettings *settings = g_settings_new("net.sapples.LiveCaptions");
+    int buffer_ms = g_settings_get_int(settings, "audio-buffer-ms");
+    AudioRingPolicy policy = g_settings_get_boolean(settings, "audio-buffer-block") ? AUDIO_RING_BLOCK : AUDIO_RING_DROP_OLDEST;
+    g_object_unref(G_OBJECT(settings));
+
+    if(buffer_ms < 100) buffer_ms = 100;
+    size_t capacity = (size_t)buffer_ms * (size_t)asr_thread_samplerate(data) / 1000;
+
+    if(!audio_ring_init(&data->ring, capacity, policy)) {
+        printf("Allocating audio buffer of %zu samples failed!\n", capacity);
+        return false;
+    }
+
+    data->thread_id = g_thread_new("lcap-audiothread", run_asr_thread, data);
+    data->feeder_thread_id = g_thread_new("lcap-feeder", run_feeder_thread, data);
+
+    data->text_stream_active = false;
+
+    return true;
+}
+
+asr_thread create_asr_thread(const char *model_path){
+    asr_thread data = new_asr_thread();
+
     if(!asr_thread_update_model(data, model_path)){
         char *model_default = GET_MODEL_PATH();
         if(!asr_thread_update_model(data, model_default)) {
+            destroy_asr_thread(data);
             return NULL;
         }
 
@@ -322,15 +796,49 @@ asr_thread create_asr_thread(const char *model_path){
         g_object_unref(G_OBJECT(settings));
     }
 
-    g_mutex_init(&data->text_mutex);
+    if(!start_asr_thread(data)) {
+        destroy_asr_thread(data);
+        return NULL;
+    }
 
-    data->thread_id = g_thread_new("lcap-audiothread", run_asr_thread, data);
+    return data;
+}
 
-    data->text_stream_active = false;
+asr_thread create_replay_asr_thread(const char *trace_path, bool max_speed) {
+    token_trace_reader replay = token_trace_reader_new(trace_path);
+    if(replay == NULL) return NULL;
+
+    asr_thread data = new_asr_thread();
+    data->replay = replay;
+    data->replay_max_speed = max_speed;
+
+    if(!start_asr_thread(data)) {
+        destroy_asr_thread(data);
+        return NULL;
+    }
+
+    data->replay_thread_id = g_thread_new("lcap-replay", run_replay_thread, data);
 
     return data;
 }
 
+bool asr_thread_record_trace(asr_thread thread, const char *path) {
+    // The handler may be using the writer at any time, so there is only ever
+    // one and it is closed in free_asr_thread
+    if(atomic_load_explicit(&thread->trace_writer, memory_order_acquire) != NULL) {
+        printf("Already recording results\n");
+        return false;
+    }
+
+    token_trace_writer writer = token_trace_writer_new(path);
+    if(writer == NULL) return false;
+
+    atomic_store_explicit(&thread->trace_writer, writer, memory_order_release);
+
+    printf("Recording results to %s\n", path);
+    return true;
+}
+
 bool asr_thread_update_model(asr_thread data, const char *model_path) {
     // Freeing model frees token list, which may be being accessed during
     // line generation
@@ -338,12 +846,18 @@ bool asr_thread_update_model(asr_thread data, const char *model_path) {
 
     data->pause = true;
 
+    // Wait for the feeder to finish with the old session
+    g_mutex_lock(&data->feed_mutex);
+
     AprilASRModel old_model = data->model;
     AprilASRSession old_session = data->session;
 
     data->model = NULL;
     data->session = NULL;
 
+    // The old session will never answer for what was fed to it
+    atomic_store_explicit(&data->pending_feed_time, 0, memory_order_release);
+
     if(old_session != NULL)
         aas_free(old_session);
 
@@ -361,6 +875,7 @@ bool asr_thread_update_model(asr_thread data, const char *model_path) {
     if(new_model == NULL) {
         printf("Loading model %s failed!\n", model_path);
         data->errored = true;
+        g_mutex_unlock(&data->feed_mutex);
         g_mutex_unlock(&data->text_mutex);
         return false;
     }
@@ -382,10 +897,15 @@ bool asr_thread_update_model(asr_thread data, const char *model_path) {
 
     line_generator_set_language(&data->line, aam_get_language(new_model));
 
+    vad_init(&data->vad, (int)aam_get_sample_rate(new_model), data->vad_flatness);
+    data->vad_frame_fill = 0;
+
     AprilASRSession new_session = aas_create_session(new_model, config);
     if(new_session == NULL) {
         printf("Creating session %s failed!\n", model_path);
+        aam_free(new_model);
         data->errored = true;
+        g_mutex_unlock(&data->feed_mutex);
         g_mutex_unlock(&data->text_mutex);
         return false;
     }
@@ -399,6 +919,7 @@ bool asr_thread_update_model(asr_thread data, const char *model_path) {
 
     line_generator_finalize(&data->line);
 
+    g_mutex_unlock(&data->feed_mutex);
     g_mutex_unlock(&data->text_mutex);
 
     return true;
@@ -409,28 +930,76 @@ bool asr_thread_is_errored(asr_thread thread) {
 }
 
 void asr_thread_set_main_window(asr_thread thread, LiveCaptionsWindow *window) {
+    if(thread->window != NULL) {
+        // A tick on the old window would never be applied to the new one
+        if(drop_update_tick(thread, GTK_WIDGET(thread->window)))
+            atomic_store_explicit(&thread->update_pending, false, memory_order_release);
+
+        g_signal_handlers_disconnect_by_data(thread->window, thread);
+    }
+
+    thread->update_tick_id = 0;
+
+    g_mutex_lock(&thread->text_mutex);
     thread->window = window;
+
+    if(window != NULL) {
+        g_signal_connect(window, "unmap", G_CALLBACK(on_window_unmap), thread);
+        g_signal_connect(window, "destroy", G_CALLBACK(on_window_destroy), thread);
+
+        // The next result lays out text with this window's font
+        publish_window_state(thread, true);
+    }
+    g_mutex_unlock(&thread->text_mutex);
 }
 
 void asr_thread_flush(asr_thread thread) {
-    if(thread->session == NULL) return;
-    aas_flush(thread->session);
+    // Audio still queued from the previous capture source is stale
+    g_mutex_lock(&thread->feed_mutex);
+    audio_ring_clear(&thread->ring);
+    vad_reset(&thread->vad);
+    thread->vad_frame_fill = 0;
+    if(thread->session != NULL) aas_flush(thread->session);
+    g_mutex_unlock(&thread->feed_mutex);
 }
 
 void free_asr_thread(asr_thread thread) {
     thread->ending = true;
 
+    audio_ring_close(&thread->ring);
+    g_thread_join(thread->feeder_thread_id);
+
+    // The replay thread takes text_mutex for every result
+    if(thread->replay_thread_id != NULL) g_thread_join(thread->replay_thread_id);
+
+    report_audio_overruns(thread);
+
     g_mutex_lock(&thread->text_mutex);
 
     g_thread_join(thread->thread_id);
 
+    // The session may still be delivering results until it is freed
     if(thread->session != NULL)
         aas_free(thread->session);
-    
-    if(thread->model != NULL)
-        aam_free(thread->model);
+    thread->session = NULL;
 
     g_thread_unref(thread->thread_id); // ?
 
-    free(thread);
+    g_mutex_unlock(&thread->text_mutex);
+
+    // Nothing can produce results anymore
+    token_trace_writer trace_writer = atomic_exchange_explicit(&thread->trace_writer, NULL, memory_order_acq_rel);
+    if(trace_writer != NULL) token_trace_writer_free(trace_writer);
+
+    // Every thread that schedules updates is gone, so whatever is still
+    // pending would only run after the thread is freed
+    g_mutex_lock(&thread->update_mutex);
+    if(thread->update_idle_id != 0) g_source_remove(thread->update_idle_id);
+    thread->update_idle_id = 0;
+    g_mutex_unlock(&thread->update_mutex);
+
+    // Also removes a pending tick
+    asr_thread_set_main_window(thread, NULL);
+
+    destroy_asr_thread(thread);
 }
@@ -21,18 +21,48 @@
 #pragma once
 
 #include <adwaita.h>
+#include "latency.h"
+#include "pcm-level.h"
+#include "vad.h"
 
 struct _LiveCaptionsWindow;
+struct audio_ring_stats;
 
 struct asr_thread_i;
 typedef struct asr_thread_i * asr_thread;
 
 
 asr_thread create_asr_thread(const char *model_path);
+
+// Creates an asr_thread without a model which hands the results recorded in
+// the trace to the captioning path instead, at the pace they were recorded
+// at or as fast as they can be taken
+asr_thread create_replay_asr_thread(const char *trace_path, bool max_speed);
+
+// Writes every result from then on to a trace at path, until the thread is
+// freed. Can only be started once.
+bool asr_thread_record_trace(asr_thread thread, const char *path);
+
 bool asr_thread_update_model(asr_thread thread, const char *model_path);
 bool asr_thread_is_errored(asr_thread thread);
 void asr_thread_set_main_window(asr_thread thread, struct _LiveCaptionsWindow *window);
 void asr_thread_enqueue_audio(asr_thread thread, short *data, size_t num_shorts);
+void asr_thread_get_audio_stats(asr_thread thread, struct audio_ring_stats *stats);
+
+// Number of UI refreshes that were merged into an already pending one
+size_t asr_thread_get_coalesced_updates(asr_thread thread);
+
+void asr_thread_get_latency(asr_thread thread, LatencyStage stage, struct latency_summary *summary);
+void asr_thread_reset_latency(asr_thread thread);
+
+// Applies the voice activity detection settings to the running thread
+void asr_thread_set_vad(asr_thread thread, bool enabled, bool use_flatness);
+void asr_thread_get_vad_stats(asr_thread thread, struct vad_stats *stats);
+void asr_thread_reset_vad_stats(asr_thread thread);
+
+// Peak and energy of the captured audio since the last call, for a meter
+void asr_thread_take_level(asr_thread thread, struct pcm_level *level);
+
 gpointer asr_thread_get_model(asr_thread thread);
 gpointer asr_thread_get_session(asr_thread thread);
 void asr_thread_pause(asr_thread thread, bool pause);
@@ -0,0 +1,180 @@
+/* audio-ring.c
+ * This file contains the implementation for audio_ring
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "audio-ring.h"
+
+bool audio_ring_init(struct audio_ring *ring, size_t min_capacity, AudioRingPolicy policy) {
+    size_t capacity = 1024;
+    while(capacity < min_capacity) capacity <<= 1;
+
+    ring->data = calloc(capacity, sizeof(short));
+    if(ring->data == NULL) return false;
+
+    ring->capacity = capacity;
+    ring->mask = capacity - 1;
+    ring->policy = policy;
+
+    atomic_init(&ring->write_pos, 0);
+    atomic_init(&ring->read_pos, 0);
+    atomic_init(&ring->closed, false);
+
+    atomic_init(&ring->overruns, 0);
+    atomic_init(&ring->dropped_samples, 0);
+    atomic_init(&ring->blocked_writes, 0);
+
+    return true;
+}
+
+void audio_ring_free(struct audio_ring *ring) {
+    free(ring->data);
+    ring->data = NULL;
+    ring->capacity = 0;
+    ring->mask = 0;
+}
+
+// Copies count samples into the ring starting at position pos, wrapping
+// around the end of the buffer if needed
+static void copy_in(struct audio_ring *ring, size_t pos, const short *samples, size_t count) {
+    size_t offset = pos & ring->mask;
+    size_t first = ring->capacity - offset;
+    if(first > count) first = count;
+
+    memcpy(&ring->data[offset], samples, first * sizeof(short));
+    if(first < count)
+        memcpy(&ring->data[0], &samples[first], (count - first) * sizeof(short));
+}
+
+static void copy_out(struct audio_ring *ring, size_t pos, short *out, size_t count) {
+    size_t offset = pos & ring->mask;
+    size_t first = ring->capacity - offset;
+    if(first > count) first = count;
+
+    memcpy(out, &ring->data[offset], first * sizeof(short));
+    if(first < count)
+        memcpy(&out[first], &ring->data[0], (count - first) * sizeof(short));
+}
+
+size_t audio_ring_write(struct audio_ring *ring, const short *samples, size_t count) {
+    if((ring->data == NULL) || (count == 0)) return 0;
+
+    // A single write bigger than the whole ring can only keep its newest part
+    if(count > ring->capacity) {
+        size_t excess = count - ring->capacity;
+        samples += excess;
+        count = ring->capacity;
+
+        atomic_fetch_add_explicit(&ring->overruns, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&ring->dropped_samples, excess, memory_order_relaxed);
+    }
+
+    // Only the producer ever stores write_pos
+    size_t w = atomic_load_explicit(&ring->write_pos, memory_order_relaxed);
+
+    bool counted_block = false;
+    for(;;) {
+        size_t r = atomic_load_explicit(&ring->read_pos, memory_order_acquire);
+        size_t space = ring->capacity - (w - r);
+        if(space >= count) break;
+
+        if((ring->policy == AUDIO_RING_BLOCK) && !atomic_load_explicit(&ring->closed, memory_order_acquire)) {
+            if(!counted_block) {
+                atomic_fetch_add_explicit(&ring->blocked_writes, 1, memory_order_relaxed);
+                counted_block = true;
+            }
+
+            g_usleep(1000);
+            continue;
+        }
+
+        // Drop the oldest samples by moving the read position forward. If the
+        // consumer is reading concurrently its own compare-and-swap on
+        // read_pos will fail, so it never returns samples that we are about
+        // to overwrite.
+        size_t needed = count - space;
+        if(atomic_compare_exchange_weak_explicit(&ring->read_pos, &r, r + needed,
+                                                 memory_order_acq_rel, memory_order_acquire)) {
+            atomic_fetch_add_explicit(&ring->overruns, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&ring->dropped_samples, needed, memory_order_relaxed);
+            break;
+        }
+    }
+
+    copy_in(ring, w, samples, count);
+
+    atomic_store_explicit(&ring->write_pos, w + count, memory_order_release);
+
+    return count;
+}
+
+size_t audio_ring_read(struct audio_ring *ring, short *out, size_t max_count, size_t *position) {
+    if((ring->data == NULL) || (max_count == 0)) return 0;
+
+    for(;;) {
+        size_t r = atomic_load_explicit(&ring->read_pos, memory_order_acquire);
+        size_t w = atomic_load_explicit(&ring->write_pos, memory_order_acquire);
+
+        size_t available = w - r;
+        if(available == 0) return 0;
+
+        size_t count = available < max_count ? available : max_count;
+        copy_out(ring, r, out, count);
+
+        // The producer may have dropped what we just copied in the meantime,
+        // in which case the copy may be torn and we have to start over
+        if(atomic_compare_exchange_strong_explicit(&ring->read_pos, &r, r + count,
+                                                   memory_order_acq_rel, memory_order_acquire)) {
+            if(position != NULL) *position = r;
+            return count;
+        }
+    }
+}
+
+size_t audio_ring_write_position(struct audio_ring *ring) {
+    return atomic_load_explicit(&ring->write_pos, memory_order_relaxed);
+}
+
+void audio_ring_clear(struct audio_ring *ring) {
+    size_t r = atomic_load_explicit(&ring->read_pos, memory_order_acquire);
+    for(;;) {
+        size_t w = atomic_load_explicit(&ring->write_pos, memory_order_acquire);
+        if(atomic_compare_exchange_weak_explicit(&ring->read_pos, &r, w,
+                                                 memory_order_acq_rel, memory_order_acquire)) {
+            return;
+        }
+    }
+}
+
+void audio_ring_close(struct audio_ring *ring) {
+    atomic_store_explicit(&ring->closed, true, memory_order_release);
+}
+
+void audio_ring_get_stats(struct audio_ring *ring, struct audio_ring_stats *stats) {
+    size_t r = atomic_load_explicit(&ring->read_pos, memory_order_acquire);
+    size_t w = atomic_load_explicit(&ring->write_pos, memory_order_acquire);
+
+    stats->capacity = ring->capacity;
+    stats->queued = w - r;
+    stats->overruns = atomic_load_explicit(&ring->overruns, memory_order_relaxed);
+    stats->dropped_samples = atomic_load_explicit(&ring->dropped_samples, memory_order_relaxed);
+    stats->blocked_writes = atomic_load_explicit(&ring->blocked_writes, memory_order_relaxed);
+}
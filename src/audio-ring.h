@@ -0,0 +1,100 @@
+/* audio-ring.h
+ * This file contains the declaration for audio_ring, a lock-free
+ * single-producer/single-consumer ring buffer of PCM16 samples that sits
+ * between the audio capture callbacks and the asr_thread feeder.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// What the producer does when the consumer has fallen behind and there is
+// no room for new samples
+typedef enum AudioRingPolicy {
+    // Discard the oldest queued samples so the newest audio always fits.
+    // The producer never waits.
+    AUDIO_RING_DROP_OLDEST = 0,
+
+    // Wait for the consumer to make room. Only use this if the capture
+    // backend tolerates its callback being held up.
+    AUDIO_RING_BLOCK = 1
+} AudioRingPolicy;
+
+struct audio_ring_stats {
+    size_t capacity;
+    size_t queued;
+
+    // Number of writes that had to discard queued samples
+    size_t overruns;
+    size_t dropped_samples;
+
+    // Number of writes that had to wait for room (AUDIO_RING_BLOCK only)
+    size_t blocked_writes;
+};
+
+struct audio_ring {
+    short *data;
+    size_t capacity; // always a power of two
+    size_t mask;
+    AudioRingPolicy policy;
+
+    // Positions increase monotonically and are wrapped with mask on access.
+    // They live on separate cache lines so the producer and consumer do not
+    // keep stealing each other's line.
+    _Alignas(64) atomic_size_t write_pos;
+    _Alignas(64) atomic_size_t read_pos;
+
+    _Alignas(64) atomic_bool closed;
+
+    atomic_size_t overruns;
+    atomic_size_t dropped_samples;
+    atomic_size_t blocked_writes;
+};
+
+// Allocates room for at least min_capacity samples (rounded up to a power of two)
+bool audio_ring_init(struct audio_ring *ring, size_t min_capacity, AudioRingPolicy policy);
+void audio_ring_free(struct audio_ring *ring);
+
+// Producer side. Only one thread may call this at a time. With
+// AUDIO_RING_DROP_OLDEST this is wait-free apart from a compare-and-swap
+// that only retries if the consumer is reading at the same moment.
+// Returns the number of samples written.
+size_t audio_ring_write(struct audio_ring *ring, const short *samples, size_t count);
+
+// Consumer side. Only one thread may call this at a time. Copies up to
+// max_count of the oldest queued samples into out and returns how many.
+// If position is not NULL, it is set to the ring position of the first
+// sample returned, which can be matched against audio_ring_write_position.
+size_t audio_ring_read(struct audio_ring *ring, short *out, size_t max_count, size_t *position);
+
+// The total number of samples ever written, which is the position right
+// after the newest sample. Only meaningful on the producer side.
+size_t audio_ring_write_position(struct audio_ring *ring);
+
+// Drops everything that is currently queued. This only ever moves the read
+// position forward with a compare-and-swap, so it is safe to call while the
+// consumer is reading.
+void audio_ring_clear(struct audio_ring *ring);
+
+// Wakes up a producer blocked in audio_ring_write and makes further blocking
+// writes return immediately
+void audio_ring_close(struct audio_ring *ring);
+
+void audio_ring_get_stats(struct audio_ring *ring, struct audio_ring_stats *stats);
@@ -29,6 +29,12 @@
 
 #define MINIMUM_BENCHMARK_RESULT (0.6)
 
+// A sample with a magnitude above this counts as sound
+#define SILENCE_THRESHOLD 16
+
+// After this many quiet samples in a row the session gets flushed
+#define SILENCE_FLUSH_SAMPLES 24000
+
 // Helper function to get the model path
 static inline const char* get_model_path_impl(void) {
     // First check environment variable
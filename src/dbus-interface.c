@@ -247,10 +247,25 @@ static const _ExtendedGDBusPropertyInfo _dblcap_net_sapples_live_captions_extern
   TRUE
 };
 
+static const _ExtendedGDBusPropertyInfo _dblcap_net_sapples_live_captions_external_property_info_latency =
+{
+  {
+    -1,
+    (gchar *) "Latency",
+    (gchar *) "a{s(tddddd)}",
+    G_DBUS_PROPERTY_INFO_FLAGS_READABLE,
+    NULL
+  },
+  "latency",
+  TRUE,
+  TRUE
+};
+
 static const GDBusPropertyInfo * const _dblcap_net_sapples_live_captions_external_property_info_pointers[] =
 {
   &_dblcap_net_sapples_live_captions_external_property_info_keep_above.parent_struct,
   &_dblcap_net_sapples_live_captions_external_property_info_text_stream_active.parent_struct,
+  &_dblcap_net_sapples_live_captions_external_property_info_latency.parent_struct,
   NULL
 };
 
@@ -296,6 +311,7 @@ dblcap_net_sapples_live_captions_external_override_properties (GObjectClass *kla
 {
   g_object_class_override_property (klass, property_id_begin++, "keep-above");
   g_object_class_override_property (klass, property_id_begin++, "text-stream-active");
+  g_object_class_override_property (klass, property_id_begin++, "latency");
   return property_id_begin - 1;
 }
 
@@ -313,6 +329,7 @@ dblcap_net_sapples_live_captions_external_override_properties (GObjectClass *kla
  * @handle_allow_keep_above: Handler for the #DBLCapNetSapplesLiveCaptionsExternal::handle-allow-keep-above signal.
  * @get_keep_above: Getter for the #DBLCapNetSapplesLiveCaptionsExternal:keep-above property.
  * @get_text_stream_active: Getter for the #DBLCapNetSapplesLiveCaptionsExternal:text-stream-active property.
+ * @get_latency: Getter for the #DBLCapNetSapplesLiveCaptionsExternal:latency property.
  * @text_stream: Handler for the #DBLCapNetSapplesLiveCaptionsExternal::text-stream signal.
  *
  * Virtual table for the D-Bus interface <link linkend="gdbus-interface-net-sapples-LiveCaptions-External.top_of_page">net.sapples.LiveCaptions.External</link>.
@@ -386,6 +403,15 @@ dblcap_net_sapples_live_captions_external_default_init (DBLCapNetSapplesLiveCapt
    */
   g_object_interface_install_property (iface,
     g_param_spec_boolean ("text-stream-active", "TextStreamActive", "TextStreamActive", FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  /**
+   * DBLCapNetSapplesLiveCaptionsExternal:latency:
+   *
+   * Represents the D-Bus property <link linkend="gdbus-property-net-sapples-LiveCaptions-External.Latency">"Latency"</link>.
+   *
+   * Since the D-Bus property for this #GObject property is readable but not writable, it is meaningful to read from it on both the client- and service-side. It is only meaningful, however, to write to it on the service-side.
+   */
+  g_object_interface_install_property (iface,
+    g_param_spec_variant ("latency", "Latency", "Latency", G_VARIANT_TYPE ("a{s(tddddd)}"), NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 }
 
 /**
@@ -450,6 +476,57 @@ dblcap_net_sapples_live_captions_external_set_text_stream_active (DBLCapNetSappl
   g_object_set (G_OBJECT (object), "text-stream-active", value, NULL);
 }
 
+/**
+ * dblcap_net_sapples_live_captions_external_get_latency: (skip)
+ * @object: A #DBLCapNetSapplesLiveCaptionsExternal.
+ *
+ * Gets the value of the <link linkend="gdbus-property-net-sapples-LiveCaptions-External.Latency">"Latency"</link> D-Bus property.
+ *
+ * Since this D-Bus property is readable, it is meaningful to use this function on both the client- and service-side.
+ *
+ * The returned value is only valid until the property changes so on the client-side it is only safe to use this function on the thread where @object was constructed. Use dblcap_net_sapples_live_captions_external_dup_latency() if on another thread.
+ *
+ * Returns: (transfer none) (nullable): The property value or %NULL if the property is not set. Do not free the returned value, it belongs to @object.
+ */
+GVariant *
+dblcap_net_sapples_live_captions_external_get_latency (DBLCapNetSapplesLiveCaptionsExternal *object)
+{
+  return DBLCAP_NET_SAPPLES_LIVE_CAPTIONS_EXTERNAL_GET_IFACE (object)->get_latency (object);
+}
+
+/**
+ * dblcap_net_sapples_live_captions_external_dup_latency: (skip)
+ * @object: A #DBLCapNetSapplesLiveCaptionsExternal.
+ *
+ * Gets a copy of the <link linkend="gdbus-property-net-sapples-LiveCaptions-External.Latency">"Latency"</link> D-Bus property.
+ *
+ * Since this D-Bus property is readable, it is meaningful to use this function on both the client- and service-side.
+ *
+ * Returns: (transfer full) (nullable): The property value or %NULL if the property is not set. The returned value should be freed with g_variant_unref().
+ */
+GVariant *
+dblcap_net_sapples_live_captions_external_dup_latency (DBLCapNetSapplesLiveCaptionsExternal *object)
+{
+  GVariant *value;
+  g_object_get (G_OBJECT (object), "latency", &value, NULL);
+  return value;
+}
+
+/**
+ * dblcap_net_sapples_live_captions_external_set_latency: (skip)
+ * @object: A #DBLCapNetSapplesLiveCaptionsExternal.
+ * @value: The value to set.
+ *
+ * Sets the <link linkend="gdbus-property-net-sapples-LiveCaptions-External.Latency">"Latency"</link> D-Bus property to @value.
+ *
+ * Since this D-Bus property is not writable, it is only meaningful to use this function on the service-side.
+ */
+void
+dblcap_net_sapples_live_captions_external_set_latency (DBLCapNetSapplesLiveCaptionsExternal *object, GVariant *value)
+{
+  g_object_set (G_OBJECT (object), "latency", value, NULL);
+}
+
 /**
  * dblcap_net_sapples_live_captions_external_emit_text_stream:
  * @object: A #DBLCapNetSapplesLiveCaptionsExternal.
@@ -623,7 +700,7 @@ dblcap_net_sapples_live_captions_external_proxy_get_property (GObject      *obje
 {
   const _ExtendedGDBusPropertyInfo *info;
   GVariant *variant;
-  g_assert (prop_id != 0 && prop_id - 1 < 2);
+  g_assert (prop_id != 0 && prop_id - 1 < 3);
   info = (const _ExtendedGDBusPropertyInfo *) _dblcap_net_sapples_live_captions_external_property_info_pointers[prop_id - 1];
   variant = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (object), info->parent_struct.name);
   if (info->use_gvariant)
@@ -670,7 +747,7 @@ dblcap_net_sapples_live_captions_external_proxy_set_property (GObject      *obje
 {
   const _ExtendedGDBusPropertyInfo *info;
   GVariant *variant;
-  g_assert (prop_id != 0 && prop_id - 1 < 2);
+  g_assert (prop_id != 0 && prop_id - 1 < 3);
   info = (const _ExtendedGDBusPropertyInfo *) _dblcap_net_sapples_live_captions_external_property_info_pointers[prop_id - 1];
   variant = g_dbus_gvalue_to_gvariant (value, G_VARIANT_TYPE (info->parent_struct.signature));
   g_dbus_proxy_call (G_DBUS_PROXY (object),
@@ -782,6 +859,19 @@ dblcap_net_sapples_live_captions_external_proxy_get_text_stream_active (DBLCapNe
   return value;
 }
 
+static GVariant *
+dblcap_net_sapples_live_captions_external_proxy_get_latency (DBLCapNetSapplesLiveCaptionsExternal *object)
+{
+  DBLCapNetSapplesLiveCaptionsExternalProxy *proxy = DBLCAP_NET_SAPPLES_LIVE_CAPTIONS_EXTERNAL_PROXY (object);
+  GVariant *variant;
+  GVariant *value = NULL;
+  variant = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (proxy), "Latency");
+  value = variant;
+  if (variant != NULL)
+    g_variant_unref (variant);
+  return value;
+}
+
 static void
 dblcap_net_sapples_live_captions_external_proxy_init (DBLCapNetSapplesLiveCaptionsExternalProxy *proxy)
 {
@@ -821,6 +911,7 @@ dblcap_net_sapples_live_captions_external_proxy_iface_init (DBLCapNetSapplesLive
 {
   iface->get_keep_above = dblcap_net_sapples_live_captions_external_proxy_get_keep_above;
   iface->get_text_stream_active = dblcap_net_sapples_live_captions_external_proxy_get_text_stream_active;
+  iface->get_latency = dblcap_net_sapples_live_captions_external_proxy_get_latency;
 }
 
 /**
@@ -1271,7 +1362,7 @@ dblcap_net_sapples_live_captions_external_skeleton_finalize (GObject *object)
 {
   DBLCapNetSapplesLiveCaptionsExternalSkeleton *skeleton = DBLCAP_NET_SAPPLES_LIVE_CAPTIONS_EXTERNAL_SKELETON (object);
   guint n;
-  for (n = 0; n < 2; n++)
+  for (n = 0; n < 3; n++)
     g_value_unset (&skeleton->priv->properties[n]);
   g_free (skeleton->priv->properties);
   g_list_free_full (skeleton->priv->changed_properties, (GDestroyNotify) _changed_property_free);
@@ -1289,7 +1380,7 @@ dblcap_net_sapples_live_captions_external_skeleton_get_property (GObject      *o
   GParamSpec   *pspec G_GNUC_UNUSED)
 {
   DBLCapNetSapplesLiveCaptionsExternalSkeleton *skeleton = DBLCAP_NET_SAPPLES_LIVE_CAPTIONS_EXTERNAL_SKELETON (object);
-  g_assert (prop_id != 0 && prop_id - 1 < 2);
+  g_assert (prop_id != 0 && prop_id - 1 < 3);
   g_mutex_lock (&skeleton->priv->lock);
   g_value_copy (&skeleton->priv->properties[prop_id - 1], value);
   g_mutex_unlock (&skeleton->priv->lock);
@@ -1408,7 +1499,7 @@ dblcap_net_sapples_live_captions_external_skeleton_set_property (GObject      *o
 {
   const _ExtendedGDBusPropertyInfo *info;
   DBLCapNetSapplesLiveCaptionsExternalSkeleton *skeleton = DBLCAP_NET_SAPPLES_LIVE_CAPTIONS_EXTERNAL_SKELETON (object);
-  g_assert (prop_id != 0 && prop_id - 1 < 2);
+  g_assert (prop_id != 0 && prop_id - 1 < 3);
   info = (const _ExtendedGDBusPropertyInfo *) _dblcap_net_sapples_live_captions_external_property_info_pointers[prop_id - 1];
   g_mutex_lock (&skeleton->priv->lock);
   g_object_freeze_notify (object);
@@ -1435,9 +1526,10 @@ dblcap_net_sapples_live_captions_external_skeleton_init (DBLCapNetSapplesLiveCap
 
   g_mutex_init (&skeleton->priv->lock);
   skeleton->priv->context = g_main_context_ref_thread_default ();
-  skeleton->priv->properties = g_new0 (GValue, 2);
+  skeleton->priv->properties = g_new0 (GValue, 3);
   g_value_init (&skeleton->priv->properties[0], G_TYPE_BOOLEAN);
   g_value_init (&skeleton->priv->properties[1], G_TYPE_BOOLEAN);
+  g_value_init (&skeleton->priv->properties[2], G_TYPE_VARIANT);
 }
 
 static gboolean 
@@ -1462,6 +1554,17 @@ dblcap_net_sapples_live_captions_external_skeleton_get_text_stream_active (DBLCa
   return value;
 }
 
+static GVariant *
+dblcap_net_sapples_live_captions_external_skeleton_get_latency (DBLCapNetSapplesLiveCaptionsExternal *object)
+{
+  DBLCapNetSapplesLiveCaptionsExternalSkeleton *skeleton = DBLCAP_NET_SAPPLES_LIVE_CAPTIONS_EXTERNAL_SKELETON (object);
+  GVariant *value;
+  g_mutex_lock (&skeleton->priv->lock);
+  value = g_value_get_variant (&(skeleton->priv->properties[2]));
+  g_mutex_unlock (&skeleton->priv->lock);
+  return value;
+}
+
 static void
 dblcap_net_sapples_live_captions_external_skeleton_class_init (DBLCapNetSapplesLiveCaptionsExternalSkeletonClass *klass)
 {
@@ -1494,6 +1597,7 @@ dblcap_net_sapples_live_captions_external_skeleton_iface_init (DBLCapNetSapplesL
   iface->text_stream = _dblcap_net_sapples_live_captions_external_on_signal_text_stream;
   iface->get_keep_above = dblcap_net_sapples_live_captions_external_skeleton_get_keep_above;
   iface->get_text_stream_active = dblcap_net_sapples_live_captions_external_skeleton_get_text_stream_active;
+  iface->get_latency = dblcap_net_sapples_live_captions_external_skeleton_get_latency;
 }
 
 /**
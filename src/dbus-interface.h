@@ -40,6 +40,8 @@ struct _DBLCapNetSapplesLiveCaptionsExternalIface
 
   gboolean  (*get_text_stream_active) (DBLCapNetSapplesLiveCaptionsExternal *object);
 
+  GVariant * (*get_latency) (DBLCapNetSapplesLiveCaptionsExternal *object);
+
   void (*text_stream) (
     DBLCapNetSapplesLiveCaptionsExternal *object,
     const gchar *arg_text);
@@ -92,6 +94,10 @@ void dblcap_net_sapples_live_captions_external_set_keep_above (DBLCapNetSapplesL
 gboolean dblcap_net_sapples_live_captions_external_get_text_stream_active (DBLCapNetSapplesLiveCaptionsExternal *object);
 void dblcap_net_sapples_live_captions_external_set_text_stream_active (DBLCapNetSapplesLiveCaptionsExternal *object, gboolean value);
 
+GVariant *dblcap_net_sapples_live_captions_external_get_latency (DBLCapNetSapplesLiveCaptionsExternal *object);
+GVariant *dblcap_net_sapples_live_captions_external_dup_latency (DBLCapNetSapplesLiveCaptionsExternal *object);
+void dblcap_net_sapples_live_captions_external_set_latency (DBLCapNetSapplesLiveCaptionsExternal *object, GVariant *value);
+
 
 /* ---- */
 
@@ -0,0 +1,815 @@
+/* file-transcribe.c
+ * This file contains the implementation for the headless file
+ * transcription mode
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <april_api.h>
+
+#include "file-transcribe.h"
+#include "history.h"
+#include "line-gen.h"
+#include "profanity-filter.h"
+#include "filter-lists.h"
+#include "render-config.h"
+#include "common.h"
+
+// How much audio is fed per call. Results can only be timed to this
+// granularity, so keep it small.
+#define FEED_CHUNK_MS 100
+
+// When running in parallel, long files are split into segments at silences
+// so that they can be spread over several workers. Segments are at least
+// SEGMENT_MIN_SECONDS long, and are cut without a silence if one cannot be
+// found within SEGMENT_MAX_SECONDS.
+#define SEGMENT_MIN_SECONDS 30
+#define SEGMENT_MAX_SECONDS 300
+
+struct audio_file {
+    FILE *f;
+    int sample_rate;
+    int channels;
+
+    // Bytes of sample data left, or 0 if unknown and reading until EOF
+    size_t remaining;
+    bool bounded;
+};
+
+struct input_file {
+    const char *path;
+    char *base;
+
+    // struct segment *, in order. Segments are read one at a time as workers
+    // need them, and are all freed once the outputs of the file are written.
+    GPtrArray *segments;
+    size_t segments_done;
+
+    // Samples read into segments so far
+    size_t num_samples;
+
+    // Set once the last segment has been read
+    bool fully_read;
+};
+
+// A finalized result, or a silence if tokens_count is 0. Positions are in
+// samples from the start of the file.
+struct transcribe_result {
+    size_t start;
+    size_t end;
+
+    size_t tokens_count;
+    struct history_token *tokens;
+};
+
+struct segment {
+    struct input_file *file;
+    size_t start;
+    size_t length;
+
+    // Freed as soon as the segment has been fed
+    short *samples;
+
+    // struct transcribe_result, only touched by the worker that took this
+    // segment until it is done
+    GArray *results;
+
+    // Whether the session was flushed at the end of this segment. It is not
+    // when the same worker goes on with the next segment of the file.
+    bool flushed;
+};
+
+struct batch {
+    AprilASRModel model;
+    int sample_rate;
+    const char *language;
+    bool split;
+
+    // Everything below is protected by lock. Inputs are read in order, one
+    // segment at a time, by whichever worker runs out of work, so at most a
+    // segment per worker is held in memory besides the look-ahead in carry.
+    GMutex lock;
+
+    struct input_file *inputs;
+    size_t num_inputs;
+    size_t next_input;
+
+    // The input that is being read, or NULL
+    struct input_file *reading;
+    struct audio_file audio;
+    short *scratch;
+
+    // Samples read past the end of the last segment, they start the next one
+    short *carry;
+    size_t carry_length;
+
+    size_t total_samples;
+    bool failed;
+};
+
+struct worker {
+    struct batch *batch;
+    AprilASRSession session;
+    GThread *thread;
+
+    struct segment *segment;
+
+    // Sample positions of the chunk that is currently being fed
+    size_t chunk_start;
+    size_t chunk_end;
+
+    // Where the result that is currently being recognized started, or
+    // SIZE_MAX if there is none
+    size_t result_start;
+};
+
+struct output_writer {
+    int sample_rate;
+    time_t start_time;
+    struct history_session history;
+
+    struct token_capitalizer tcap;
+    struct render_config config;
+    GString *text;
+
+    FILE *txt;
+    FILE *srt;
+    int srt_index;
+};
+
+
+static uint32_t read_le32(const unsigned char *b) {
+    return (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static uint16_t read_le16(const unsigned char *b) {
+    return (uint16_t)(b[0] | (b[1] << 8));
+}
+
+// Opens a WAV or raw PCM16 file and positions it at the first sample
+static bool open_audio_file(struct audio_file *af, const char *path, int model_sample_rate) {
+    af->f = fopen(path, "rb");
+    if(af->f == NULL) {
+        printf("fopen %s returned NULL\n", path);
+        return false;
+    }
+
+    af->sample_rate = model_sample_rate;
+    af->channels = 1;
+    af->remaining = 0;
+    af->bounded = false;
+
+    unsigned char header[12];
+    if((fread(header, 1, 12, af->f) != 12) || (memcmp(header, "RIFF", 4) != 0) || (memcmp(&header[8], "WAVE", 4) != 0)) {
+        // Not a WAV file, treat it as raw samples
+        rewind(af->f);
+        return true;
+    }
+
+    bool found_fmt = false;
+    int bits_per_sample = 0;
+    for(;;) {
+        unsigned char chunk[8];
+        if(fread(chunk, 1, 8, af->f) != 8) {
+            printf("%s: WAV file has no data chunk\n", path);
+            fclose(af->f);
+            return false;
+        }
+
+        uint32_t chunk_size = read_le32(&chunk[4]);
+
+        if(memcmp(chunk, "fmt ", 4) == 0) {
+            unsigned char fmt[16];
+            if((chunk_size < 16) || (fread(fmt, 1, 16, af->f) != 16)) {
+                printf("%s: WAV fmt chunk is truncated\n", path);
+                fclose(af->f);
+                return false;
+            }
+
+            uint16_t format = read_le16(&fmt[0]);
+            af->channels = read_le16(&fmt[2]);
+            af->sample_rate = (int)read_le32(&fmt[4]);
+            bits_per_sample = read_le16(&fmt[14]);
+
+            // 0xFFFE is WAVE_FORMAT_EXTENSIBLE, which we accept as long as
+            // the samples are 16-bit
+            if(((format != 1) && (format != 0xFFFE)) || (bits_per_sample != 16) || (af->channels < 1)) {
+                printf("%s: only 16-bit PCM WAV files are supported\n", path);
+                fclose(af->f);
+                return false;
+            }
+
+            found_fmt = true;
+            chunk_size -= 16;
+        } else if(memcmp(chunk, "data", 4) == 0) {
+            if(!found_fmt) {
+                printf("%s: WAV data chunk comes before fmt chunk\n", path);
+                fclose(af->f);
+                return false;
+            }
+
+            // Streamed WAV files may leave the size at 0 or 0xFFFFFFFF
+            af->bounded = (chunk_size != 0) && (chunk_size != 0xFFFFFFFF);
+            af->remaining = chunk_size;
+            break;
+        }
+
+        // Skip the rest of the chunk, chunks are padded to an even size
+        if(fseek(af->f, (long)chunk_size + (chunk_size & 1), SEEK_CUR) != 0) {
+            printf("%s: WAV file is truncated\n", path);
+            fclose(af->f);
+            return false;
+        }
+    }
+
+    if(af->sample_rate != model_sample_rate) {
+        printf("%s: sample rate is %d Hz but the model expects %d Hz, please resample it first\n",
+               path, af->sample_rate, model_sample_rate);
+        fclose(af->f);
+        return false;
+    }
+
+    return true;
+}
+
+// Reads up to max_samples mono samples, downmixing if needed
+static size_t read_audio_file(struct audio_file *af, short *out, short *scratch, size_t max_samples) {
+    size_t frame_bytes = sizeof(short) * af->channels;
+    size_t want = max_samples;
+    if(af->bounded && (want * frame_bytes > af->remaining)) want = af->remaining / frame_bytes;
+
+    short *dst = (af->channels == 1) ? out : scratch;
+    size_t frames = fread(dst, frame_bytes, want, af->f);
+    if(af->bounded) af->remaining -= frames * frame_bytes;
+
+    if(af->channels > 1) {
+        for(size_t i=0; i<frames; i++) {
+            int sum = 0;
+            for(int c=0; c<af->channels; c++) sum += scratch[i * af->channels + c];
+            out[i] = (short)(sum / af->channels);
+        }
+    }
+
+    return frames;
+}
+
+
+
+// Opens the next input for reading. Must be called with the batch lock held.
+static bool open_next_input(struct batch *batch) {
+    struct input_file *input = &batch->inputs[batch->next_input++];
+    if(!open_audio_file(&batch->audio, input->path, batch->sample_rate)) {
+        batch->failed = true;
+        return false;
+    }
+
+    size_t chunk_samples = (size_t)batch->sample_rate * FEED_CHUNK_MS / 1000;
+    batch->scratch = realloc(batch->scratch, chunk_samples * batch->audio.channels * sizeof(short));
+    batch->carry_length = 0;
+    batch->reading = input;
+
+    return true;
+}
+
+// Reads samples of the input that is being read until max_samples are in out
+// or the file ends, and returns how many there are
+static size_t fill_samples(struct batch *batch, short *out, size_t length, size_t max_samples) {
+    size_t chunk_samples = (size_t)batch->sample_rate * FEED_CHUNK_MS / 1000;
+
+    while(length < max_samples) {
+        size_t count = read_audio_file(&batch->audio, &out[length], batch->scratch, MIN(chunk_samples, max_samples - length));
+        if(count == 0) break;
+
+        length += count;
+    }
+
+    return length;
+}
+
+// Closes the input that is being read, once nothing is left of it
+static void finish_reading(struct batch *batch) {
+    batch->reading->fully_read = true;
+    batch->reading = NULL;
+
+    fclose(batch->audio.f);
+    batch->audio.f = NULL;
+}
+
+// Reads the next segment of the input that is being read, cut in the middle
+// of a silence where possible. Silence is detected with the same threshold the
+// live captions use to flush the session. Returns NULL if the file is empty.
+// Must be called with the batch lock held.
+static struct segment *read_segment(struct batch *batch) {
+    struct input_file *input = batch->reading;
+
+    // Without splitting, segments only bound how much is read at a time
+    size_t min_length = (size_t)SEGMENT_MIN_SECONDS * batch->sample_rate;
+    size_t max_length = (size_t)SEGMENT_MAX_SECONDS * batch->sample_rate;
+
+    short *samples = malloc(max_length * sizeof(short));
+    memcpy(samples, batch->carry, batch->carry_length * sizeof(short));
+
+    size_t length = fill_samples(batch, samples, batch->carry_length, max_length);
+    if(length == 0) {
+        free(samples);
+        finish_reading(batch);
+        return NULL;
+    }
+
+    size_t end = length;
+    if(batch->split && (length > min_length)) {
+        size_t quiet = 0;
+        for(size_t i = min_length; i < length; i++) {
+            short sample = samples[i];
+            quiet = ((sample > SILENCE_THRESHOLD) || (sample < -SILENCE_THRESHOLD)) ? 0 : (quiet + 1);
+
+            if(quiet >= SILENCE_FLUSH_SAMPLES) {
+                end = i - (SILENCE_FLUSH_SAMPLES / 2);
+                break;
+            }
+        }
+    }
+
+    // Whatever was read past the cut starts the next segment
+    batch->carry_length = length - end;
+    memcpy(batch->carry, &samples[end], batch->carry_length * sizeof(short));
+
+    struct segment *segment = calloc(1, sizeof(struct segment));
+    segment->file = input;
+    segment->start = input->num_samples;
+    segment->length = end;
+    segment->samples = realloc(samples, end * sizeof(short));
+    segment->results = g_array_new(FALSE, TRUE, sizeof(struct transcribe_result));
+
+    g_ptr_array_add(input->segments, segment);
+    input->num_samples += end;
+    batch->total_samples += end;
+
+    // Looks ahead a chunk, so that the last segment is known to be the last
+    // one when it is handed out
+    if(batch->carry_length == 0) {
+        size_t chunk_samples = (size_t)batch->sample_rate * FEED_CHUNK_MS / 1000;
+        batch->carry_length = fill_samples(batch, batch->carry, 0, chunk_samples);
+        if(batch->carry_length == 0) finish_reading(batch);
+    }
+
+    return segment;
+}
+
+static void add_result(struct worker *worker, size_t start, size_t count, const AprilToken *tokens) {
+    struct transcribe_result result = {
+        .start = start,
+        .end = worker->chunk_end,
+        .tokens_count = count,
+        .tokens = (count > 0) ? calloc(count, sizeof(struct history_token)) : NULL
+    };
+
+    for(size_t i=0; i<count; i++) {
+        history_token_set(&result.tokens[i], &tokens[i]);
+    }
+
+    g_array_append_val(worker->segment->results, result);
+}
+
+// Runs synchronously inside aas_feed_pcm16/aas_flush on the worker thread
+static void transcribe_result_handler(void *userdata, AprilResultType result, size_t count, const AprilToken *tokens) {
+    struct worker *worker = userdata;
+
+    switch(result) {
+        case APRIL_RESULT_RECOGNITION_PARTIAL:
+            if((count > 0) && (worker->result_start == SIZE_MAX))
+                worker->result_start = worker->chunk_start;
+            break;
+
+        case APRIL_RESULT_RECOGNITION_FINAL: {
+            size_t start = (worker->result_start == SIZE_MAX) ? worker->chunk_start : worker->result_start;
+            worker->result_start = SIZE_MAX;
+
+            if(count > 0) add_result(worker, start, count, tokens);
+            break;
+        }
+
+        case APRIL_RESULT_SILENCE:
+            add_result(worker, worker->chunk_end, 0, NULL);
+            break;
+
+        default:
+            break;
+    }
+}
+
+// Feeds the segment without flushing, results that are still being
+// recognized at its end go to whichever segment the session is fed next
+static void transcribe_segment(struct worker *worker, struct segment *segment, size_t chunk_samples) {
+    worker->segment = segment;
+    worker->chunk_end = segment->start;
+
+    size_t end = segment->start + segment->length;
+    while(worker->chunk_end < end) {
+        size_t count = MIN(chunk_samples, end - worker->chunk_end);
+
+        worker->chunk_start = worker->chunk_end;
+        worker->chunk_end += count;
+        aas_feed_pcm16(worker->session, &segment->samples[worker->chunk_start - segment->start], count);
+    }
+
+    free(segment->samples);
+    segment->samples = NULL;
+}
+
+static void flush_segment(struct worker *worker) {
+    worker->chunk_start = worker->chunk_end;
+    aas_flush(worker->session);
+
+    worker->segment->flushed = true;
+    worker->result_start = SIZE_MAX;
+}
+
+
+// Builds the display text of a finalized result, applying the same
+// capitalization and filtering as the captions
+static void build_result_text(struct output_writer *writer, const struct transcribe_result *result) {
+    bool use_lowercase = writer->config.use_lowercase;
+    FilterMode filter_mode = writer->config.filter_mode;
+
+    const struct history_token *tokens = result->tokens;
+    size_t count = result->tokens_count;
+
+    g_string_truncate(writer->text, 0);
+
+    for(size_t i=0; i<count;) {
+        size_t skipahead = 1;
+        const char *token = history_token_text(&tokens[i]);
+
+        if((filter_mode > FILTER_NONE) && (tokens[i].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT)) {
+            size_t skip = get_filter_skip_history(tokens, i, count, filter_mode);
+            if(skip > 0) {
+                skipahead = skip;
+                token = SWEAR_REPLACEMENT;
+            }
+        }
+
+        if((i == 0) && (*token == ' ')) token++;
+
+        bool should_be_capitalized = false;
+        if(use_lowercase) {
+            if((i + skipahead) < count)
+                should_be_capitalized = token_capitalizer_next(&writer->tcap, token, tokens[i].flags, history_token_text(&tokens[i+skipahead]), tokens[i+skipahead].flags);
+            else
+                should_be_capitalized = token_capitalizer_next(&writer->tcap, token, tokens[i].flags, NULL, 0);
+        }
+
+        if(use_lowercase) {
+            for(const char *p = token; *p; p = g_utf8_next_char(p)) {
+                gunichar c = g_utf8_get_char_validated(p, -1);
+                if((c == ((gunichar)-1)) || (c == ((gunichar)-2))) break;
+
+                c = g_unichar_tolower(c);
+                if(should_be_capitalized) {
+                    gunichar c1 = g_unichar_toupper(c);
+                    if(c != c1) {
+                        c = c1;
+                        should_be_capitalized = false;
+                    }
+                }
+
+                g_string_append_unichar(writer->text, c);
+            }
+        } else {
+            g_string_append(writer->text, token);
+        }
+
+        i += skipahead;
+    }
+
+    token_capitalizer_finish(&writer->tcap);
+}
+
+static void write_srt_time(FILE *f, size_t position, int sample_rate) {
+    size_t ms = (size_t)((uint64_t)position * 1000 / sample_rate);
+    fprintf(f, "%02zu:%02zu:%02zu,%03zu", ms / 3600000, (ms / 60000) % 60, (ms / 1000) % 60, ms % 1000);
+}
+
+// Moves the result into the history session, which takes over its tokens
+static void write_result(struct output_writer *writer, struct transcribe_result *result) {
+    struct history_session *session = &writer->history;
+
+    // Consecutive silences carry no information
+    if((result->tokens_count == 0) && ((session->entries_count == 0) || (session->entries[session->entries_count - 1].tokens_count == 0)))
+        return;
+
+    session->entries_count += 1;
+    session->entries = realloc(session->entries, session->entries_count * sizeof(struct history_entry));
+
+    struct history_entry *entry = &session->entries[session->entries_count - 1];
+    entry->timestamp = writer->start_time + (time_t)(result->start / writer->sample_rate);
+    entry->tokens_count = result->tokens_count;
+    entry->tokens = result->tokens;
+
+    if(entry->tokens_count == 0) return;
+
+    build_result_text(writer, result);
+    result->tokens = NULL;
+    if(writer->text->len == 0) return;
+
+    fprintf(writer->txt, "%s\n", writer->text->str);
+
+    writer->srt_index++;
+    fprintf(writer->srt, "%d\n", writer->srt_index);
+    write_srt_time(writer->srt, result->start, writer->sample_rate);
+    fprintf(writer->srt, " --> ");
+    write_srt_time(writer->srt, result->end, writer->sample_rate);
+    fprintf(writer->srt, "\n%s\n\n", writer->text->str);
+}
+
+// Writes the outputs of one input from its segments, in order
+static bool write_outputs(struct input_file *input, const char *language, int sample_rate) {
+    char *txt_path = g_strdup_printf("%s.txt", input->base);
+    char *srt_path = g_strdup_printf("%s.srt", input->base);
+    char *history_path = g_strdup_printf("%s.bin", input->base);
+
+    struct output_writer writer = { 0 };
+    writer.sample_rate = sample_rate;
+    writer.start_time = time(NULL);
+    writer.history.timestamp = writer.start_time;
+    writer.config = render_config_get();
+    writer.text = g_string_new(NULL);
+    token_capitalizer_init(&writer.tcap);
+    writer.tcap.is_english = (language[0] == 'e') && (language[1] == 'n');
+
+    bool ok = false;
+
+    writer.txt = fopen(txt_path, "w");
+    writer.srt = fopen(srt_path, "w");
+    if((writer.txt == NULL) || (writer.srt == NULL)) {
+        printf("Could not open %s or %s for writing\n", txt_path, srt_path);
+        goto cleanup;
+    }
+
+    for(guint i=0; i<input->segments->len; i++) {
+        struct segment *segment = g_ptr_array_index(input->segments, i);
+
+        GArray *results = segment->results;
+        for(guint j=0; j<results->len; j++)
+            write_result(&writer, &g_array_index(results, struct transcribe_result, j));
+
+        // Segments that were flushed are cut at silences
+        if(segment->flushed && ((i + 1) < input->segments->len)) {
+            struct transcribe_result silence = { .start = segment->start + segment->length };
+            write_result(&writer, &silence);
+        }
+    }
+
+    save_history_session(history_path, &writer.history);
+
+    printf("Wrote %s, %s and %s\n", history_path, txt_path, srt_path);
+    ok = true;
+
+cleanup:
+    if(writer.txt != NULL) fclose(writer.txt);
+    if(writer.srt != NULL) fclose(writer.srt);
+
+    for(size_t i=0; i<writer.history.entries_count; i++) free(writer.history.entries[i].tokens);
+    free(writer.history.entries);
+
+    g_string_free(writer.text, TRUE);
+    g_free(txt_path);
+    g_free(srt_path);
+    g_free(history_path);
+
+    return ok;
+}
+
+static void free_segment(gpointer data) {
+    struct segment *segment = data;
+
+    GArray *results = segment->results;
+    for(guint i=0; i<results->len; i++) free(g_array_index(results, struct transcribe_result, i).tokens);
+    g_array_free(results, TRUE);
+
+    free(segment->samples);
+    free(segment);
+}
+
+// Writes the outputs of an input whose segments are all done, and frees them
+static void finish_input(struct batch *batch, struct input_file *input) {
+    bool ok = write_outputs(input, batch->language, batch->sample_rate);
+
+    g_ptr_array_set_size(input->segments, 0);
+
+    if(!ok) {
+        g_mutex_lock(&batch->lock);
+        batch->failed = true;
+        g_mutex_unlock(&batch->lock);
+    }
+}
+
+// Reads the next segment to work on, or returns NULL once every input has
+// been read
+static struct segment *take_segment(struct batch *batch) {
+    g_mutex_lock(&batch->lock);
+
+    struct segment *segment = NULL;
+    while(segment == NULL) {
+        if(batch->reading == NULL) {
+            if(batch->next_input >= batch->num_inputs) break;
+            if(!open_next_input(batch)) continue;
+        }
+
+        struct input_file *input = batch->reading;
+        segment = read_segment(batch);
+
+        // Empty files have nothing to wait for, their outputs are written
+        // right away
+        if((segment == NULL) && (input->segments->len == 0)) {
+            g_mutex_unlock(&batch->lock);
+            finish_input(batch, input);
+            g_mutex_lock(&batch->lock);
+        }
+    }
+
+    g_mutex_unlock(&batch->lock);
+    return segment;
+}
+
+// Marks the segment as done. Whoever finishes the last segment of an input
+// writes its outputs.
+static void finish_segment(struct batch *batch, struct segment *segment) {
+    struct input_file *input = segment->file;
+
+    g_mutex_lock(&batch->lock);
+    input->segments_done++;
+    bool complete = input->fully_read && (input->segments_done == input->segments->len);
+    g_mutex_unlock(&batch->lock);
+
+    if(complete) finish_input(batch, input);
+}
+
+static void *run_transcribe_worker(void *userdata) {
+    struct worker *worker = userdata;
+    struct batch *batch = worker->batch;
+
+    size_t chunk_samples = (size_t)batch->sample_rate * FEED_CHUNK_MS / 1000;
+    struct segment *previous = NULL;
+
+    worker->result_start = SIZE_MAX;
+
+    for(;;) {
+        struct segment *segment = take_segment(batch);
+
+        if(previous != NULL) {
+            // A segment that carries on where the previous one ended is fed
+            // into the same session, so nothing is cut short at the boundary
+            bool continues = (segment != NULL) && (segment->file == previous->file)
+                && (segment->start == (previous->start + previous->length));
+
+            if(!continues) flush_segment(worker);
+            finish_segment(batch, previous);
+        }
+
+        if(segment == NULL) break;
+
+        transcribe_segment(worker, segment, chunk_samples);
+        previous = segment;
+    }
+
+    return NULL;
+}
+
+static char *get_output_base(const char *input_path, const char *output_base) {
+    if(output_base != NULL) return g_strdup(output_base);
+
+    char *base = g_strdup(input_path);
+    char *dot = strrchr(base, '.');
+    char *slash = strrchr(base, '/');
+    if((dot != NULL) && ((slash == NULL) || (dot > slash))) *dot = '\0';
+
+    return base;
+}
+
+int transcribe_files(const char *model_path, const char * const *paths, size_t num_paths, const char *output_base, int num_jobs) {
+    if((output_base != NULL) && (num_paths > 1)) {
+        printf("--output can only be used with a single input file\n");
+        return 1;
+    }
+
+    if(num_jobs <= 0) num_jobs = (int)g_get_num_processors();
+
+    render_config_init();
+    filter_lists_load();
+
+    struct batch batch = { 0 };
+    batch.model = aam_create_model(model_path);
+    if(batch.model == NULL) {
+        printf("Loading model %s failed!\n", model_path);
+        return 1;
+    }
+
+    batch.sample_rate = (int)aam_get_sample_rate(batch.model);
+    batch.language = aam_get_language(batch.model);
+
+    // With a single worker there is nothing to gain from splitting
+    batch.split = num_jobs > 1;
+
+    g_mutex_init(&batch.lock);
+    batch.carry = malloc((size_t)SEGMENT_MAX_SECONDS * batch.sample_rate * sizeof(short));
+
+    // Every segment but the last of a file is at least SEGMENT_MIN_SECONDS
+    // long, which bounds how many workers could ever be busy
+    size_t max_segments = 0;
+    size_t min_length = (size_t)SEGMENT_MIN_SECONDS * batch.sample_rate;
+
+    batch.inputs = calloc(num_paths, sizeof(struct input_file));
+    batch.num_inputs = num_paths;
+    for(size_t i=0; i<num_paths; i++) {
+        batch.inputs[i].path = paths[i];
+        batch.inputs[i].base = get_output_base(paths[i], output_base);
+        batch.inputs[i].segments = g_ptr_array_new_with_free_func(free_segment);
+
+        struct stat st;
+        size_t file_samples = (stat(paths[i], &st) == 0) ? ((size_t)st.st_size / sizeof(short)) : 0;
+        max_segments += batch.split ? (file_samples / min_length + 1) : 1;
+    }
+
+    size_t num_workers = MIN((size_t)num_jobs, max_segments);
+    struct worker *workers = calloc(MAX(num_workers, 1), sizeof(struct worker));
+
+    gint64 start_us = g_get_monotonic_time();
+
+    AprilConfig config = {
+        .handler = transcribe_result_handler,
+        .flags = APRIL_CONFIG_FLAG_ZERO_BIT
+    };
+
+    size_t num_started = 0;
+    for(size_t i=0; i<num_workers; i++) {
+        workers[i].batch = &batch;
+
+        config.userdata = &workers[i];
+        workers[i].session = aas_create_session(batch.model, config);
+        if(workers[i].session == NULL) {
+            printf("Creating session %zu failed!\n", i);
+            break;
+        }
+
+        workers[i].thread = g_thread_new("lcap-transcribe", run_transcribe_worker, &workers[i]);
+        num_started++;
+    }
+
+    int ret = 0;
+    if((num_started == 0) && (num_paths > 0)) {
+        ret = 1;
+    }
+
+    for(size_t i=0; i<num_started; i++) {
+        g_thread_join(workers[i].thread);
+        aas_free(workers[i].session);
+    }
+
+    gint64 elapsed_us = g_get_monotonic_time() - start_us;
+
+    if(batch.failed) ret = 1;
+
+    if(num_started > 0) {
+        double audio_seconds = (double)batch.total_samples / batch.sample_rate;
+        double wall_seconds = (double)elapsed_us / 1000000.0;
+        printf("Transcribed %.1f s of audio from %zu files in %.1f s with %zu workers (realtime factor %.3f, %.1fx faster than realtime)\n",
+               audio_seconds, num_paths, wall_seconds, num_started,
+               (audio_seconds > 0.0) ? (wall_seconds / audio_seconds) : 0.0,
+               (wall_seconds > 0.0) ? (audio_seconds / wall_seconds) : 0.0);
+    }
+
+    for(size_t i=0; i<num_paths; i++) {
+        g_ptr_array_free(batch.inputs[i].segments, TRUE);
+        g_free(batch.inputs[i].base);
+    }
+    free(batch.inputs);
+    free(workers);
+
+    free(batch.carry);
+    free(batch.scratch);
+    g_mutex_clear(&batch.lock);
+
+    aam_free(batch.model);
+
+    return ret;
+}
@@ -0,0 +1,44 @@
+/* file-transcribe.h
+ * This file contains the declaration for the headless file transcription
+ * mode, which runs recorded audio through a synchronous session as fast as
+ * the CPU allows instead of captioning live audio
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Transcribes each of the given files with the model at model_path.
+//
+// Files may be WAV (16-bit PCM, any channel count, must match the model
+// sample rate) or headerless little-endian mono PCM16 at the model sample
+// rate. For every input, <base>.bin (history format), <base>.txt and
+// <base>.srt are written, where <base> is output_base if given or the input
+// path without its extension otherwise. output_base may only be given for a
+// single input.
+//
+// The files are spread over num_jobs workers, each with its own session on
+// the shared model. If num_jobs is 0 or less, one worker per core is used.
+// Long files are split at silences so that they can be worked on in
+// parallel too, the results are put back together in order. Inputs are read
+// a segment at a time as workers need them, and the outputs of a file are
+// written as soon as its last segment is done.
+//
+// Returns 0 if every file was transcribed, 1 otherwise.
+int transcribe_files(const char *model_path, const char * const *paths, size_t num_paths, const char *output_base, int num_jobs);
@@ -0,0 +1,204 @@
+/* filter-lists.c
+ * This file contains the implementation for user filter lists
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "filter-lists.h"
+#include "profanity-filter.h"
+
+#define FILTER_LISTS_DIR "live-captions-filters"
+
+// Editors save in several steps, changes are only picked up once they
+// stop for this long
+#define FILTER_LISTS_RELOAD_DELAY_MS 500
+
+static char *lists_dir = NULL;
+static GFileMonitor *monitor = NULL;
+static guint reload_source = 0;
+
+// Only one compile runs at a time, a change during it starts another
+static bool compiling = false;
+static bool reload_pending = false;
+
+
+static char *get_lists_dir(void) {
+    return g_build_filename(g_get_user_data_dir(), FILTER_LISTS_DIR, NULL);
+}
+
+static gint compare_names(gconstpointer a, gconstpointer b) {
+    return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+// Adds every rule of a list, returning the number of lines that could not
+// be added
+static size_t add_list(profanity_filter filter, const char *path, char *contents) {
+    size_t skipped = 0;
+    size_t line_number = 0;
+
+    char *next = contents;
+    while(next != NULL) {
+        char *line = next;
+        line_number++;
+
+        next = strchr(line, '\n');
+        if(next != NULL) *(next++) = '\0';
+
+        g_strstrip(line);
+        if((*line == '\0') || (*line == '#')) continue;
+
+        if(!profanity_filter_add(filter, line, FILTER_SLURS)) {
+            printf("%s:%zu: cannot filter \"%s\", rules may only contain letters, digits, marks and apostrophes in UTF-8\n", path, line_number, line);
+            skipped++;
+        }
+    }
+
+    return skipped;
+}
+
+static profanity_filter compile_lists(const char *dir) {
+    profanity_filter filter = profanity_filter_new();
+    profanity_filter_add_builtin(filter);
+
+    size_t num_builtin = profanity_filter_num_rules(filter);
+
+    GPtrArray *names = g_ptr_array_new_with_free_func(g_free);
+
+    GDir *d = g_dir_open(dir, 0, NULL);
+    if(d != NULL) {
+        const char *name;
+        while((name = g_dir_read_name(d)) != NULL) {
+            if(g_str_has_suffix(name, ".txt")) g_ptr_array_add(names, g_strdup(name));
+        }
+
+        g_dir_close(d);
+    }
+
+    g_ptr_array_sort(names, compare_names);
+
+    size_t skipped = 0;
+    for(guint i=0; i<names->len; i++){
+        char *path = g_build_filename(dir, g_ptr_array_index(names, i), NULL);
+
+        char *contents = NULL;
+        GError *error = NULL;
+        if(g_file_get_contents(path, &contents, NULL, &error)) {
+            skipped += add_list(filter, path, contents);
+            g_free(contents);
+        } else {
+            printf("Could not read filter list %s: %s\n", path, error->message);
+            g_error_free(error);
+        }
+
+        g_free(path);
+    }
+
+    if(names->len > 0) {
+        printf("Loaded %zu filter rules from %u lists in %s, %zu lines skipped\n",
+               profanity_filter_num_rules(filter) - num_builtin, names->len, dir, skipped);
+    }
+
+    g_ptr_array_free(names, TRUE);
+
+    // Packing is the slow part for long lists, keep it off the main thread
+    profanity_filter_finish(filter);
+
+    return filter;
+}
+
+
+static void start_compile(void);
+
+static void run_compile(GTask *task, gpointer source_object, gpointer task_data, GCancellable *cancellable) {
+    g_task_return_pointer(task, compile_lists(task_data), (GDestroyNotify)profanity_filter_unref);
+}
+
+static void compile_done(GObject *source_object, GAsyncResult *result, gpointer userdata) {
+    profanity_filter filter = g_task_propagate_pointer(G_TASK(result), NULL);
+    if(filter != NULL) profanity_filter_publish(filter);
+
+    compiling = false;
+    if(reload_pending) {
+        reload_pending = false;
+        start_compile();
+    }
+}
+
+static void start_compile(void) {
+    if(compiling) {
+        reload_pending = true;
+        return;
+    }
+
+    compiling = true;
+
+    GTask *task = g_task_new(NULL, NULL, compile_done, NULL);
+    g_task_set_task_data(task, g_strdup(lists_dir), g_free);
+    g_task_run_in_thread(task, run_compile);
+    g_object_unref(task);
+}
+
+static gboolean reload_lists(gpointer userdata) {
+    reload_source = 0;
+    start_compile();
+
+    return G_SOURCE_REMOVE;
+}
+
+static void on_lists_changed(GFileMonitor *self, GFile *file, GFile *other_file, GFileMonitorEvent event, gpointer userdata) {
+    if(reload_source != 0) g_source_remove(reload_source);
+    reload_source = g_timeout_add(FILTER_LISTS_RELOAD_DELAY_MS, reload_lists, NULL);
+}
+
+void filter_lists_init(void) {
+    if(lists_dir != NULL) return;
+
+    lists_dir = get_lists_dir();
+
+    // So that there is somewhere obvious to put lists
+    if(g_mkdir_with_parents(lists_dir, 0755) != 0)
+        printf("Could not create %s\n", lists_dir);
+
+    GFile *dir = g_file_new_for_path(lists_dir);
+
+    GError *error = NULL;
+    monitor = g_file_monitor_directory(dir, G_FILE_MONITOR_NONE, NULL, &error);
+    if(monitor != NULL) {
+        g_signal_connect(monitor, "changed", G_CALLBACK(on_lists_changed), NULL);
+    } else {
+        printf("Not watching %s for changes: %s\n", lists_dir, error->message);
+        g_error_free(error);
+    }
+
+    g_object_unref(dir);
+
+    start_compile();
+}
+
+void filter_lists_load(void) {
+    char *dir = get_lists_dir();
+
+    profanity_filter_publish(compile_lists(dir));
+
+    g_free(dir);
+}
@@ -0,0 +1,33 @@
+/* filter-lists.h
+ * This file contains the declaration for user filter lists. Every .txt file
+ * in <user data dir>/live-captions-filters holds extra words to filter, one
+ * rule per line in the same form as the built-in ones. Lines starting with #
+ * are ignored. The words are filtered whenever a filter is enabled.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// Compiles the built-in rules together with the lists in a worker thread
+// and publishes the result, then does so again whenever something in the
+// directory changes. Must be called from the main thread. Calling it again
+// does nothing.
+void filter_lists_init(void);
+
+// Compiles and publishes the lists right away, for when there is no main
+// loop to watch for changes
+void filter_lists_load(void);
@@ -0,0 +1,505 @@
+/* history-export.c
+ * This file contains the implementation for exporting history
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <april_api.h>
+#include <glib/gstdio.h>
+
+#include "history-export.h"
+#include "history.h"
+#include "line-gen.h"
+#include "render-config.h"
+#include "common.h"
+
+#define EXPORT_BUFFER_SIZE (64 * 1024)
+
+// Entries only have the time they were committed at, which is the end of
+// the speech. A cue starts where the previous entry ended, but no earlier
+// than this.
+#define EXPORT_MAX_CUE_SECONDS 10
+
+// Progress is only reported once it has moved by this much
+#define EXPORT_PROGRESS_STEP 0.01
+
+// localtime is only called once per minute of history, the seconds are
+// added on
+struct time_cache {
+    time_t minute;
+    struct tm tm;
+
+    char date[16]; // %F
+    char zone[16]; // +hh:mm, as RFC 3339 wants it
+};
+
+struct export_job {
+    char *path;
+    char *tmp_path;
+    HistoryExportFormat format;
+
+    // Copied, the snapshot is not kept valid for as long as an export takes
+    struct render_config config;
+
+    history_export_progress_cb progress_cb;
+    gpointer user_data;
+    GMainContext *context;
+    double reported;
+
+    GCancellable *cancellable;
+    bool cancelled;
+
+    // Output, flushed to fd whenever the buffer fills up. The first error
+    // is kept and everything after it is dropped.
+    int fd;
+    char *buffer;
+    size_t used;
+    int error;
+
+    GString *text;
+    struct token_capitalizer tcap;
+    struct time_cache times;
+
+    // The session being written, SIZE_MAX before the first one
+    size_t session_num;
+
+    // Subtitle timing, in seconds since the start of the first session
+    bool have_base;
+    time_t base;
+    time_t previous_time;
+    int64_t last_cue_end;
+    size_t cues;
+};
+
+struct progress_update {
+    GTask *task;
+    double fraction;
+};
+
+
+HistoryExportFormat history_export_format_for_path(const char *path) {
+    const char *extension = strrchr(path, '.');
+    if(extension == NULL) return HISTORY_EXPORT_TEXT;
+
+    if(g_ascii_strcasecmp(extension, ".srt") == 0) return HISTORY_EXPORT_SRT;
+    if(g_ascii_strcasecmp(extension, ".vtt") == 0) return HISTORY_EXPORT_WEBVTT;
+    if((g_ascii_strcasecmp(extension, ".jsonl") == 0) || (g_ascii_strcasecmp(extension, ".json") == 0)) return HISTORY_EXPORT_JSONL;
+
+    return HISTORY_EXPORT_TEXT;
+}
+
+
+static void flush_output(struct export_job *job) {
+    size_t written = 0;
+    while((job->error == 0) && (written < job->used)) {
+        ssize_t r = write(job->fd, job->buffer + written, job->used - written);
+        if(r < 0) {
+            if(errno != EINTR) job->error = errno;
+            continue;
+        }
+
+        written += (size_t)r;
+    }
+
+    job->used = 0;
+}
+
+static void output_append_len(struct export_job *job, const char *data, size_t length) {
+    while(length > 0) {
+        if(job->used == EXPORT_BUFFER_SIZE) flush_output(job);
+
+        size_t n = EXPORT_BUFFER_SIZE - job->used;
+        if(n > length) n = length;
+
+        memcpy(job->buffer + job->used, data, n);
+        job->used += n;
+        data += n;
+        length -= n;
+    }
+}
+
+static void output_append(struct export_job *job, const char *data) {
+    output_append_len(job, data, strlen(data));
+}
+
+static void output_printf(struct export_job *job, const char *format, ...) G_GNUC_PRINTF(2, 3);
+static void output_printf(struct export_job *job, const char *format, ...) {
+    char line[256];
+
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    if(length < 0) return;
+    output_append_len(job, line, ((size_t)length < sizeof(line)) ? (size_t)length : (sizeof(line) - 1));
+}
+
+// Escapes the characters WebVTT cue text gives a meaning to
+static void output_append_vtt(struct export_job *job, const char *text) {
+    for(const char *p = text; *p; p++) {
+        switch(*p) {
+        case '&': output_append_len(job, "&amp;", 5); break;
+        case '<': output_append_len(job, "&lt;", 4); break;
+        case '>': output_append_len(job, "&gt;", 4); break;
+        default: output_append_len(job, p, 1); break;
+        }
+    }
+}
+
+static void output_append_json(struct export_job *job, const char *text) {
+    output_append_len(job, "\"", 1);
+
+    for(const char *p = text; *p; p++) {
+        unsigned char c = (unsigned char)*p;
+        if(c == '"') output_append_len(job, "\\\"", 2);
+        else if(c == '\\') output_append_len(job, "\\\\", 2);
+        else if(c == '\n') output_append_len(job, "\\n", 2);
+        else if(c < 0x20) output_printf(job, "\\u%04x", c);
+        else output_append_len(job, p, 1);
+    }
+
+    output_append_len(job, "\"", 1);
+}
+
+
+static const struct tm *local_time(struct time_cache *cache, time_t t) {
+    time_t minute = t - (((t % 60) + 60) % 60);
+
+    if(minute != cache->minute) {
+        cache->minute = minute;
+        localtime_r(&minute, &cache->tm);
+
+        strftime(cache->date, sizeof(cache->date), "%F", &cache->tm);
+
+        // %z leaves out the colon
+        long offset = cache->tm.tm_gmtoff / 60;
+        long abs_offset = (offset < 0) ? -offset : offset;
+        snprintf(cache->zone, sizeof(cache->zone), "%c%02ld:%02ld", (offset < 0) ? '-' : '+', abs_offset / 60, abs_offset % 60);
+    }
+
+    cache->tm.tm_sec = (int)(t - minute);
+    return &cache->tm;
+}
+
+// Writes hh:mm:ss followed by the separator and milliseconds, which are
+// always 0 as history only has whole seconds
+static void output_cue_time(struct export_job *job, int64_t seconds, char separator) {
+    if(seconds < 0) seconds = 0;
+
+    output_printf(job, "%02lld:%02d:%02d%c000", (long long)(seconds / 3600), (int)((seconds / 60) % 60), (int)(seconds % 60), separator);
+}
+
+
+// Builds the text of an entry into job->text, with the same capitalization
+// and filtering as the captions
+static void build_entry_text(struct export_job *job, const struct history_entry *entry) {
+    bool use_lowercase = job->config.use_lowercase;
+    FilterMode filter_mode = job->config.filter_mode;
+
+    const struct history_token *tokens = entry->tokens;
+    size_t count = entry->tokens_count;
+
+    g_string_truncate(job->text, 0);
+
+    for(size_t i=0; i<count;) {
+        size_t skipahead = 1;
+        const char *token = history_token_text(&tokens[i]);
+
+        if((filter_mode > FILTER_NONE) && (tokens[i].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT)) {
+            size_t skip = get_filter_skip_history(tokens, i, count, filter_mode);
+            if(skip > 0) {
+                skipahead = skip;
+                token = SWEAR_REPLACEMENT;
+            }
+        }
+
+        if((i == 0) && (*token == ' ')) token++;
+
+        bool should_be_capitalized = false;
+        if(use_lowercase) {
+            if((i + skipahead) < count)
+                should_be_capitalized = token_capitalizer_next(&job->tcap, token, tokens[i].flags, history_token_text(&tokens[i+skipahead]), tokens[i+skipahead].flags);
+            else
+                should_be_capitalized = token_capitalizer_next(&job->tcap, token, tokens[i].flags, NULL, 0);
+        }
+
+        if(use_lowercase) {
+            for(const char *p = token; *p; p = g_utf8_next_char(p)) {
+                gunichar c = g_utf8_get_char_validated(p, -1);
+                if((c == ((gunichar)-1)) || (c == ((gunichar)-2))) break;
+
+                c = g_unichar_tolower(c);
+                if(should_be_capitalized) {
+                    gunichar c1 = g_unichar_toupper(c);
+                    if(c != c1) {
+                        c = c1;
+                        should_be_capitalized = false;
+                    }
+                }
+
+                g_string_append_unichar(job->text, c);
+            }
+        } else {
+            g_string_append(job->text, token);
+        }
+
+        i += skipahead;
+    }
+
+    token_capitalizer_finish(&job->tcap);
+}
+
+
+static void end_session(struct export_job *job) {
+    if(job->session_num == SIZE_MAX) return;
+
+    if(job->format == HISTORY_EXPORT_TEXT) output_append(job, "\n\n");
+}
+
+static void begin_session(struct export_job *job, const struct history_session *session, size_t session_num) {
+    end_session(job);
+
+    job->session_num = session_num;
+    job->previous_time = session->timestamp;
+    token_capitalizer_init(&job->tcap);
+
+    if(!job->have_base) {
+        job->have_base = true;
+        job->base = session->timestamp;
+    }
+
+    char time_buff[64];
+    strftime(time_buff, sizeof(time_buff), "%F | %H:%M", local_time(&job->times, session->timestamp));
+
+    switch(job->format) {
+    case HISTORY_EXPORT_TEXT:
+        output_printf(job, "    -[ %s ]-    ", time_buff);
+        break;
+    case HISTORY_EXPORT_WEBVTT:
+        output_printf(job, "NOTE Session of %s\n\n", time_buff);
+        break;
+    default:
+        break;
+    }
+}
+
+static void write_cue(struct export_job *job, const struct history_entry *entry) {
+    int64_t end = (int64_t)(entry->timestamp - job->base);
+    int64_t start = (int64_t)(job->previous_time - job->base);
+
+    if(start < (end - EXPORT_MAX_CUE_SECONDS)) start = end - EXPORT_MAX_CUE_SECONDS;
+    if(start < job->last_cue_end) start = job->last_cue_end;
+    if(end <= start) end = start + 1;
+
+    job->last_cue_end = end;
+    job->cues++;
+
+    bool vtt = (job->format == HISTORY_EXPORT_WEBVTT);
+    if(!vtt) output_printf(job, "%zu\n", job->cues);
+
+    output_cue_time(job, start, vtt ? '.' : ',');
+    output_append(job, " --> ");
+    output_cue_time(job, end, vtt ? '.' : ',');
+    output_append(job, "\n");
+
+    if(vtt) output_append_vtt(job, job->text->str);
+    else output_append(job, job->text->str);
+
+    output_append(job, "\n\n");
+}
+
+static void write_entry(struct export_job *job, const struct history_entry *entry) {
+    if(entry->tokens_count > 0) build_entry_text(job, entry);
+    else g_string_truncate(job->text, 0);
+
+    const struct tm *tm = local_time(&job->times, entry->timestamp);
+
+    switch(job->format) {
+    case HISTORY_EXPORT_TEXT:
+        // Silences are kept, the time shows where speech resumed
+        output_printf(job, "\n(%02d:%02d:%02d) - ", tm->tm_hour, tm->tm_min, tm->tm_sec);
+        output_append_len(job, job->text->str, job->text->len);
+        break;
+    case HISTORY_EXPORT_SRT:
+    case HISTORY_EXPORT_WEBVTT:
+        if(job->text->len > 0) write_cue(job, entry);
+        break;
+    case HISTORY_EXPORT_JSONL:
+        if(job->text->len == 0) break;
+
+        output_printf(job, "{\"session\":%zu,\"timestamp\":%lld,\"time\":\"%sT%02d:%02d:%02d%s\",\"text\":",
+                      job->session_num, (long long)entry->timestamp,
+                      job->times.date, tm->tm_hour, tm->tm_min, tm->tm_sec, job->times.zone);
+        output_append_json(job, job->text->str);
+        output_append(job, "}\n");
+        break;
+    }
+
+    job->previous_time = entry->timestamp;
+}
+
+
+static gboolean report_progress(gpointer userdata) {
+    struct progress_update *update = userdata;
+    struct export_job *job = g_task_get_task_data(update->task);
+
+    if(!g_task_had_error(update->task) && !g_cancellable_is_cancelled(job->cancellable))
+        job->progress_cb(update->fraction, job->user_data);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void free_progress_update(gpointer userdata) {
+    struct progress_update *update = userdata;
+
+    g_object_unref(update->task);
+    g_free(update);
+}
+
+static void maybe_report_progress(GTask *task, struct export_job *job, double fraction) {
+    if((job->progress_cb == NULL) || ((fraction - job->reported) < EXPORT_PROGRESS_STEP)) return;
+    job->reported = fraction;
+
+    struct progress_update *update = g_new(struct progress_update, 1);
+    update->task = g_object_ref(task);
+    update->fraction = fraction;
+
+    g_main_context_invoke_full(job->context, G_PRIORITY_DEFAULT, report_progress, update, free_progress_update);
+}
+
+struct walk_context {
+    GTask *task;
+    struct export_job *job;
+};
+
+static bool export_entries(const struct history_session *session, size_t session_num, size_t num_sessions, size_t first_entry, size_t count, void *userdata) {
+    struct walk_context *ctx = userdata;
+    struct export_job *job = ctx->job;
+
+    if(g_cancellable_is_cancelled(job->cancellable)) {
+        job->cancelled = true;
+        return false;
+    }
+
+    if(session_num != job->session_num) begin_session(job, session, session_num);
+
+    for(size_t i=0; i<count; i++)
+        write_entry(job, &session->entries[first_entry + i]);
+
+    // Sessions count the same whatever their length
+    double fraction = ((double)session_num + (double)(first_entry + count) / (double)session->entries_count) / (double)num_sessions;
+    maybe_report_progress(ctx->task, job, fraction);
+
+    return job->error == 0;
+}
+
+static void run_export(GTask *task, gpointer source_object, gpointer task_data, GCancellable *cancellable) {
+    struct export_job *job = task_data;
+
+    job->fd = g_open(job->tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(job->fd < 0) {
+        int err = errno;
+        g_task_return_new_error(task, G_IO_ERROR, g_io_error_from_errno(err), "Could not open %s: %s", job->tmp_path, g_strerror(err));
+        return;
+    }
+
+    if(job->format == HISTORY_EXPORT_WEBVTT) output_append(job, "WEBVTT\n\n");
+
+    struct walk_context ctx = { .task = task, .job = job };
+    history_foreach_entries(export_entries, &ctx);
+
+    end_session(job);
+    flush_output(job);
+
+    if((job->error == 0) && (fsync(job->fd) != 0)) job->error = errno;
+    if((close(job->fd) != 0) && (job->error == 0)) job->error = errno;
+    job->fd = -1;
+
+    if((job->error == 0) && !job->cancelled && (g_rename(job->tmp_path, job->path) != 0)) job->error = errno;
+
+    if(job->cancelled || (job->error != 0)) {
+        g_unlink(job->tmp_path);
+
+        if(job->cancelled)
+            g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_CANCELLED, "Export was cancelled");
+        else
+            g_task_return_new_error(task, G_IO_ERROR, g_io_error_from_errno(job->error), "Could not write %s: %s", job->path, g_strerror(job->error));
+        return;
+    }
+
+    maybe_report_progress(task, job, 1.0);
+    g_task_return_boolean(task, TRUE);
+}
+
+static void free_export_job(gpointer data) {
+    struct export_job *job = data;
+
+    if(job->fd >= 0) close(job->fd);
+
+    g_free(job->path);
+    g_free(job->tmp_path);
+    g_free(job->buffer);
+    g_string_free(job->text, TRUE);
+    g_main_context_unref(job->context);
+    g_free(job);
+}
+
+void history_export_async(const char *path,
+                          HistoryExportFormat format,
+                          GObject *source_object,
+                          GCancellable *cancellable,
+                          history_export_progress_cb progress_cb,
+                          GAsyncReadyCallback callback,
+                          gpointer user_data)
+{
+    struct export_job *job = g_new0(struct export_job, 1);
+
+    job->path = g_strdup(path);
+    job->tmp_path = g_strdup_printf("%s.tmp", path);
+    job->format = format;
+    job->config = render_config_get();
+
+    job->progress_cb = progress_cb;
+    job->user_data = user_data;
+    job->context = g_main_context_ref_thread_default();
+    job->cancellable = cancellable;
+
+    job->fd = -1;
+    job->buffer = g_malloc(EXPORT_BUFFER_SIZE);
+    job->text = g_string_new(NULL);
+    job->times.minute = -1;
+    job->session_num = SIZE_MAX;
+
+    GTask *task = g_task_new(source_object, cancellable, callback, user_data);
+    g_task_set_source_tag(task, history_export_async);
+    g_task_set_task_data(task, job, free_export_job);
+
+    g_task_run_in_thread(task, run_export);
+    g_object_unref(task);
+}
+
+bool history_export_finish(GAsyncResult *result, GError **error) {
+    return g_task_propagate_boolean(G_TASK(result), error);
+}
@@ -0,0 +1,62 @@
+/* history-export.h
+ * This file contains the declaration for exporting history to a file. The
+ * export runs in a worker thread and streams history out a few hundred
+ * entries at a time, applying the current capitalization and filter
+ * settings like the captions do.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <gio/gio.h>
+
+typedef enum HistoryExportFormat {
+    // Every session under a heading, every entry after its time
+    HISTORY_EXPORT_TEXT = 0,
+
+    // Subtitles, timed from the start of the first session
+    HISTORY_EXPORT_SRT = 1,
+    HISTORY_EXPORT_WEBVTT = 2,
+
+    // One JSON object per entry
+    HISTORY_EXPORT_JSONL = 3
+} HistoryExportFormat;
+
+// Picks the format from the extension of path, plain text if unknown
+HistoryExportFormat history_export_format_for_path(const char *path);
+
+// Called on the main context of the caller of history_export_async with the
+// fraction of history written so far
+typedef void (*history_export_progress_cb)(double fraction, gpointer user_data);
+
+// Writes all of history to path in the given format. The file is written
+// next to path first and only replaces it once complete, so a cancelled or
+// failed export leaves nothing behind.
+//
+// The filter and capitalization settings are the ones current at the time
+// of the call. callback is called once done, on the main context of the
+// caller, and should call history_export_finish.
+void history_export_async(const char *path,
+                          HistoryExportFormat format,
+                          GObject *source_object,
+                          GCancellable *cancellable,
+                          history_export_progress_cb progress_cb,
+                          GAsyncReadyCallback callback,
+                          gpointer user_data);
+
+bool history_export_finish(GAsyncResult *result, GError **error);
@@ -0,0 +1,645 @@
+/* history-index.c
+ * This file contains the implementation for the history search index
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <glib.h>
+#include <april_api.h>
+
+#include "history-index.h"
+#include "history.h"
+
+/*
+ * Index file layout:
+ *   struct index_file_header
+ *   for each word, its postings as struct history_index_posting
+ *   the bytes of every word, one after another
+ *   num_words struct index_file_word at directory_offset, sorted by word
+ *
+ * The file is mapped and searched in place. Loading it only checks the
+ * directory, the postings are not read until a word is searched for.
+ * Entries added after it was saved are kept in memory until the next save.
+ */
+
+#define INDEX_FILE_MAGIC "LCINDEX1"
+#define INDEX_FILE_VERSION 2
+
+// Longer words are cut off, nobody searches for them
+#define INDEX_MAX_WORD_BYTES 64
+
+// Lowercasing the last character can make a word a few bytes longer
+#define INDEX_MAX_STORED_WORD_BYTES (INDEX_MAX_WORD_BYTES * 2)
+
+struct index_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t generation;
+    uint64_t num_sessions;
+    uint64_t num_words;
+    uint64_t directory_offset;
+};
+
+struct index_file_word {
+    uint64_t postings_offset;
+    uint64_t word_offset;
+    uint32_t word_length;
+    uint32_t count;
+};
+
+// Postings are kept sorted by session and entry, which is the order entries
+// are added in
+struct posting_list {
+    struct history_index_posting *postings;
+    size_t count;
+    size_t capacity;
+};
+
+// An entry added while the index is frozen
+struct queued_entry {
+    struct history_index_posting posting;
+    const struct history_token *tokens;
+    size_t tokens_count;
+};
+
+struct history_index_i {
+    // Normalized word -> struct posting_list, for entries added since the
+    // file was saved
+    GHashTable *words;
+
+    GString *word;
+
+    bool frozen;
+    GArray *queued;
+
+    // The saved index, if one is loaded
+    uint8_t *map;
+    size_t map_length;
+    const struct index_file_word *directory;
+    size_t num_file_words;
+    uint32_t file_sessions;
+};
+
+// The postings of one word. Those in the file all come before the ones
+// added since.
+struct word_postings {
+    const struct history_index_posting *file;
+    size_t file_count;
+    const struct posting_list *added;
+};
+
+typedef void (*word_cb)(const char *word, void *userdata);
+
+
+static void free_posting_list(gpointer data) {
+    struct posting_list *list = data;
+    free(list->postings);
+    free(list);
+}
+
+history_index history_index_new(void) {
+    history_index index = calloc(1, sizeof(struct history_index_i));
+
+    index->words = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free_posting_list);
+    index->word = g_string_new(NULL);
+    index->queued = g_array_new(FALSE, FALSE, sizeof(struct queued_entry));
+
+    return index;
+}
+
+static void unmap_file(history_index index) {
+    if(index->map != NULL) munmap(index->map, index->map_length);
+
+    index->map = NULL;
+    index->map_length = 0;
+    index->directory = NULL;
+    index->num_file_words = 0;
+    index->file_sessions = 0;
+}
+
+void history_index_free(history_index index) {
+    unmap_file(index);
+    g_hash_table_destroy(index->words);
+    g_string_free(index->word, TRUE);
+    g_array_free(index->queued, TRUE);
+    free(index);
+}
+
+void history_index_clear(history_index index) {
+    unmap_file(index);
+    g_hash_table_remove_all(index->words);
+    g_array_set_size(index->queued, 0);
+}
+
+
+static void flush_word(GString *word, word_cb cb, void *userdata) {
+    // Apostrophes only count inside of a word
+    while((word->len > 0) && (word->str[word->len - 1] == '\'')) g_string_truncate(word, word->len - 1);
+
+    if(word->len > 0) cb(word->str, userdata);
+
+    g_string_truncate(word, 0);
+}
+
+// Splits text into lowercase words of letters, digits and apostrophes and
+// calls cb for every word that ends. A word left unfinished at the end of
+// text is continued by the next call.
+static void split_words(GString *word, const char *text, word_cb cb, void *userdata) {
+    for(const char *p = text; *p; p = g_utf8_next_char(p)) {
+        gunichar c = g_utf8_get_char_validated(p, -1);
+        if((c == ((gunichar)-1)) || (c == ((gunichar)-2))) break;
+
+        if(g_unichar_isalnum(c) || ((c == '\'') && (word->len > 0))) {
+            if(word->len < INDEX_MAX_WORD_BYTES) g_string_append_unichar(word, g_unichar_tolower(c));
+        } else {
+            flush_word(word, cb, userdata);
+        }
+    }
+}
+
+
+struct add_context {
+    history_index index;
+    struct history_index_posting posting;
+};
+
+static void add_word(const char *word, void *userdata) {
+    struct add_context *ctx = userdata;
+
+    struct posting_list *list = g_hash_table_lookup(ctx->index->words, word);
+    if(list == NULL) {
+        list = calloc(1, sizeof(struct posting_list));
+        g_hash_table_insert(ctx->index->words, g_strdup(word), list);
+    }
+
+    // A word said twice in an entry is only posted once
+    if(list->count > 0) {
+        const struct history_index_posting *last = &list->postings[list->count - 1];
+        if((last->session == ctx->posting.session) && (last->entry == ctx->posting.entry)) return;
+    }
+
+    if(list->count == list->capacity) {
+        list->capacity = (list->capacity > 0) ? (list->capacity * 2) : 4;
+        list->postings = realloc(list->postings, list->capacity * sizeof(struct history_index_posting));
+    }
+
+    list->postings[list->count++] = ctx->posting;
+}
+
+void history_index_add_entry(history_index index, uint32_t session, uint32_t entry, time_t timestamp, const struct history_token *tokens, size_t tokens_count) {
+    if(index->frozen) {
+        struct queued_entry queued = {
+            .posting = { .session = session, .entry = entry, .timestamp = timestamp },
+            .tokens = tokens,
+            .tokens_count = tokens_count
+        };
+        g_array_append_val(index->queued, queued);
+        return;
+    }
+
+    struct add_context ctx = {
+        .index = index,
+        .posting = { .session = session, .entry = entry, .timestamp = timestamp }
+    };
+
+    g_string_truncate(index->word, 0);
+
+    for(size_t i=0; i<tokens_count; i++){
+        if(tokens[i].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT)
+            flush_word(index->word, add_word, &ctx);
+
+        split_words(index->word, history_token_text(&tokens[i]), add_word, &ctx);
+    }
+
+    flush_word(index->word, add_word, &ctx);
+}
+
+
+void history_index_freeze(history_index index) {
+    index->frozen = true;
+}
+
+void history_index_thaw(history_index index) {
+    index->frozen = false;
+
+    for(guint i=0; i<index->queued->len; i++){
+        const struct queued_entry *queued = &g_array_index(index->queued, struct queued_entry, i);
+        history_index_add_entry(index, queued->posting.session, queued->posting.entry, (time_t)queued->posting.timestamp, queued->tokens, queued->tokens_count);
+    }
+
+    g_array_set_size(index->queued, 0);
+}
+
+void history_index_prepend(history_index index, history_index older) {
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, older->words);
+    while(g_hash_table_iter_next(&iter, &key, &value)) {
+        struct posting_list *old_list = value;
+
+        struct posting_list *list = g_hash_table_lookup(index->words, key);
+        if(list == NULL) {
+            g_hash_table_iter_steal(&iter);
+            g_hash_table_insert(index->words, key, old_list);
+            continue;
+        }
+
+        size_t count = old_list->count + list->count;
+        struct history_index_posting *postings = malloc(count * sizeof(struct history_index_posting));
+        memcpy(postings, old_list->postings, old_list->count * sizeof(struct history_index_posting));
+        memcpy(postings + old_list->count, list->postings, list->count * sizeof(struct history_index_posting));
+
+        free(list->postings);
+        list->postings = postings;
+        list->count = list->capacity = count;
+    }
+
+    g_hash_table_remove_all(older->words);
+}
+
+
+static const char *file_word(const history_index index, const struct index_file_word *entry) {
+    return (const char *)index->map + entry->word_offset;
+}
+
+// Orders words the way strcmp does, for words that are not terminated
+static int compare_word(const char *a, size_t a_length, const char *b, size_t b_length) {
+    int c = memcmp(a, b, MIN(a_length, b_length));
+    if(c != 0) return c;
+
+    return (a_length > b_length) - (a_length < b_length);
+}
+
+// Finds the postings of word in the mapped file. Sessions the file does not
+// know about can only be there if it is damaged, they are left out.
+static void find_file_postings(const history_index index, const char *word, struct word_postings *found) {
+    found->file = NULL;
+    found->file_count = 0;
+
+    size_t length = strlen(word);
+    size_t lo = 0;
+    size_t hi = index->num_file_words;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const struct index_file_word *entry = &index->directory[mid];
+
+        int c = compare_word(file_word(index, entry), entry->word_length, word, length);
+        if(c < 0) {
+            lo = mid + 1;
+        } else if(c > 0) {
+            hi = mid;
+        } else {
+            const struct history_index_posting *postings = (const struct history_index_posting *)(index->map + entry->postings_offset);
+
+            size_t count = entry->count;
+            while((count > 0) && (postings[count - 1].session >= index->file_sessions)) count--;
+
+            found->file = postings;
+            found->file_count = count;
+            return;
+        }
+    }
+}
+
+static void find_postings(const history_index index, const char *word, struct word_postings *found) {
+    find_file_postings(index, word, found);
+    found->added = g_hash_table_lookup(index->words, word);
+}
+
+static size_t postings_count(const struct word_postings *postings) {
+    return postings->file_count + ((postings->added != NULL) ? postings->added->count : 0);
+}
+
+static const struct history_index_posting *posting_at(const struct word_postings *postings, size_t i) {
+    if(i < postings->file_count) return &postings->file[i];
+    return &postings->added->postings[i - postings->file_count];
+}
+
+
+static int compare_postings(const struct history_index_posting *a, const struct history_index_posting *b) {
+    if(a->session != b->session) return (a->session < b->session) ? -1 : 1;
+    if(a->entry != b->entry) return (a->entry < b->entry) ? -1 : 1;
+    return 0;
+}
+
+static bool postings_contain(const struct word_postings *postings, const struct history_index_posting *posting) {
+    size_t lo = 0;
+    size_t hi = postings_count(postings);
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int c = compare_postings(posting_at(postings, mid), posting);
+        if(c == 0) return true;
+
+        if(c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return false;
+}
+
+static int compare_postings_sizes(const void *a, const void *b) {
+    size_t count_a = postings_count((const struct word_postings *)a);
+    size_t count_b = postings_count((const struct word_postings *)b);
+
+    return (count_a > count_b) - (count_a < count_b);
+}
+
+struct search_context {
+    history_index index;
+    GArray *words;
+    bool missing;
+};
+
+static void find_word(const char *word, void *userdata) {
+    struct search_context *ctx = userdata;
+
+    struct word_postings postings;
+    find_postings(ctx->index, word, &postings);
+
+    if(postings_count(&postings) == 0) ctx->missing = true;
+    else g_array_append_val(ctx->words, postings);
+}
+
+size_t history_index_search(history_index index, const char *query, struct history_index_posting *hits, size_t max_hits) {
+    struct search_context ctx = {
+        .index = index,
+        .words = g_array_new(FALSE, FALSE, sizeof(struct word_postings)),
+        .missing = false
+    };
+
+    g_string_truncate(index->word, 0);
+    split_words(index->word, query, find_word, &ctx);
+    flush_word(index->word, find_word, &ctx);
+
+    size_t found = 0;
+    if(!ctx.missing && (ctx.words->len > 0)) {
+        // Walk the rarest word and look the others up
+        g_array_sort(ctx.words, compare_postings_sizes);
+
+        const struct word_postings *rarest = &g_array_index(ctx.words, struct word_postings, 0);
+        for(size_t i=postings_count(rarest); i>0; i--){
+            const struct history_index_posting *posting = posting_at(rarest, i - 1);
+
+            bool all = true;
+            for(guint j=1; all && (j<ctx.words->len); j++)
+                all = postings_contain(&g_array_index(ctx.words, struct word_postings, j), posting);
+
+            if(!all) continue;
+
+            if(found < max_hits) hits[found] = *posting;
+            found++;
+        }
+    }
+
+    g_array_free(ctx.words, TRUE);
+
+    return found;
+}
+
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+// Number of postings before the first one of a session from num_sessions on
+static size_t count_before(const struct history_index_posting *postings, size_t count, uint32_t num_sessions) {
+    while((count > 0) && (postings[count - 1].session >= num_sessions)) count--;
+    return count;
+}
+
+bool history_index_save(history_index index, const char *path, uint64_t generation, uint32_t num_sessions) {
+    char *tmp_path = g_strdup_printf("%s.tmp", path);
+
+    FILE *f = fopen(tmp_path, "w");
+    if(f == NULL) {
+        printf("fopen %s returned NULL\n", tmp_path);
+        g_free(tmp_path);
+        return false;
+    }
+
+    struct index_file_header header = {
+        .version = INDEX_FILE_VERSION,
+        .reserved = 0,
+        .generation = generation,
+        .num_sessions = num_sessions,
+        .num_words = 0,
+        .directory_offset = 0
+    };
+    memcpy(header.magic, INDEX_FILE_MAGIC, 8);
+
+    // The header is written again once the directory offset is known
+    fwrite(&header, sizeof(header), 1, f);
+
+    // Words from the file and words added since are merged in order
+    GPtrArray *added = g_ptr_array_new();
+    GHashTableIter iter;
+    gpointer key;
+    g_hash_table_iter_init(&iter, index->words);
+    while(g_hash_table_iter_next(&iter, &key, NULL)) g_ptr_array_add(added, key);
+    g_ptr_array_sort(added, compare_strings);
+
+    GArray *directory = g_array_new(FALSE, FALSE, sizeof(struct index_file_word));
+    GString *words = g_string_new(NULL);
+
+    size_t i = 0, j = 0;
+    while((i < index->num_file_words) || (j < added->len)) {
+        const struct index_file_word *file_entry = (i < index->num_file_words) ? &index->directory[i] : NULL;
+        const char *added_word = (j < added->len) ? g_ptr_array_index(added, j) : NULL;
+
+        int c;
+        if(file_entry == NULL) c = 1;
+        else if(added_word == NULL) c = -1;
+        else c = compare_word(file_word(index, file_entry), file_entry->word_length, added_word, strlen(added_word));
+
+        const char *word;
+        size_t word_length;
+        struct word_postings postings = { 0 };
+        if(c <= 0) {
+            word = file_word(index, file_entry);
+            word_length = file_entry->word_length;
+            postings.file = (const struct history_index_posting *)(index->map + file_entry->postings_offset);
+            postings.file_count = count_before(postings.file, file_entry->count, index->file_sessions);
+            i++;
+        } else {
+            word = added_word;
+            word_length = strlen(added_word);
+        }
+
+        if(c >= 0) {
+            postings.added = g_hash_table_lookup(index->words, added_word);
+            j++;
+        }
+
+        size_t file_count = count_before(postings.file, postings.file_count, num_sessions);
+        size_t added_count = (postings.added != NULL) ? count_before(postings.added->postings, postings.added->count, num_sessions) : 0;
+        if(file_count + added_count == 0) continue;
+
+        struct index_file_word entry = {
+            .postings_offset = (uint64_t)ftell(f),
+            .word_offset = words->len,
+            .word_length = (uint32_t)word_length,
+            .count = (uint32_t)(file_count + added_count)
+        };
+        g_array_append_val(directory, entry);
+        g_string_append_len(words, word, word_length);
+
+        if(file_count > 0)
+            fwrite(postings.file, sizeof(struct history_index_posting), file_count, f);
+        if(added_count > 0)
+            fwrite(postings.added->postings, sizeof(struct history_index_posting), added_count, f);
+    }
+
+    uint64_t words_offset = (uint64_t)ftell(f);
+    fwrite(words->str, 1, words->len, f);
+
+    long pos = ftell(f);
+    while((pos % 8) != 0) {
+        fputc(0, f);
+        pos++;
+    }
+
+    header.num_words = directory->len;
+    header.directory_offset = (uint64_t)pos;
+    for(guint k=0; k<directory->len; k++){
+        struct index_file_word *entry = &g_array_index(directory, struct index_file_word, k);
+        entry->word_offset += words_offset;
+    }
+    if(directory->len > 0)
+        fwrite(directory->data, sizeof(struct index_file_word), directory->len, f);
+
+    fseek(f, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, f);
+
+    g_ptr_array_free(added, TRUE);
+    g_array_free(directory, TRUE);
+    g_string_free(words, TRUE);
+
+    bool ok = (ferror(f) == 0);
+    ok = (fclose(f) == 0) && ok;
+
+    // Not synced, a damaged index is simply rebuilt
+    ok = ok && (rename(tmp_path, path) == 0);
+    if(!ok) {
+        printf("Writing history index %s failed\n", path);
+        unlink(tmp_path);
+    }
+
+    g_free(tmp_path);
+
+    return ok;
+}
+
+// Checks that every word of the directory and its postings lie inside the
+// file, and that the words are in order for the binary search
+static bool check_directory(const uint8_t *map, size_t length, const struct index_file_word *directory, size_t num_words) {
+    const char *previous = NULL;
+    size_t previous_length = 0;
+
+    for(size_t i=0; i<num_words; i++){
+        const struct index_file_word *entry = &directory[i];
+
+        if((entry->word_length == 0) || (entry->word_length > INDEX_MAX_STORED_WORD_BYTES)) return false;
+        if((entry->word_offset > length) || (entry->word_length > length - entry->word_offset)) return false;
+
+        // A damaged count could point far past the end
+        if((entry->count == 0) || ((entry->postings_offset % 8) != 0) || (entry->postings_offset > length)) return false;
+        if(entry->count > (length - entry->postings_offset) / sizeof(struct history_index_posting)) return false;
+
+        const char *word = (const char *)map + entry->word_offset;
+        if((previous != NULL) && (compare_word(previous, previous_length, word, entry->word_length) >= 0)) return false;
+
+        previous = word;
+        previous_length = entry->word_length;
+    }
+
+    return true;
+}
+
+// Drops the postings of sessions before num_sessions from what was added,
+// they are in the file now
+static void drop_saved_postings(history_index index, uint32_t num_sessions) {
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, index->words);
+    while(g_hash_table_iter_next(&iter, NULL, &value)) {
+        struct posting_list *list = value;
+
+        size_t saved = 0;
+        while((saved < list->count) && (list->postings[saved].session < num_sessions)) saved++;
+
+        if(saved == list->count) {
+            g_hash_table_iter_remove(&iter);
+        } else if(saved > 0) {
+            memmove(list->postings, list->postings + saved, (list->count - saved) * sizeof(struct history_index_posting));
+            list->count -= saved;
+        }
+    }
+}
+
+bool history_index_load(history_index index, const char *path, uint64_t generation, uint32_t num_sessions) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return false;
+
+    struct stat st;
+    void *data = MAP_FAILED;
+    if((fstat(fd, &st) == 0) && ((size_t)st.st_size >= sizeof(struct index_file_header)))
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    uint8_t *map = (data != MAP_FAILED) ? data : NULL;
+    size_t length = (size_t)st.st_size;
+
+    struct index_file_header header = { 0 };
+    if(map != NULL) memcpy(&header, map, sizeof(header));
+
+    bool ok = (map != NULL)
+        && (memcmp(header.magic, INDEX_FILE_MAGIC, 8) == 0)
+        && (header.version == INDEX_FILE_VERSION)
+        && (header.generation == generation)
+        && (header.num_sessions == num_sessions)
+        && ((header.directory_offset % 8) == 0)
+        && (header.directory_offset <= length)
+        && (header.num_words <= (length - header.directory_offset) / sizeof(struct index_file_word));
+
+    const struct index_file_word *directory = ok ? (const struct index_file_word *)(map + header.directory_offset) : NULL;
+    ok = ok && check_directory(map, length, directory, header.num_words);
+
+    if(!ok) {
+        printf("History index %s is out of date, rebuilding it\n", path);
+        if(map != NULL) munmap(map, length);
+        return false;
+    }
+
+    unmap_file(index);
+    index->map = map;
+    index->map_length = length;
+    index->directory = directory;
+    index->num_file_words = header.num_words;
+    index->file_sessions = num_sessions;
+
+    drop_saved_postings(index, num_sessions);
+
+    return true;
+}
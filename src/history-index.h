@@ -0,0 +1,70 @@
+/* history-index.h
+ * This file contains the declaration for the history search index, an
+ * inverted index from each word said to the entries of history it appears
+ * in.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+struct history_token;
+
+// Sessions are numbered from the oldest, starting at 0
+struct history_index_posting {
+    uint32_t session;
+    uint32_t entry;
+    int64_t timestamp;
+};
+
+typedef struct history_index_i *history_index;
+
+// The index does no locking of its own, history.c serializes all calls
+history_index history_index_new(void);
+void history_index_free(history_index index);
+void history_index_clear(history_index index);
+
+// Adds every word of an entry. Entries must be added in order.
+void history_index_add_entry(history_index index, uint32_t session, uint32_t entry, time_t timestamp, const struct history_token *tokens, size_t tokens_count);
+
+// While frozen, added entries are only queued and the index does not change,
+// so it can be saved without the lock while other calls go on. Searches
+// miss the queued entries until they are added by history_index_thaw. The
+// tokens of queued entries must stay valid until then.
+void history_index_freeze(history_index index);
+void history_index_thaw(history_index index);
+
+// Finds the entries containing every word of query, ignoring case and
+// punctuation. Up to max_hits of them are written to hits, the newest first.
+// Returns the number of entries found, which may be more than max_hits.
+size_t history_index_search(history_index index, const char *query, struct history_index_posting *hits, size_t max_hits);
+
+// Puts the postings of older, which must all come before the ones in index,
+// in front of them. Leaves older empty.
+void history_index_prepend(history_index index, history_index older);
+
+// The saved index belongs to the history file at the given generation with
+// num_sessions sessions, and is only loaded for that exact state. Postings
+// of later sessions are left out when saving. Loading maps the file and
+// searches it in place, and drops the postings of earlier sessions added
+// since, which the file holds. A failed load leaves the index as it was.
+bool history_index_save(history_index index, const char *path, uint64_t generation, uint32_t num_sessions);
+bool history_index_load(history_index index, const char *path, uint64_t generation, uint32_t num_sessions);
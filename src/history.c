@@ -19,8 +19,19 @@
 
 
 #include <time.h>
+#include <math.h>
+#include <stddef.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <adwaita.h>
 #include "history.h"
+#include "history-index.h"
 
 static struct history_session active_session = { 0 };
 static struct past_history_sessions past_sessions = { 0 };
@@ -29,6 +40,206 @@ char default_history_file_v[1024] = { 0 };
 char *default_history_file = NULL;
 
 static GSettings *settings = NULL;
+static atomic_bool save_history = true;
+
+
+/*
+ * The history file is a snapshot which is only rewritten when compacting.
+ * Everything committed after that is appended to <history file>.journal as
+ * it happens, so a crash loses at most the last few seconds that were not
+ * synced yet, and exiting does not have to rewrite anything.
+ *
+ * Snapshot layout (HISTORY_FILE_VERSION):
+ *   struct history_file_header
+ *   for each session, 8-byte aligned, at the offset given in the index:
+ *     for each entry: struct history_file_entry, packed_length bytes of
+ *                     packed tokens
+ *   num_tokens token texts at tokens_offset, each a varint length and the
+ *     bytes. A token's position in this list is its id in the file.
+ *   num_sessions struct history_file_session at index_offset
+ *
+ * A packed token is its id as a varint, then the quantized logprob byte and
+ * the flags byte.
+ *
+ * The snapshot is mmapped and only the index is read at startup. A session's
+ * entries are decoded the first time it is asked for. Snapshots in the
+ * original fwrite layout are migrated once when they are loaded.
+ *
+ * Journal layout:
+ *   struct journal_header
+ *   repeated: struct journal_record_header, followed by `length` bytes
+ *             starting with a JournalRecordType
+ *
+ * The snapshot header holds the generation it was written at. The journal
+ * is only replayed if its generation matches, so a crash halfway through
+ * compaction never applies the same records twice.
+ */
+
+#define HISTORY_FILE_MAGIC "LCHISTRY"
+#define HISTORY_FILE_VERSION 1
+
+#define JOURNAL_MAGIC "LCJ1"
+
+#define LEGACY_TOKEN_MAX_CHARS 32
+
+// A varint id, the logprob and the flags
+#define PACKED_TOKEN_MAX_BYTES 7
+
+// Tokens are carved out of blocks of this many, see allocate_tokens
+#define TOKEN_BLOCK_TOKENS 4096
+
+// First allocation for the entries of a session, which then doubles
+#define ENTRIES_INITIAL_CAPACITY 64
+
+// Logprobs are stored in steps of 1/LOGPROB_SCALE around 0
+#define LOGPROB_SCALE 8.0f
+#define LOGPROB_ZERO 128
+
+// How often the journal is synced to disk
+#define JOURNAL_SYNC_INTERVAL_SECONDS 2
+
+// The journal is folded into the snapshot once it grows past this
+#define JOURNAL_COMPACT_BYTES (4 * 1024 * 1024)
+
+// Anything larger is treated as a torn or corrupted record
+#define JOURNAL_MAX_RECORD_BYTES (1024 * 1024)
+
+typedef enum JournalRecordType {
+    // int64_t session timestamp. Entries that follow belong to this session.
+    JOURNAL_SESSION_START = 1,
+
+    // int64_t session timestamp. Written first after compaction when the
+    // active session is already in the snapshot, entries that follow
+    // continue the last session of the snapshot.
+    JOURNAL_SESSION_CONTINUE = 2,
+
+    // int64_t timestamp, uint32_t tokens_count, and for each token a varint
+    // length, the text, the quantized logprob and the flags. The text is
+    // stored instead of the id, ids are not stable between runs.
+    JOURNAL_ENTRY = 3
+} JournalRecordType;
+
+struct journal_header {
+    char magic[4];
+    uint32_t reserved;
+    uint64_t generation;
+};
+
+struct journal_record_header {
+    uint32_t length;
+    uint32_t checksum; // CRC-32 of the `length` bytes that follow
+};
+
+struct history_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t generation;
+    uint64_t num_sessions;
+    uint64_t index_offset;
+    uint64_t num_tokens;
+    uint64_t tokens_offset;
+};
+
+struct history_file_session {
+    int64_t timestamp;
+    uint64_t entries_count;
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct history_file_entry {
+    int64_t timestamp;
+    uint32_t tokens_count;
+    uint32_t packed_length;
+};
+
+// How tokens were stored in the original layout
+struct legacy_history_token {
+    char token[LEGACY_TOKEN_MAX_CHARS];
+    float logprob;
+    uint32_t flags;
+};
+
+// Where the entries of past_sessions.sessions[i] are, if they have not been
+// decoded yet
+struct session_source {
+    const uint8_t *data;
+    size_t length;
+    bool decoded;
+};
+
+// Protects the sessions and the journal state below against the ASR thread
+// committing entries while the journal thread syncs or compacts
+static GMutex history_mutex;
+
+static char *snapshot_path = NULL;
+static char *journal_path = NULL;
+static int journal_fd = -1;
+static size_t journal_size = 0;
+static uint64_t generation = 0;
+static bool journal_dirty = false;
+
+// Whether the active session has been announced in the journal yet
+static bool active_session_journaled = false;
+
+static GThread *journal_thread = NULL;
+
+// Set while compact_history works without the lock. Erasing or loading
+// history waits for it on compaction_done, since the snapshot being written
+// still points into the sessions.
+static bool compacting = false;
+static GCond compaction_done;
+
+// The mapped snapshot, and one session_source per past session
+static uint8_t *snapshot_map = NULL;
+static size_t snapshot_map_length = 0;
+static struct session_source *past_sources = NULL;
+
+// The token table id of each token id of the mapped snapshot. NULL if they
+// are the same, which they are unless something was interned before the
+// snapshot was loaded.
+static uint32_t *snapshot_token_ids = NULL;
+static size_t snapshot_num_tokens = 0;
+
+// The tokens of every entry are carved out of fixed-size blocks. A block is
+// never moved, and they are only freed when all history is erased.
+struct token_block {
+    struct token_block *next;
+    size_t used;
+    size_t capacity;
+    struct history_token tokens[];
+};
+
+// The block being filled is first
+static struct token_block *token_blocks = NULL;
+static size_t token_blocks_count = 0;
+static size_t token_blocks_bytes = 0;
+
+static size_t active_entries_capacity = 0;
+static size_t entries_bytes = 0;
+
+// Word -> entries, see history-index.h. Saved as <history file>.index
+// whenever the snapshot is compacted.
+static history_index search_index = NULL;
+static char *index_path = NULL;
+
+// Set while the index is missing the sessions of the snapshot, because its
+// file was missing or out of date. They are added back on a thread of their
+// own, and the index is not saved until then. Loading or erasing history
+// bumps index_epoch, which makes a running rebuild give up.
+static bool index_rebuilding = false;
+static unsigned int index_epoch = 0;
+
+// Set if the snapshot was written by a newer version. It is then left alone
+// and nothing is saved.
+static bool snapshot_read_only = false;
+
+
+static void on_save_history_changed(GSettings *self, gchar *key, gpointer user_data) {
+    atomic_store(&save_history, g_settings_get_boolean(settings, "save-history"));
+}
+
 void history_init(void){
     // set timestamp for current session, etc
     active_session.timestamp = time(NULL);
@@ -45,23 +256,324 @@ void history_init(void){
 
     printf("Save file: %s\n", default_history_file);
 
-    if(settings == NULL) settings = g_settings_new("net.sapples.LiveCaptions");
+    if(search_index == NULL) search_index = history_index_new();
+
+    if(settings == NULL) {
+        settings = g_settings_new("net.sapples.LiveCaptions");
+        g_signal_connect(settings, "changed::save-history", G_CALLBACK(on_save_history_changed), NULL);
+        atomic_store(&save_history, g_settings_get_boolean(settings, "save-history"));
+    }
+}
+
+
+// Must be called with history_mutex held
+static struct history_token *allocate_tokens(size_t count) {
+    if(count == 0) return NULL;
+
+    struct token_block *block = token_blocks;
+    if((block != NULL) && ((block->capacity - block->used) >= count)) {
+        struct history_token *tokens = &block->tokens[block->used];
+        block->used += count;
+        return tokens;
+    }
+
+    size_t capacity = (count > TOKEN_BLOCK_TOKENS) ? count : TOKEN_BLOCK_TOKENS;
+    size_t size = sizeof(struct token_block) + capacity * sizeof(struct history_token);
+
+    block = malloc(size);
+    block->used = count;
+    block->capacity = capacity;
+
+    // An oversized block is full right away, so the current block keeps
+    // being filled
+    if((count >= TOKEN_BLOCK_TOKENS) && (token_blocks != NULL)) {
+        block->next = token_blocks->next;
+        token_blocks->next = block;
+    } else {
+        block->next = token_blocks;
+        token_blocks = block;
+    }
+
+    token_blocks_count += 1;
+    token_blocks_bytes += size;
+
+    return &block->tokens[0];
+}
+
+// Gives back tokens that turned out to be damaged while decoding, if they
+// were the last ones allocated. Must be called with history_mutex held.
+static void release_tokens(struct history_token *tokens, size_t count) {
+    struct token_block *block = token_blocks;
+    if((tokens == NULL) || (block == NULL)) return;
+
+    if(tokens + count == &block->tokens[block->used])
+        block->used -= count;
+}
+
+// Must be called with history_mutex held
+static void free_token_blocks(void) {
+    while(token_blocks != NULL) {
+        struct token_block *next = token_blocks->next;
+        free(token_blocks);
+        token_blocks = next;
+    }
+
+    token_blocks_count = 0;
+    token_blocks_bytes = 0;
+}
+
+// Makes room for one more entry in session. The array grows geometrically,
+// so that appending stays amortized O(1) however long the session gets.
+// Must be called with history_mutex held.
+static void reserve_entry(struct history_session *session, size_t *capacity) {
+    if(session->entries_count < *capacity) return;
+
+    size_t new_capacity = (*capacity > 0) ? (*capacity * 2) : ENTRIES_INITIAL_CAPACITY;
+    session->entries = realloc(session->entries, new_capacity * sizeof(struct history_entry));
+
+    entries_bytes += (new_capacity - *capacity) * sizeof(struct history_entry);
+    *capacity = new_capacity;
+}
+
+// Must be called with history_mutex held
+static struct history_entry *allocate_entries(size_t count) {
+    entries_bytes += count * sizeof(struct history_entry);
+    return calloc(count > 0 ? count : 1, sizeof(struct history_entry));
+}
+
+// Must be called with history_mutex held
+static void collect_memory_stats(struct history_memory_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    for(size_t i=0; i<past_sessions.num_sessions; i++){
+        if(past_sources[i].decoded) stats->entries += past_sessions.sessions[i].entries_count;
+        else stats->undecoded_sessions += 1;
+    }
+    stats->entries += active_session.entries_count;
+    stats->sessions = past_sessions.num_sessions + 1;
+
+    for(struct token_block *block = token_blocks; block != NULL; block = block->next)
+        stats->tokens += block->used;
+
+    stats->entries_bytes = entries_bytes;
+    stats->token_blocks = token_blocks_count;
+    stats->token_blocks_bytes = token_blocks_bytes;
+    stats->mapped_bytes = snapshot_map_length;
+    stats->interned_tokens = token_table_size();
+}
+
+void history_get_memory_stats(struct history_memory_stats *stats) {
+    g_mutex_lock(&history_mutex);
+    collect_memory_stats(stats);
+    g_mutex_unlock(&history_mutex);
+}
+
+// Must be called with history_mutex held
+static void report_memory_usage(void) {
+    struct history_memory_stats stats;
+    collect_memory_stats(&stats);
+
+    printf("History memory: %zu entries in %zu KiB, %zu tokens in %zu blocks (%zu KiB), %zu distinct, %zu KiB mapped\n",
+           stats.entries, stats.entries_bytes / 1024,
+           stats.tokens, stats.token_blocks, stats.token_blocks_bytes / 1024,
+           stats.interned_tokens, stats.mapped_bytes / 1024);
+}
+
+
+static uint32_t crc32_table[256];
+
+static uint32_t checksum(const uint8_t *data, size_t length) {
+    // The journal thread, loading and committing can all get here first
+    static gsize table_ready = 0;
+    if(g_once_init_enter(&table_ready)) {
+        for(uint32_t i=0; i<256; i++) {
+            uint32_t c = i;
+            for(int k=0; k<8; k++) c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+            crc32_table[i] = c;
+        }
+        g_once_init_leave(&table_ready, 1);
+    }
+
+    uint32_t crc = 0xFFFFFFFFu;
+    for(size_t i=0; i<length; i++) crc = crc32_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+
+    return crc ^ 0xFFFFFFFFu;
+}
+
+static bool write_all(int fd, const void *data, size_t length) {
+    const uint8_t *p = data;
+    while(length > 0) {
+        ssize_t written = write(fd, p, length);
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            return false;
+        }
+
+        p += written;
+        length -= written;
+    }
+
+    return true;
+}
+
+static size_t put_varint(uint8_t *out, uint32_t value) {
+    size_t length = 0;
+    while(value >= 0x80) {
+        out[length++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[length++] = (uint8_t)value;
+
+    return length;
+}
+
+static bool read_varint(const uint8_t **p, const uint8_t *end, uint32_t *value) {
+    uint32_t result = 0;
+    for(int shift=0; shift<35; shift += 7) {
+        if(*p >= end) return false;
+
+        uint8_t b = *(*p)++;
+        result |= (uint32_t)(b & 0x7F) << shift;
+        if((b & 0x80) == 0) {
+            *value = result;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static uint8_t quantize_logprob(float logprob) {
+    float q = roundf(logprob * LOGPROB_SCALE) + LOGPROB_ZERO;
+    if(!(q >= 0.0f)) q = 0.0f;
+    if(q > 255.0f) q = 255.0f;
+
+    return (uint8_t)q;
+}
+
+static void set_token(struct history_token *token, const char *text, size_t length, float logprob, uint32_t flags) {
+    token->id = token_table_intern_len(text, length);
+    token->logprob = quantize_logprob(logprob);
+    token->flags = (uint8_t)flags;
+}
+
+void history_token_set(struct history_token *token, const AprilToken *april_token) {
+    set_token(token, april_token->token, strlen(april_token->token), april_token->logprob, april_token->flags);
+}
+
+const char *history_token_text(const struct history_token *token) {
+    return token_table_get(token->id);
+}
+
+float history_token_logprob(const struct history_token *token) {
+    return ((float)token->logprob - LOGPROB_ZERO) / LOGPROB_SCALE;
+}
+
+static void set_token_from_legacy(struct history_token *token, const struct legacy_history_token *legacy) {
+    set_token(token, legacy->token, strnlen(legacy->token, LEGACY_TOKEN_MAX_CHARS), legacy->logprob, legacy->flags);
+}
+
+// Packs tokens into out, which needs PACKED_TOKEN_MAX_BYTES per token.
+// Returns the number of bytes used.
+static size_t pack_tokens(const struct history_token *tokens, size_t count, uint8_t *out) {
+    size_t length = 0;
+    for(size_t i=0; i<count; i++){
+        length += put_varint(&out[length], tokens[i].id);
+        out[length++] = tokens[i].logprob;
+        out[length++] = tokens[i].flags;
+    }
+
+    return length;
+}
+
+// Makes a rename in the directory of path durable
+static void sync_parent_directory(const char *path) {
+    char *copy = g_strdup(path);
+    int fd = open(dirname(copy), O_RDONLY);
+    if(fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    g_free(copy);
+}
+
+// Must be called with history_mutex held
+static void journal_append(JournalRecordType type, const void *payload, size_t payload_length) {
+    if(journal_fd < 0) return;
+
+    size_t length = 1 + payload_length;
+    uint8_t *record = malloc(sizeof(struct journal_record_header) + length);
+
+    uint8_t *body = record + sizeof(struct journal_record_header);
+    body[0] = (uint8_t)type;
+    memcpy(&body[1], payload, payload_length);
+
+    struct journal_record_header header = {
+        .length = (uint32_t)length,
+        .checksum = checksum(body, length)
+    };
+    memcpy(record, &header, sizeof(header));
+
+    // A single write, so a crash leaves at most one torn record at the end
+    if(write_all(journal_fd, record, sizeof(header) + length)) {
+        journal_size += sizeof(header) + length;
+        journal_dirty = true;
+    } else {
+        printf("Writing to history journal %s failed: %s\n", journal_path, strerror(errno));
+    }
+
+    free(record);
+}
+
+// Must be called with history_mutex held
+static void journal_append_entry(const struct history_entry *entry) {
+    if(!atomic_load(&save_history)) return;
+
+    if(!active_session_journaled) {
+        int64_t timestamp = active_session.timestamp;
+        journal_append(JOURNAL_SESSION_START, &timestamp, sizeof(timestamp));
+        active_session_journaled = true;
+    }
+
+    size_t payload_length = sizeof(int64_t) + sizeof(uint32_t);
+    for(size_t i=0; i<entry->tokens_count; i++){
+        size_t text_length = strlen(history_token_text(&entry->tokens[i]));
+        payload_length += 5 + text_length + 2;
+    }
+
+    uint8_t *payload = malloc(payload_length);
+
+    int64_t timestamp = entry->timestamp;
+    uint32_t tokens_count = (uint32_t)entry->tokens_count;
+    memcpy(payload, &timestamp, sizeof(timestamp));
+    memcpy(payload + sizeof(timestamp), &tokens_count, sizeof(tokens_count));
+
+    size_t length = sizeof(timestamp) + sizeof(tokens_count);
+    for(size_t i=0; i<entry->tokens_count; i++){
+        const char *text = history_token_text(&entry->tokens[i]);
+        size_t text_length = strlen(text);
+
+        length += put_varint(&payload[length], (uint32_t)text_length);
+        memcpy(&payload[length], text, text_length);
+        length += text_length;
+        payload[length++] = entry->tokens[i].logprob;
+        payload[length++] = entry->tokens[i].flags;
+    }
+
+    journal_append(JOURNAL_ENTRY, payload, length);
+
+    free(payload);
 }
 
 
 static struct history_entry *allocate_new_entry(size_t tokens_count) {
+    reserve_entry(&active_session, &active_entries_capacity);
     active_session.entries_count += 1;
-    active_session.entries = realloc(active_session.entries,
-        active_session.entries_count * sizeof(struct history_entry));
 
     struct history_entry *entry = &active_session.entries[active_session.entries_count - 1];
 
     entry->tokens_count = tokens_count;
-
-    if(tokens_count > 0)
-        entry->tokens = calloc(tokens_count, sizeof(struct history_token));
-    else
-        entry->tokens = NULL;
+    entry->tokens = allocate_tokens(tokens_count);
 
     return entry;
 }
@@ -69,75 +581,770 @@ static struct history_entry *allocate_new_entry(size_t tokens_count) {
 void commit_tokens_to_current_history(const AprilToken *tokens,
                                       size_t tokens_count)
 {
+    g_mutex_lock(&history_mutex);
+
     struct history_entry *entry = allocate_new_entry(tokens_count);
 
     entry->timestamp = time(NULL);
 
     for(size_t i=0; i<tokens_count; i++){
-        struct history_token *token = &entry->tokens[i];
+        history_token_set(&entry->tokens[i], &tokens[i]);
+    }
 
-        if(strlen(tokens[i].token) >= HISTORY_TOKEN_MAX_CHARS){
-            printf("Token %s is too long! (%d)\n", tokens[i].token, strlen(tokens[i].token));
-            g_assert(false);
-        }
+    if(search_index != NULL)
+        history_index_add_entry(search_index, (uint32_t)past_sessions.num_sessions, (uint32_t)(active_session.entries_count - 1), entry->timestamp, entry->tokens, entry->tokens_count);
 
-        strcpy(&token->token[0], tokens[i].token);
-        token->logprob = tokens[i].logprob;
-        token->flags   = tokens[i].flags;
-    }
+    journal_append_entry(entry);
+
+    g_mutex_unlock(&history_mutex);
 }
 
 void save_silence_to_history(void){
+    g_mutex_lock(&history_mutex);
+
     struct history_entry *entry = allocate_new_entry(0);
     entry->timestamp = time(NULL);
+
+    journal_append_entry(entry);
+
+    g_mutex_unlock(&history_mutex);
 }
 
 
-static void write_session_to_file(FILE *f, const struct history_session *session) {
-    fwrite(&session->timestamp, sizeof(session->timestamp), 1, f);
-    fwrite(&session->entries_count, sizeof(session->entries_count), 1, f);
+// A session to be written, either from memory or as the still encoded bytes
+// of the mapped snapshot. The session is a copy, so that it can be written
+// while entries are added to the real one.
+struct session_ref {
+    struct history_session session;
+    const uint8_t *data;
+    size_t length;
+
+    // Set if session.entries is a copy that has to be freed
+    bool owns_entries;
+};
+
+static void write_session_entries(FILE *f, const struct history_session *session) {
+    uint8_t *packed = NULL;
+    size_t packed_capacity = 0;
+
     for(size_t i=0; i<session->entries_count; i++){
         struct history_entry *entry = &session->entries[i];
 
-        fwrite(&entry->timestamp, sizeof(entry->timestamp), 1, f);
-        fwrite(&entry->tokens_count, sizeof(entry->tokens_count), 1, f);
+        if(entry->tokens_count * PACKED_TOKEN_MAX_BYTES > packed_capacity) {
+            packed_capacity = entry->tokens_count * PACKED_TOKEN_MAX_BYTES;
+            packed = realloc(packed, packed_capacity);
+        }
 
-        for(size_t j=0; j<entry->tokens_count; j++){
-            struct history_token *token = &entry->tokens[j];
+        size_t packed_length = pack_tokens(entry->tokens, entry->tokens_count, packed);
 
-            fwrite(token, sizeof(struct history_token), 1, f);
-        }
+        struct history_file_entry file_entry = {
+            .timestamp = entry->timestamp,
+            .tokens_count = (uint32_t)entry->tokens_count,
+            .packed_length = (uint32_t)packed_length
+        };
+        fwrite(&file_entry, sizeof(file_entry), 1, f);
+
+        if(packed_length > 0)
+            fwrite(packed, 1, packed_length, f);
     }
+
+    free(packed);
 }
 
-void save_current_history(const char *path){
-    FILE *f = fopen(path, "w");
+// Writes the whole token table, so that ids in the file are the ones in
+// memory
+static void write_token_table(FILE *f, uint64_t *num_tokens) {
+    *num_tokens = token_table_size();
+
+    for(uint32_t id=0; id<*num_tokens; id++){
+        const char *text = token_table_get(id);
+        size_t text_length = strlen(text);
+
+        uint8_t length[5];
+        fwrite(length, 1, put_varint(length, (uint32_t)text_length), f);
+        fwrite(text, 1, text_length, f);
+    }
+}
+
+static void pad_to_alignment(FILE *f) {
+    long pos = ftell(f);
+    while((pos % 8) != 0) {
+        fputc(0, f);
+        pos++;
+    }
+}
+
+// Writes a complete snapshot. If index is not NULL, it receives the
+// location of each session. Returns false on a write error.
+static bool write_history_file(FILE *f, uint64_t file_generation, const struct session_ref *refs, size_t count, struct history_file_session *index) {
+    struct history_file_header header = {
+        .version = HISTORY_FILE_VERSION,
+        .reserved = 0,
+        .generation = file_generation,
+        .num_sessions = count,
+        .index_offset = 0,
+        .num_tokens = 0,
+        .tokens_offset = 0
+    };
+    memcpy(header.magic, HISTORY_FILE_MAGIC, 8);
+
+    // The header is written again once the index offset is known
+    fwrite(&header, sizeof(header), 1, f);
+
+    struct history_file_session *sessions = calloc(count > 0 ? count : 1, sizeof(struct history_file_session));
+
+    for(size_t i=0; i<count; i++){
+        pad_to_alignment(f);
+
+        long offset = ftell(f);
+        sessions[i].timestamp = refs[i].session.timestamp;
+        sessions[i].entries_count = refs[i].session.entries_count;
+        sessions[i].offset = (uint64_t)offset;
+
+        if(refs[i].data != NULL)
+            fwrite(refs[i].data, 1, refs[i].length, f);
+        else
+            write_session_entries(f, &refs[i].session);
+
+        sessions[i].length = (uint64_t)(ftell(f) - offset);
+    }
+
+    // After the sessions, so that every token they use is in the table
+    header.tokens_offset = (uint64_t)ftell(f);
+    write_token_table(f, &header.num_tokens);
 
-    bool write_active_session = active_session.entries_count > 0;
-    write_active_session = write_active_session && g_settings_get_boolean(settings, "save-history");
+    pad_to_alignment(f);
+    header.index_offset = (uint64_t)ftell(f);
+    fwrite(sessions, sizeof(struct history_file_session), count, f);
 
-    size_t num_sessions_to_write = past_sessions.num_sessions + (write_active_session ? 1 : 0);
-    fwrite(&num_sessions_to_write, sizeof(num_sessions_to_write), 1, f);
+    fseek(f, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, f);
+
+    if(index != NULL) memcpy(index, sessions, count * sizeof(struct history_file_session));
+    free(sessions);
+
+    return ferror(f) == 0;
+}
+
+static bool should_write_active_session(void) {
+    return (active_session.entries_count > 0) && atomic_load(&save_history);
+}
+
+static void decode_past_session(size_t i);
+
+// Lists the past sessions and, if it is to be saved, the active session.
+// Must be called with history_mutex held.
+static struct session_ref *collect_sessions(size_t *count) {
+    bool write_active_session = should_write_active_session();
+
+    *count = past_sessions.num_sessions + (write_active_session ? 1 : 0);
+    struct session_ref *refs = calloc(*count > 0 ? *count : 1, sizeof(struct session_ref));
+
+    // Undecoded sessions can only be copied as they are if their token ids
+    // are the ones that are written
+    bool copy_undecoded = (snapshot_token_ids == NULL);
 
     for(size_t i=0; i<past_sessions.num_sessions; i++){
-        write_session_to_file(f, &past_sessions.sessions[i]);
+        if(!copy_undecoded) decode_past_session(i);
+
+        // Decoded past sessions never change again
+        refs[i].session = past_sessions.sessions[i];
+        if(!past_sources[i].decoded) {
+            refs[i].data = past_sources[i].data;
+            refs[i].length = past_sources[i].length;
+        }
     }
 
-    if(write_active_session)
-        write_session_to_file(f, &active_session);
+    if(write_active_session) {
+        // Committing moves the entries of the active session when it grows
+        struct session_ref *ref = &refs[past_sessions.num_sessions];
+        ref->session = active_session;
+        ref->session.entries = malloc(active_session.entries_count * sizeof(struct history_entry));
+        memcpy(ref->session.entries, active_session.entries, active_session.entries_count * sizeof(struct history_entry));
+        ref->owns_entries = true;
+    }
 
-    fclose(f);
+    return refs;
+}
+
+static void free_session_refs(struct session_ref *refs, size_t count) {
+    for(size_t i=0; i<count; i++){
+        if(refs[i].owns_entries) free(refs[i].session.entries);
+    }
+
+    free(refs);
 }
 
+static bool write_current_history_file(FILE *f, uint64_t file_generation, struct history_file_session **index, size_t *count) {
+    struct session_ref *refs = collect_sessions(count);
+
+    if(index != NULL) *index = calloc(*count > 0 ? *count : 1, sizeof(struct history_file_session));
+    bool ok = write_history_file(f, file_generation, refs, *count, (index != NULL) ? *index : NULL);
+
+    free_session_refs(refs, *count);
+    return ok;
+}
+
+static bool map_snapshot(const char *path, uint8_t **map, size_t *length) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return false;
+
+    struct stat st;
+    if((fstat(fd, &st) != 0) || (st.st_size == 0)) {
+        close(fd);
+        return false;
+    }
+
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if(data == MAP_FAILED) {
+        printf("mmap %s failed: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    *map = data;
+    *length = (size_t)st.st_size;
+    return true;
+}
+
+static void unmap_snapshot(void) {
+    if(snapshot_map != NULL) munmap(snapshot_map, snapshot_map_length);
+    snapshot_map = NULL;
+    snapshot_map_length = 0;
+}
+
+// Appends an empty, decoded past session. Must be called with history_mutex
+// held.
+static struct history_session *append_past_session(time_t timestamp) {
+    past_sessions.num_sessions += 1;
+    past_sessions.sessions = realloc(past_sessions.sessions, past_sessions.num_sessions * sizeof(struct history_session));
+    past_sources = realloc(past_sources, past_sessions.num_sessions * sizeof(struct session_source));
+
+    struct history_session *session = &past_sessions.sessions[past_sessions.num_sessions - 1];
+    session->timestamp = timestamp;
+    session->entries_count = 0;
+    session->entries = NULL;
+
+    struct session_source *source = &past_sources[past_sessions.num_sessions - 1];
+    source->data = NULL;
+    source->length = 0;
+    source->decoded = true;
+
+    return session;
+}
+
+// Decodes the tokens of one entry of the mapped snapshot into storage
+// from allocate. Returns false if they are damaged.
+static bool decode_tokens(struct history_entry *entry, const uint8_t *data, size_t length, struct history_token *(*allocate)(size_t count)) {
+    if(entry->tokens_count == 0) return true;
+
+    // Every packed token takes at least 3 bytes
+    if(entry->tokens_count > length / 3) return false;
+
+    entry->tokens = allocate(entry->tokens_count);
+
+    const uint8_t *p = data;
+    const uint8_t *end = data + length;
+    for(size_t j=0; j<entry->tokens_count; j++){
+        uint32_t id;
+        if(!read_varint(&p, end, &id) || ((end - p) < 2)) return false;
+        if(id >= snapshot_num_tokens) return false;
+
+        entry->tokens[j].id = (snapshot_token_ids != NULL) ? snapshot_token_ids[id] : id;
+        entry->tokens[j].logprob = *p++;
+        entry->tokens[j].flags = *p++;
+    }
+
+    return true;
+}
+
+// Reads the entry at *p of a session in the mapped snapshot and moves past
+// it. Returns false at the end of the data or if the entry is damaged.
+static bool read_source_entry(const uint8_t **p, const uint8_t *end, struct history_entry *entry, struct history_token *(*allocate)(size_t count)) {
+    struct history_file_entry file_entry;
+    if((size_t)(end - *p) < sizeof(file_entry)) return false;
+    memcpy(&file_entry, *p, sizeof(file_entry));
+    *p += sizeof(file_entry);
+
+    size_t tokens_size = file_entry.packed_length;
+    if((size_t)(end - *p) < tokens_size) return false;
+
+    entry->timestamp = (time_t)file_entry.timestamp;
+    entry->tokens_count = file_entry.tokens_count;
+    entry->tokens = NULL;
+    if(!decode_tokens(entry, *p, tokens_size, allocate)) return false;
+
+    *p += tokens_size;
+    return true;
+}
+
+// Decodes the entries of a past session from the mapped snapshot if that has
+// not happened yet. Must be called with history_mutex held.
+static void decode_past_session(size_t i) {
+    struct session_source *source = &past_sources[i];
+    if(source->decoded) return;
+
+    struct history_session *session = &past_sessions.sessions[i];
+    session->entries = allocate_entries(session->entries_count);
+
+    const uint8_t *p = source->data;
+    const uint8_t *end = source->data + source->length;
+
+    size_t decoded = 0;
+    for(; decoded<session->entries_count; decoded++){
+        struct history_entry *entry = &session->entries[decoded];
+        if(!read_source_entry(&p, end, entry, allocate_tokens)) {
+            release_tokens(entry->tokens, entry->tokens_count);
+            break;
+        }
+    }
+
+    if(decoded != session->entries_count) {
+        printf("History session %zu is truncated, only %zu of %zu entries could be read\n", i, decoded, session->entries_count);
+        session->entries_count = decoded;
+    }
+
+    source->decoded = true;
+    source->data = NULL;
+    source->length = 0;
+}
+
+static struct history_token *scratch_tokens = NULL;
+static size_t scratch_tokens_capacity = 0;
+
+// Must be called with history_mutex held
+static struct history_token *allocate_scratch_tokens(size_t count) {
+    if(count > scratch_tokens_capacity) {
+        scratch_tokens_capacity = count;
+        scratch_tokens = realloc(scratch_tokens, count * sizeof(struct history_token));
+    }
+
+    return scratch_tokens;
+}
+
+// Points the sessions that have not been decoded at a newly written and
+// mapped snapshot. Must be called with history_mutex held.
+static void remap_snapshot(const char *path, const struct history_file_session *index, size_t count) {
+    uint8_t *map;
+    size_t length;
+    if(!map_snapshot(path, &map, &length)) return;
+
+    for(size_t i=0; (i<count) && (i<past_sessions.num_sessions); i++){
+        if(past_sources[i].decoded) continue;
+
+        past_sources[i].data = map + index[i].offset;
+        past_sources[i].length = index[i].length;
+    }
+
+    unmap_snapshot();
+    snapshot_map = map;
+    snapshot_map_length = length;
+
+    // The snapshot was written with the ids of the token table, as far as it
+    // went at the time
+    struct history_file_header header;
+    memcpy(&header, map, sizeof(header));
+
+    free(snapshot_token_ids);
+    snapshot_token_ids = NULL;
+    snapshot_num_tokens = header.num_tokens;
+}
+
+// Replaces the journal with an empty one at the given generation. Must be
+// called with history_mutex held.
+static bool reset_journal(uint64_t new_generation) {
+    char *tmp_path = g_strdup_printf("%s.tmp", journal_path);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if(fd < 0) {
+        printf("Creating history journal %s failed: %s\n", tmp_path, strerror(errno));
+        g_free(tmp_path);
+        return false;
+    }
+
+    struct journal_header header = { .reserved = 0, .generation = new_generation };
+    memcpy(header.magic, JOURNAL_MAGIC, 4);
+
+    bool ok = write_all(fd, &header, sizeof(header)) && (fsync(fd) == 0);
+    close(fd);
+
+    if(!ok || (rename(tmp_path, journal_path) != 0)) {
+        printf("Writing history journal %s failed: %s\n", tmp_path, strerror(errno));
+        unlink(tmp_path);
+        g_free(tmp_path);
+        return false;
+    }
+
+    g_free(tmp_path);
+    sync_parent_directory(journal_path);
+
+    if(journal_fd >= 0) close(journal_fd);
+    journal_fd = open(journal_path, O_WRONLY | O_APPEND);
+    journal_size = sizeof(header);
+    journal_dirty = false;
+    generation = new_generation;
+
+    active_session_journaled = false;
+
+    return journal_fd >= 0;
+}
+
+// Copies the journal from offset up to end into fd. Returns false on a read
+// or write error.
+static bool copy_journal_tail(int fd, size_t offset, size_t end) {
+    int source = open(journal_path, O_RDONLY);
+    if(source < 0) return false;
+
+    uint8_t buffer[65536];
+    bool ok = true;
+    while(ok && (offset < end)) {
+        size_t wanted = MIN(sizeof(buffer), end - offset);
+        ssize_t got = pread(source, buffer, wanted, (off_t)offset);
+        if((got < 0) && (errno == EINTR)) continue;
+
+        ok = (got > 0) && write_all(fd, buffer, (size_t)got);
+        if(ok) offset += (size_t)got;
+    }
+
+    close(source);
+    return ok;
+}
+
+// Writes <journal>.tmp at the given generation. If the active session is
+// already part of the snapshot, it is announced again so that the entries
+// that follow continue it. Then the records the current journal got from
+// offset on are copied over, up to its current size. Returns the fd of the
+// new journal, or -1.
+static int write_next_journal(uint64_t new_generation, bool active_session_in_snapshot, int64_t active_timestamp, size_t offset, size_t *copied_until) {
+    char *tmp_path = g_strdup_printf("%s.tmp", journal_path);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    if(fd < 0) {
+        printf("Creating history journal %s failed: %s\n", tmp_path, strerror(errno));
+        g_free(tmp_path);
+        return -1;
+    }
+
+    struct journal_header header = { .reserved = 0, .generation = new_generation };
+    memcpy(header.magic, JOURNAL_MAGIC, 4);
+
+    bool ok = write_all(fd, &header, sizeof(header));
+
+    if(ok && active_session_in_snapshot) {
+        uint8_t body[1 + sizeof(int64_t)];
+        body[0] = (uint8_t)JOURNAL_SESSION_CONTINUE;
+        memcpy(&body[1], &active_timestamp, sizeof(active_timestamp));
+
+        struct journal_record_header record = {
+            .length = sizeof(body),
+            .checksum = checksum(body, sizeof(body))
+        };
+
+        ok = write_all(fd, &record, sizeof(record)) && write_all(fd, body, sizeof(body));
+    }
+
+    g_mutex_lock(&history_mutex);
+    size_t end = journal_size;
+    g_mutex_unlock(&history_mutex);
+
+    ok = ok && copy_journal_tail(fd, offset, end) && (fsync(fd) == 0);
+    if(!ok) {
+        printf("Writing history journal %s failed: %s\n", tmp_path, strerror(errno));
+        close(fd);
+        unlink(tmp_path);
+        g_free(tmp_path);
+        return -1;
+    }
+
+    g_free(tmp_path);
 
-static void read_session_from_file(FILE *f, struct history_session *session) {
+    *copied_until = end;
+    return fd;
+}
+
+// Folds the journal into a new snapshot. The lock is only held to collect
+// what to write and, once it is on disk, to switch to the new snapshot and
+// journal, so committing entries goes on while the snapshot is written.
+// Must be called without history_mutex held.
+static void compact_history(void) {
+    g_mutex_lock(&history_mutex);
+
+    while(compacting) g_cond_wait(&compaction_done, &history_mutex);
+
+    if((snapshot_path == NULL) || snapshot_read_only || (journal_fd < 0)) {
+        g_mutex_unlock(&history_mutex);
+        return;
+    }
+
+    compacting = true;
+
+    uint64_t new_generation = generation + 1;
+    char *tmp_path = g_strdup_printf("%s.tmp", snapshot_path);
+
+    // Everything in the journal up to here ends up in the snapshot
+    size_t count = 0;
+    struct session_ref *refs = collect_sessions(&count);
+    size_t journal_offset = journal_size;
+    bool active_session_in_snapshot = should_write_active_session();
+    int64_t active_timestamp = active_session.timestamp;
+
+    // Otherwise its announcement would be left behind in the old journal, so
+    // it is announced again with the next entry
+    if(!active_session_in_snapshot) active_session_journaled = false;
+
+    // Commits only queue up their words until the index is saved. An index
+    // that is still being rebuilt would be saved incomplete.
+    bool save_index = !index_rebuilding;
+    history_index_freeze(search_index);
+
+    g_mutex_unlock(&history_mutex);
+
+    struct history_file_session *index = calloc(count > 0 ? count : 1, sizeof(struct history_file_session));
+
+    FILE *f = fopen(tmp_path, "w");
+    bool ok = (f != NULL);
+    if(ok) {
+        ok = write_history_file(f, new_generation, refs, count, index);
+        ok = ok && (fflush(f) == 0) && (fsync(fileno(f)) == 0);
+        ok = (fclose(f) == 0) && ok;
+    } else {
+        printf("fopen %s returned NULL\n", tmp_path);
+    }
+
+    free_session_refs(refs, count);
+
+    ok = ok && (rename(tmp_path, snapshot_path) == 0);
+    bool index_saved = false;
+    if(ok) {
+        sync_parent_directory(snapshot_path);
+        if(save_index) index_saved = history_index_save(search_index, index_path, new_generation, (uint32_t)count);
+    } else {
+        printf("Compacting history into %s failed: %s\n", snapshot_path, strerror(errno));
+        unlink(tmp_path);
+    }
+
+    g_free(tmp_path);
+
+    // If we crash before the new journal is in place, the old one has an
+    // older generation than the new snapshot and will be ignored. What was
+    // committed after journal_offset is lost then, which is no more than
+    // what was not synced yet before compaction.
+    size_t copied_until = journal_offset;
+    int new_fd = ok ? write_next_journal(new_generation, active_session_in_snapshot, active_timestamp, journal_offset, &copied_until) : -1;
+
+    g_mutex_lock(&history_mutex);
+
+    // Searched from the file from now on. What was committed meanwhile is
+    // added after, as it is not in there.
+    if(index_saved) history_index_load(search_index, index_path, new_generation, (uint32_t)count);
+    history_index_thaw(search_index);
+
+    if(ok) {
+        // Release the old snapshot, which would otherwise stay on disk for as
+        // long as it is mapped
+        remap_snapshot(snapshot_path, index, count);
+        report_memory_usage();
+    }
+
+    if(new_fd >= 0) {
+        // Records committed since the copy are few, they are brought over
+        // with the lock held so that none can be missed
+        char *journal_tmp_path = g_strdup_printf("%s.tmp", journal_path);
+        bool copied_more = (journal_size > copied_until);
+        bool switched = copy_journal_tail(new_fd, copied_until, journal_size)
+            && (rename(journal_tmp_path, journal_path) == 0);
+
+        if(switched) {
+            journal_size = (size_t)lseek(new_fd, 0, SEEK_END);
+            journal_dirty = copied_more;
+
+            close(journal_fd);
+            journal_fd = new_fd;
+            generation = new_generation;
+
+            if(active_session_in_snapshot) active_session_journaled = true;
+        } else {
+            printf("Writing history journal %s failed: %s\n", journal_tmp_path, strerror(errno));
+            close(new_fd);
+            unlink(journal_tmp_path);
+        }
+
+        g_free(journal_tmp_path);
+    }
+
+    compacting = false;
+    g_cond_broadcast(&compaction_done);
+
+    g_mutex_unlock(&history_mutex);
+
+    if(new_fd >= 0) sync_parent_directory(journal_path);
+
+    free(index);
+}
+
+static void *run_journal_thread(void *userdata) {
+    g_mutex_lock(&history_mutex);
+
+    while(journal_fd >= 0) {
+        g_mutex_unlock(&history_mutex);
+        sleep(JOURNAL_SYNC_INTERVAL_SECONDS);
+        g_mutex_lock(&history_mutex);
+
+        if(journal_fd < 0) break;
+
+        if(journal_size >= JOURNAL_COMPACT_BYTES) {
+            g_mutex_unlock(&history_mutex);
+            compact_history();
+            g_mutex_lock(&history_mutex);
+        } else if(journal_dirty) {
+            // Sync without holding the lock, so committing entries does not
+            // have to wait on the disk
+            int fd = dup(journal_fd);
+            journal_dirty = false;
+
+            g_mutex_unlock(&history_mutex);
+            if(fd >= 0) {
+                fdatasync(fd);
+                close(fd);
+            }
+            g_mutex_lock(&history_mutex);
+        }
+    }
+
+    journal_thread = NULL;
+    g_mutex_unlock(&history_mutex);
+
+    return NULL;
+}
+
+
+// Reads the tokens of a journal entry record into entry. Returns false if
+// they do not fill the record exactly.
+static bool read_journal_tokens(const uint8_t *data, size_t length, struct history_entry *entry) {
+    // Every token takes at least 3 bytes
+    if(entry->tokens_count > length / 3) return false;
+
+    if(entry->tokens_count == 0) return length == 0;
+
+    entry->tokens = allocate_tokens(entry->tokens_count);
+
+    const uint8_t *p = data;
+    const uint8_t *end = data + length;
+    for(size_t i=0; i<entry->tokens_count; i++){
+        uint32_t text_length;
+        if(!read_varint(&p, end, &text_length)) return false;
+        if((size_t)(end - p) < (size_t)text_length + 2) return false;
+
+        set_token(&entry->tokens[i], (const char *)p, text_length, 0.0f, 0);
+        p += text_length;
+        entry->tokens[i].logprob = *p++;
+        entry->tokens[i].flags = *p++;
+    }
+
+    return p == end;
+}
+
+// Applies the records of the journal on top of the loaded snapshot. Stops at
+// the first torn or corrupted record and cuts the journal off there. Returns
+// false if the journal does not belong to the snapshot. Must be called with
+// history_mutex held.
+static bool replay_journal(int fd) {
+    struct journal_header header;
+    if((read(fd, &header, sizeof(header)) != sizeof(header))
+        || (memcmp(header.magic, JOURNAL_MAGIC, 4) != 0)
+        || (header.generation != generation)) {
+        printf("History journal %s does not belong to %s, ignoring it\n", journal_path, snapshot_path);
+        return false;
+    }
+
+    size_t offset = sizeof(header);
+    struct history_session *session = NULL;
+    size_t session_capacity = 0;
+    size_t num_records = 0;
+
+    uint8_t *body = NULL;
+    for(;;) {
+        struct journal_record_header record;
+        if(read(fd, &record, sizeof(record)) != sizeof(record)) break;
+        if((record.length == 0) || (record.length > JOURNAL_MAX_RECORD_BYTES)) break;
+
+        body = realloc(body, record.length);
+        if(read(fd, body, record.length) != (ssize_t)record.length) break;
+        if(checksum(body, record.length) != record.checksum) break;
+
+        const uint8_t *payload = &body[1];
+        size_t payload_length = record.length - 1;
+
+        bool is_continue = (body[0] == JOURNAL_SESSION_CONTINUE) && (num_records == 0);
+        if(((body[0] == JOURNAL_SESSION_START) || is_continue) && (payload_length == sizeof(int64_t))) {
+            int64_t timestamp;
+            memcpy(&timestamp, payload, sizeof(timestamp));
+
+            session = NULL;
+            if(is_continue && (past_sessions.num_sessions > 0)) {
+                size_t last = past_sessions.num_sessions - 1;
+                if(past_sessions.sessions[last].timestamp == (time_t)timestamp) {
+                    decode_past_session(last);
+                    session = &past_sessions.sessions[last];
+                }
+            }
+
+            if(session == NULL) session = append_past_session((time_t)timestamp);
+            session_capacity = session->entries_count;
+        } else if((body[0] == JOURNAL_ENTRY) && (session != NULL) && (payload_length >= sizeof(int64_t) + sizeof(uint32_t))) {
+            int64_t timestamp;
+            uint32_t tokens_count;
+            memcpy(&timestamp, payload, sizeof(timestamp));
+            memcpy(&tokens_count, payload + sizeof(timestamp), sizeof(tokens_count));
+
+            struct history_entry entry = {
+                .timestamp = (time_t)timestamp,
+                .tokens_count = tokens_count,
+                .tokens = NULL
+            };
+
+            const uint8_t *tokens = payload + sizeof(timestamp) + sizeof(tokens_count);
+            size_t tokens_length = payload_length - sizeof(timestamp) - sizeof(tokens_count);
+            if(!read_journal_tokens(tokens, tokens_length, &entry)) {
+                release_tokens(entry.tokens, entry.tokens_count);
+                break;
+            }
+
+            reserve_entry(session, &session_capacity);
+            session->entries[session->entries_count++] = entry;
+
+            history_index_add_entry(search_index, (uint32_t)(session - past_sessions.sessions), (uint32_t)(session->entries_count - 1), entry.timestamp, entry.tokens, entry.tokens_count);
+        } else {
+            break;
+        }
+
+        offset += sizeof(record) + record.length;
+        num_records++;
+    }
+
+    free(body);
+
+    // Drop the torn tail so that new records are not appended after garbage
+    struct stat st;
+    if((fstat(fd, &st) == 0) && ((size_t)st.st_size > offset)) {
+        printf("History journal %s has a damaged tail, discarding %zu bytes\n", journal_path, (size_t)st.st_size - offset);
+        if(ftruncate(fd, offset) != 0)
+            printf("ftruncate %s failed: %s\n", journal_path, strerror(errno));
+    }
+
+    journal_size = offset;
+
+    printf("Replayed %zu records from history journal\n", num_records);
+
+    return true;
+}
+
+static void read_legacy_session_from_file(FILE *f, struct history_session *session) {
     fread(&session->timestamp, sizeof(session->timestamp), 1, f);
     fread(&session->entries_count, sizeof(session->entries_count), 1, f);
 
-    session->entries = calloc(
-        session->entries_count,
-        sizeof(struct history_entry)
-    );
+    session->entries = allocate_entries(session->entries_count);
 
     for(size_t i=0; i<session->entries_count; i++){
         struct history_entry *entry = &session->entries[i];
@@ -150,80 +1357,574 @@ static void read_session_from_file(FILE *f, struct history_session *session) {
             continue;
         }
 
-        entry->tokens = calloc(
-            entry->tokens_count,
-            sizeof(struct history_token)
-        );
+        entry->tokens = allocate_tokens(entry->tokens_count);
 
         for(size_t j=0; j<entry->tokens_count; j++){
-            struct history_token *token = &entry->tokens[j];
-            fread(token, sizeof(struct history_token), 1, f);
+            struct legacy_history_token legacy = { 0 };
+            fread(&legacy, sizeof(legacy), 1, f);
+            set_token_from_legacy(&entry->tokens[j], &legacy);
         }
     }
 }
 
-void load_history_from(const char *path){
+// Loads a snapshot in the original fwrite layout. Must be called with
+// history_mutex held.
+static void load_legacy_snapshot(const char *path) {
     FILE *f = fopen(path, "r");
-
     if(f == NULL) {
         printf("fopen %s returned NULL\n", path);
         return;
     }
 
+    // There was no journal yet
+    generation = 0;
+
     size_t num_sessions_in_file = 0;
     fread(&num_sessions_in_file, sizeof(num_sessions_in_file), 1, f);
 
-    past_sessions.num_sessions = num_sessions_in_file;
-    past_sessions.sessions = calloc(past_sessions.num_sessions, sizeof(struct history_session));
-    
     for(size_t i=0; i<num_sessions_in_file; i++){
-        read_session_from_file(f, &past_sessions.sessions[i]);
+        struct history_session *session = append_past_session(0);
+        read_legacy_session_from_file(f, session);
     }
 
     fclose(f);
 }
 
+// Rewrites a snapshot of an older version, which has been loaded and
+// decoded completely, in the current format. The original is kept as
+// <path>.v<version>. Must be called with history_mutex held.
+static void migrate_snapshot(const char *path, uint32_t old_version) {
+    printf("Migrating %zu history sessions in %s from version %u to %d\n", past_sessions.num_sessions, path, old_version, HISTORY_FILE_VERSION);
 
-static void export_session_into_text(FILE *f, const struct history_session *session) {
-    char time_buff[512];
+    // Nothing refers to the old file anymore
+    unmap_snapshot();
+    free(snapshot_token_ids);
+    snapshot_token_ids = NULL;
 
-    struct tm *tm = localtime(&session->timestamp);
-    strftime(time_buff, 512, "%F | %H:%M", tm);
+    char *tmp_path = g_strdup_printf("%s.tmp", path);
+    char *backup_path = g_strdup_printf("%s.v%u", path, old_version);
 
-    fprintf(f, "    -[ %s ]-    ", time_buff);
+    FILE *f = fopen(tmp_path, "w");
+    if(f == NULL) {
+        printf("fopen %s returned NULL\n", tmp_path);
+        g_free(tmp_path);
+        g_free(backup_path);
+        return;
+    }
 
-    for(size_t i=0; i<session->entries_count; i++){
-        struct history_entry *entry = &session->entries[i];
+    // The same generation keeps an existing journal valid
+    size_t count = 0;
+    bool ok = write_current_history_file(f, generation, NULL, &count);
+    ok = ok && (fflush(f) == 0) && (fsync(fileno(f)) == 0);
+    ok = (fclose(f) == 0) && ok;
 
-        tm = localtime_r(&entry->timestamp, tm);
-        strftime(time_buff, 512, "%T", tm);
+    if(ok) {
+        unlink(backup_path);
+        if(link(path, backup_path) != 0)
+            printf("Could not keep a copy of the old history at %s: %s\n", backup_path, strerror(errno));
 
-        fprintf(f, "\n(%s) - ", time_buff);
+        ok = rename(tmp_path, path) == 0;
+    }
 
-        for(size_t j=0; j<entry->tokens_count; j++){
-            fprintf(f, "%s", entry->tokens[j].token);
+    if(ok) {
+        sync_parent_directory(path);
+    } else {
+        printf("Migrating %s failed: %s\n", path, strerror(errno));
+        unlink(tmp_path);
+    }
+
+    g_free(tmp_path);
+    g_free(backup_path);
+}
+
+// Interns the token table of a mapped snapshot. Returns false if it is
+// damaged. Must be called with history_mutex held.
+static bool load_token_table(const uint8_t *map, size_t length, const struct history_file_header *header) {
+    if(header->tokens_offset > length) return false;
+    if(header->num_tokens > (length - header->tokens_offset)) return false;
+
+    const uint8_t *p = map + header->tokens_offset;
+    const uint8_t *end = map + length;
+
+    uint32_t *ids = malloc((header->num_tokens > 0 ? header->num_tokens : 1) * sizeof(uint32_t));
+    bool identity = true;
+
+    for(size_t i=0; i<header->num_tokens; i++){
+        uint32_t text_length;
+        if(!read_varint(&p, end, &text_length) || ((size_t)(end - p) < text_length)) {
+            free(ids);
+            return false;
+        }
+
+        ids[i] = token_table_intern_len((const char *)p, text_length);
+        identity = identity && (ids[i] == i);
+
+        p += text_length;
+    }
+
+    free(snapshot_token_ids);
+    snapshot_token_ids = identity ? NULL : ids;
+    snapshot_num_tokens = header->num_tokens;
+    if(identity) free(ids);
+
+    return true;
+}
+
+// Maps a snapshot and reads its session index and token table. Returns the
+// version of the file, or 0 if it is in the original fwrite layout. Must be
+// called with history_mutex held.
+static uint32_t load_snapshot(const char *path) {
+    uint8_t *map;
+    size_t length;
+    if(!map_snapshot(path, &map, &length)) return 0;
+
+    struct history_file_header header;
+    if((length < sizeof(header)) || (memcmp(map, HISTORY_FILE_MAGIC, 8) != 0)) {
+        munmap(map, length);
+        return 0;
+    }
+
+    memcpy(&header, map, sizeof(header));
+
+    if(header.version > HISTORY_FILE_VERSION) {
+        printf("%s was written by a newer version (format %u), history will not be loaded or saved\n", path, header.version);
+        snapshot_read_only = true;
+        munmap(map, length);
+        return header.version;
+    }
+
+    bool damaged = (header.version != HISTORY_FILE_VERSION);
+
+    size_t index_size = (size_t)header.num_sessions * sizeof(struct history_file_session);
+    if((header.index_offset > length) || (index_size > (length - header.index_offset))) damaged = true;
+
+    if(!damaged) damaged = !load_token_table(map, length, &header);
+
+    if(damaged) {
+        printf("%s is damaged, history will not be saved\n", path);
+        snapshot_read_only = true;
+        munmap(map, length);
+
+        // Not in the original layout either
+        return HISTORY_FILE_VERSION;
+    }
+
+    unmap_snapshot();
+    snapshot_map = map;
+    snapshot_map_length = length;
+    generation = header.generation;
+
+    const uint8_t *index = map + header.index_offset;
+    for(size_t i=0; i<header.num_sessions; i++){
+        struct history_file_session file_session;
+        memcpy(&file_session, index + i * sizeof(file_session), sizeof(file_session));
+
+        if((file_session.offset > length) || (file_session.length > (length - file_session.offset))) {
+            printf("Skipping history session %zu, it lies outside of %s\n", i, path);
+            continue;
         }
+
+        struct history_session *session = append_past_session((time_t)file_session.timestamp);
+        session->entries_count = file_session.entries_count;
+
+        struct session_source *source = &past_sources[past_sessions.num_sessions - 1];
+        source->data = map + file_session.offset;
+        source->length = file_session.length;
+        source->decoded = false;
     }
 
-    fprintf(f, "\n\n");
+    return header.version;
 }
 
-void export_history_as_text(const char *path) {
-    // TODO: Apply current settings for filtering, capitalization, etc
-    
+// Opens the journal next to path, replaying what it holds, and starts the
+// thread that syncs and compacts it. Must be called with history_mutex held.
+static void open_journal(const char *path) {
+    g_free(snapshot_path);
+    g_free(journal_path);
+    snapshot_path = g_strdup(path);
+    journal_path = g_strdup_printf("%s.journal", path);
+
+    if(journal_fd >= 0) close(journal_fd);
+    journal_fd = -1;
+    active_session_journaled = false;
+
+    if(snapshot_read_only) return;
+
+    bool valid = false;
+
+    int fd = open(journal_path, O_RDWR);
+    if(fd >= 0) {
+        valid = replay_journal(fd);
+        close(fd);
+    }
+
+    // The new active session gets announced with its first entry, so the
+    // replayed records can simply be appended to
+    if(valid) {
+        journal_fd = open(journal_path, O_WRONLY | O_APPEND);
+        journal_dirty = false;
+    } else {
+        reset_journal(generation);
+    }
+
+    if(journal_fd < 0) {
+        printf("History journal is unavailable, history will only be saved on exit\n");
+        return;
+    }
+
+    if(journal_thread == NULL)
+        journal_thread = g_thread_new("lcap-history", run_journal_thread, NULL);
+}
+
+
+
+void save_history_session(const char *path, const struct history_session *session){
     FILE *f = fopen(path, "w");
-    g_assert(f != NULL);
+    if(f == NULL) {
+        printf("fopen %s returned NULL\n", path);
+        return;
+    }
 
-    for(size_t i=0; i<past_sessions.num_sessions; i++){
-        if(past_sessions.sessions[i].entries_count == 0) continue;
+    struct session_ref ref = { .session = *session, .data = NULL, .length = 0, .owns_entries = false };
+    if(!write_history_file(f, 0, &ref, 1, NULL))
+        printf("Writing %s failed\n", path);
+
+    fclose(f);
+}
+
+void save_current_history(const char *path){
+    g_mutex_lock(&history_mutex);
+
+    bool is_snapshot = (snapshot_path != NULL) && (strcmp(path, snapshot_path) == 0);
+
+    if(is_snapshot && snapshot_read_only) {
+        g_mutex_unlock(&history_mutex);
+        return;
+    }
 
-        export_session_into_text(f, &past_sessions.sessions[i]);
+    if(is_snapshot && (journal_fd >= 0)) {
+        // Everything is already in the journal, it only needs to reach the disk
+        if(journal_dirty) fdatasync(journal_fd);
+        journal_dirty = false;
+
+        g_mutex_unlock(&history_mutex);
+        return;
+    }
+
+    FILE *f = fopen(path, "w");
+    if(f == NULL) {
+        printf("fopen %s returned NULL\n", path);
+        g_mutex_unlock(&history_mutex);
+        return;
     }
 
-    if(active_session.entries_count > 0)
-        export_session_into_text(f, &active_session);
+    size_t count = 0;
+    write_current_history_file(f, generation, NULL, &count);
 
     fclose(f);
+
+    g_mutex_unlock(&history_mutex);
+}
+
+// Where a rebuild of the index is. It covers the sessions that were in the
+// snapshot when it started, as far as they went then; the journal can add
+// entries to the last one, and those are indexed as they are replayed.
+struct index_rebuild {
+    unsigned int epoch;
+    size_t num_sessions;
+    size_t last_entries;
+
+    history_index rebuilt;
+
+    size_t session;
+    size_t entry;
+    size_t offset; // into the session's source, while it is not decoded
+};
+
+// Adds up to HISTORY_FOREACH_CHUNK entries to rebuild->rebuilt and moves
+// along. Returns true once every session is done. Must be called with
+// history_mutex held.
+static bool rebuild_index_chunk(struct index_rebuild *rebuild) {
+    size_t budget = HISTORY_FOREACH_CHUNK;
+
+    while((budget > 0) && (rebuild->session < rebuild->num_sessions)) {
+        const struct history_session *session = &past_sessions.sessions[rebuild->session];
+        const struct session_source *source = &past_sources[rebuild->session];
+
+        size_t count = session->entries_count;
+        if((rebuild->session == rebuild->num_sessions - 1) && (count > rebuild->last_entries)) count = rebuild->last_entries;
+
+        if(rebuild->entry >= count) {
+            rebuild->session++;
+            rebuild->entry = 0;
+            rebuild->offset = 0;
+            continue;
+        }
+
+        // Compacting copies an undecoded session as it is, so the offset
+        // stays good even if it moved to a new snapshot. If it was decoded
+        // meanwhile, its entries are taken from memory.
+        struct history_entry scratch;
+        const struct history_entry *entry = &scratch;
+        if(source->decoded) {
+            entry = &session->entries[rebuild->entry];
+        } else {
+            const uint8_t *p = source->data + rebuild->offset;
+            if((rebuild->offset > source->length) || !read_source_entry(&p, source->data + source->length, &scratch, allocate_scratch_tokens)) {
+                rebuild->entry = count;
+                continue;
+            }
+
+            rebuild->offset = (size_t)(p - source->data);
+        }
+
+        history_index_add_entry(rebuild->rebuilt, (uint32_t)rebuild->session, (uint32_t)rebuild->entry, entry->timestamp, entry->tokens, entry->tokens_count);
+
+        rebuild->entry++;
+        budget--;
+    }
+
+    return rebuild->session >= rebuild->num_sessions;
+}
+
+// Indexes the sessions of the snapshot a chunk at a time, so committing
+// and searching go on meanwhile, then saves the index by compacting
+static void *run_index_thread(void *userdata) {
+    struct index_rebuild *rebuild = userdata;
+
+    bool done = false;
+    bool current = true;
+    while(current && !done) {
+        g_mutex_lock(&history_mutex);
+
+        current = (rebuild->epoch == index_epoch);
+        if(current) done = rebuild_index_chunk(rebuild);
+
+        // The index is frozen while compacting
+        if(current && done) {
+            while(compacting) g_cond_wait(&compaction_done, &history_mutex);
+
+            current = (rebuild->epoch == index_epoch);
+            if(current) {
+                history_index_prepend(search_index, rebuild->rebuilt);
+                index_rebuilding = false;
+            }
+        }
+
+        g_mutex_unlock(&history_mutex);
+    }
+
+    history_index_free(rebuild->rebuilt);
+    free(rebuild);
+
+    if(current) {
+        printf("History index rebuilt\n");
+        compact_history();
+    }
+
+    return NULL;
+}
+
+// Must be called with history_mutex held, before the journal is replayed
+static void start_index_rebuild(void) {
+    struct index_rebuild *rebuild = calloc(1, sizeof(struct index_rebuild));
+    rebuild->epoch = index_epoch;
+    rebuild->num_sessions = past_sessions.num_sessions;
+    rebuild->last_entries = past_sessions.sessions[past_sessions.num_sessions - 1].entries_count;
+    rebuild->rebuilt = history_index_new();
+
+    index_rebuilding = true;
+    g_thread_unref(g_thread_new("lcap-index", run_index_thread, rebuild));
+}
+
+void load_history_from(const char *path){
+    g_mutex_lock(&history_mutex);
+
+    while(compacting) g_cond_wait(&compaction_done, &history_mutex);
+
+    generation = 0;
+    snapshot_read_only = false;
+
+    index_epoch++;
+    index_rebuilding = false;
+
+    if(access(path, F_OK) != 0) {
+        printf("%s does not exist yet\n", path);
+    } else {
+        uint32_t version = load_snapshot(path);
+
+        if(version == 0) {
+            load_legacy_snapshot(path);
+            migrate_snapshot(path, version);
+        }
+    }
+
+    // The index of the snapshot, the journal is indexed as it is replayed
+    g_free(index_path);
+    index_path = g_strdup_printf("%s.index", path);
+
+    history_index_clear(search_index);
+    if((past_sessions.num_sessions > 0) && !history_index_load(search_index, index_path, generation, (uint32_t)past_sessions.num_sessions))
+        start_index_rebuild();
+
+    open_journal(path);
+
+    report_memory_usage();
+
+    g_mutex_unlock(&history_mutex);
+}
+
+
+// A past session that has not been decoded, walked from its source a chunk
+// at a time so that neither all of it is decoded at once nor the lock is
+// held for long
+struct session_copy {
+    struct history_session session; // entries cover the whole session
+    size_t entries_capacity;
+
+    struct history_token *tokens; // of the current chunk only
+    size_t tokens_capacity;
+
+    // Where entry next_entry starts in the source, if offset_valid
+    size_t next_entry;
+    size_t offset;
+    bool offset_valid;
+};
+
+// Decodes up to count entries of past session i, starting at first, into
+// copy. Returns how many it decoded, fewer if the source ends early. Must be
+// called with history_mutex held.
+static size_t decode_session_chunk(size_t i, size_t first, size_t count, struct session_copy *copy) {
+    const struct history_session *session = &past_sessions.sessions[i];
+    const struct session_source *source = &past_sources[i];
+
+    copy->session.timestamp = session->timestamp;
+    copy->session.entries_count = session->entries_count;
+    if(copy->entries_capacity < session->entries_count) {
+        copy->entries_capacity = session->entries_count;
+        copy->session.entries = realloc(copy->session.entries, copy->entries_capacity * sizeof(struct history_entry));
+    }
+
+    const uint8_t *end = source->data + source->length;
+
+    // Compacting copies an undecoded session as it is, so the offset stays
+    // good. It only has to be found again if the walk went on in memory.
+    if(!copy->offset_valid || (copy->next_entry != first) || (copy->offset > source->length)) {
+        copy->offset = 0;
+        const uint8_t *p = source->data;
+        struct history_entry skipped;
+        for(size_t j=0; j<first; j++) {
+            if(!read_source_entry(&p, end, &skipped, allocate_scratch_tokens)) return 0;
+        }
+        copy->offset = (size_t)(p - source->data);
+    }
+
+    const uint8_t *p = source->data + copy->offset;
+    size_t tokens_count = 0;
+    size_t decoded = 0;
+    for(; decoded < count; decoded++){
+        struct history_entry entry;
+        if(!read_source_entry(&p, end, &entry, allocate_scratch_tokens)) break;
+
+        if(tokens_count + entry.tokens_count > copy->tokens_capacity) {
+            copy->tokens_capacity = MAX(copy->tokens_capacity * 2, tokens_count + entry.tokens_count);
+            copy->tokens = realloc(copy->tokens, copy->tokens_capacity * sizeof(struct history_token));
+        }
+
+        if(entry.tokens_count > 0)
+            memcpy(&copy->tokens[tokens_count], entry.tokens, entry.tokens_count * sizeof(struct history_token));
+
+        // Pointed at the tokens once they are done moving
+        entry.tokens = (struct history_token *)(uintptr_t)tokens_count;
+        tokens_count += entry.tokens_count;
+
+        copy->session.entries[first + decoded] = entry;
+    }
+
+    for(size_t j=first; j<first + decoded; j++)
+        copy->session.entries[j].tokens = copy->tokens + (uintptr_t)copy->session.entries[j].tokens;
+
+    copy->offset = (size_t)(p - source->data);
+    copy->next_entry = first + decoded;
+    copy->offset_valid = true;
+
+    return decoded;
+}
+
+void history_foreach_entries(history_entries_cb cb, void *userdata) {
+    size_t session_num = 0;
+    size_t first = 0;
+
+    // Sessions that were not decoded are walked from a copy, so that an
+    // export does not leave all of history decoded
+    struct session_copy copy = { 0 };
+
+    for(;;) {
+        g_mutex_lock(&history_mutex);
+
+        // The active session comes after the past ones. Erasing history in
+        // between ends the walk.
+        size_t num_sessions = past_sessions.num_sessions + 1;
+        const struct history_session *session = NULL;
+        size_t count = 0;
+        if(session_num < past_sessions.num_sessions) {
+            session = &past_sessions.sessions[session_num];
+            count = (first < session->entries_count) ? MIN(session->entries_count - first, HISTORY_FOREACH_CHUNK) : 0;
+
+            if((count > 0) && !past_sources[session_num].decoded) {
+                count = decode_session_chunk(session_num, first, count, &copy);
+                session = &copy.session;
+
+                // The rest of the session could not be read
+                if(count == 0) first = session->entries_count;
+            } else {
+                copy.offset_valid = false;
+            }
+        } else if(session_num == past_sessions.num_sessions) {
+            session = &active_session;
+            count = (first < session->entries_count) ? MIN(session->entries_count - first, HISTORY_FOREACH_CHUNK) : 0;
+        }
+
+        bool keep_going = (session != NULL);
+        if(keep_going && (count > 0)) {
+            keep_going = cb(session, session_num, num_sessions, first, count, userdata);
+            first += count;
+        } else if(keep_going && (first >= session->entries_count)) {
+            session_num++;
+            first = 0;
+            copy.offset_valid = false;
+        }
+
+        g_mutex_unlock(&history_mutex);
+
+        if(!keep_going) break;
+    }
+
+    free(copy.session.entries);
+    free(copy.tokens);
+}
+
+size_t history_search(const char *query, struct history_search_hit *hits, size_t max_hits) {
+    struct history_index_posting *postings = calloc(max_hits > 0 ? max_hits : 1, sizeof(struct history_index_posting));
+
+    g_mutex_lock(&history_mutex);
+
+    size_t found = 0;
+    if(search_index != NULL) found = history_index_search(search_index, query, postings, max_hits);
+
+    size_t count = (found < max_hits) ? found : max_hits;
+    for(size_t i=0; i<count; i++){
+        // The active session comes right after the past ones
+        hits[i].session_idx = past_sessions.num_sessions - postings[i].session;
+        hits[i].entry = postings[i].entry;
+        hits[i].timestamp = (time_t)postings[i].timestamp;
+    }
+
+    g_mutex_unlock(&history_mutex);
+
+    free(postings);
+
+    return found;
 }
 
 const struct history_session *get_history_session(size_t idx) {
@@ -232,18 +1933,61 @@ const struct history_session *get_history_session(size_t idx) {
     ssize_t i = ((ssize_t)past_sessions.num_sessions - (ssize_t)idx);
     if(i < 0) return NULL;
 
+    // Sessions are only decoded once they are asked for
+    g_mutex_lock(&history_mutex);
+    decode_past_session((size_t)i);
+    g_mutex_unlock(&history_mutex);
+
     return &past_sessions.sessions[i];
 }
 
+bool history_with_session(size_t idx, history_session_cb cb, void *userdata) {
+    g_mutex_lock(&history_mutex);
+
+    const struct history_session *session = NULL;
+    if(idx == 0) {
+        session = &active_session;
+    } else if(idx <= past_sessions.num_sessions) {
+        size_t i = past_sessions.num_sessions - idx;
+        decode_past_session(i);
+        session = &past_sessions.sessions[i];
+    }
+
+    if(session != NULL) cb(session, userdata);
+
+    g_mutex_unlock(&history_mutex);
+
+    return session != NULL;
+}
+
+
 
 void erase_all_history(void){
+    g_mutex_lock(&history_mutex);
+
+    while(compacting) g_cond_wait(&compaction_done, &history_mutex);
+
     for(size_t i=0; i<past_sessions.num_sessions; i++){
         free(past_sessions.sessions[i].entries);
     }
     free(past_sessions.sessions);
+    free(past_sources);
+    past_sources = NULL;
+
+    unmap_snapshot();
+    free(snapshot_token_ids);
+    snapshot_token_ids = NULL;
 
     free(active_session.entries);
+    active_entries_capacity = 0;
+    entries_bytes = 0;
+
+    // Every token of every session is in the blocks
+    free_token_blocks();
 
+    history_index_clear(search_index);
+    index_epoch++;
+    index_rebuilding = false;
 
     active_session.timestamp = time(NULL);
     active_session.entries_count = 0;
@@ -252,5 +1996,14 @@ void erase_all_history(void){
     past_sessions.num_sessions = 0;
     past_sessions.sessions = NULL;
 
-    save_current_history(default_history_file);
-}
\ No newline at end of file
+    if(journal_fd >= 0) {
+        // Writes an empty snapshot and starts over with an empty journal
+        g_mutex_unlock(&history_mutex);
+        compact_history();
+    } else {
+        if(index_path != NULL) unlink(index_path);
+
+        g_mutex_unlock(&history_mutex);
+        save_current_history(default_history_file);
+    }
+}
@@ -19,25 +19,36 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
 #include <april_api.h>
 #include <adwaita.h>
+#include "token-table.h"
 
-#define HISTORY_TOKEN_MAX_CHARS 32
 #define HISTORY_MAX_TOKENS 256
 
 extern char *default_history_file;
 
 
-// A single token. The token text is inline for serialization simplicity
+// A single token. The text is interned in the token table and the logprob
+// is quantized to a byte, use the functions below to read them.
 struct history_token {
-    char token[HISTORY_TOKEN_MAX_CHARS]; // should this be a dynamic array?
-    float logprob;
-    AprilTokenFlagBits flags;
+    uint32_t id;
+    uint8_t logprob;
+    uint8_t flags; // AprilTokenFlagBits
 };
 
+// Fills in a history token from a token of an april result
+void history_token_set(struct history_token *token, const AprilToken *april_token);
+
+// Returns the text of the token, valid for the lifetime of the process
+const char *history_token_text(const struct history_token *token);
+
+// Returns the logprob, to within 1/8
+float history_token_logprob(const struct history_token *token);
+
 // A single history entry containing a collection of tokens
 // An entry consisting of 0 tokens denotes silence
 struct history_entry {
@@ -73,11 +84,74 @@ void commit_tokens_to_current_history(const AprilToken *tokens,
 void save_silence_to_history(void);
 
 // Serialize/Deserialize list of history_entry
+//
+// load_history_from also replays <path>.journal and from then on appends
+// every committed entry to it, syncing and compacting it into path in the
+// background. save_current_history on that same path then only has to make
+// sure the journal has reached the disk.
+//
+// Only the session index of path is read when loading, the entries of a past
+// session are decoded the first time get_history_session returns it. Files in
+// the original format are converted once, keeping the old file as <path>.v0.
 void save_current_history(const char *path);
 void load_history_from(const char *path);
 
-// Convert to text file
-void export_history_as_text(const char *path);
+// Writes a file in the same format containing only the given session
+void save_history_session(const char *path, const struct history_session *session);
+
+struct history_memory_stats {
+    size_t sessions;
+    size_t undecoded_sessions;
+
+    // Entries and tokens held in memory, and the bytes allocated for them.
+    // Both are allocated ahead in bulk, so the bytes should grow in steps
+    // and stay flat in between.
+    size_t entries;
+    size_t entries_bytes;
+    size_t tokens;
+    size_t token_blocks;
+    size_t token_blocks_bytes;
+
+    // Distinct token texts
+    size_t interned_tokens;
+
+    // Size of the mapped history file
+    size_t mapped_bytes;
+};
+
+void history_get_memory_stats(struct history_memory_stats *stats);
+
+// Called with a run of count consecutive entries of a session, starting at
+// first_entry. Sessions are numbered from the oldest, the active session is
+// num_sessions - 1. History is locked during the call, so the entries must
+// not be kept after it returns. Returning false stops the walk.
+typedef bool (*history_entries_cb)(const struct history_session *session,
+                                   size_t session_num,
+                                   size_t num_sessions,
+                                   size_t first_entry,
+                                   size_t count,
+                                   void *userdata);
+
+#define HISTORY_FOREACH_CHUNK 256
+
+// Walks every entry of history, the oldest first, at most
+// HISTORY_FOREACH_CHUNK entries per call so that committing new entries is
+// never held up for long. Can be called from any thread.
+void history_foreach_entries(history_entries_cb cb, void *userdata);
+
+
+struct history_search_hit {
+    size_t session_idx; // as passed to get_history_session
+    size_t entry;
+    time_t timestamp;
+};
+
+// Finds the entries that contain every word of query, ignoring case and
+// punctuation, using an index kept up to date as entries are committed.
+// Up to max_hits are written to hits, the newest first. Returns the number
+// of entries found, which may be more than max_hits. While the index is
+// rebuilt after it went missing, older sessions are not found yet.
+size_t history_search(const char *query, struct history_search_hit *hits, size_t max_hits);
 
 
 // 0 returns the active session
@@ -85,7 +159,18 @@ void export_history_as_text(const char *path);
 // 2 returns the one prior to the previous
 // ...
 // returns NULL once reached the first session
+// Past sessions are decoded on first access
+// The entries of the active session move as it grows, so only read them
+// through history_with_session.
 const struct history_session *get_history_session(size_t idx);
 
+typedef void (*history_session_cb)(const struct history_session *session, void *userdata);
+
+// Calls cb with the session get_history_session would return for idx, with
+// history locked so that entries can be read even from the active session.
+// Nothing of the session may be kept after cb returns. Returns false without
+// calling cb if there is no such session.
+bool history_with_session(size_t idx, history_session_cb cb, void *userdata);
+
 
 void erase_all_history(void);
\ No newline at end of file
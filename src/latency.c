@@ -0,0 +1,128 @@
+/* latency.c
+ * Implements latency_histogram
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "latency.h"
+
+#include <stddef.h>
+
+static const char *stage_names[LATENCY_NUM_STAGES] = {
+    "capture-to-feed",
+    "feed-to-result",
+    "result-to-paint",
+};
+
+const char *latency_stage_name(LatencyStage stage) {
+    if((stage < 0) || (stage >= LATENCY_NUM_STAGES)) return "unknown";
+    return stage_names[stage];
+}
+
+// Values below 2 * LATENCY_SUB_BUCKETS get a bucket each. Above that, the
+// top LATENCY_SUB_BUCKET_BITS + 1 bits pick the bucket within each power of two.
+static size_t bucket_index(uint64_t value) {
+    int shift = 0;
+    if(value >= (2 * LATENCY_SUB_BUCKETS)) {
+        int msb = 63 - __builtin_clzll(value);
+        shift = msb - LATENCY_SUB_BUCKET_BITS;
+    }
+
+    return ((size_t)shift * LATENCY_SUB_BUCKETS) + (size_t)(value >> shift);
+}
+
+// The largest value that ends up in the bucket
+static uint64_t bucket_upper(size_t index) {
+    if(index < (2 * LATENCY_SUB_BUCKETS)) return index;
+
+    int shift = (int)(index / LATENCY_SUB_BUCKETS) - 1;
+    uint64_t sub = index - ((size_t)shift * LATENCY_SUB_BUCKETS);
+
+    return ((sub + 1) << shift) - 1;
+}
+
+void latency_histogram_reset(struct latency_histogram *hist) {
+    for(size_t i=0; i<LATENCY_NUM_BUCKETS; i++)
+        atomic_store_explicit(&hist->buckets[i], 0, memory_order_relaxed);
+
+    atomic_store_explicit(&hist->count, 0, memory_order_relaxed);
+    atomic_store_explicit(&hist->sum_us, 0, memory_order_relaxed);
+    atomic_store_explicit(&hist->max_us, 0, memory_order_relaxed);
+}
+
+void latency_histogram_record(struct latency_histogram *hist, int64_t elapsed_us) {
+    // The monotonic clock never goes back, but stamps from different
+    // threads can be taken in either order around the same moment
+    uint64_t value = (elapsed_us > 0) ? (uint64_t)elapsed_us : 0;
+    if(value >= (UINT64_C(1) << LATENCY_MAX_BITS)) value = (UINT64_C(1) << LATENCY_MAX_BITS) - 1;
+
+    atomic_fetch_add_explicit(&hist->buckets[bucket_index(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->sum_us, value, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->count, 1, memory_order_relaxed);
+
+    uint64_t max = atomic_load_explicit(&hist->max_us, memory_order_relaxed);
+    while((value > max) && !atomic_compare_exchange_weak_explicit(&hist->max_us, &max, value,
+                                                                  memory_order_relaxed, memory_order_relaxed));
+}
+
+void latency_histogram_summarize(struct latency_histogram *hist, struct latency_summary *summary) {
+    uint64_t counts[LATENCY_NUM_BUCKETS];
+    uint64_t total = 0;
+
+    // Count from the buckets themselves so the percentiles are consistent
+    // even if records come in while we are reading
+    for(size_t i=0; i<LATENCY_NUM_BUCKETS; i++) {
+        counts[i] = atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+        total += counts[i];
+    }
+
+    summary->count = total;
+    summary->mean_ms = 0.0;
+    summary->p50_ms = 0.0;
+    summary->p90_ms = 0.0;
+    summary->p99_ms = 0.0;
+    summary->max_ms = (double)atomic_load_explicit(&hist->max_us, memory_order_relaxed) / 1000.0;
+
+    if(total == 0) return;
+
+    uint64_t sum_count = atomic_load_explicit(&hist->count, memory_order_relaxed);
+    uint64_t sum = atomic_load_explicit(&hist->sum_us, memory_order_relaxed);
+    if(sum_count > 0) summary->mean_ms = ((double)sum / (double)sum_count) / 1000.0;
+
+    // Each percentile is the first bucket at which the running count reaches it
+    const struct {
+        double fraction;
+        double *out;
+    } percentiles[] = {
+        { 0.50, &summary->p50_ms },
+        { 0.90, &summary->p90_ms },
+        { 0.99, &summary->p99_ms },
+    };
+
+    size_t p = 0;
+    uint64_t seen = 0;
+    for(size_t i=0; (i<LATENCY_NUM_BUCKETS) && (p < 3); i++) {
+        seen += counts[i];
+
+        while((p < 3) && (seen > 0) && ((double)seen >= (percentiles[p].fraction * (double)total))) {
+            double upper = (double)bucket_upper(i) / 1000.0;
+
+            // A bucket may be wider than anything that was recorded in it
+            *percentiles[p].out = (upper < summary->max_ms) ? upper : summary->max_ms;
+            p++;
+        }
+    }
+}
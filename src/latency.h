@@ -0,0 +1,79 @@
+/* latency.h
+ * This file contains latency_histogram, which collects how long each stage
+ * of the captioning pipeline takes, from audio capture to the text being
+ * painted, in log-linear buckets so percentiles stay accurate from
+ * microseconds to seconds.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+typedef enum LatencyStage {
+    // From the capture callback handing over audio to the feeder passing it
+    // to the session
+    LATENCY_CAPTURE_TO_FEED = 0,
+
+    // From audio being fed to the session to a partial or final result for it
+    LATENCY_FEED_TO_RESULT = 1,
+
+    // From a result to the label being updated on the next frame
+    LATENCY_RESULT_TO_PAINT = 2,
+
+    LATENCY_NUM_STAGES
+} LatencyStage;
+
+// Each power of two is split into this many linear buckets, which keeps the
+// relative error of any percentile under 1/16
+#define LATENCY_SUB_BUCKET_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+
+// Values are in microseconds and clamped to 2^30 (about 18 minutes)
+#define LATENCY_MAX_BITS 30
+#define LATENCY_NUM_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+struct latency_histogram {
+    atomic_uint_least64_t buckets[LATENCY_NUM_BUCKETS];
+
+    atomic_uint_least64_t count;
+    atomic_uint_least64_t sum_us;
+    atomic_uint_least64_t max_us;
+};
+
+struct latency_summary {
+    uint64_t count;
+
+    double mean_ms;
+    double p50_ms;
+    double p90_ms;
+    double p99_ms;
+    double max_ms;
+};
+
+void latency_histogram_reset(struct latency_histogram *hist);
+
+// Lock-free, can be called from any thread including realtime ones
+void latency_histogram_record(struct latency_histogram *hist, int64_t elapsed_us);
+
+// Percentiles are the upper edge of the bucket they fall into. Records made
+// while this runs may or may not be included.
+void latency_histogram_summarize(struct latency_histogram *hist, struct latency_summary *summary);
+
+// Short name for the stage, such as "capture-to-feed"
+const char *latency_stage_name(LatencyStage stage);
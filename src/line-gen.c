@@ -32,7 +32,9 @@
 #include <adwaita.h>
 
 #include "line-gen.h"
+#include "text-builder.h"
 #include "profanity-filter.h"
+#include "render-config.h"
 #include "common.h"
 
 void token_capitalizer_init(struct token_capitalizer *tc) {
@@ -92,59 +94,278 @@ void token_capitalizer_rewind(struct token_capitalizer *tc){
     tc->force_next_cap = false;
 }
 
+void build_text_from_tokens(GString *acc, size_t count, const AprilToken* tokens) {
+    bool use_lowercase = render_config_get().use_lowercase;
+
+    bool should_capitalize[count > 0 ? count : 1];
+    struct token_capitalizer tcap;
+    token_capitalizer_init(&tcap);
+    for(size_t i = 0; i < count; i++) {
+        const char *next_tok = (i + 1) < count ? tokens[i+1].token : NULL;
+        int next_flags = (i + 1) < count ? tokens[i+1].flags : 0;
+        should_capitalize[i] = token_capitalizer_next(&tcap, tokens[i].token, tokens[i].flags, next_tok, next_flags);
+    }
+    char scratch[256];
+    for(size_t i = 0; i < count; i++) {
+        const char *src = tokens[i].token;
+        if(!src) continue;
+        if(use_lowercase) {
+            const char *p = src;
+            char *out = scratch;
+            bool cap = should_capitalize[i];
+            while(*p) {
+                gunichar c = g_utf8_get_char_validated(p, -1);
+                if(c == (gunichar)-1 || c == (gunichar)-2) break;
+                c = g_unichar_tolower(c);
+                if(cap) {
+                    gunichar uc = g_unichar_toupper(c);
+                    if(uc != c) {
+                        c = uc; cap = false;
+                    }
+                }
+                out += g_unichar_to_utf8(c, out);
+                if((out + 8) >= (scratch + sizeof(scratch))) break;
+                p = g_utf8_next_char(p);
+            }
+            *out = '\0';
+            g_string_append(acc, scratch);
+        } else {
+            g_string_append(acc, src);
+        }
+    }
+    // Replace any newlines with space (safety)
+    for(guint i = 0; i < acc->len; ++i) if(acc->str[i] == '\n') acc->str[i] = ' ';
+}
+
 
 #define REL_LINE_IDX(HEAD, IDX) (4*AC_LINE_COUNT + (HEAD) + (IDX)) % AC_LINE_COUNT
 
-static GSettings *settings = NULL;
+// Alpha only needs to be roughly right. Rounding it to a few levels lets
+// neighbouring tokens share an attribute.
+#define ALPHA_LEVELS 64
+#define ALPHA_MIN 10000
+#define ALPHA_MAX 65535
+
+static uint16_t get_token_alpha(float logprob) {
+    int alpha = (int)((logprob + 2.0) / 8.0 * 65536.0);
+    alpha /= 2.0;
+    alpha += 32768;
+    if(alpha < ALPHA_MIN) alpha = ALPHA_MIN;
+    if(alpha > ALPHA_MAX) alpha = ALPHA_MAX;
+
+    int level = ((alpha - ALPHA_MIN) * (ALPHA_LEVELS - 1) + (ALPHA_MAX - ALPHA_MIN) / 2) / (ALPHA_MAX - ALPHA_MIN);
+    return (uint16_t)(ALPHA_MIN + (level * (ALPHA_MAX - ALPHA_MIN)) / (ALPHA_LEVELS - 1));
+}
+
+// Drops the ranges past num_ranges and trims the last one to end at head
+static void line_truncate_ranges(struct line *curr) {
+    if((curr->num_ranges > 0) && (curr->ranges[curr->num_ranges - 1].end > curr->head))
+        curr->ranges[curr->num_ranges - 1].end = (uint32_t)curr->head;
+}
+
+static void line_add_range(struct line *curr, size_t start, size_t end, uint16_t alpha) {
+    struct line_alpha_range *last = (curr->num_ranges > 0) ? &curr->ranges[curr->num_ranges - 1] : NULL;
+
+    if((last != NULL) && (last->end == start) && (last->alpha == alpha)) {
+        last->end = (uint32_t)end;
+        return;
+    }
+
+    // Out of ranges, the rest of the line takes the last alpha
+    if(curr->num_ranges == AC_LINE_MAX_RANGES) {
+        last->end = (uint32_t)end;
+        return;
+    }
+
+    curr->ranges[curr->num_ranges].start = (uint32_t)start;
+    curr->ranges[curr->num_ranges].end = (uint32_t)end;
+    curr->ranges[curr->num_ranges].alpha = alpha;
+    curr->num_ranges++;
+}
+
+static void line_generator_invalidate_cache(struct line_generator *lg);
 
 void line_generator_init(struct line_generator *lg) {
     for(int i=0; i<AC_LINE_COUNT; i++){
         lg->active_start_of_lines[i] = -1;
 
+        lg->lines[i].text[0] = '\0';
+        lg->lines[i].head = 0;
+        lg->lines[i].num_ranges = 0;
+        lg->lines[i].len = 0;
         lg->lines[i].start_head = 0;
+        lg->lines[i].start_num_ranges = 0;
         lg->lines[i].start_len = 0;
     }
 
     lg->current_line = 0;
     lg->active_start_of_lines[0] = 0;
 
-    if(settings == NULL) settings = g_settings_new("net.sapples.LiveCaptions");
+    lg->layout = NULL;
+    lg->width_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    lg->layout_counter = 0;
+    lg->width_cache_hits = 0;
+    lg->width_cache_misses = 0;
+
+    lg->cache.text = g_string_new(NULL);
+    lg->cache.opts.use_fade = false;
+    lg->cache.opts.use_lowercase = false;
+    lg->cache.opts.filter_mode = FILTER_NONE;
+    lg->cache.opts.filter = NULL;
+    lg->cache.opts.filter_serial = 0;
+    line_generator_invalidate_cache(lg);
+
+    render_config_init();
 
     token_capitalizer_init(&lg->tcap);
 }
 
+void line_generator_free(struct line_generator *lg) {
+    if(lg->layout != NULL) g_object_unref(lg->layout);
+    lg->layout = NULL;
+
+    if(lg->cache.opts.filter != NULL) profanity_filter_unref(lg->cache.opts.filter);
+    lg->cache.opts.filter = NULL;
+
+    g_hash_table_destroy(lg->width_cache);
+    g_string_free(lg->cache.text, TRUE);
+}
+
+void line_generator_set_layout(struct line_generator *lg, PangoLayout *layout, int max_text_width, size_t layout_counter) {
+    if(lg->layout != NULL) g_object_unref(lg->layout);
+
+    lg->layout = layout;
+    lg->max_text_width = max_text_width;
+
+    if(lg->layout != NULL) pango_layout_set_width(lg->layout, -1);
+
+    if(lg->layout_counter != layout_counter) {
+        g_hash_table_remove_all(lg->width_cache);
+        lg->layout_counter = layout_counter;
+    }
+
+    // Recorded line widths and break positions depend on the layout
+    line_generator_invalidate_cache(lg);
+}
+
+// Distinct tokens are bounded by the model vocabulary plus capitalization
+// variants, this is only a safety net
+#define WIDTH_CACHE_MAX_ENTRIES 16384
+
 static int line_generator_get_text_width(struct line_generator *lg, const char *text){
-    pango_layout_set_width(lg->layout, -1);
+    gpointer cached;
+    if(g_hash_table_lookup_extended(lg->width_cache, text, NULL, &cached)) {
+        lg->width_cache_hits++;
+        return GPOINTER_TO_INT(cached);
+    }
+
+    lg->width_cache_misses++;
 
     int width, height;
     pango_layout_set_text(lg->layout, text, strlen(text));
     pango_layout_get_size(lg->layout, &width, &height);
 
-    return width / PANGO_SCALE;
+    width /= PANGO_SCALE;
+
+    if(g_hash_table_size(lg->width_cache) >= WIDTH_CACHE_MAX_ENTRIES)
+        g_hash_table_remove_all(lg->width_cache);
+
+    g_hash_table_insert(lg->width_cache, g_strdup(text), GINT_TO_POINTER(width));
+
+    return width;
 }
 
-#define MAX_TOKEN_SCRATCH 72
-void line_generator_update(struct line_generator *lg, size_t num_tokens, const AprilToken *tokens) {
-    // Add capitalization information
-    static bool should_capitalize[1024];
+void line_generator_get_width_cache_stats(struct line_generator *lg, size_t *hits, size_t *misses) {
+    *hits = lg->width_cache_hits;
+    *misses = lg->width_cache_misses;
+}
 
-    token_capitalizer_rewind(&lg->tcap);
-    for(size_t i=0; i<num_tokens; i++){
-        if((i+1) < num_tokens) {
-            should_capitalize[i] = token_capitalizer_next(&lg->tcap, tokens[i].token, tokens[i].flags, tokens[i+1].token, tokens[i+1].flags);
-        }else{
-            should_capitalize[i] = token_capitalizer_next(&lg->tcap, tokens[i].token, tokens[i].flags, NULL, 0);
-        }
+static void line_generator_invalidate_cache(struct line_generator *lg) {
+    struct line_token_cache *cache = &lg->cache;
+
+    cache->count = 0;
+    g_string_truncate(cache->text, 0);
+
+    for(size_t i=0; i<AC_MAX_TOKENS; i++) cache->line_of[i] = -1;
+    for(size_t i=0; i<AC_LINE_COUNT; i++) {
+        cache->line_start[i] = -1;
+        cache->line_end[i] = 0;
+    }
+}
+
+// Compares the incoming tokens against the ones from the previous update,
+// remembers the new ones and returns the index of the first token that differs
+static size_t line_generator_diff_tokens(struct line_generator *lg, size_t num_tokens, const AprilToken *tokens, const struct line_render_options *opts) {
+    struct line_token_cache *cache = &lg->cache;
+
+    if((cache->opts.use_fade != opts->use_fade)
+        || (cache->opts.use_lowercase != opts->use_lowercase)
+        || (cache->opts.filter_mode != opts->filter_mode)
+        || (cache->opts.filter_serial != opts->filter_serial)) {
+        line_generator_invalidate_cache(lg);
+
+        profanity_filter old_filter = cache->opts.filter;
+        cache->opts = *opts;
+        cache->opts.filter = profanity_filter_ref(opts->filter);
+        if(old_filter != NULL) profanity_filter_unref(old_filter);
+    }
+
+    size_t common = cache->count < num_tokens ? cache->count : num_tokens;
+    size_t first_changed = 0;
+    for(; first_changed < common; first_changed++) {
+        size_t k = first_changed;
+        if(cache->flags[k] != tokens[k].flags) break;
+        if(cache->logprob[k] != tokens[k].logprob) break;
+        if(strcmp(&cache->text->str[cache->text_offset[k]], tokens[k].token) != 0) break;
     }
 
-    bool use_fade = g_settings_get_boolean(settings, "fade-text");
+    if(first_changed < cache->count)
+        g_string_truncate(cache->text, cache->text_offset[first_changed]);
+
+    for(size_t k=first_changed; k<num_tokens; k++) {
+        cache->text_offset[k] = cache->text->len;
+        g_string_append_len(cache->text, tokens[k].token, strlen(tokens[k].token) + 1);
+        cache->flags[k] = tokens[k].flags;
+        cache->logprob[k] = tokens[k].logprob;
+    }
+
+    cache->count = num_tokens;
+
+    return first_changed;
+}
+
+// Finds the last token index from which line i can continue rendering using
+// what was recorded in the previous update. It must lie before the first
+// changed token and on a word boundary, so neither the capitalization of the
+// preceding token nor a filtered word straddling it can have changed.
+static size_t line_generator_find_resume(struct line_generator *lg, size_t i, size_t start_of_line, size_t end, size_t first_changed, const AprilToken *tokens) {
+    struct line_token_cache *cache = &lg->cache;
+
+    if(cache->line_start[i] != (ssize_t)start_of_line) return start_of_line;
+    if(cache->line_start_head[i] != lg->lines[i].start_head) return start_of_line;
+
+    size_t limit = first_changed;
+    if(limit > end) limit = end;
+    if(limit > cache->line_end[i]) limit = cache->line_end[i];
 
-    bool filter_slurs = g_settings_get_boolean(settings, "filter-slurs");
-    bool filter_profanity = g_settings_get_boolean(settings, "filter-profanity");
+    for(size_t p = limit; p > (start_of_line + 1); p--) {
+        size_t q = p - 1;
+        if(cache->line_of[q] != (int8_t)i) continue;
+        if(!(tokens[q].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT)) continue;
 
-    FilterMode filter_mode = filter_profanity ? FILTER_PROFANITY : (filter_slurs ? FILTER_SLURS : FILTER_NONE);
+        // The line may have overflowed while it was not the active line, in
+        // which case the active line has to find its break point again
+        if((i == lg->current_line) && (cache->len_at[q] >= (size_t)lg->max_text_width)) continue;
+
+        return q;
+    }
+
+    return start_of_line;
+}
 
-    bool use_lowercase = !g_settings_get_boolean(settings, "text-uppercase");
+#define MAX_TOKEN_SCRATCH 72
+static void line_generator_render(struct line_generator *lg, size_t num_tokens, const AprilToken *tokens, size_t first_changed, const struct line_render_options *opts) {
+    struct line_token_cache *cache = &lg->cache;
     char token_scratch[MAX_TOKEN_SCRATCH] = { 0 };
 
     for(size_t i=0; i<AC_LINE_COUNT; i++){
@@ -154,19 +375,26 @@ void line_generator_update(struct line_generator *lg, size_t num_tokens, const A
         struct line *curr = &lg->lines[i];
 
         // reset for writing
-        curr->text[curr->start_head] = '\0';
         curr->head = curr->start_head;
+        curr->num_ranges = curr->start_num_ranges;
         curr->len = curr->start_len;
 
-        if(num_tokens == 0) continue;
+        if(num_tokens == 0) {
+            curr->text[curr->start_head] = '\0';
+            line_truncate_ranges(curr);
+            continue;
+        }
 
         if(start_of_line >= num_tokens) {
+            curr->text[curr->start_head] = '\0';
+            line_truncate_ranges(curr);
             if(i == lg->current_line) {
                 // oops... turns out our text isn't long enough for the new line
                 // backtrack to the previous line
                 lg->active_start_of_lines[lg->current_line] = -1;
+                cache->line_start[lg->current_line] = -1;
                 lg->current_line = REL_LINE_IDX(lg->current_line, -1);
-                return line_generator_update(lg, num_tokens, tokens);
+                return line_generator_render(lg, num_tokens, tokens, first_changed, opts);
             } else {
                 continue;
             }
@@ -176,14 +404,40 @@ void line_generator_update(struct line_generator *lg, size_t num_tokens, const A
         ssize_t end = lg->active_start_of_lines[REL_LINE_IDX(i, 1)];
         if((end == -1) || (i == lg->current_line)) end = num_tokens;
 
+        // pick up where the previous update left off if the tokens so far
+        // are unchanged
+        size_t j = line_generator_find_resume(lg, i, start_of_line, (size_t)end, first_changed, tokens);
+        if(j > start_of_line) {
+            curr->head = cache->head_at[j];
+            curr->num_ranges = cache->ranges_at[j];
+            curr->len = cache->len_at[j];
+        }
+
+        // Only once the head is known, a range recorded as merged past it
+        // may still be needed to resume
+        line_truncate_ranges(curr);
+
+        struct text_builder text;
+        text_builder_init(&text, curr->text, AC_LINE_MAX, curr->head);
+
+        cache->line_start[i] = start_of_line;
+        cache->line_start_head[i] = curr->start_head;
+
         // print line
-        for(size_t j=start_of_line; j<((size_t)end);) {
+        for(; j<((size_t)end);) {
             size_t skipahead = 1;
             const char *token = tokens[j].token;
 
-            bool should_be_capitalized = should_capitalize[j];
+            // remember the line state before this token, to resume from here
+            cache->line_of[j] = (int8_t)i;
+            cache->head_at[j] = text.len;
+            cache->ranges_at[j] = curr->num_ranges;
+            cache->len_at[j] = curr->len;
+            cache->line_end[i] = j + 1;
+
+            bool should_be_capitalized = cache->should_capitalize[j];
 
-            if(use_lowercase){
+            if(opts->use_lowercase){
                 char *out = token_scratch;
                 const char *p = tokens[j].token;
                 gunichar c;
@@ -222,73 +476,117 @@ void line_generator_update(struct line_generator *lg, size_t num_tokens, const A
             }
 
             // filter current word, if applicable
-            if((filter_mode > FILTER_NONE) && (tokens[j].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT)) {
-                size_t skip = get_filter_skip(tokens, j, num_tokens, filter_mode);
+            if((opts->filter_mode > FILTER_NONE) && (tokens[j].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT)) {
+                size_t skip = profanity_filter_skip(opts->filter, tokens, j, num_tokens, opts->filter_mode);
                 if(skip > 0) {
                     skipahead = skip;
                     token = SWEAR_REPLACEMENT;
                 }
             }
 
-            // skip if line is too long to safely write
-            bool must_break = (curr->head > (AC_LINE_MAX - 256));
-            if(must_break){
+            // leave the line as it is if the token does not fit in it
+            size_t token_len = strlen(token);
+            if(!text_builder_fits(&text, token_len)){
                 printf("Must linebreak, but not active line. Leaving incomplete line...\n");
                 break;
             }
 
+            // Width is tracked on every line, not just the active one, so the
+            // recorded widths stay valid if this line becomes active again
+            curr->len += line_generator_get_text_width(lg, token);
+
             // break line if too long
-            if(i == lg->current_line){
-                curr->len += line_generator_get_text_width(lg, token);
-                if(curr->len >= lg->max_text_width) {
-                    size_t tgt_brk = j;
-                    // find previous word boundary
-                    while((!(tokens[tgt_brk].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT)) && (tgt_brk > start_of_line)) tgt_brk--;
-
-                    // if we backtracked all the way to the start of line, just give up and break here
-                    // unless this line has starting text
-                    if((tgt_brk == start_of_line) && (curr->start_head == 0)) tgt_brk = j;
-
-                    // line break
-                    lg->current_line = REL_LINE_IDX(lg->current_line, 1);
-                    lg->active_start_of_lines[lg->current_line] = tgt_brk;
-                    lg->lines[lg->current_line].start_head = 0;
-                    lg->lines[lg->current_line].start_len = 0;
-                    return line_generator_update(lg, num_tokens, tokens);
-                }
+            if((i == lg->current_line) && (curr->len >= lg->max_text_width)) {
+                size_t tgt_brk = j;
+                // find previous word boundary
+                while((!(tokens[tgt_brk].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT)) && (tgt_brk > start_of_line)) tgt_brk--;
+
+                // if we backtracked all the way to the start of line, just give up and break here
+                // unless this line has starting text
+                if((tgt_brk == start_of_line) && (curr->start_head == 0)) tgt_brk = j;
+
+                // line break
+                lg->current_line = REL_LINE_IDX(lg->current_line, 1);
+                lg->active_start_of_lines[lg->current_line] = tgt_brk;
+                lg->lines[lg->current_line].start_head = 0;
+                lg->lines[lg->current_line].start_num_ranges = 0;
+                lg->lines[lg->current_line].start_len = 0;
+                cache->line_start[lg->current_line] = -1;
+                return line_generator_render(lg, num_tokens, tokens, first_changed, opts);
             }
 
             // write the actual line
-            int alpha = (int)((tokens[j].logprob + 2.0) / 8.0 * 65536.0);
-            alpha /= 2.0;
-            alpha += 32768;
-            if(alpha < 10000) alpha = 10000;
-            if(alpha > 65535) alpha = 65535;
-
-            if(use_fade)
-                curr->head += sprintf(&curr->text[curr->head], "<span fgalpha=\"%d\">%s</span>", alpha, token);
-            else
-                curr->head += sprintf(&curr->text[curr->head], "%s", token);
-            
-            g_assert(curr->head < AC_LINE_MAX);
+            text_builder_append_len(&text, token, token_len);
+            if(opts->use_fade) line_add_range(curr, curr->head, text.len, get_token_alpha(tokens[j].logprob));
+
+            curr->head = text.len;
+
+            // tokens swallowed by the filter are not valid places to resume
+            for(size_t k=j+1; (k < j+skipahead) && (k < num_tokens); k++) cache->line_of[k] = -1;
 
             j += skipahead;
         }
     }
 }
 
+void line_generator_update(struct line_generator *lg, size_t num_tokens, const AprilToken *tokens) {
+    if(num_tokens > AC_MAX_TOKENS) {
+        printf("Too many tokens (%zu), only the first %d are shown\n", num_tokens, AC_MAX_TOKENS);
+        num_tokens = AC_MAX_TOKENS;
+    }
+
+    struct render_config config = render_config_get();
+
+    profanity_filter filter = profanity_filter_get();
+
+    struct line_render_options opts = {
+        .use_fade = config.use_fade,
+        .use_lowercase = config.use_lowercase,
+        .filter_mode = config.filter_mode,
+        .filter = filter,
+        .filter_serial = profanity_filter_serial(filter)
+    };
+
+    size_t first_changed = line_generator_diff_tokens(lg, num_tokens, tokens, &opts);
+
+    // Add capitalization information. A token's capitalization depends on
+    // the token after it, so start one before the first change.
+    struct line_token_cache *cache = &lg->cache;
+    size_t cap_start = first_changed > 0 ? (first_changed - 1) : 0;
+
+    if(cap_start == 0) token_capitalizer_rewind(&lg->tcap);
+    else lg->tcap = cache->tcap_before[cap_start];
+
+    for(size_t i=cap_start; i<num_tokens; i++){
+        cache->tcap_before[i] = lg->tcap;
+        if((i+1) < num_tokens) {
+            cache->should_capitalize[i] = token_capitalizer_next(&lg->tcap, tokens[i].token, tokens[i].flags, tokens[i+1].token, tokens[i+1].flags);
+        }else{
+            cache->should_capitalize[i] = token_capitalizer_next(&lg->tcap, tokens[i].token, tokens[i].flags, NULL, 0);
+        }
+    }
+
+    line_generator_render(lg, num_tokens, tokens, first_changed, &opts);
+
+    profanity_filter_unref(filter);
+}
+
 void line_generator_finalize(struct line_generator *lg) {
     // reset active
     for(size_t i=0; i<AC_LINE_COUNT; i++) lg->active_start_of_lines[i] = -1;
 
     // freeze the current line thus far
     lg->lines[lg->current_line].start_head = lg->lines[lg->current_line].head;
+    lg->lines[lg->current_line].start_num_ranges = lg->lines[lg->current_line].num_ranges;
     lg->lines[lg->current_line].start_len = lg->lines[lg->current_line].len;
 
     token_capitalizer_finish(&lg->tcap);
 
     // set new line to start at 0
     lg->active_start_of_lines[lg->current_line] = 0;
+
+    // the next tokens belong to a new utterance
+    line_generator_invalidate_cache(lg);
 }
 
 void line_generator_break(struct line_generator *lg) {
@@ -304,23 +602,51 @@ void line_generator_break(struct line_generator *lg) {
     // clear new line
     lg->lines[lg->current_line].text[0] = '\0';
     lg->lines[lg->current_line].head = 0;
+    lg->lines[lg->current_line].num_ranges = 0;
+    lg->lines[lg->current_line].start_num_ranges = 0;
     lg->lines[lg->current_line].len = 0;
     lg->lines[lg->current_line].start_head = 0;
     lg->lines[lg->current_line].start_len = 0;
+
+    line_generator_invalidate_cache(lg);
 }
 
-void line_generator_set_text(struct line_generator *lg, GtkLabel *lbl) {
-    char *head = &lg->output[0];
-    *head = '\0';
+// Joins the lines into output. If attrs is given, the alpha ranges of every
+// line are added to it at the offset the line ends up at.
+static void line_generator_join(struct line_generator *lg, PangoAttrList *attrs) {
+    struct text_builder output;
+    text_builder_init(&output, lg->output, sizeof(lg->output), 0);
 
     for(int i=AC_LINE_COUNT-1; i>=0; i--) {
         struct line *curr = &lg->lines[REL_LINE_IDX(lg->current_line, -i)];
-        head += sprintf(head, "%s", curr->text);
 
-        if(i != 0) head += sprintf(head, "\n");
+        size_t offset = output.len;
+        if(!text_builder_append_len(&output, curr->text, curr->head)) break;
+
+        if(attrs != NULL) {
+            for(size_t r=0; r<curr->num_ranges; r++){
+                PangoAttribute *attr = pango_attr_foreground_alpha_new(curr->ranges[r].alpha);
+                attr->start_index = (guint)(offset + curr->ranges[r].start);
+                attr->end_index = (guint)(offset + curr->ranges[r].end);
+
+                // Ranges are in order, so this appends
+                pango_attr_list_insert(attrs, attr);
+            }
+        }
+
+        if(i != 0) text_builder_append_c(&output, '\n');
     }
+}
+
+void line_generator_set_text(struct line_generator *lg, GtkLabel *lbl, PangoAttrList *base_attrs) {
+    PangoAttrList *attrs = (base_attrs != NULL) ? pango_attr_list_copy(base_attrs) : pango_attr_list_new();
+
+    line_generator_join(lg, attrs);
+
+    gtk_label_set_attributes(lbl, attrs);
+    gtk_label_set_text(lbl, lg->output);
 
-    gtk_label_set_markup(lbl, lg->output);
+    pango_attr_list_unref(attrs);
 }
 
 void line_generator_set_language(struct line_generator *lg, const char* language) {
@@ -329,68 +655,11 @@ void line_generator_set_language(struct line_generator *lg, const char* language
 }
 
 const char *line_generator_get_plaintext(struct line_generator *lg) {
-    bool use_fade = g_settings_get_boolean(settings, "fade-text");
-
-    char *head = &lg->plaintext[0];
-    *head = '\0';
-
-    for(int i=AC_LINE_COUNT-1; i>=0; i--) {
-        struct line *curr = &lg->lines[REL_LINE_IDX(lg->current_line, -i)];
-
-        if(!use_fade) {
-            head += sprintf(head, "%s", curr->text);
-        } else {
-            // HACK: We need to remove the <span...></span> tags
-            bool inside_markup = false;
-            for(int j=0; j<curr->head; j++) {
-                if(curr->text[j] == '<') {
-                    inside_markup = true;
-                    continue;
-                }else if(curr->text[j] == '>') {
-                    inside_markup = false;
-                    continue;
-                }else if(inside_markup) {
-                    continue;
-                }
-
-                head += sprintf(head, "%c", curr->text[j]);
-            }
-        }
-
-        if(i != 0) head += sprintf(head, "\n");
-    }
-
-    return &lg->plaintext[0];
+    line_generator_join(lg, NULL);
+    return &lg->output[0];
 }
 
 const char *line_generator_get_active_plaintext(struct line_generator *lg) {
-    bool use_fade = g_settings_get_boolean(settings, "fade-text");
-
-    char *head = &lg->plaintext[0];
-    *head = '\0';
-
     // Only the current active line should be included in live streaming
-    struct line *curr = &lg->lines[REL_LINE_IDX(lg->current_line, 0)];
-
-    if(!use_fade) {
-        head += sprintf(head, "%s", curr->text);
-    } else {
-        // Remove the <span...> markup from the current line
-        bool inside_markup = false;
-        for(int j=0; j<curr->head; j++) {
-            if(curr->text[j] == '<') {
-                inside_markup = true;
-                continue;
-            } else if(curr->text[j] == '>') {
-                inside_markup = false;
-                continue;
-            } else if(inside_markup) {
-                continue;
-            }
-
-            head += sprintf(head, "%c", curr->text[j]);
-        }
-    }
-
-    return &lg->plaintext[0];
-}
\ No newline at end of file
+    return lg->lines[REL_LINE_IDX(lg->current_line, 0)].text;
+}
@@ -26,9 +26,14 @@
 #include <april_api.h>
 #include <adwaita.h>
 
+#include "profanity-filter.h"
+
 #define AC_LINE_MAX 4096
 #define AC_LINE_COUNT 2
 
+// Maximum number of tokens in a single result that will be displayed
+#define AC_MAX_TOKENS 1024
+
 struct token_capitalizer {
     bool is_english;
     bool finished_at_period;
@@ -42,17 +47,78 @@ bool token_capitalizer_next(struct token_capitalizer *tc, const char *token, int
 void token_capitalizer_finish(struct token_capitalizer *tc);
 void token_capitalizer_rewind(struct token_capitalizer *tc);
 
+// Appends the text of the tokens to acc as the transcript shows it, with the
+// capitalization of the current render config and no newlines
+void build_text_from_tokens(GString *acc, size_t count, const AprilToken* tokens);
+
+
+// A run of text drawn with the same foreground alpha, in bytes
+struct line_alpha_range {
+    uint32_t start;
+    uint32_t end;
+    uint16_t alpha;
+};
+
+// Neighbouring tokens of similar confidence share a range
+#define AC_LINE_MAX_RANGES 512
 
 struct line {
     char text[AC_LINE_MAX];
 
+    // Only filled in if fade is in use
+    struct line_alpha_range ranges[AC_LINE_MAX_RANGES];
+
     size_t start_head;
+    size_t start_num_ranges;
     size_t start_len;
 
     size_t head;
+    size_t num_ranges;
     size_t len;
 };
 
+struct line_render_options {
+    bool use_fade;
+    bool use_lowercase;
+    FilterMode filter_mode;
+
+    // Taken once per update, cached tokens are rendered again when it changes.
+    // The cache holds a reference to its filter.
+    profanity_filter filter;
+    uint64_t filter_serial;
+};
+
+// State kept between updates so that a partial result which shares a prefix
+// with the previous one only re-renders from the first changed token
+struct line_token_cache {
+    // Copy of the previous token array (strings are NUL separated in text)
+    GString *text;
+    size_t text_offset[AC_MAX_TOKENS];
+    int flags[AC_MAX_TOKENS];
+    float logprob[AC_MAX_TOKENS];
+    size_t count;
+
+    struct line_render_options opts;
+
+    // Capitalizer state before each token, and whether it gets capitalized
+    struct token_capitalizer tcap_before[AC_MAX_TOKENS];
+    bool should_capitalize[AC_MAX_TOKENS];
+
+    // For every token the render loop stopped at: the line it was written to
+    // (-1 if none) and that line's text offset, alpha range count and width
+    // before the token
+    int8_t line_of[AC_MAX_TOKENS];
+    size_t head_at[AC_MAX_TOKENS];
+    size_t ranges_at[AC_MAX_TOKENS];
+    size_t len_at[AC_MAX_TOKENS];
+
+    // What the recorded offsets of each line are relative to, and one past
+    // the last token index recorded for it
+    ssize_t line_start[AC_LINE_COUNT];
+    size_t line_start_head[AC_LINE_COUNT];
+    size_t line_end[AC_LINE_COUNT];
+};
+
 struct line_generator {
     size_t current_line;
     struct line lines[AC_LINE_COUNT];
@@ -61,22 +127,38 @@ struct line_generator {
     // If -1, means the active tokens don't reach that line yet
     ssize_t active_start_of_lines[AC_LINE_COUNT];
 
+    // The lines joined together
     char output[AC_LINE_MAX * AC_LINE_COUNT];
-    char plaintext[AC_LINE_MAX * AC_LINE_COUNT];
 
     PangoLayout *layout;
     int max_text_width;
 
+    // Rendered token text -> pixel width, only valid for the layout that was
+    // set with layout_counter
+    GHashTable *width_cache;
+    size_t layout_counter;
+    size_t width_cache_hits;
+    size_t width_cache_misses;
+
     bool is_english;
     struct token_capitalizer tcap;
+
+    struct line_token_cache cache;
 };
 
 void line_generator_init(struct line_generator *lg);
+void line_generator_free(struct line_generator *lg);
+// Takes ownership of layout. The token width cache is dropped whenever
+// layout_counter changes.
+void line_generator_set_layout(struct line_generator *lg, PangoLayout *layout, int max_text_width, size_t layout_counter);
 void line_generator_update(struct line_generator *lg, size_t num_tokens, const AprilToken *tokens);
 void line_generator_finalize(struct line_generator *lg);
 void line_generator_break(struct line_generator *lg);
-void line_generator_set_text(struct line_generator *lg, GtkLabel *lbl);
+// Sets the text of lbl, with the alpha of every token applied on top of
+// base_attrs (may be NULL). No markup is involved.
+void line_generator_set_text(struct line_generator *lg, GtkLabel *lbl, PangoAttrList *base_attrs);
 void line_generator_set_language(struct line_generator *lg, const char* language);
 const char *line_generator_get_plaintext(struct line_generator *lg);
-// Returns only the current active line as plaintext (no markup), used for live streaming
-const char *line_generator_get_active_plaintext(struct line_generator *lg);
\ No newline at end of file
+// Returns only the current active line, used for live streaming
+const char *line_generator_get_active_plaintext(struct line_generator *lg);
+void line_generator_get_width_cache_stats(struct line_generator *lg, size_t *hits, size_t *misses);
\ No newline at end of file
@@ -24,6 +24,7 @@
 #include "asrproc.h"
 #include "common.h"
 #include "history.h"
+#include "filter-lists.h"
 
 G_DEFINE_TYPE (LiveCaptionsApplication, livecaptions_application, ADW_TYPE_APPLICATION)
 
@@ -84,6 +85,7 @@ static void livecaptions_application_show_welcome(LiveCaptionsApplication *self)
 static void livecaptions_application_activate(GApplication *app) {
     history_init();
     load_history_from(default_history_file);
+    filter_lists_init();
 
     GtkWindow *window;
 
@@ -108,7 +110,8 @@ static void livecaptions_application_activate(GApplication *app) {
 
     gdouble benchmark_result = g_settings_get_double(self->settings, "benchmark");
 
-    if(benchmark_result < MINIMUM_BENCHMARK_RESULT) {
+    // A replay has no model to benchmark
+    if((benchmark_result < MINIMUM_BENCHMARK_RESULT) && (asr_thread_get_model(self->asr) != NULL)) {
         livecaptions_application_show_welcome(self);
     }
 
@@ -127,6 +130,34 @@ static gboolean on_handle_allow_keep_above(DBLCapNetSapplesLiveCaptionsExternal
     return TRUE;
 }
 
+#define LATENCY_PUBLISH_SECONDS 1
+
+// Maps each stage to (count, mean, p50, p90, p99, max) in milliseconds
+static GVariant *build_latency_variant(LiveCaptionsApplication *self) {
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{s(tddddd)}"));
+
+    for(int i=0; i<LATENCY_NUM_STAGES; i++) {
+        struct latency_summary summary = { 0 };
+        if(self->asr != NULL) asr_thread_get_latency(self->asr, i, &summary);
+
+        g_variant_builder_add(&builder, "{s(tddddd)}", latency_stage_name(i),
+                              (guint64)summary.count, summary.mean_ms,
+                              summary.p50_ms, summary.p90_ms, summary.p99_ms, summary.max_ms);
+    }
+
+    return g_variant_builder_end(&builder);
+}
+
+static gboolean publish_latency(void *userdata) {
+    LiveCaptionsApplication *self = userdata;
+
+    if(self->dbus_external != NULL)
+        dblcap_net_sapples_live_captions_external_set_latency(self->dbus_external, build_latency_variant(self));
+
+    return G_SOURCE_CONTINUE;
+}
+
 static gboolean
 livecaptions_application_dbus_register(GApplication     *app,
                                        GDBusConnection  *connection,
@@ -163,6 +194,11 @@ livecaptions_application_dbus_register(GApplication     *app,
 
     g_signal_connect(self->dbus_external, "handle-allow-keep-above", G_CALLBACK(on_handle_allow_keep_above), self);
 
+    // Unchanged values are not re-sent, so this costs nothing on the bus
+    // while no captions are being made
+    publish_latency(self);
+    self->latency_source = g_timeout_add_seconds(LATENCY_PUBLISH_SECONDS, publish_latency, self);
+
     return success;
 }
 
@@ -174,6 +210,11 @@ livecaptions_application_dbus_unregister(GApplication    *app,
 {
     LiveCaptionsApplication *self = LIVECAPTIONS_APPLICATION(app);
 
+    if(self->latency_source != 0) {
+        g_source_remove(self->latency_source);
+        self->latency_source = 0;
+    }
+
     g_dbus_interface_skeleton_unexport(G_DBUS_INTERFACE_SKELETON(self->dbus_external));
 
     if(self->dbus_external){
@@ -271,6 +312,10 @@ static void on_settings_change(G_GNUC_UNUSED GSettings *settings,
             // Filter profanity was turned on but slurs is still off, this is invalid state, turn on slur filter
             g_settings_set_boolean(self->settings, "filter-slurs", true);
         }
+    }else if(g_str_equal(key, "voice-activity-detection") || g_str_equal(key, "vad-spectral-flatness")){
+        asr_thread_set_vad(self->asr,
+                           g_settings_get_boolean(self->settings, "voice-activity-detection"),
+                           g_settings_get_boolean(self->settings, "vad-spectral-flatness"));
     }else if(g_str_equal(key, "keep-on-top")){
         if(self->dbus_external) {
             dblcap_net_sapples_live_captions_external_set_keep_above(
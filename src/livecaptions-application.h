@@ -36,6 +36,7 @@ struct _LiveCaptionsApplication {
     audio_thread audio;
 
     DBLCapNetSapplesLiveCaptionsExternal *dbus_external;
+    guint latency_source;
 };
 
 G_BEGIN_DECLS
@@ -0,0 +1,266 @@
+/* livecaptions-history-model.c
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "livecaptions-history-model.h"
+
+// What a row refers to. Rows are only turned into objects when the list
+// view asks for them, which is for the visible ones.
+struct row_ref {
+    int64_t timestamp;
+    uint32_t session_idx; // as passed to get_history_session
+    uint32_t entry;
+    HistoryRowKind kind;
+};
+
+struct _LiveCaptionsHistoryRow {
+    GObject parent_instance;
+
+    struct row_ref ref;
+    char *message;
+};
+
+struct _LiveCaptionsHistoryModel {
+    GObject parent_instance;
+
+    // struct row_ref, oldest first
+    GArray *rows;
+
+    // The number of sessions loaded, counting back from the active one
+    size_t sessions_loaded;
+
+    char *message;
+};
+
+G_DEFINE_TYPE(LiveCaptionsHistoryRow, livecaptions_history_row, G_TYPE_OBJECT)
+
+static void livecaptions_history_model_list_model_init(GListModelInterface *iface);
+
+G_DEFINE_TYPE_WITH_CODE(LiveCaptionsHistoryModel, livecaptions_history_model, G_TYPE_OBJECT,
+                        G_IMPLEMENT_INTERFACE(G_TYPE_LIST_MODEL, livecaptions_history_model_list_model_init))
+
+
+static void livecaptions_history_row_finalize(GObject *object) {
+    LiveCaptionsHistoryRow *self = LIVECAPTIONS_HISTORY_ROW(object);
+
+    g_free(self->message);
+
+    G_OBJECT_CLASS(livecaptions_history_row_parent_class)->finalize(object);
+}
+
+static void livecaptions_history_row_class_init(LiveCaptionsHistoryRowClass *klass) {
+    G_OBJECT_CLASS(klass)->finalize = livecaptions_history_row_finalize;
+}
+
+static void livecaptions_history_row_init(LiveCaptionsHistoryRow *self) {
+    self->message = NULL;
+}
+
+HistoryRowKind livecaptions_history_row_get_kind(LiveCaptionsHistoryRow *row) {
+    return row->ref.kind;
+}
+
+time_t livecaptions_history_row_get_timestamp(LiveCaptionsHistoryRow *row) {
+    return (time_t)row->ref.timestamp;
+}
+
+struct copy_context {
+    size_t entry;
+    struct history_entry *copy;
+    bool found;
+};
+
+static void copy_entry(const struct history_session *session, void *userdata) {
+    struct copy_context *ctx = userdata;
+    if(ctx->entry >= session->entries_count) return;
+
+    const struct history_entry *entry = &session->entries[ctx->entry];
+
+    ctx->copy->timestamp = entry->timestamp;
+    ctx->copy->tokens_count = entry->tokens_count;
+    ctx->copy->tokens = malloc((entry->tokens_count > 0 ? entry->tokens_count : 1) * sizeof(struct history_token));
+    memcpy(ctx->copy->tokens, entry->tokens, entry->tokens_count * sizeof(struct history_token));
+
+    ctx->found = true;
+}
+
+bool livecaptions_history_row_copy_entry(LiveCaptionsHistoryRow *row, struct history_entry *copy) {
+    struct copy_context ctx = { .entry = row->ref.entry, .copy = copy, .found = false };
+    history_with_session(row->ref.session_idx, copy_entry, &ctx);
+
+    return ctx.found;
+}
+
+const char *livecaptions_history_row_get_message(LiveCaptionsHistoryRow *row) {
+    return (row->message != NULL) ? row->message : "";
+}
+
+
+static GType get_item_type(GListModel *list) {
+    return LIVECAPTIONS_TYPE_HISTORY_ROW;
+}
+
+static guint get_n_items(GListModel *list) {
+    LiveCaptionsHistoryModel *self = LIVECAPTIONS_HISTORY_MODEL(list);
+
+    return self->rows->len;
+}
+
+static gpointer get_item(GListModel *list, guint position) {
+    LiveCaptionsHistoryModel *self = LIVECAPTIONS_HISTORY_MODEL(list);
+    if(position >= self->rows->len) return NULL;
+
+    LiveCaptionsHistoryRow *row = g_object_new(LIVECAPTIONS_TYPE_HISTORY_ROW, NULL);
+    row->ref = g_array_index(self->rows, struct row_ref, position);
+
+    if(row->ref.kind == HISTORY_ROW_MESSAGE) row->message = g_strdup(self->message);
+
+    return row;
+}
+
+static void livecaptions_history_model_list_model_init(GListModelInterface *iface) {
+    iface->get_item_type = get_item_type;
+    iface->get_n_items = get_n_items;
+    iface->get_item = get_item;
+}
+
+static void livecaptions_history_model_finalize(GObject *object) {
+    LiveCaptionsHistoryModel *self = LIVECAPTIONS_HISTORY_MODEL(object);
+
+    g_array_free(self->rows, TRUE);
+    g_free(self->message);
+
+    G_OBJECT_CLASS(livecaptions_history_model_parent_class)->finalize(object);
+}
+
+static void livecaptions_history_model_class_init(LiveCaptionsHistoryModelClass *klass) {
+    G_OBJECT_CLASS(klass)->finalize = livecaptions_history_model_finalize;
+}
+
+static void livecaptions_history_model_init(LiveCaptionsHistoryModel *self) {
+    self->rows = g_array_new(FALSE, FALSE, sizeof(struct row_ref));
+    self->sessions_loaded = 0;
+    self->message = NULL;
+}
+
+LiveCaptionsHistoryModel *livecaptions_history_model_new(void) {
+    return g_object_new(LIVECAPTIONS_TYPE_HISTORY_MODEL, NULL);
+}
+
+
+static void add_row(GArray *rows, HistoryRowKind kind, size_t session_idx, size_t entry, time_t timestamp) {
+    struct row_ref ref = {
+        .timestamp = timestamp,
+        .session_idx = (uint32_t)session_idx,
+        .entry = (uint32_t)entry,
+        .kind = kind
+    };
+
+    g_array_append_val(rows, ref);
+}
+
+struct build_context {
+    GArray *rows;
+    size_t session_idx;
+};
+
+// Appends the rows of a session to rows. Called with history locked.
+static void build_session_rows(const struct history_session *session, void *userdata) {
+    struct build_context *ctx = userdata;
+    GArray *rows = ctx->rows;
+    size_t session_idx = ctx->session_idx;
+
+    if(session->entries_count == 0) return;
+
+    add_row(rows, HISTORY_ROW_SESSION_START, session_idx, 0, session->entries[0].timestamp);
+
+    for(size_t i=0; i<session->entries_count; i++){
+        const struct history_entry *entry = &session->entries[i];
+
+        if(entry->tokens_count > 0) {
+            add_row(rows, HISTORY_ROW_TEXT, session_idx, i, entry->timestamp);
+        } else if((i + 1) < session->entries_count) {
+            // Silence, show when speech resumed
+            add_row(rows, HISTORY_ROW_TIME, session_idx, i + 1, session->entries[i + 1].timestamp);
+        }
+    }
+}
+
+static void replace_rows(LiveCaptionsHistoryModel *self, GArray *rows) {
+    guint removed = self->rows->len;
+
+    g_array_free(self->rows, TRUE);
+    self->rows = rows;
+
+    g_list_model_items_changed(G_LIST_MODEL(self), 0, removed, rows->len);
+}
+
+void livecaptions_history_model_reset(LiveCaptionsHistoryModel *self) {
+    GArray *rows = g_array_new(FALSE, FALSE, sizeof(struct row_ref));
+
+    struct build_context ctx = { .rows = rows, .session_idx = 0 };
+    history_with_session(0, build_session_rows, &ctx);
+
+    self->sessions_loaded = 1;
+
+    replace_rows(self, rows);
+}
+
+bool livecaptions_history_model_load_more(LiveCaptionsHistoryModel *self) {
+    GArray *rows = g_array_new(FALSE, FALSE, sizeof(struct row_ref));
+
+    bool more = true;
+    while(rows->len == 0) {
+        struct build_context ctx = { .rows = rows, .session_idx = self->sessions_loaded };
+        if(!history_with_session(self->sessions_loaded, build_session_rows, &ctx)) {
+            more = false;
+            break;
+        }
+
+        self->sessions_loaded++;
+    }
+
+    guint added = rows->len;
+    if(added > 0) {
+        g_array_prepend_vals(self->rows, rows->data, added);
+        g_list_model_items_changed(G_LIST_MODEL(self), 0, 0, added);
+    }
+
+    g_array_free(rows, TRUE);
+
+    return more;
+}
+
+void livecaptions_history_model_show_hits(LiveCaptionsHistoryModel *self, const struct history_search_hit *hits, size_t count, const char *message) {
+    GArray *rows = g_array_new(FALSE, FALSE, sizeof(struct row_ref));
+
+    g_free(self->message);
+    self->message = g_strdup(message);
+    add_row(rows, HISTORY_ROW_MESSAGE, 0, 0, 0);
+
+    // Hits come newest first
+    for(size_t i=count; i>0; i--){
+        const struct history_search_hit *hit = &hits[i - 1];
+
+        add_row(rows, HISTORY_ROW_HIT_TIME, hit->session_idx, hit->entry, hit->timestamp);
+        add_row(rows, HISTORY_ROW_TEXT, hit->session_idx, hit->entry, hit->timestamp);
+    }
+
+    replace_rows(self, rows);
+}
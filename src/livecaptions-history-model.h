@@ -0,0 +1,79 @@
+/* livecaptions-history-model.h
+ * A GListModel over the history store for the history window. Every row is
+ * a session start, a timestamp after a silence, or a single entry. Rows
+ * only refer to history, their text is looked up when a row is shown.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <time.h>
+#include <gio/gio.h>
+#include "history.h"
+
+typedef enum HistoryRowKind {
+    // The start of a session, with the time of its first entry
+    HISTORY_ROW_SESSION_START = 0,
+
+    // The time speech resumed after a silence
+    HISTORY_ROW_TIME = 1,
+
+    // The text of an entry
+    HISTORY_ROW_TEXT = 2,
+
+    // The date and time of a search hit, followed by its HISTORY_ROW_TEXT
+    HISTORY_ROW_HIT_TIME = 3,
+
+    // A line of its own, such as the number of search results
+    HISTORY_ROW_MESSAGE = 4
+} HistoryRowKind;
+
+G_BEGIN_DECLS
+
+#define LIVECAPTIONS_TYPE_HISTORY_ROW (livecaptions_history_row_get_type())
+
+G_DECLARE_FINAL_TYPE (LiveCaptionsHistoryRow, livecaptions_history_row, LIVECAPTIONS, HISTORY_ROW, GObject);
+
+#define LIVECAPTIONS_TYPE_HISTORY_MODEL (livecaptions_history_model_get_type())
+
+G_DECLARE_FINAL_TYPE (LiveCaptionsHistoryModel, livecaptions_history_model, LIVECAPTIONS, HISTORY_MODEL, GObject);
+
+G_END_DECLS
+
+HistoryRowKind livecaptions_history_row_get_kind(LiveCaptionsHistoryRow *row);
+time_t livecaptions_history_row_get_timestamp(LiveCaptionsHistoryRow *row);
+
+// Copies the entry of a HISTORY_ROW_TEXT row, whose tokens must then be
+// freed with free. Returns false if history has been erased since.
+bool livecaptions_history_row_copy_entry(LiveCaptionsHistoryRow *row, struct history_entry *copy);
+
+// The text of a HISTORY_ROW_MESSAGE row
+const char *livecaptions_history_row_get_message(LiveCaptionsHistoryRow *row);
+
+
+LiveCaptionsHistoryModel *livecaptions_history_model_new(void);
+
+// Shows only the active session
+void livecaptions_history_model_reset(LiveCaptionsHistoryModel *self);
+
+// Adds the next older session with anything in it at the top. Returns false
+// once the oldest session has been added.
+bool livecaptions_history_model_load_more(LiveCaptionsHistoryModel *self);
+
+// Shows message followed by search hits, newest at the bottom
+void livecaptions_history_model_show_hits(LiveCaptionsHistoryModel *self, const struct history_search_hit *hits, size_t count, const char *message);
@@ -17,18 +17,25 @@
  */
 
 #include <ctype.h>
+#include <stdlib.h>
 #include <glib/gi18n.h>
 #include <april_api.h>
 #include <adwaita.h>
 #include "livecaptions-history-window.h"
 #include "history.h"
 #include "profanity-filter.h"
+#include "render-config.h"
 #include "common.h"
 #include "window-helper.h"
 #include "line-gen.h"
+#include "livecaptions-history-model.h"
+#include "history-export.h"
 
 G_DEFINE_TYPE(LiveCaptionsHistoryWindow, livecaptions_history_window, GTK_TYPE_WINDOW)
 
+// Search results shown at most, the newest ones
+#define HISTORY_SEARCH_MAX_HITS 200
+
 
 static gboolean close_self_window(gpointer userdata) {
     LiveCaptionsHistoryWindow *self = LIVECAPTIONS_HISTORY_WINDOW(userdata);
@@ -81,176 +88,232 @@ static gboolean force_bottom(gpointer userdata) {
     return G_SOURCE_REMOVE;
 }
 
-static void add_text(LiveCaptionsHistoryWindow *self, char *text, bool is_text) {
-    GtkWidget *label = gtk_label_new(text);
+// Shared by every text row instead of being built for each label
+static void update_font_attributes(LiveCaptionsHistoryWindow *self) {
+    if(self->font_attrs != NULL) pango_attr_list_unref(self->font_attrs);
+
+    char *font_name = g_settings_get_string(self->settings, "font-name");
+    PangoFontDescription *desc = pango_font_description_from_string(font_name);
+
+    self->font_attrs = pango_attr_list_new();
+    pango_attr_list_change(self->font_attrs, pango_attr_font_desc_new(desc));
+
+    pango_font_description_free(desc);
+    g_free(font_name);
+}
+
+// Appends the text of an entry with the current filter and capitalization
+// settings, followed by a newline
+static void append_entry_text(GString *string, const struct history_entry *entry, struct token_capitalizer *tcap, bool use_lowercase, FilterMode filter_mode) {
+    if(entry->tokens[0].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT) {
+        tcap->previous_was_period = true;
+    }
+
+    for(size_t j=0; j<entry->tokens_count;) {
+        size_t skipahead = 1;
+        const char *token = history_token_text(&entry->tokens[j]);
+
+        if((filter_mode > FILTER_NONE) && (entry->tokens[j].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT)) {
+            size_t skip = get_filter_skip_history(entry->tokens, j, entry->tokens_count, filter_mode);
+            if(skip > 0) {
+                skipahead = skip;
+                token = SWEAR_REPLACEMENT;
+            }
+        }
+
+        if((j == 0) && (*token == ' ')) token++;
+
+        bool should_be_capitalized = false;
+        if((j+skipahead) < entry->tokens_count){
+            should_be_capitalized = use_lowercase && token_capitalizer_next(tcap, token, entry->tokens[j].flags, history_token_text(&entry->tokens[j+skipahead]), entry->tokens[j+skipahead].flags);
+        }else{
+            should_be_capitalized = use_lowercase && token_capitalizer_next(tcap, token, entry->tokens[j].flags, NULL, 0);
+        }
+
+        if(use_lowercase){
+            const char *p = token;
+            gunichar c;
+            while (*p) {
+                c = g_utf8_get_char_validated(p, -1);
+                if(c == ((gunichar)-2)) {
+                    printf("gunichar -2 \n");
+                    break;
+                }else if(c == ((gunichar)-1)) {
+                    printf("gunichar -1 \n");
+                    break;
+                }
+
+                c = g_unichar_tolower(c);
 
-    if(is_text){
-        PangoFontDescription *desc = pango_font_description_from_string(g_settings_get_string(self->settings, "font-name"));
-        PangoAttribute *attr_font = pango_attr_font_desc_new(desc);
-        PangoAttrList *attr = gtk_label_get_attributes(GTK_LABEL(label));
-        if(attr == NULL){
-            attr = pango_attr_list_new();
+                if(should_be_capitalized){
+                    gunichar c1 = g_unichar_toupper(c);
+                    if(c != c1){
+                        c = c1;
+                        should_be_capitalized = false;
+                    }
+                }
+
+                g_string_append_unichar(string, c);
+
+                p = g_utf8_next_char(p);
+            }
+        }else{
+            g_string_append(string, token);
         }
-        pango_attr_list_change(attr, attr_font);
-        gtk_label_set_attributes(GTK_LABEL(label), attr);
-        pango_font_description_free(desc);
+
+        j += skipahead;
     }
 
+    g_string_append_c(string, '\n');
+}
+
+static void setup_row_cb(GtkSignalListItemFactory *factory, GtkListItem *item, LiveCaptionsHistoryWindow *self) {
+    GtkWidget *label = gtk_label_new(NULL);
+
     gtk_label_set_selectable(GTK_LABEL(label), true);
     gtk_label_set_wrap(GTK_LABEL(label), true);
     gtk_label_set_xalign(GTK_LABEL(label), 0.0f);
-    gtk_widget_add_css_class(label, is_text ? "history-label" : "timestamp-label");
 
     gtk_widget_set_hexpand(label, true);
     gtk_widget_set_halign(label, GTK_ALIGN_FILL);
+    gtk_widget_set_margin_start(label, 18);
+    gtk_widget_set_margin_end(label, 36);
 
-    gtk_box_prepend(self->main_box, label);
+    gtk_list_item_set_child(item, label);
+    gtk_list_item_set_activatable(item, false);
 }
 
-static void add_time(LiveCaptionsHistoryWindow *self, time_t timestamp, bool date) {
-    char text[64];
+static void bind_row_cb(GtkSignalListItemFactory *factory, GtkListItem *item, LiveCaptionsHistoryWindow *self) {
+    LiveCaptionsHistoryRow *row = LIVECAPTIONS_HISTORY_ROW(gtk_list_item_get_item(item));
+    GtkLabel *label = GTK_LABEL(gtk_list_item_get_child(item));
 
+    HistoryRowKind kind = livecaptions_history_row_get_kind(row);
+    time_t timestamp = livecaptions_history_row_get_timestamp(row);
     struct tm *tm = localtime(&timestamp);
-    strftime(text, 64, date ? "\n\nStart of session %F | %H:%M" : "%H:%M:%S", tm);
 
-    add_text(self, text, false);
-}
+    char time_text[64];
+    GString *string = NULL;
+    const char *text = time_text;
+
+    switch(kind) {
+    case HISTORY_ROW_SESSION_START:
+        strftime(time_text, 64, "\n\nStart of session %F | %H:%M", tm);
+        break;
+    case HISTORY_ROW_TIME:
+        strftime(time_text, 64, "%H:%M:%S", tm);
+        break;
+    case HISTORY_ROW_HIT_TIME:
+        strftime(time_text, 64, "\n%F | %H:%M:%S", tm);
+        break;
+    case HISTORY_ROW_MESSAGE:
+        text = livecaptions_history_row_get_message(row);
+        break;
+    case HISTORY_ROW_TEXT: {
+        struct render_config config = render_config_get();
+
+        // A copy, the active session may grow and move its entries meanwhile
+        struct history_entry entry;
+        string = g_string_new(NULL);
+        if(livecaptions_history_row_copy_entry(row, &entry)) {
+            if(entry.tokens_count > 0) {
+                struct token_capitalizer tcap;
+                token_capitalizer_init(&tcap);
+
+                append_entry_text(string, &entry, &tcap, config.use_lowercase, config.filter_mode);
+                g_string_truncate(string, string->len - 1);
+            }
 
-static void add_session(LiveCaptionsHistoryWindow *self, const struct history_session *session){
-    if(session->entries_count == 0) return;
+            free(entry.tokens);
+        }
 
-    bool use_lowercase = !g_settings_get_boolean(self->settings, "text-uppercase");
-    GString *string = g_string_new(NULL);
+        text = string->str;
+        break;
+    }
+    }
 
-    bool filter_slurs = g_settings_get_boolean(self->settings, "filter-slurs");
-    bool filter_profanity = g_settings_get_boolean(self->settings, "filter-profanity");
+    bool is_text = (kind == HISTORY_ROW_TEXT);
 
-    FilterMode filter_mode = filter_profanity ? FILTER_PROFANITY : (filter_slurs ? FILTER_SLURS : FILTER_NONE);
-    struct token_capitalizer tcap;
-    token_capitalizer_init(&tcap);
+    gtk_label_set_text(label, text);
+    gtk_label_set_attributes(label, is_text ? self->font_attrs : NULL);
 
-    for(size_t i_1=0; i_1<session->entries_count; i_1++){
-        size_t i = session->entries_count - i_1 - 1;
+    gtk_widget_remove_css_class(GTK_WIDGET(label), is_text ? "timestamp-label" : "history-label");
+    gtk_widget_add_css_class(GTK_WIDGET(label), is_text ? "history-label" : "timestamp-label");
 
-        const struct history_entry *entry = &session->entries[i];
+    if(string != NULL) g_string_free(string, true);
+}
 
-        if(entry->tokens_count == 0){
-            // Silence
-            if((i + 1) >= session->entries_count) continue;
-            const struct history_entry *next_entry = &session->entries[i+1];
+static void load_more_cb(LiveCaptionsHistoryWindow *self) {
+    if(!livecaptions_history_model_load_more(self->model))
+        gtk_widget_set_sensitive(self->load_more_button, false);
+}
 
-            add_text(self, string->str, true);
-            add_time(self, next_entry->timestamp, false);
+// Scrolling up to the top loads the session before
+static void edge_reached_cb(GtkScrolledWindow *scroll, GtkPositionType pos, LiveCaptionsHistoryWindow *self) {
+    if((pos != GTK_POS_TOP) || !gtk_widget_get_visible(self->load_more_button)) return;
+    if(!gtk_widget_get_sensitive(self->load_more_button)) return;
 
-            g_string_truncate(string, 0);
-        } else {
-            GString *entry_text = g_string_new(NULL);
+    load_more_cb(self);
+}
 
-            if(entry->tokens[0].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT) {
-                tcap.previous_was_period = true;
-            }
 
-            for(size_t j=0; j<entry->tokens_count;) {
-                size_t skipahead = 1;
-                const char *token = entry->tokens[j].token;
+static void export_progress_cb(double fraction, gpointer userdata) {
+    LiveCaptionsHistoryWindow *self = LIVECAPTIONS_HISTORY_WINDOW(userdata);
+    if(self->export_cancellable == NULL) return;
 
-                if((filter_mode > FILTER_NONE) && (entry->tokens[j].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT)) {
-                    size_t skip = get_filter_skip_history(entry->tokens, j, entry->tokens_count, filter_mode);
-                    if(skip > 0) {
-                        skipahead = skip;
-                        token = SWEAR_REPLACEMENT;
-                    }
-                }
+    gtk_progress_bar_set_fraction(self->export_progress, fraction);
+}
 
-                if((j == 0) && (*token == ' ')) token++;
+static void export_done_cb(GObject *source_object, GAsyncResult *result, gpointer userdata) {
+    LiveCaptionsHistoryWindow *self = LIVECAPTIONS_HISTORY_WINDOW(userdata);
 
-                bool should_be_capitalized = false;
-                if((j+skipahead) < entry->tokens_count){
-                    should_be_capitalized = use_lowercase && token_capitalizer_next(&tcap, token, entry->tokens[j].flags, entry->tokens[j+skipahead].token, entry->tokens[j+skipahead].flags);
-                }else{
-                    should_be_capitalized = use_lowercase && token_capitalizer_next(&tcap, token, entry->tokens[j].flags, NULL, 0);
-                }
+    g_autoptr(GError) error = NULL;
+    bool ok = history_export_finish(result, &error);
 
-                if(use_lowercase){
-                    const char *p = token;
-                    gunichar c;
-                    while (*p) {
-                        c = g_utf8_get_char_validated(p, -1);
-                        if(c == ((gunichar)-2)) {
-                            printf("gunichar -2 \n");
-                            break;
-                        }else if(c == ((gunichar)-1)) {
-                            printf("gunichar -1 \n");
-                            break;
-                        }
-
-                        c = g_unichar_tolower(c);
-
-                        if(should_be_capitalized){
-                            gunichar c1 = g_unichar_toupper(c);
-                            if(c != c1){
-                                c = c1;
-                                should_be_capitalized = false;
-                            }
-                        }
-
-                        g_string_append_unichar(entry_text, c);
-
-                        p = g_utf8_next_char(p);
-                    }
-                }else{
-                    g_string_append(entry_text, token);
-                }
-
-                j += skipahead;
-            }
+    // Cancelled when the window is closed, there is nothing left to update
+    if(!ok && g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) return;
 
-            g_string_append_c(entry_text, '\n');
-            g_string_prepend(string, entry_text->str);
+    g_clear_object(&self->export_cancellable);
 
-            g_string_free(entry_text, true);
-        }
-    }
+    gtk_widget_set_visible(GTK_WIDGET(self->export_progress), false);
+    gtk_widget_set_sensitive(self->export_button, true);
 
-    add_text(self, string->str, true);
-    add_time(self, session->entries[0].timestamp, true);
-}
+    if(!ok) {
+        printf("Exporting history failed: %s\n", error->message);
+    } else {
+        g_autoptr(GFile) file = g_file_new_for_path(self->export_path);
+        char *uri = g_file_get_uri(file);
 
-static void load_to(LiveCaptionsHistoryWindow *self, size_t idx){
-    for(size_t i_1=0; i_1<1; i_1++){
-        const struct history_session *session = get_history_session(idx - i_1 - 1);
-        if(session == NULL) break;
+        gtk_show_uri(GTK_WINDOW(self), uri, GDK_CURRENT_TIME);
 
-        // TODO: text fading?
-        add_session(self, session);
+        g_free(uri);
     }
-}
 
-static void load_more_cb(LiveCaptionsHistoryWindow *self) {
-    // gets very laggy
-    load_to(self, ++self->session_load);
+    g_clear_pointer(&self->export_path, g_free);
 }
 
-
 static void on_save_response(GtkNativeDialog *native,
                              int        response,
                              LiveCaptionsHistoryWindow *self)
 {
-    if(response == GTK_RESPONSE_ACCEPT){
+    if((response == GTK_RESPONSE_ACCEPT) && (self->export_cancellable == NULL)){
         GtkFileChooser *chooser = GTK_FILE_CHOOSER(native);
 
         g_autoptr(GFile) file = gtk_file_chooser_get_file(chooser);
-        
-        char *path = g_file_get_path(file);
 
-        export_history_as_text(path);
+        self->export_path = g_file_get_path(file);
+        self->export_cancellable = g_cancellable_new();
 
-        char *uri = g_file_get_uri(file);
+        gtk_progress_bar_set_fraction(self->export_progress, 0.0);
+        gtk_widget_set_visible(GTK_WIDGET(self->export_progress), true);
+        gtk_widget_set_sensitive(self->export_button, false);
 
-        gtk_show_uri(GTK_WINDOW(self), uri, GDK_CURRENT_TIME);
-
-        g_free(path);
-        g_free(uri);
+        history_export_async(self->export_path,
+                             history_export_format_for_path(self->export_path),
+                             G_OBJECT(self),
+                             self->export_cancellable,
+                             export_progress_cb,
+                             export_done_cb,
+                             self);
     }
 
     g_object_unref(native);
@@ -290,43 +353,118 @@ static gboolean deferred_update_keep_above(void *userdata) {
 
 
 static void refresh_cb(LiveCaptionsHistoryWindow *self) {
-    GtkWidget *childs = gtk_widget_get_first_child(GTK_WIDGET(self->main_box));
-    while (childs != NULL) {
-        gtk_box_remove(self->main_box, childs);
-        childs = gtk_widget_get_first_child(GTK_WIDGET(self->main_box));
+    // Clearing the search comes back here through search_changed_cb
+    if(*gtk_editable_get_text(GTK_EDITABLE(self->search_entry)) != '\0') {
+        gtk_editable_set_text(GTK_EDITABLE(self->search_entry), "");
+        return;
     }
 
-    self->session_load = 0;
-    load_to(self, ++self->session_load);
+    update_font_attributes(self);
+
+    gtk_widget_set_visible(self->load_more_button, true);
+    gtk_widget_set_sensitive(self->load_more_button, true);
+
+    livecaptions_history_model_reset(self->model);
+
+    g_idle_add(force_bottom, self);
+}
+
+// Shows every entry matching the search, the newest at the bottom like the
+// rest of history
+static void show_search_results(LiveCaptionsHistoryWindow *self, const char *query) {
+    gtk_widget_set_visible(self->load_more_button, false);
+
+    struct history_search_hit *hits = calloc(HISTORY_SEARCH_MAX_HITS, sizeof(struct history_search_hit));
+    size_t found = history_search(query, hits, HISTORY_SEARCH_MAX_HITS);
+    size_t count = (found < HISTORY_SEARCH_MAX_HITS) ? found : HISTORY_SEARCH_MAX_HITS;
+
+    char *summary;
+    if(found == 0)
+        summary = g_strdup_printf(_("No results for \"%s\""), query);
+    else if(found > count)
+        summary = g_strdup_printf(_("Showing the newest %zu of %zu results"), count, found);
+    else
+        summary = g_strdup_printf(ngettext("%zu result", "%zu results", found), found);
+
+    livecaptions_history_model_show_hits(self->model, hits, count, summary);
+
+    g_free(summary);
+    free(hits);
 
     g_idle_add(force_bottom, self);
 }
 
+static void search_changed_cb(LiveCaptionsHistoryWindow *self) {
+    const char *query = gtk_editable_get_text(GTK_EDITABLE(self->search_entry));
+
+    if(*query == '\0') {
+        refresh_cb(self);
+        return;
+    }
+
+    show_search_results(self, query);
+}
+
+static void livecaptions_history_window_dispose(GObject *object) {
+    LiveCaptionsHistoryWindow *self = LIVECAPTIONS_HISTORY_WINDOW(object);
+
+    // The export keeps going after the window is gone otherwise
+    if(self->export_cancellable != NULL) g_cancellable_cancel(self->export_cancellable);
+    g_clear_object(&self->export_cancellable);
+    g_clear_pointer(&self->export_path, g_free);
+
+    g_clear_object(&self->model);
+    g_clear_pointer(&self->font_attrs, pango_attr_list_unref);
+
+    G_OBJECT_CLASS(livecaptions_history_window_parent_class)->dispose(object);
+}
+
 static void livecaptions_history_window_class_init(LiveCaptionsHistoryWindowClass *klass) {
     GtkWidgetClass *widget_class = GTK_WIDGET_CLASS(klass);
 
+    G_OBJECT_CLASS(klass)->dispose = livecaptions_history_window_dispose;
+
     gtk_widget_class_set_template_from_resource(widget_class, "/net/sapples/LiveCaptions/livecaptions-history-window.ui");
 
     gtk_widget_class_bind_template_child(widget_class, LiveCaptionsHistoryWindow, scroll);
-    gtk_widget_class_bind_template_child(widget_class, LiveCaptionsHistoryWindow, main_box);
+    gtk_widget_class_bind_template_child(widget_class, LiveCaptionsHistoryWindow, list_view);
+    gtk_widget_class_bind_template_child(widget_class, LiveCaptionsHistoryWindow, search_entry);
+    gtk_widget_class_bind_template_child(widget_class, LiveCaptionsHistoryWindow, load_more_button);
+    gtk_widget_class_bind_template_child(widget_class, LiveCaptionsHistoryWindow, export_button);
+    gtk_widget_class_bind_template_child(widget_class, LiveCaptionsHistoryWindow, export_progress);
 
     gtk_widget_class_bind_template_callback(widget_class, load_more_cb);
+    gtk_widget_class_bind_template_callback(widget_class, edge_reached_cb);
     gtk_widget_class_bind_template_callback(widget_class, export_cb);
     gtk_widget_class_bind_template_callback(widget_class, warn_deletion_cb);
     gtk_widget_class_bind_template_callback(widget_class, refresh_cb);
+    gtk_widget_class_bind_template_callback(widget_class, search_changed_cb);
 }
 
-// TODO: ctrl+f search
 static void livecaptions_history_window_init(LiveCaptionsHistoryWindow *self) {
     gtk_widget_init_template(GTK_WIDGET(self));
 
     self->settings = g_settings_new("net.sapples.LiveCaptions");
 
+    self->font_attrs = NULL;
+    update_font_attributes(self);
 
-    self->session_load = 0;
-    load_to(self, ++self->session_load);
+    // Only the rows in view get a label, which is rebound as they scroll
+    GtkListItemFactory *factory = gtk_signal_list_item_factory_new();
+    g_signal_connect(factory, "setup", G_CALLBACK(setup_row_cb), self);
+    g_signal_connect(factory, "bind", G_CALLBACK(bind_row_cb), self);
+
+    self->model = livecaptions_history_model_new();
+    GtkNoSelection *selection = gtk_no_selection_new(G_LIST_MODEL(g_object_ref(self->model)));
+
+    gtk_list_view_set_factory(self->list_view, factory);
+    gtk_list_view_set_model(self->list_view, GTK_SELECTION_MODEL(selection));
+
+    g_object_unref(factory);
+    g_object_unref(selection);
+
+    livecaptions_history_model_reset(self->model);
 
     g_idle_add(force_bottom, self);
     g_idle_add(deferred_update_keep_above, self);
 }
-
@@ -26,11 +26,25 @@ struct _LiveCaptionsHistoryWindow {
 
     GSettings *settings;
 
-    GtkBox *main_box;
+    GtkListView *list_view;
 
     GtkScrolledWindow *scroll;
 
-    size_t session_load;
+    GtkSearchEntry *search_entry;
+
+    GtkWidget *load_more_button;
+
+    GtkWidget *export_button;
+
+    GtkProgressBar *export_progress;
+
+    // Set while an export is running
+    GCancellable *export_cancellable;
+    char *export_path;
+
+    struct _LiveCaptionsHistoryModel *model;
+
+    PangoAttrList *font_attrs;
 };
 
 G_BEGIN_DECLS
@@ -17,6 +17,7 @@
  */
 
 #include <glib/gi18n.h>
+#include <math.h>
 
 #include "common.h"
 #include "window-helper.h"
@@ -37,6 +38,99 @@ static void rerun_benchmark_cb (LiveCaptionsSettings *self) {
     gtk_window_destroy(GTK_WINDOW(self));
 }
 
+#define LATENCY_REFRESH_SECONDS 1
+
+static void set_latency_subtitle(LiveCaptionsSettings *self, AdwActionRow *row, LatencyStage stage) {
+    struct latency_summary summary;
+    asr_thread_get_latency(self->application->asr, stage, &summary);
+
+    if(summary.count == 0) {
+        adw_action_row_set_subtitle(row, "-");
+        return;
+    }
+
+    char text[96];
+    snprintf(text, sizeof(text), "%.0f / %.0f / %.0f ms", summary.p50_ms, summary.p90_ms, summary.p99_ms);
+    adw_action_row_set_subtitle(row, text);
+}
+
+static void set_vad_subtitle(LiveCaptionsSettings *self) {
+    struct vad_stats stats;
+    asr_thread_get_vad_stats(self->application->asr, &stats);
+
+    if(!stats.enabled) {
+        adw_action_row_set_subtitle(self->vad_skipped_row, _("Off"));
+        return;
+    }
+
+    if(stats.samples_seen == 0) {
+        adw_action_row_set_subtitle(self->vad_skipped_row, "-");
+        return;
+    }
+
+    // Audio held back before speech is counted when it is fed later
+    double fed = (double)MIN(stats.samples_fed, stats.samples_seen) / (double)stats.samples_seen;
+
+    char text[96];
+    snprintf(text, sizeof(text), _("%.0f%% of audio, %zu utterances"), (1.0 - fed) * 100.0, stats.utterances);
+    adw_action_row_set_subtitle(self->vad_skipped_row, text);
+}
+
+static gboolean update_latency(void *userdata) {
+    LiveCaptionsSettings *self = userdata;
+
+    // The application is only set after construction
+    if((self->application == NULL) || (self->application->asr == NULL)) return G_SOURCE_CONTINUE;
+
+    set_latency_subtitle(self, self->latency_capture_row, LATENCY_CAPTURE_TO_FEED);
+    set_latency_subtitle(self, self->latency_result_row, LATENCY_FEED_TO_RESULT);
+    set_latency_subtitle(self, self->latency_paint_row, LATENCY_RESULT_TO_PAINT);
+    set_vad_subtitle(self);
+
+    return G_SOURCE_CONTINUE;
+}
+
+#define LEVEL_REFRESH_MS 100
+
+// The meter shows RMS from here to full scale
+#define LEVEL_MIN_DB -60.0
+
+static double level_to_db(double value) {
+    if(value <= 0.0) return LEVEL_MIN_DB;
+
+    double db = 20.0 * log10(value / 32768.0);
+    return (db < LEVEL_MIN_DB) ? LEVEL_MIN_DB : db;
+}
+
+static gboolean update_level(void *userdata) {
+    LiveCaptionsSettings *self = userdata;
+
+    if((self->application == NULL) || (self->application->asr == NULL)) return G_SOURCE_CONTINUE;
+
+    struct pcm_level level;
+    asr_thread_take_level(self->application->asr, &level);
+    if(level.count == 0) return G_SOURCE_CONTINUE;
+
+    double rms_db = level_to_db(pcm_level_rms(&level));
+    double peak_db = level_to_db((double)level.peak);
+
+    gtk_level_bar_set_value(self->input_level_bar, (rms_db - LEVEL_MIN_DB) / -LEVEL_MIN_DB);
+
+    char text[96];
+    snprintf(text, sizeof(text), _("%.0f dB RMS, %.0f dB peak"), rms_db, peak_db);
+    adw_action_row_set_subtitle(self->input_level_row, text);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void reset_latency_cb(LiveCaptionsSettings *self) {
+    if((self->application == NULL) || (self->application->asr == NULL)) return;
+
+    asr_thread_reset_latency(self->application->asr);
+    asr_thread_reset_vad_stats(self->application->asr);
+    update_latency(self);
+}
+
 static void about_cb(LiveCaptionsSettings *self) {
     GtkRoot *root = gtk_widget_get_root (GTK_WIDGET (self));
     GtkWidget *about;
@@ -173,9 +267,20 @@ static void add_model_cb(LiveCaptionsSettings *self) {
 
 static void on_builtin_toggled(LiveCaptionsSettings *self);
 
+static void livecaptions_settings_dispose(GObject *object) {
+    LiveCaptionsSettings *self = LIVECAPTIONS_SETTINGS(object);
+
+    g_clear_handle_id(&self->latency_source, g_source_remove);
+    g_clear_handle_id(&self->level_source, g_source_remove);
+
+    G_OBJECT_CLASS(livecaptions_settings_parent_class)->dispose(object);
+}
+
 static void livecaptions_settings_class_init(LiveCaptionsSettingsClass *klass) {
     GtkWidgetClass *widget_class = GTK_WIDGET_CLASS(klass);
 
+    G_OBJECT_CLASS(klass)->dispose = livecaptions_settings_dispose;
+
     gtk_widget_class_set_template_from_resource(widget_class, "/net/sapples/LiveCaptions/livecaptions-settings.ui");
 
     gtk_widget_class_bind_template_child (widget_class, LiveCaptionsSettings, font_button);
@@ -197,6 +302,12 @@ static void livecaptions_settings_class_init(LiveCaptionsSettingsClass *klass) {
     gtk_widget_class_bind_template_child (widget_class, LiveCaptionsSettings, window_transparency_adjustment);
 
     gtk_widget_class_bind_template_child (widget_class, LiveCaptionsSettings, benchmark_label);
+    gtk_widget_class_bind_template_child (widget_class, LiveCaptionsSettings, latency_capture_row);
+    gtk_widget_class_bind_template_child (widget_class, LiveCaptionsSettings, latency_result_row);
+    gtk_widget_class_bind_template_child (widget_class, LiveCaptionsSettings, latency_paint_row);
+    gtk_widget_class_bind_template_child (widget_class, LiveCaptionsSettings, vad_skipped_row);
+    gtk_widget_class_bind_template_child (widget_class, LiveCaptionsSettings, input_level_row);
+    gtk_widget_class_bind_template_child (widget_class, LiveCaptionsSettings, input_level_bar);
     gtk_widget_class_bind_template_child (widget_class, LiveCaptionsSettings, keep_above_instructions);
 
     gtk_widget_class_bind_template_child (widget_class, LiveCaptionsSettings, models_list);
@@ -206,6 +317,7 @@ static void livecaptions_settings_class_init(LiveCaptionsSettingsClass *klass) {
     gtk_widget_class_bind_template_callback (widget_class, report_cb);
     gtk_widget_class_bind_template_callback (widget_class, about_cb);
     gtk_widget_class_bind_template_callback (widget_class, rerun_benchmark_cb);
+    gtk_widget_class_bind_template_callback (widget_class, reset_latency_cb);
     gtk_widget_class_bind_template_callback (widget_class, open_history);
     gtk_widget_class_bind_template_callback (widget_class, add_model_cb);
     gtk_widget_class_bind_template_callback (widget_class, on_builtin_toggled);
@@ -427,6 +539,9 @@ static void livecaptions_settings_init(LiveCaptionsSettings *self) {
     sprintf(benchmark_result, "%.2f", (float)benchmark_result_v);
     gtk_label_set_text(self->benchmark_label, benchmark_result);
 
+    self->latency_source = g_timeout_add_seconds(LATENCY_REFRESH_SECONDS, update_latency, self);
+    self->level_source = g_timeout_add(LEVEL_REFRESH_MS, update_level, self);
+
     if(is_keep_above_supported(GTK_WINDOW(self))) {
         g_settings_bind(self->settings, "keep-on-top", self->keep_above_switch, "active", G_SETTINGS_BIND_DEFAULT);
         gtk_widget_set_sensitive(GTK_WIDGET(self->keep_above_switch), true);
@@ -47,6 +47,17 @@ struct _LiveCaptionsSettings {
     GtkAdjustment *window_transparency_adjustment;
 
     GtkLabel *benchmark_label;
+
+    AdwActionRow *latency_capture_row;
+    AdwActionRow *latency_result_row;
+    AdwActionRow *latency_paint_row;
+    AdwActionRow *vad_skipped_row;
+    guint latency_source;
+
+    AdwActionRow *input_level_row;
+    GtkLevelBar *input_level_bar;
+    guint level_source;
+
     GtkLabel *keep_above_instructions;
 
     AdwPreferencesGroup *models_list;
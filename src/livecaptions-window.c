@@ -27,9 +27,22 @@
 
 G_DEFINE_TYPE(LiveCaptionsWindow, livecaptions_window, GTK_TYPE_APPLICATION_WINDOW)
 
+static void livecaptions_window_dispose(GObject *object) {
+    LiveCaptionsWindow *self = LIVECAPTIONS_WINDOW(object);
+
+    // Also disconnects it from the scroll adjustment, which may outlive it
+    g_clear_pointer(&self->transcript, transcript_buffer_free);
+
+    g_clear_pointer(&self->font_attrs, pango_attr_list_unref);
+
+    G_OBJECT_CLASS(livecaptions_window_parent_class)->dispose(object);
+}
+
 static void livecaptions_window_class_init (LiveCaptionsWindowClass *klass) {
     GtkWidgetClass *widget_class = GTK_WIDGET_CLASS(klass);
 
+    G_OBJECT_CLASS(klass)->dispose = livecaptions_window_dispose;
+
     gtk_widget_class_set_template_from_resource(widget_class, "/net/sapples/LiveCaptions/livecaptions-window.ui");
     gtk_widget_class_bind_template_child(widget_class, LiveCaptionsWindow, main);
     gtk_widget_class_bind_template_child(widget_class, LiveCaptionsWindow, side_box);
@@ -62,6 +75,7 @@ static void update_line_width(LiveCaptionsWindow *self){
     int width, height;
     PangoLayout *layout = gtk_label_get_layout(self->label);
     layout = pango_layout_copy(layout);
+    pango_layout_set_attributes(layout, self->font_attrs);
 
     pango_layout_set_width(layout, -1);
     pango_layout_set_text(layout, LINE_WIDTH_TEXT_TEMPLATE, text_len);
@@ -81,15 +95,13 @@ static void update_line_width(LiveCaptionsWindow *self){
 static void update_font(LiveCaptionsWindow *self) {
     PangoFontDescription *desc = pango_font_description_from_string(g_settings_get_string(self->settings, "font-name"));
 
-    PangoAttribute *attr_font = pango_attr_font_desc_new(desc);
+    // Kept apart from the label's own attributes, which also hold the alpha
+    // of every token and are replaced on every update
+    if(self->font_attrs != NULL) pango_attr_list_unref(self->font_attrs);
+    self->font_attrs = pango_attr_list_new();
+    pango_attr_list_change(self->font_attrs, pango_attr_font_desc_new(desc));
 
-    PangoAttrList *attr = gtk_label_get_attributes(self->label);
-    if(attr == NULL){
-        attr = pango_attr_list_new();
-    }
-    pango_attr_list_change(attr, attr_font);
-
-    gtk_label_set_attributes(self->label, attr);
+    gtk_label_set_attributes(self->label, self->font_attrs);
 
     pango_font_description_free(desc);
 
@@ -125,6 +137,12 @@ static void update_keep_above(LiveCaptionsWindow *self) {
     }
 }
 
+static void update_transcript_max_chars(LiveCaptionsWindow *self) {
+    if(self->transcript == NULL) return;
+
+    transcript_buffer_set_max_chars(self->transcript, (size_t)g_settings_get_int(self->settings, "transcript-max-chars"));
+}
+
 static void on_settings_change(G_GNUC_UNUSED GSettings *settings,
                                char      *key,
                                gpointer   user_data){
@@ -138,6 +156,8 @@ static void on_settings_change(G_GNUC_UNUSED GSettings *settings,
         update_window_transparency(self);
     }else if(g_str_equal(key, "keep-on-top")) {
         update_keep_above(self);
+    }else if(g_str_equal(key, "transcript-max-chars")) {
+        update_transcript_max_chars(self);
     }
 }
 
@@ -215,22 +235,17 @@ static void livecaptions_window_init(LiveCaptionsWindow *self) {
 
     self->font_layout = NULL;
     self->font_layout_counter = 0;
+    self->font_attrs = NULL;
 
     update_font(self);
     update_window_transparency(self);
 
     // Configure transcript view defaults
     if(self->transcript_view) {
-        GtkTextBuffer *buf = gtk_text_view_get_buffer(self->transcript_view);
-        if(buf) {
-            // Do not clear buffer on startup; keep session text persistent
-            // Create a mark to indicate where the live (replaceable) tail starts
-            GtkTextIter end_iter;
-            gtk_text_buffer_get_end_iter(buf, &end_iter);
-            if(self->transcript_live_start)
-                gtk_text_buffer_delete_mark(buf, self->transcript_live_start);
-            self->transcript_live_start = gtk_text_buffer_create_mark(buf, "transcript_live_start", &end_iter, TRUE);
-        }
+        // Do not clear buffer on startup; keep session text persistent
+        self->transcript = transcript_buffer_new(self->transcript_view, self->transcript_scroll);
+        update_transcript_max_chars(self);
+
         gtk_text_view_set_wrap_mode(self->transcript_view, GTK_WRAP_WORD_CHAR);
         gtk_text_view_set_editable(self->transcript_view, FALSE);
         gtk_text_view_set_cursor_visible(self->transcript_view, FALSE);
@@ -22,6 +22,8 @@
 
 #include <gtk/gtk.h>
 
+#include "transcript-buffer.h"
+
 struct _LiveCaptionsWindow {
     GtkApplicationWindow  parent_instance;
 
@@ -37,7 +39,7 @@ struct _LiveCaptionsWindow {
     // New persistent transcript widgets
     GtkScrolledWindow *transcript_scroll;
     GtkTextView       *transcript_view;
-    GtkTextMark       *transcript_live_start; // mark where the live, replaceable tail begins
+    transcript_buffer  transcript;
 
     GtkCssProvider *css_provider;
 
@@ -52,6 +54,10 @@ struct _LiveCaptionsWindow {
     volatile size_t font_layout_counter;
     volatile int max_text_width;
 
+    // The caption font, which the line generator applies the token alpha on
+    // top of
+    PangoAttrList *font_attrs;
+
     gboolean was_errored;
 };
 
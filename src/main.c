@@ -22,6 +22,7 @@
 
 #include <glib/gi18n.h>
 #include <stdio.h>
+#include <string.h>
 #include <adwaita.h>
 #include <april_api.h>
 
@@ -35,6 +36,7 @@
 #include "livecaptions-application.h"
 #include "audiocap.h"
 #include "asrproc.h"
+#include "file-transcribe.h"
 #include "common.h"
 
 int main (int argc, char *argv[]) {
@@ -65,13 +67,72 @@ int main (int argc, char *argv[]) {
     char *active_model = g_settings_get_string(settings, "active-model");
     if(active_model == NULL) active_model = GET_MODEL_PATH();
 
-    asr_thread asr = create_asr_thread(active_model);
+    // Headless mode: --transcribe FILE [--transcribe FILE...] [--output BASE] [--jobs N]
+    {
+        const char *transcribe_paths[argc];
+        size_t num_transcribe_paths = 0;
+        const char *output_base = NULL;
+        int num_jobs = 0;
+
+        for(int i=1; i<argc; i++) {
+            if((strcmp(argv[i], "--transcribe") == 0) && ((i + 1) < argc)) {
+                transcribe_paths[num_transcribe_paths++] = argv[++i];
+            } else if((strcmp(argv[i], "--output") == 0) && ((i + 1) < argc)) {
+                output_base = argv[++i];
+            } else if((strcmp(argv[i], "--jobs") == 0) && ((i + 1) < argc)) {
+                num_jobs = atoi(argv[++i]);
+            }
+        }
+
+        if(num_transcribe_paths > 0)
+            return transcribe_files(active_model, transcribe_paths, num_transcribe_paths, output_base, num_jobs);
+    }
+
+    // Profiling: --record-trace FILE saves the results of the model,
+    // --replay-trace FILE [--replay-speed original|max] shows them again
+    // without loading a model
+    const char *record_trace_path = NULL;
+    const char *replay_trace_path = NULL;
+    bool replay_max_speed = false;
+
+    // GApplication would refuse options it does not know, so these are
+    // taken out of what it gets
+    char *app_argv[argc + 1];
+    int app_argc = 0;
+    app_argv[app_argc++] = argv[0];
+
+    for(int i=1; i<argc; i++) {
+        if((strcmp(argv[i], "--record-trace") == 0) && ((i + 1) < argc)) {
+            record_trace_path = argv[++i];
+        } else if((strcmp(argv[i], "--replay-trace") == 0) && ((i + 1) < argc)) {
+            replay_trace_path = argv[++i];
+        } else if((strcmp(argv[i], "--replay-speed") == 0) && ((i + 1) < argc)) {
+            replay_max_speed = (strcmp(argv[++i], "max") == 0);
+        } else {
+            app_argv[app_argc++] = argv[i];
+        }
+    }
+    app_argv[app_argc] = NULL;
+
+    asr_thread asr;
+    if(replay_trace_path != NULL) {
+        asr = create_replay_asr_thread(replay_trace_path, replay_max_speed);
+        if(asr == NULL) return 1;
+    } else {
+        asr = create_asr_thread(active_model);
+    }
+
     if(asr == NULL){
         printf("Loading model failed!\n");
         // Show GUI error?
         return 1;
     }
 
+    if((record_trace_path != NULL) && !asr_thread_record_trace(asr, record_trace_path)) {
+        free_asr_thread(asr);
+        return 1;
+    }
+
     int ret;
     {
         g_autoptr(LiveCaptionsApplication) app = NULL;
@@ -101,7 +162,7 @@ int main (int argc, char *argv[]) {
         * method "run". But we need to cast, which is what the "G_APPLICATION()"
         * macro does.
         */
-        ret = g_application_run(G_APPLICATION(app), argc, argv);
+        ret = g_application_run(G_APPLICATION(app), app_argc, app_argv);
     }
 
     free_asr_thread(asr);
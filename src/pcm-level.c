@@ -0,0 +1,197 @@
+/* pcm-level.c
+ * Implements pcm_level_scan
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pcm-level.h"
+
+#include <glib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PCM_LEVEL_X86
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define PCM_LEVEL_NEON
+#include <arm_neon.h>
+#endif
+
+// Vector loops leave the last few samples to this
+static void scan_tail(const short *data, size_t start, size_t count, int *max, int *min, uint64_t *sum) {
+    int lo = *min, hi = *max;
+    uint64_t total = *sum;
+
+    // Kept free of branches so the compiler can vectorize it where it may
+    for(size_t i=start; i<count; i++) {
+        int sample = data[i];
+        hi = (sample > hi) ? sample : hi;
+        lo = (sample < lo) ? sample : lo;
+        total += (uint64_t)(sample * sample);
+    }
+
+    *min = lo;
+    *max = hi;
+    *sum = total;
+}
+
+static void finish(struct pcm_level *level, size_t count, int max, int min, uint64_t sum) {
+    level->peak = (max > -min) ? max : -min;
+    level->sum_squares = sum;
+    level->count = count;
+}
+
+static void scan_scalar(const short *data, size_t count, struct pcm_level *level) {
+    int max = 0, min = 0;
+    uint64_t sum = 0;
+
+    scan_tail(data, 0, count, &max, &min, &sum);
+    finish(level, count, max, min, sum);
+}
+
+#ifdef PCM_LEVEL_X86
+// Squares are summed in pairs by madd. Two samples of -32768 make 2^31,
+// which only fits unsigned, so the pairs are widened to 64 bits right away.
+__attribute__((target("sse2")))
+static void scan_sse2(const short *data, size_t count, struct pcm_level *level) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i vmax = zero, vmin = zero, vsum = zero;
+
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *)&data[i]);
+
+        vmax = _mm_max_epi16(vmax, x);
+        vmin = _mm_min_epi16(vmin, x);
+
+        __m128i squares = _mm_madd_epi16(x, x);
+        vsum = _mm_add_epi64(vsum, _mm_unpacklo_epi32(squares, zero));
+        vsum = _mm_add_epi64(vsum, _mm_unpackhi_epi32(squares, zero));
+    }
+
+    short maxs[8], mins[8];
+    uint64_t sums[2];
+    _mm_storeu_si128((__m128i *)maxs, vmax);
+    _mm_storeu_si128((__m128i *)mins, vmin);
+    _mm_storeu_si128((__m128i *)sums, vsum);
+
+    int max = 0, min = 0;
+    uint64_t sum = sums[0] + sums[1];
+    for(int k=0; k<8; k++) {
+        if(maxs[k] > max) max = maxs[k];
+        if(mins[k] < min) min = mins[k];
+    }
+
+    scan_tail(data, i, count, &max, &min, &sum);
+    finish(level, count, max, min, sum);
+}
+
+__attribute__((target("avx2")))
+static void scan_avx2(const short *data, size_t count, struct pcm_level *level) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i vmax = zero, vmin = zero, vsum = zero;
+
+    size_t i = 0;
+    for(; i + 16 <= count; i += 16) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)&data[i]);
+
+        vmax = _mm256_max_epi16(vmax, x);
+        vmin = _mm256_min_epi16(vmin, x);
+
+        __m256i squares = _mm256_madd_epi16(x, x);
+        vsum = _mm256_add_epi64(vsum, _mm256_unpacklo_epi32(squares, zero));
+        vsum = _mm256_add_epi64(vsum, _mm256_unpackhi_epi32(squares, zero));
+    }
+
+    short maxs[16], mins[16];
+    uint64_t sums[4];
+    _mm256_storeu_si256((__m256i *)maxs, vmax);
+    _mm256_storeu_si256((__m256i *)mins, vmin);
+    _mm256_storeu_si256((__m256i *)sums, vsum);
+
+    int max = 0, min = 0;
+    uint64_t sum = sums[0] + sums[1] + sums[2] + sums[3];
+    for(int k=0; k<16; k++) {
+        if(maxs[k] > max) max = maxs[k];
+        if(mins[k] < min) min = mins[k];
+    }
+
+    scan_tail(data, i, count, &max, &min, &sum);
+    finish(level, count, max, min, sum);
+}
+#endif
+
+#ifdef PCM_LEVEL_NEON
+static void scan_neon(const short *data, size_t count, struct pcm_level *level) {
+    int16x8_t vmax = vdupq_n_s16(0), vmin = vdupq_n_s16(0);
+    uint64x2_t vsum = vdupq_n_u64(0);
+
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8) {
+        int16x8_t x = vld1q_s16(&data[i]);
+
+        vmax = vmaxq_s16(vmax, x);
+        vmin = vminq_s16(vmin, x);
+
+        // A single square is at most 2^30, the pairwise add widens
+        int32x4_t low = vmull_s16(vget_low_s16(x), vget_low_s16(x));
+        int32x4_t high = vmull_high_s16(x, x);
+        vsum = vpadalq_u32(vsum, vreinterpretq_u32_s32(low));
+        vsum = vpadalq_u32(vsum, vreinterpretq_u32_s32(high));
+    }
+
+    int max = vmaxvq_s16(vmax), min = vminvq_s16(vmin);
+    uint64_t sum = vaddvq_u64(vsum);
+
+    scan_tail(data, i, count, &max, &min, &sum);
+    finish(level, count, max, min, sum);
+}
+#endif
+
+static struct pcm_level_impl impls[4];
+static size_t num_impls;
+
+static void detect_impls(void) {
+    impls[num_impls++] = (struct pcm_level_impl){ "scalar", scan_scalar };
+
+#ifdef PCM_LEVEL_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2")) impls[num_impls++] = (struct pcm_level_impl){ "sse2", scan_sse2 };
+    if(__builtin_cpu_supports("avx2")) impls[num_impls++] = (struct pcm_level_impl){ "avx2", scan_avx2 };
+#endif
+
+#ifdef PCM_LEVEL_NEON
+    // Always there on aarch64
+    impls[num_impls++] = (struct pcm_level_impl){ "neon", scan_neon };
+#endif
+}
+
+const struct pcm_level_impl *pcm_level_get_impls(size_t *count) {
+    static gsize detected = 0;
+    if(g_once_init_enter(&detected)) {
+        detect_impls();
+        g_once_init_leave(&detected, 1);
+    }
+
+    *count = num_impls;
+    return impls;
+}
+
+void pcm_level_scan(const short *data, size_t count, struct pcm_level *level) {
+    size_t count_impls;
+    const struct pcm_level_impl *available = pcm_level_get_impls(&count_impls);
+
+    available[count_impls - 1].scan(data, count, level);
+}
@@ -0,0 +1,59 @@
+/* pcm-level.h
+ * This file contains pcm_level_scan, which finds the peak and energy of a
+ * buffer of PCM16 in one pass. It runs on every capture buffer, so it uses
+ * SSE2, AVX2 or NEON when the CPU has them, picked the first time it is
+ * called, and plain C otherwise.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct pcm_level {
+    // Largest absolute sample, up to 32768
+    int peak;
+
+    uint64_t sum_squares;
+    size_t count;
+};
+
+void pcm_level_scan(const short *data, size_t count, struct pcm_level *level);
+
+// Same as finding any sample above threshold or below -threshold
+static inline bool pcm_level_is_silent(const struct pcm_level *level, int threshold) {
+    return level->peak <= threshold;
+}
+
+static inline double pcm_level_rms(const struct pcm_level *level) {
+    if(level->count == 0) return 0.0;
+    return sqrt((double)level->sum_squares / (double)level->count);
+}
+
+typedef void (*pcm_level_scan_fn)(const short *data, size_t count, struct pcm_level *level);
+
+struct pcm_level_impl {
+    const char *name;
+    pcm_level_scan_fn scan;
+};
+
+// Every implementation this CPU can run, plain C first and the one
+// pcm_level_scan uses last
+const struct pcm_level_impl *pcm_level_get_impls(size_t *count);
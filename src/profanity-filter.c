@@ -20,10 +20,16 @@
 #include "profanity-filter.h"
 #include "history.h"
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <glib.h>
 
 #define MAX_CURSE_WORD_LENGTH 64
 
+// In bytes once casefolded, rules of several words included
+#define MAX_RULE_LENGTH 256
+
 #define NUM_CURSE_WORDS 22
 const char curse_words[NUM_CURSE_WORDS][MAX_CURSE_WORD_LENGTH] = {
     "FAG*",
@@ -50,78 +56,454 @@ const char curse_words[NUM_CURSE_WORDS][MAX_CURSE_WORD_LENGTH] = {
     "MASTURBAT*",
 };
 
-typedef enum WordState {
-    WORD_STILL_SCANNING = 0,
-    WORD_NON_MATCHING = 1,
-    WORD_MATCHED = 2
-} WordState;
+// The trie goes over the bytes of casefolded UTF-8, so that letters of any
+// script match regardless of case. Words of a rule are separated by a single
+// space, which matches the boundary between two words of the text.
+#define FILTER_ALPHABET 256
 
-size_t get_filter_skip(const AprilToken *tokens, size_t curr_idx, size_t count, FilterMode mode) {
-    if(mode <= FILTER_NONE) return 0;
+// Rules are only matched from the start of a word, so a trie is all that is
+// needed, a failed match never has to resume at a later offset.
+//
+// While rules are added the children of each node are a list sorted by
+// byte. Once finished, the children of each node are packed next to each
+// other, which keeps lists of thousands of words small. The root gets a slot
+// for every byte as it has the most children and is looked at for every word.
+struct build_node {
+    // 0 if there is none, the root is node 0 and is never a child
+    uint32_t first_child;
+    uint32_t next_sibling;
+
+    uint8_t c;
+    uint8_t prefix_mode;
+    uint8_t word_mode;
+};
+
+struct filter_node {
+    uint32_t first_edge;
+    uint16_t num_edges;
+
+    // The FilterMode from which a word matches once it gets here (a rule
+    // ending in *), or only if it also ends here. 0 if no rule does.
+    uint8_t prefix_mode;
+    uint8_t word_mode;
+};
+
+struct profanity_filter_i {
+    // Only until profanity_filter_finish
+    struct build_node *build;
+    size_t build_capacity;
+
+    size_t num_nodes;
+    size_t num_rules;
+
+    // Unique for every filter finished, unlike its address
+    uint64_t serial;
+
+    atomic_int refs;
+
+    uint32_t root_next[FILTER_ALPHABET];
+    struct filter_node *nodes;
+
+    // The children of node n are edge_nodes[first_edge..first_edge+num_edges],
+    // sorted by character
+    uint8_t *edge_chars;
+    uint32_t *edge_nodes;
+};
+
+typedef enum FilterState {
+    FILTER_SCANNING = 0,
+    FILTER_NO_MATCH = 1,
+    FILTER_MATCHED = 2
+} FilterState;
+
+struct filter_cursor {
+    uint32_t node;
+    FilterState state;
+
+    // The tokens of the longest rule that matched whole words so far
+    size_t matched;
+
+    // The start of a character the next token finishes
+    char pending[4];
+    size_t pending_length;
+};
+
+// Held only to swap the filter in use or take a reference to it
+static GMutex current_mutex;
+static profanity_filter current_filter = NULL;
+
+static atomic_uint_least64_t next_serial = 1;
+
+
+// Returns the rule composed and casefolded, with its words separated by
+// single spaces, or NULL if it has anything but letters, digits, marks and
+// apostrophes
+static char *fold_rule(const char *rule, size_t length) {
+    if(!g_utf8_validate(rule, length, NULL)) return NULL;
+
+    char *composed = g_utf8_normalize(rule, length, G_NORMALIZE_DEFAULT_COMPOSE);
+    if(composed == NULL) return NULL;
+
+    char *folded = g_utf8_casefold(composed, -1);
+    g_free(composed);
+
+    GString *result = g_string_sized_new(strlen(folded));
+    bool separated = false;
+    for(const char *p = folded; *p; p = g_utf8_next_char(p)) {
+        gunichar c = g_utf8_get_char(p);
+        if(g_unichar_isspace(c)) {
+            separated = true;
+            continue;
+        }
+
+        if(!g_unichar_isalnum(c) && !g_unichar_ismark(c) && (c != '\'')) {
+            g_free(folded);
+            g_string_free(result, TRUE);
+            return NULL;
+        }
+
+        if(separated && (result->len > 0)) g_string_append_c(result, ' ');
+        separated = false;
+
+        g_string_append_unichar(result, c);
+    }
+
+    g_free(folded);
+
+    return g_string_free(result, FALSE);
+}
+
+static uint32_t add_node(profanity_filter filter) {
+    if(filter->num_nodes == filter->build_capacity) {
+        filter->build_capacity *= 2;
+        filter->build = realloc(filter->build, filter->build_capacity * sizeof(struct build_node));
+    }
+
+    memset(&filter->build[filter->num_nodes], 0, sizeof(struct build_node));
+    return (uint32_t)(filter->num_nodes++);
+}
+
+profanity_filter profanity_filter_new(void) {
+    profanity_filter filter = calloc(1, sizeof(struct profanity_filter_i));
+    atomic_init(&filter->refs, 1);
+
+    filter->build_capacity = 64;
+    filter->build = malloc(filter->build_capacity * sizeof(struct build_node));
+    add_node(filter);
+
+    return filter;
+}
+
+static void profanity_filter_free(profanity_filter filter) {
+    free(filter->build);
+    free(filter->nodes);
+    free(filter->edge_chars);
+    free(filter->edge_nodes);
+    free(filter);
+}
+
+profanity_filter profanity_filter_ref(profanity_filter filter) {
+    atomic_fetch_add_explicit(&filter->refs, 1, memory_order_relaxed);
+    return filter;
+}
+
+void profanity_filter_unref(profanity_filter filter) {
+    if(atomic_fetch_sub_explicit(&filter->refs, 1, memory_order_acq_rel) == 1)
+        profanity_filter_free(filter);
+}
+
+bool profanity_filter_add(profanity_filter filter, const char *rule, FilterMode mode) {
+    if(filter->build == NULL) return false;
+
+    size_t length = strlen(rule);
+    bool prefix = (length > 0) && (rule[length - 1] == '*');
+    if(prefix) length--;
+
+    if((length == 0) || (length > MAX_RULE_LENGTH) || (mode <= FILTER_NONE)) return false;
+
+    char *folded = fold_rule(rule, length);
+    if(folded == NULL) return false;
+
+    length = strlen(folded);
+    if((length == 0) || (length > MAX_RULE_LENGTH)) {
+        g_free(folded);
+        return false;
+    }
+
+    uint32_t node = 0;
+    for(size_t i=0; i<length; i++){
+        uint8_t c = (uint8_t)folded[i];
+
+        // Children are kept sorted so that packing them keeps the order
+        uint32_t *link = &filter->build[node].first_child;
+        while((*link != 0) && (filter->build[*link].c < c)) link = &filter->build[*link].next_sibling;
+
+        if((*link == 0) || (filter->build[*link].c != c)) {
+            uint32_t child = add_node(filter);
+
+            // add_node may have moved the nodes
+            link = &filter->build[node].first_child;
+            while((*link != 0) && (filter->build[*link].c < c)) link = &filter->build[*link].next_sibling;
+
+            filter->build[child].c = c;
+            filter->build[child].next_sibling = *link;
+            *link = child;
+        }
+
+        node = *link;
+    }
+
+    g_free(folded);
+
+    // The least restrictive mode wins if a rule is given twice
+    uint8_t *rule_mode = prefix ? &filter->build[node].prefix_mode : &filter->build[node].word_mode;
+    if(*rule_mode == 0) filter->num_rules++;
+    if((*rule_mode == 0) || (*rule_mode > mode)) *rule_mode = (uint8_t)mode;
+
+    return true;
+}
+
+void profanity_filter_add_builtin(profanity_filter filter) {
+    // The rules after \1 are for profanity, the ones before are slurs
+    FilterMode mode = FILTER_SLURS;
+    for(size_t i=0; i<NUM_CURSE_WORDS; i++){
+        if(curse_words[i][0] == '\1') {
+            mode = FILTER_PROFANITY;
+            continue;
+        }
+
+        profanity_filter_add(filter, curse_words[i], mode);
+    }
+}
+
+void profanity_filter_finish(profanity_filter filter) {
+    if(filter->build == NULL) return;
+
+    filter->nodes = calloc(filter->num_nodes, sizeof(struct filter_node));
+    filter->edge_chars = malloc(filter->num_nodes);
+    filter->edge_nodes = malloc(filter->num_nodes * sizeof(uint32_t));
+
+    for(uint32_t child = filter->build[0].first_child; child != 0; child = filter->build[child].next_sibling)
+        filter->root_next[filter->build[child].c] = child;
+
+    // Every node but the root is the child of exactly one edge
+    uint32_t edges = 0;
+    for(size_t n=0; n<filter->num_nodes; n++){
+        const struct build_node *b = &filter->build[n];
+        struct filter_node *node = &filter->nodes[n];
+
+        node->first_edge = edges;
+        node->prefix_mode = b->prefix_mode;
+        node->word_mode = b->word_mode;
 
-    WordState is_match[NUM_CURSE_WORDS] = { 0 };
-
-    size_t num_to_skip = 0;
-    size_t curr_character = 0;
-    bool matched_badword = false;
-    bool still_scanning_any = true;
-    for(size_t i=curr_idx; i<count; i++){
-        if((i > curr_idx) && (tokens[i].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT)) {
-            // Once we've arrived at the next word, stop looking.
-            // we only want to filter the word starting at curr_idx
-            break;
+        for(uint32_t child = b->first_child; child != 0; child = filter->build[child].next_sibling){
+            filter->edge_chars[edges] = filter->build[child].c;
+            filter->edge_nodes[edges] = child;
+            edges++;
+            node->num_edges++;
         }
+    }
+
+    free(filter->build);
+    filter->build = NULL;
+
+    filter->serial = atomic_fetch_add_explicit(&next_serial, 1, memory_order_relaxed);
+}
+
+size_t profanity_filter_num_rules(profanity_filter filter) {
+    return filter->num_rules;
+}
+
+uint64_t profanity_filter_serial(profanity_filter filter) {
+    return filter->serial;
+}
+
+
+void profanity_filter_publish(profanity_filter filter) {
+    profanity_filter_finish(filter);
+
+    g_mutex_lock(&current_mutex);
+    profanity_filter old = current_filter;
+    current_filter = filter;
+    g_mutex_unlock(&current_mutex);
+
+    if(old != NULL) profanity_filter_unref(old);
+}
+
+profanity_filter profanity_filter_get(void) {
+    g_mutex_lock(&current_mutex);
+
+    // Nothing has been published yet, start with the built-in rules
+    if(current_filter == NULL) {
+        current_filter = profanity_filter_new();
+        profanity_filter_add_builtin(current_filter);
+        profanity_filter_finish(current_filter);
+    }
+
+    profanity_filter filter = profanity_filter_ref(current_filter);
+
+    g_mutex_unlock(&current_mutex);
+
+    return filter;
+}
+
+
+static uint32_t filter_next(const struct profanity_filter_i *filter, uint32_t node, uint8_t c) {
+    if(node == 0) return filter->root_next[c];
+
+    const struct filter_node *n = &filter->nodes[node];
+    for(uint32_t e = n->first_edge; e < (n->first_edge + n->num_edges); e++){
+        if(filter->edge_chars[e] == c) return filter->edge_nodes[e];
+        if(filter->edge_chars[e] > c) break;
+    }
+
+    return 0;
+}
+
+// Advances the cursor by one byte of casefolded text, returning false once
+// it is known whether the rules match
+static bool filter_advance(const struct profanity_filter_i *filter, struct filter_cursor *cursor, uint8_t c, FilterMode mode) {
+    uint32_t next = filter_next(filter, cursor->node, c);
+    if(next == 0) {
+        cursor->state = FILTER_NO_MATCH;
+        return false;
+    }
+
+    cursor->node = next;
+
+    uint8_t prefix_mode = filter->nodes[next].prefix_mode;
+    if((prefix_mode != 0) && (mode >= prefix_mode)) {
+        cursor->state = FILTER_MATCHED;
+        return false;
+    }
+
+    return true;
+}
+
+// Text that is not plain ASCII is casefolded before going over it
+static void filter_step_utf8(const struct profanity_filter_i *filter, struct filter_cursor *cursor, const char *text, FilterMode mode) {
+    char *joined = NULL;
+    if(cursor->pending_length > 0) {
+        joined = g_strconcat(cursor->pending, text, NULL);
+        text = joined;
+        cursor->pending_length = 0;
+    }
+
+    const char *end;
+    g_utf8_validate(text, -1, &end);
+
+    // A character split between tokens is finished by the next one
+    size_t rest = strlen(end);
+    if(rest > 0) {
+        if((rest < sizeof(cursor->pending)) && (g_utf8_get_char_validated(end, rest) == (gunichar)-2)) {
+            memcpy(cursor->pending, end, rest);
+            cursor->pending[rest] = '\0';
+            cursor->pending_length = rest;
+        } else {
+            cursor->state = FILTER_NO_MATCH;
+        }
+    }
 
-        num_to_skip++;
-
-        if(matched_badword) continue;
-
-        still_scanning_any = false;
-        size_t token_len = strlen(tokens[i].token);
-        for(size_t c=0; c<token_len; c++){
-            if(curr_character >= MAX_CURSE_WORD_LENGTH) break;
-
-            if((c == 0) && (tokens[i].token[c] == ' ')) continue;
-
-            for(size_t j=0; j<NUM_CURSE_WORDS; j++){
-                const char *rule = curse_words[j];
-                if((rule[0] == '\1') && mode < FILTER_PROFANITY) break;
-
-                if(is_match[j] == WORD_STILL_SCANNING) {
-                    still_scanning_any = true;
-
-                    if(rule[curr_character] != tokens[i].token[c]) {
-                        is_match[j] = WORD_NON_MATCHING;
-                        continue;
-                    }
-
-                    if(rule[curr_character + 1] == '*') {
-                        is_match[j] = WORD_MATCHED;
-                        matched_badword = true;
-                        break;
-                    }else if(rule[curr_character + 1] == '\0') {
-                        // if doesn't end in *, must be the end of word to match
-                        if(((i + 1) >= count) || (tokens[i + 1].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT)) {
-                            is_match[j] = WORD_MATCHED;
-                            matched_badword = true;
-                            break;
-                        }else{
-                            is_match[j] = WORD_NON_MATCHING;
-                            continue;
-                        }
-                    }
-                }
-            }
-
-            curr_character++;
+    if(cursor->state == FILTER_SCANNING) {
+        char *folded = g_utf8_casefold(text, end - text);
+        for(const char *p = folded; *p; p++)
+            if(!filter_advance(filter, cursor, (uint8_t)*p, mode)) break;
+
+        g_free(folded);
+    }
+
+    g_free(joined);
+}
+
+// Advances the cursor over the text of one token of the word
+static void filter_step(const struct profanity_filter_i *filter, struct filter_cursor *cursor, const char *text, FilterMode mode) {
+    if(cursor->state != FILTER_SCANNING) return;
+
+    // Only the space at the start of a token separates words
+    if(*text == ' ') text++;
+
+    // Casefolding ASCII only lowercases it, which needs no copy
+    if(cursor->pending_length == 0) {
+        for(; *text && !((uint8_t)*text & 0x80); text++)
+            if(!filter_advance(filter, cursor, (uint8_t)g_ascii_tolower(*text), mode)) return;
+
+        if(*text == '\0') return;
+    }
+
+    filter_step_utf8(filter, cursor, text, mode);
+}
+
+// Called at the end of every word the cursor went over, after consumed
+// tokens. Moves the cursor on to the next word if there is one and a rule
+// may still go on to it, otherwise returns false.
+static bool filter_word_end(const struct profanity_filter_i *filter, struct filter_cursor *cursor, FilterMode mode, size_t consumed, bool more) {
+    if(cursor->state == FILTER_MATCHED) {
+        cursor->matched = consumed;
+        return false;
+    }
+
+    if((cursor->state == FILTER_NO_MATCH) || (cursor->pending_length > 0)) return false;
+
+    uint8_t word_mode = filter->nodes[cursor->node].word_mode;
+    if((word_mode != 0) && (mode >= word_mode)) cursor->matched = consumed;
+
+    if(!more) return false;
+
+    uint32_t next = filter_next(filter, cursor->node, ' ');
+    if(next == 0) return false;
+
+    cursor->node = next;
+    return true;
+}
+
+size_t profanity_filter_skip(profanity_filter filter, const AprilToken *tokens, size_t curr_idx, size_t count, FilterMode mode) {
+    if((mode <= FILTER_NONE) || (curr_idx >= count)) return 0;
+
+    struct filter_cursor cursor = { 0 };
+
+    size_t i = curr_idx;
+    for(;;) {
+        filter_step(filter, &cursor, tokens[i].token, mode);
+        if(cursor.state == FILTER_NO_MATCH) break;
+
+        i++;
+        bool more = (i < count);
+        if(!more || (tokens[i].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT)) {
+            if(!filter_word_end(filter, &cursor, mode, i - curr_idx, more)) break;
         }
+    }
+
+    return cursor.matched;
+}
+
+size_t profanity_filter_skip_history(profanity_filter filter, const struct history_token *tokens, size_t curr_idx, size_t count, FilterMode mode) {
+    if((mode <= FILTER_NONE) || (curr_idx >= count)) return 0;
+
+    struct filter_cursor cursor = { 0 };
 
-        if(!still_scanning_any) break;
+    size_t i = curr_idx;
+    for(;;) {
+        filter_step(filter, &cursor, history_token_text(&tokens[i]), mode);
+        if(cursor.state == FILTER_NO_MATCH) break;
+
+        i++;
+        bool more = (i < count);
+        if(!more || (tokens[i].flags & APRIL_TOKEN_FLAG_WORD_BOUNDARY_BIT)) {
+            if(!filter_word_end(filter, &cursor, mode, i - curr_idx, more)) break;
+        }
     }
 
+    return cursor.matched;
+}
+
+size_t get_filter_skip(const AprilToken *tokens, size_t curr_idx, size_t count, FilterMode mode) {
+    if(mode <= FILTER_NONE) return 0;
+
+    profanity_filter filter = profanity_filter_get();
+    size_t skip = profanity_filter_skip(filter, tokens, curr_idx, count, mode);
+    profanity_filter_unref(filter);
 
-    if(matched_badword) return num_to_skip;
-    else return 0;
+    return skip;
 }
 
 size_t get_filter_skip_history(const struct history_token *tokens,
@@ -129,17 +511,11 @@ size_t get_filter_skip_history(const struct history_token *tokens,
                                size_t count,
                                FilterMode mode)
 {
-    // Construct a list of AprilToken * and copy data
-    AprilToken *a_tokens = calloc(sizeof(AprilToken), count);
-    for(size_t i=0; i<count; i++){
-        a_tokens[i].token   = &tokens[i].token[0];
-        a_tokens[i].flags   = tokens[i].flags;
-        a_tokens[i].logprob = tokens[i].logprob;
-    }
-
-    size_t result = get_filter_skip(a_tokens, curr_idx, count, mode);
+    if(mode <= FILTER_NONE) return 0;
 
-    free(a_tokens);
+    profanity_filter filter = profanity_filter_get();
+    size_t skip = profanity_filter_skip_history(filter, tokens, curr_idx, count, mode);
+    profanity_filter_unref(filter);
 
-    return result;
-}
\ No newline at end of file
+    return skip;
+}
@@ -19,6 +19,7 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <april_api.h>
@@ -44,4 +45,46 @@ struct history_token;
 size_t get_filter_skip_history(const struct history_token *tokens,
                                size_t curr_idx,
                                size_t count,
-                               FilterMode mode);
\ No newline at end of file
+                               FilterMode mode);
+
+
+// The rules are compiled into a trie. The functions above use the one that
+// was last published, which starts out with only the built-in rules.
+typedef struct profanity_filter_i *profanity_filter;
+
+// Filters are reference counted, a new one has a single reference
+profanity_filter profanity_filter_new(void);
+profanity_filter profanity_filter_ref(profanity_filter filter);
+void profanity_filter_unref(profanity_filter filter);
+
+// Adds a rule that applies from the given mode up. A rule ending in * matches
+// any word starting with it, otherwise only the whole word matches. Rules are
+// UTF-8 and may contain letters of any script, which match regardless of
+// case, digits, marks and apostrophes. Words separated by spaces match the
+// same words in a row. Returns false if the rule cannot be added.
+bool profanity_filter_add(profanity_filter filter, const char *rule, FilterMode mode);
+
+// Adds the slurs and profanity that are filtered by default
+void profanity_filter_add_builtin(profanity_filter filter);
+
+// Packs the trie for matching. No rules can be added after this.
+void profanity_filter_finish(profanity_filter filter);
+
+size_t profanity_filter_num_rules(profanity_filter filter);
+
+// Differs between any two finished filters, even if one was allocated
+// where the other was freed
+uint64_t profanity_filter_serial(profanity_filter filter);
+
+// Finishes filter and makes it the one in use, taking over the caller's
+// reference. The one it replaces is freed once nobody holds it anymore. Can
+// be called from any thread.
+void profanity_filter_publish(profanity_filter filter);
+
+// Returns a reference to the filter in use, which the caller must unref
+profanity_filter profanity_filter_get(void);
+
+// get_filter_skip and get_filter_skip_history with a given filter, so that
+// a whole update can use the same one
+size_t profanity_filter_skip(profanity_filter filter, const AprilToken *tokens, size_t curr_idx, size_t count, FilterMode mode);
+size_t profanity_filter_skip_history(profanity_filter filter, const struct history_token *tokens, size_t curr_idx, size_t count, FilterMode mode);
@@ -0,0 +1,87 @@
+/* render-config.c
+ * This file contains the implementation for render_config
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdatomic.h>
+#include <string.h>
+#include <adwaita.h>
+
+#include "render-config.h"
+
+// Bit 0 is use_fade, bit 1 use_lowercase, the rest the filter mode
+#define CONFIG_FADE 1u
+#define CONFIG_LOWERCASE 2u
+#define CONFIG_FILTER_SHIFT 2
+
+static unsigned pack_config(const struct render_config *config) {
+    return (config->use_fade ? CONFIG_FADE : 0u)
+         | (config->use_lowercase ? CONFIG_LOWERCASE : 0u)
+         | ((unsigned)config->filter_mode << CONFIG_FILTER_SHIFT);
+}
+
+// Starts out as the defaults: lowercase, profanity filtered, no fade
+static atomic_uint current_config = CONFIG_LOWERCASE | ((unsigned)FILTER_PROFANITY << CONFIG_FILTER_SHIFT);
+
+static GSettings *settings = NULL;
+
+void render_config_publish(const struct render_config *config) {
+    atomic_store_explicit(&current_config, pack_config(config), memory_order_release);
+}
+
+struct render_config render_config_get(void) {
+    unsigned packed = atomic_load_explicit(&current_config, memory_order_acquire);
+
+    struct render_config config = {
+        .use_fade = (packed & CONFIG_FADE) != 0,
+        .use_lowercase = (packed & CONFIG_LOWERCASE) != 0,
+        .filter_mode = (FilterMode)(packed >> CONFIG_FILTER_SHIFT)
+    };
+
+    return config;
+}
+
+static void rebuild_config(void) {
+    bool filter_slurs = g_settings_get_boolean(settings, "filter-slurs");
+    bool filter_profanity = g_settings_get_boolean(settings, "filter-profanity");
+
+    struct render_config config = {
+        .use_fade = g_settings_get_boolean(settings, "fade-text"),
+        .use_lowercase = !g_settings_get_boolean(settings, "text-uppercase"),
+        .filter_mode = filter_profanity ? FILTER_PROFANITY : (filter_slurs ? FILTER_SLURS : FILTER_NONE)
+    };
+
+    render_config_publish(&config);
+}
+
+static void on_settings_changed(GSettings *self, gchar *key, gpointer user_data) {
+    if((strcmp(key, "fade-text") == 0)
+        || (strcmp(key, "text-uppercase") == 0)
+        || (strcmp(key, "filter-slurs") == 0)
+        || (strcmp(key, "filter-profanity") == 0)) {
+        rebuild_config();
+    }
+}
+
+void render_config_init(void) {
+    if(settings != NULL) return;
+
+    settings = g_settings_new("net.sapples.LiveCaptions");
+    g_signal_connect(settings, "changed", G_CALLBACK(on_settings_changed), NULL);
+
+    rebuild_config();
+}
@@ -0,0 +1,47 @@
+/* render-config.h
+ * This file contains the declaration for render_config, an immutable
+ * snapshot of the settings that affect how tokens are turned into text.
+ * The snapshot is rebuilt on the main thread whenever one of those settings
+ * changes and can be read from any thread without locking. It is small
+ * enough to be packed into a single atomic word, so readers get it by value
+ * and there is nothing to free.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include "profanity-filter.h"
+
+struct render_config {
+    bool use_fade;
+    bool use_lowercase;
+    FilterMode filter_mode;
+};
+
+// Reads the current settings and starts tracking changes to them. Must be
+// called from the main thread. Calling it again does nothing.
+void render_config_init(void);
+
+// Returns a copy of the current snapshot. Before render_config_init has been
+// called this returns the defaults.
+struct render_config render_config_get(void);
+
+// Replaces the current snapshot with config. render_config_init
+// calls this whenever the settings change; it is public so that code
+// running without GSettings can still choose a configuration.
+void render_config_publish(const struct render_config *config);
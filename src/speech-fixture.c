@@ -0,0 +1,280 @@
+/* speech-fixture.c
+ * Implements speech_synth
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "speech-fixture.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+
+const struct speech_fixture speech_fixtures[] = {
+    { "conversation", 2022, 60.0, 4.0, 0.20, 0.002 },
+    { "fast",         2023, 60.0, 6.0, 0.08, 0.002 },
+    { "noisy",        2024, 60.0, 4.0, 0.20, 0.030 },
+    { "sparse",       2025, 60.0, 3.5, 0.50, 0.0002 },
+};
+
+const size_t num_speech_fixtures = sizeof(speech_fixtures) / sizeof(speech_fixtures[0]);
+
+typedef enum SpeechSegment {
+    SEGMENT_PAUSE = 0,
+    SEGMENT_GAP,
+    SEGMENT_FRICATIVE,
+    SEGMENT_NASAL,
+    SEGMENT_VOWEL
+} SpeechSegment;
+
+// F1, F2, F3 of a few vowels of an adult male speaker, in Hz
+static const double vowel_formants[][SPEECH_NUM_FORMANTS] = {
+    { 730, 1090, 2440 }, // a
+    { 270, 2290, 3010 }, // i
+    { 300,  870, 2240 }, // u
+    { 530, 1840, 2480 }, // e
+    { 570,  840, 2410 }, // o
+    { 500, 1500, 2500 }, // schwa
+    { 660, 1720, 2410 }, // ae
+};
+
+#define NUM_VOWELS (sizeof(vowel_formants) / sizeof(vowel_formants[0]))
+
+static const double formant_bandwidths[SPEECH_NUM_FORMANTS] = { 90, 110, 170 };
+static const double nasal_formants[SPEECH_NUM_FORMANTS] = { 250, 1100, 2300 };
+
+#define BASE_F0 120.0
+
+// Chosen so that vowels peak around a quarter of full scale
+#define OUTPUT_GAIN 37500.0
+
+const struct speech_fixture *speech_fixture_find(const char *name) {
+    for(size_t i=0; i<num_speech_fixtures; i++)
+        if(strcmp(speech_fixtures[i].name, name) == 0) return &speech_fixtures[i];
+
+    return NULL;
+}
+
+size_t speech_fixture_samples(const struct speech_fixture *fixture, int sample_rate) {
+    return (size_t)(fixture->seconds * (double)sample_rate);
+}
+
+// xorshift32, so that the audio is the same everywhere
+static uint32_t next_random(struct speech_synth *synth) {
+    uint32_t x = synth->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    synth->rng = x;
+    return x;
+}
+
+// Uniform in [low, high)
+static double random_range(struct speech_synth *synth, double low, double high) {
+    return low + (high - low) * ((double)next_random(synth) / 4294967296.0);
+}
+
+static int random_int(struct speech_synth *synth, int low, int high) {
+    return low + (int)(next_random(synth) % (uint32_t)(high - low + 1));
+}
+
+static size_t seconds_to_samples(struct speech_synth *synth, double seconds) {
+    size_t samples = (size_t)(seconds * synth->sample_rate);
+    return samples > 0 ? samples : 1;
+}
+
+static double syllable_seconds(struct speech_synth *synth) {
+    return random_range(synth, 0.7, 1.3) / synth->fixture->syllables_per_second;
+}
+
+static void start_phrase(struct speech_synth *synth) {
+    synth->words_left = random_int(synth, 4, 12);
+    synth->phrase_f0 = BASE_F0 * random_range(synth, 0.9, 1.15);
+}
+
+static void start_syllable(struct speech_synth *synth, bool word_start) {
+    // Most syllables start with a consonant, words more often than not
+    double consonant_chance = word_start ? 0.7 : 0.5;
+    double length = syllable_seconds(synth);
+
+    if(random_range(synth, 0.0, 1.0) < consonant_chance) {
+        bool fricative = random_range(synth, 0.0, 1.0) < 0.6;
+
+        synth->segment = fricative ? SEGMENT_FRICATIVE : SEGMENT_NASAL;
+        synth->segment_left = seconds_to_samples(synth, length * 0.35);
+
+        synth->target_amplitude = fricative ? 0.35 : 0.45;
+        synth->target_voicing = fricative ? 0.0 : 1.0;
+
+        synth->frication.frequency = random_range(synth, 3000.0, 6000.0);
+        if(!fricative) memcpy(synth->target_formants, nasal_formants, sizeof(nasal_formants));
+    } else {
+        synth->segment = SEGMENT_VOWEL;
+        synth->segment_left = seconds_to_samples(synth, length);
+    }
+}
+
+static void start_vowel(struct speech_synth *synth, size_t length) {
+    const double *formants = vowel_formants[next_random(synth) % NUM_VOWELS];
+    for(int i=0; i<SPEECH_NUM_FORMANTS; i++)
+        synth->target_formants[i] = formants[i] * random_range(synth, 0.95, 1.05);
+
+    synth->segment = SEGMENT_VOWEL;
+    synth->segment_left = length;
+
+    synth->target_amplitude = random_range(synth, 0.7, 1.0);
+    synth->target_voicing = 1.0;
+
+    // Pitch drifts down over a phrase, with some movement on every syllable
+    synth->phrase_f0 *= 0.985;
+    synth->f0 = synth->phrase_f0 * random_range(synth, 0.92, 1.08);
+}
+
+static void next_segment(struct speech_synth *synth) {
+    switch(synth->segment) {
+        case SEGMENT_FRICATIVE:
+        case SEGMENT_NASAL:
+            start_vowel(synth, seconds_to_samples(synth, syllable_seconds(synth) * 0.65));
+            return;
+
+        case SEGMENT_VOWEL:
+            if(--synth->syllables_left > 0) {
+                start_syllable(synth, false);
+                return;
+            }
+
+            if(--synth->words_left > 0) {
+                synth->segment = SEGMENT_GAP;
+                synth->segment_left = seconds_to_samples(synth, random_range(synth, 0.0, 0.08));
+            } else {
+                // An average phrase is 8 words of 2 syllables
+                double phrase = 16.0 / synth->fixture->syllables_per_second;
+                double pause = phrase * synth->fixture->pause_fraction / (1.0 - synth->fixture->pause_fraction);
+
+                synth->segment = SEGMENT_PAUSE;
+                synth->segment_left = seconds_to_samples(synth, pause * random_range(synth, 0.5, 1.5));
+            }
+
+            synth->target_amplitude = 0.0;
+            return;
+
+        case SEGMENT_PAUSE:
+            start_phrase(synth);
+            // fallthrough
+        case SEGMENT_GAP:
+        default:
+            synth->syllables_left = random_int(synth, 1, 3);
+            start_syllable(synth, true);
+            return;
+    }
+}
+
+// Second order resonator with unity gain at 0 Hz, as in cascade formant
+// synthesizers
+static double resonate(struct speech_resonator *r, double x, double sample_rate) {
+    double radius = exp(-M_PI * r->bandwidth / sample_rate);
+    double b = 2.0 * radius * cos(2.0 * M_PI * r->frequency / sample_rate);
+    double c = -radius * radius;
+    double a = 1.0 - b - c;
+
+    double y = a * x + b * r->y1 + c * r->y2;
+    r->y2 = r->y1;
+    r->y1 = y;
+
+    return y;
+}
+
+// Rosenberg glottal pulse, open for the first 56% of the period
+static double glottal_pulse(double phase) {
+    if(phase < 0.4) return 0.5 * (1.0 - cos(M_PI * phase / 0.4));
+    if(phase < 0.56) return cos(0.5 * M_PI * (phase - 0.4) / 0.16);
+    return 0.0;
+}
+
+void speech_synth_init(struct speech_synth *synth, const struct speech_fixture *fixture, int sample_rate) {
+    memset(synth, 0, sizeof(*synth));
+
+    synth->fixture = fixture;
+    synth->sample_rate = (double)sample_rate;
+    synth->rng = fixture->seed ? fixture->seed : 1;
+
+    for(int i=0; i<SPEECH_NUM_FORMANTS; i++) {
+        synth->formants[i].frequency = vowel_formants[0][i];
+        synth->formants[i].bandwidth = formant_bandwidths[i];
+        synth->target_formants[i] = vowel_formants[0][i];
+    }
+
+    synth->frication.frequency = 4500.0;
+    synth->frication.bandwidth = 2000.0;
+
+    // Start with a short pause, as a recording would
+    synth->segment = SEGMENT_PAUSE;
+    synth->segment_left = seconds_to_samples(synth, 0.3);
+}
+
+void speech_synth_fill(struct speech_synth *synth, short *out, size_t count) {
+    double fs = synth->sample_rate;
+
+    // Amplitude settles within a few ms, formants glide over about 25 ms
+    double amplitude_rate = 1.0 - exp(-1.0 / (0.004 * fs));
+    double formant_rate = 1.0 - exp(-1.0 / (0.025 * fs));
+    double nyquist_limit = fs * 0.45;
+
+    for(size_t i=0; i<count; i++) {
+        if(synth->segment_left == 0) next_segment(synth);
+        synth->segment_left--;
+
+        synth->amplitude += (synth->target_amplitude - synth->amplitude) * amplitude_rate;
+        synth->voicing += (synth->target_voicing - synth->voicing) * amplitude_rate;
+
+        for(int f=0; f<SPEECH_NUM_FORMANTS; f++) {
+            struct speech_resonator *r = &synth->formants[f];
+            r->frequency += (synth->target_formants[f] - r->frequency) * formant_rate;
+        }
+
+        // Differentiating the pulse stands in for radiation at the lips
+        synth->glottal_phase += synth->f0 / fs;
+        if(synth->glottal_phase >= 1.0) synth->glottal_phase -= 1.0;
+
+        double pulse = glottal_pulse(synth->glottal_phase);
+        double voiced = pulse - synth->glottal_prev;
+        synth->glottal_prev = pulse;
+
+        for(int f=0; f<SPEECH_NUM_FORMANTS; f++) {
+            // Formants above what the sample rate can hold are left out
+            if(synth->formants[f].frequency < nyquist_limit)
+                voiced = resonate(&synth->formants[f], voiced, fs);
+        }
+
+        double white = random_range(synth, -1.0, 1.0);
+        double fricative = 0.0;
+        if(synth->frication.frequency < nyquist_limit)
+            fricative = resonate(&synth->frication, white, fs) * 0.02;
+        else
+            fricative = white * 0.005;
+
+        // Background noise is tilted towards low frequencies like room noise
+        synth->noise_state = 0.95 * synth->noise_state + 0.05 * random_range(synth, -1.0, 1.0);
+
+        double sample = synth->amplitude * (synth->voicing * voiced + (1.0 - synth->voicing) * fricative);
+        sample = sample * OUTPUT_GAIN + synth->noise_state * synth->fixture->noise_level * 32767.0 * 4.0;
+
+        if(sample > 32767.0) sample = 32767.0;
+        if(sample < -32768.0) sample = -32768.0;
+
+        out[i] = (short)lrint(sample);
+    }
+}
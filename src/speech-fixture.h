@@ -0,0 +1,94 @@
+/* speech-fixture.h
+ * This file contains speech_synth, which makes reproducible speech-like
+ * audio for benchmarking. Syllables are made of a voiced source through
+ * gliding vowel formants and fricative noise, grouped into words and
+ * phrases with pauses in between, so the model is kept busy the same way
+ * as with real speech rather than noise or silence.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct speech_fixture {
+    const char *name;
+
+    // The same seed always gives the same audio
+    uint32_t seed;
+    double seconds;
+
+    double syllables_per_second;
+
+    // Roughly the fraction of time spent in pauses between phrases
+    double pause_fraction;
+
+    // Background noise level, relative to full scale
+    double noise_level;
+};
+
+extern const struct speech_fixture speech_fixtures[];
+extern const size_t num_speech_fixtures;
+
+// Returns NULL if there is no fixture with that name
+const struct speech_fixture *speech_fixture_find(const char *name);
+
+#define SPEECH_NUM_FORMANTS 3
+
+struct speech_resonator {
+    double frequency;
+    double bandwidth;
+    double y1, y2;
+};
+
+struct speech_synth {
+    const struct speech_fixture *fixture;
+    double sample_rate;
+
+    uint32_t rng;
+
+    // What is being said right now and for how many more samples
+    int segment;
+    size_t segment_left;
+    int syllables_left;
+    int words_left;
+
+    double f0;
+    double phrase_f0;
+    double glottal_phase;
+    double glottal_prev;
+
+    double amplitude;
+    double target_amplitude;
+    double voicing;
+    double target_voicing;
+
+    double target_formants[SPEECH_NUM_FORMANTS];
+    struct speech_resonator formants[SPEECH_NUM_FORMANTS];
+    struct speech_resonator frication;
+
+    double noise_state;
+};
+
+void speech_synth_init(struct speech_synth *synth, const struct speech_fixture *fixture, int sample_rate);
+
+// Appends the next count samples of mono PCM16
+void speech_synth_fill(struct speech_synth *synth, short *out, size_t count);
+
+// Number of samples in the whole fixture at sample_rate
+size_t speech_fixture_samples(const struct speech_fixture *fixture, int sample_rate);
@@ -0,0 +1,73 @@
+/* text-builder.h
+ * This file contains text_builder, which appends to a fixed-size buffer
+ * while keeping track of its length, so that nothing has to be formatted,
+ * measured or parsed again. An append that does not fit is dropped as a
+ * whole and the builder is marked as having overflowed.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+struct text_builder {
+    char *buffer;
+
+    // Including the terminating NUL
+    size_t capacity;
+    size_t len;
+
+    bool overflowed;
+};
+
+// Continues the text already in buffer, which is len bytes long
+static inline void text_builder_init(struct text_builder *tb, char *buffer, size_t capacity, size_t len) {
+    tb->buffer = buffer;
+    tb->capacity = capacity;
+    tb->len = len;
+    tb->overflowed = false;
+
+    buffer[len] = '\0';
+}
+
+// Whether length more bytes would fit
+static inline bool text_builder_fits(const struct text_builder *tb, size_t length) {
+    return (tb->len + length) < tb->capacity;
+}
+
+static inline bool text_builder_append_len(struct text_builder *tb, const char *text, size_t length) {
+    if(!text_builder_fits(tb, length)) {
+        tb->overflowed = true;
+        return false;
+    }
+
+    memcpy(tb->buffer + tb->len, text, length);
+    tb->len += length;
+    tb->buffer[tb->len] = '\0';
+
+    return true;
+}
+
+static inline bool text_builder_append(struct text_builder *tb, const char *text) {
+    return text_builder_append_len(tb, text, strlen(text));
+}
+
+static inline bool text_builder_append_c(struct text_builder *tb, char c) {
+    return text_builder_append_len(tb, &c, 1);
+}
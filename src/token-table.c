@@ -0,0 +1,122 @@
+/* token-table.c
+ * This file contains the implementation for the token table
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <glib.h>
+
+#include "token-table.h"
+
+// Ids are looked up through fixed blocks of pointers. A block never moves
+// once published, so readers do not need the lock.
+#define TOKEN_TABLE_BLOCK_BITS 10
+#define TOKEN_TABLE_BLOCK_SIZE (1u << TOKEN_TABLE_BLOCK_BITS)
+#define TOKEN_TABLE_MAX_BLOCKS 4096
+
+static GMutex table_mutex;
+
+// Owns the text of every token
+static GStringChunk *strings = NULL;
+
+// Text -> id + 1
+static GHashTable *ids = NULL;
+
+static _Atomic(const char **) blocks[TOKEN_TABLE_MAX_BLOCKS];
+static atomic_uint_least32_t table_size = 0;
+
+
+// Must be called with table_mutex held
+static uint32_t add_token(const char *text) {
+    uint32_t id = atomic_load_explicit(&table_size, memory_order_relaxed);
+
+    if(id >= (TOKEN_TABLE_BLOCK_SIZE * TOKEN_TABLE_MAX_BLOCKS)) {
+        printf("Token table is full, %s is stored as an empty token\n", text);
+        return TOKEN_TABLE_EMPTY_ID;
+    }
+
+    const char **block = atomic_load_explicit(&blocks[id >> TOKEN_TABLE_BLOCK_BITS], memory_order_relaxed);
+    if(block == NULL) {
+        block = calloc(TOKEN_TABLE_BLOCK_SIZE, sizeof(const char *));
+        atomic_store_explicit(&blocks[id >> TOKEN_TABLE_BLOCK_BITS], block, memory_order_release);
+    }
+
+    block[id & (TOKEN_TABLE_BLOCK_SIZE - 1)] = text;
+    g_hash_table_insert(ids, (gpointer)text, GUINT_TO_POINTER(id + 1));
+
+    // Publishes the text along with the new size
+    atomic_store_explicit(&table_size, id + 1, memory_order_release);
+
+    return id;
+}
+
+// Must be called with table_mutex held
+static void ensure_table(void) {
+    if(strings != NULL) return;
+
+    strings = g_string_chunk_new(4096);
+    ids = g_hash_table_new(g_str_hash, g_str_equal);
+
+    add_token(g_string_chunk_insert_len(strings, "", 0));
+}
+
+uint32_t token_table_intern_len(const char *text, size_t length) {
+    // Lookups need a terminated string, and tokens are short
+    char stack_buffer[64];
+    char *key = (length < sizeof(stack_buffer)) ? stack_buffer : malloc(length + 1);
+    memcpy(key, text, length);
+    key[length] = '\0';
+
+    g_mutex_lock(&table_mutex);
+    ensure_table();
+
+    uint32_t id;
+    gpointer existing = g_hash_table_lookup(ids, key);
+    if(existing != NULL) {
+        id = GPOINTER_TO_UINT(existing) - 1;
+    } else {
+        id = add_token(g_string_chunk_insert_len(strings, key, (gssize)length));
+    }
+
+    g_mutex_unlock(&table_mutex);
+
+    if(key != stack_buffer) free(key);
+
+    return id;
+}
+
+uint32_t token_table_intern(const char *text) {
+    return token_table_intern_len(text, strlen(text));
+}
+
+const char *token_table_get(uint32_t id) {
+    if(id >= atomic_load_explicit(&table_size, memory_order_acquire)) return "";
+
+    const char **block = atomic_load_explicit(&blocks[id >> TOKEN_TABLE_BLOCK_BITS], memory_order_acquire);
+    return block[id & (TOKEN_TABLE_BLOCK_SIZE - 1)];
+}
+
+uint32_t token_table_size(void) {
+    g_mutex_lock(&table_mutex);
+    ensure_table();
+    g_mutex_unlock(&table_mutex);
+
+    return atomic_load_explicit(&table_size, memory_order_acquire);
+}
@@ -0,0 +1,45 @@
+/* token-table.h
+ * This file contains the declaration for the token table, which interns the
+ * text of history tokens so that each distinct token is stored only once
+ * and referred to by a 32-bit id.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Id 0 is always the empty string
+#define TOKEN_TABLE_EMPTY_ID 0
+
+// The table only ever grows. Tokens come from the model vocabulary, so it
+// stays small no matter how long history gets.
+
+// Returns the id of the given text, adding it to the table if it is new.
+// Safe to call from any thread. If the table is full, the empty string is
+// returned instead.
+uint32_t token_table_intern(const char *text);
+uint32_t token_table_intern_len(const char *text, size_t length);
+
+// Returns the text of an id. The pointer stays valid for the lifetime of the
+// process. This does not take a lock, so it is cheap enough to call for
+// every token while rendering. Unknown ids return the empty string.
+const char *token_table_get(uint32_t id);
+
+// Number of ids handed out so far. Ids are always below this.
+uint32_t token_table_size(void);
@@ -0,0 +1,322 @@
+/* token-trace.c
+ * Implements token_trace_writer and token_trace_reader
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "token-trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+// What is kept of a token to tell whether the next record repeats it
+struct trace_token {
+    uint32_t text_id;
+    float logprob;
+    uint32_t flags;
+    uint32_t time_ms;
+};
+
+struct token_trace_writer_i {
+    FILE *file;
+    char *path;
+    bool failed;
+
+    // Token text to its index + 1
+    GHashTable *text_ids;
+    uint32_t num_texts;
+
+    GArray *previous;
+
+    // Scratch for the record being put together
+    GByteArray *record;
+
+    int64_t start_time;
+};
+
+struct token_trace_reader_i {
+    FILE *file;
+    char *path;
+
+    GStringChunk *text_chunk;
+    GPtrArray *texts;
+
+    GArray *tokens;
+};
+
+static bool write_bytes(token_trace_writer writer, const void *data, size_t size) {
+    if(writer->failed) return false;
+
+    if(fwrite(data, 1, size, writer->file) != size) {
+        printf("Writing trace %s failed, recording stopped\n", writer->path);
+        writer->failed = true;
+        return false;
+    }
+
+    return true;
+}
+
+token_trace_writer token_trace_writer_new(const char *path) {
+    FILE *file = fopen(path, "wb");
+    if(file == NULL) {
+        printf("Could not create trace %s\n", path);
+        return NULL;
+    }
+
+    token_trace_writer writer = calloc(1, sizeof(struct token_trace_writer_i));
+    writer->file = file;
+    writer->path = g_strdup(path);
+    writer->text_ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    writer->previous = g_array_new(FALSE, FALSE, sizeof(struct trace_token));
+    writer->record = g_byte_array_new();
+    writer->start_time = -1;
+
+    // Results come in a few at a time, most of them small
+    setvbuf(file, NULL, _IOFBF, 65536);
+
+    char magic[8] = TOKEN_TRACE_MAGIC;
+    uint32_t version = TOKEN_TRACE_VERSION;
+    uint32_t reserved = 0;
+
+    write_bytes(writer, magic, sizeof(magic));
+    write_bytes(writer, &version, sizeof(version));
+    write_bytes(writer, &reserved, sizeof(reserved));
+
+    return writer;
+}
+
+// Longer token text is cut to this when it is written, and looked up cut
+// the same way
+static size_t trace_text_length(const char *text) {
+    size_t length = strlen(text);
+    return (length > UINT16_MAX) ? UINT16_MAX : length;
+}
+
+// Index + 1 of the text, or 0 if it has not been written yet
+static uint32_t lookup_text(token_trace_writer writer, const char *text, size_t length) {
+    if(text[length] == '\0')
+        return GPOINTER_TO_UINT(g_hash_table_lookup(writer->text_ids, text));
+
+    char *cut = g_strndup(text, length);
+    uint32_t found = GPOINTER_TO_UINT(g_hash_table_lookup(writer->text_ids, cut));
+    g_free(cut);
+
+    return found;
+}
+
+// Adds the text the first time it is seen, and only its index after that
+static void append_text(token_trace_writer writer, GByteArray *record, const char *text, uint32_t *text_id) {
+    size_t length = trace_text_length(text);
+
+    uint32_t found = lookup_text(writer, text, length);
+    if(found != 0) {
+        *text_id = found - 1;
+        g_byte_array_append(record, (const guint8 *)text_id, sizeof(*text_id));
+        return;
+    }
+
+    uint16_t length16 = (uint16_t)length;
+    *text_id = writer->num_texts++;
+    g_hash_table_insert(writer->text_ids, g_strndup(text, length), GUINT_TO_POINTER(*text_id + 1));
+
+    g_byte_array_append(record, (const guint8 *)text_id, sizeof(*text_id));
+    g_byte_array_append(record, (const guint8 *)&length16, sizeof(length16));
+    g_byte_array_append(record, (const guint8 *)text, length);
+}
+
+void token_trace_writer_add(token_trace_writer writer, AprilResultType type, size_t count, const AprilToken *tokens) {
+    if(writer->failed) return;
+
+    int64_t now = g_get_monotonic_time();
+    if(writer->start_time < 0) writer->start_time = now;
+
+    if(tokens == NULL) count = 0;
+    if(count > UINT32_MAX) count = UINT32_MAX;
+
+    // Find how many tokens are the same as in the previous record. The text
+    // of a known token only needs a lookup, so compare that last.
+    uint32_t common = 0;
+    for(; common < writer->previous->len && common < count; common++) {
+        const struct trace_token *prev = &g_array_index(writer->previous, struct trace_token, common);
+        const AprilToken *token = &tokens[common];
+
+        if((prev->flags != (uint32_t)token->flags) || (prev->logprob != token->logprob) || (prev->time_ms != (uint32_t)token->time_ms)) break;
+
+        uint32_t found = lookup_text(writer, token->token, trace_text_length(token->token));
+        if((found == 0) || (found - 1 != prev->text_id)) break;
+    }
+
+    int64_t time_us = now - writer->start_time;
+    uint8_t type8 = (uint8_t)type;
+    uint32_t added = (uint32_t)count - common;
+
+    // The record is put together first and written in one go, so a failure
+    // can only cut it short, never leave its header promising other tokens
+    GByteArray *record = writer->record;
+    g_byte_array_set_size(record, 0);
+    g_byte_array_append(record, (const guint8 *)&time_us, sizeof(time_us));
+    g_byte_array_append(record, (const guint8 *)&type8, sizeof(type8));
+    g_byte_array_append(record, (const guint8 *)&common, sizeof(common));
+    g_byte_array_append(record, (const guint8 *)&added, sizeof(added));
+
+    size_t previous_len = writer->previous->len;
+    for(size_t i=common; i<count; i++) {
+        struct trace_token token = {
+            .logprob = tokens[i].logprob,
+            .flags = (uint32_t)tokens[i].flags,
+            .time_ms = (uint32_t)tokens[i].time_ms
+        };
+
+        append_text(writer, record, tokens[i].token, &token.text_id);
+
+        g_byte_array_append(record, (const guint8 *)&token.logprob, sizeof(token.logprob));
+        g_byte_array_append(record, (const guint8 *)&token.flags, sizeof(token.flags));
+        g_byte_array_append(record, (const guint8 *)&token.time_ms, sizeof(token.time_ms));
+
+        // Kept past the end for now, the previous record stays as it was
+        // until this one is written
+        g_array_append_val(writer->previous, token);
+    }
+
+    if(!write_bytes(writer, record->data, record->len)) return;
+
+    g_array_remove_range(writer->previous, common, previous_len - common);
+}
+
+void token_trace_writer_free(token_trace_writer writer) {
+    if(fclose(writer->file) != 0 && !writer->failed)
+        printf("Writing trace %s failed\n", writer->path);
+
+    g_hash_table_destroy(writer->text_ids);
+    g_array_free(writer->previous, TRUE);
+    g_byte_array_free(writer->record, TRUE);
+    g_free(writer->path);
+    free(writer);
+}
+
+
+static bool read_bytes(token_trace_reader reader, void *data, size_t size) {
+    return fread(data, 1, size, reader->file) == size;
+}
+
+token_trace_reader token_trace_reader_new(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if(file == NULL) {
+        printf("Could not open trace %s\n", path);
+        return NULL;
+    }
+
+    char magic[8] = { 0 };
+    uint32_t version = 0;
+    uint32_t reserved = 0;
+
+    if((fread(magic, 1, sizeof(magic), file) != sizeof(magic))
+       || (fread(&version, 1, sizeof(version), file) != sizeof(version))
+       || (fread(&reserved, 1, sizeof(reserved), file) != sizeof(reserved))
+       || (memcmp(magic, TOKEN_TRACE_MAGIC, sizeof(TOKEN_TRACE_MAGIC)) != 0)) {
+        printf("%s is not a trace\n", path);
+        fclose(file);
+        return NULL;
+    }
+
+    if(version != TOKEN_TRACE_VERSION) {
+        printf("Trace %s has version %u, only version %d is supported\n", path, version, TOKEN_TRACE_VERSION);
+        fclose(file);
+        return NULL;
+    }
+
+    token_trace_reader reader = calloc(1, sizeof(struct token_trace_reader_i));
+    reader->file = file;
+    reader->path = g_strdup(path);
+    reader->text_chunk = g_string_chunk_new(4096);
+    reader->texts = g_ptr_array_new();
+    reader->tokens = g_array_new(FALSE, TRUE, sizeof(AprilToken));
+
+    return reader;
+}
+
+static bool read_token(token_trace_reader reader, AprilToken *token) {
+    uint32_t text_id;
+    if(!read_bytes(reader, &text_id, sizeof(text_id))) return false;
+
+    if(text_id == reader->texts->len) {
+        char text[UINT16_MAX];
+        uint16_t length;
+
+        if(!read_bytes(reader, &length, sizeof(length))) return false;
+        if(!read_bytes(reader, text, length)) return false;
+
+        g_ptr_array_add(reader->texts, g_string_chunk_insert_len(reader->text_chunk, text, length));
+    } else if(text_id > reader->texts->len) {
+        return false;
+    }
+
+    uint32_t flags, time_ms;
+    if(!read_bytes(reader, &token->logprob, sizeof(token->logprob))) return false;
+    if(!read_bytes(reader, &flags, sizeof(flags))) return false;
+    if(!read_bytes(reader, &time_ms, sizeof(time_ms))) return false;
+
+    token->token = g_ptr_array_index(reader->texts, text_id);
+    token->flags = flags;
+    token->time_ms = time_ms;
+
+    return true;
+}
+
+bool token_trace_reader_next(token_trace_reader reader, struct token_trace_event *event) {
+    int64_t time_us;
+    uint8_t type8;
+    uint32_t common, added;
+
+    // Running out exactly between records is the normal end of a trace
+    if(!read_bytes(reader, &time_us, sizeof(time_us))) return false;
+
+    if(!read_bytes(reader, &type8, sizeof(type8))
+       || !read_bytes(reader, &common, sizeof(common))
+       || !read_bytes(reader, &added, sizeof(added))
+       || (common > reader->tokens->len)) goto corrupt;
+
+    g_array_set_size(reader->tokens, common);
+    for(uint32_t i=0; i<added; i++) {
+        AprilToken token = { 0 };
+        if(!read_token(reader, &token)) goto corrupt;
+
+        g_array_append_val(reader->tokens, token);
+    }
+
+    event->type = (AprilResultType)type8;
+    event->time_us = time_us;
+    event->count = reader->tokens->len;
+    event->tokens = (const AprilToken *)reader->tokens->data;
+
+    return true;
+
+corrupt:
+    printf("Trace %s is truncated or corrupt, stopping there\n", reader->path);
+    return false;
+}
+
+void token_trace_reader_free(token_trace_reader reader) {
+    fclose(reader->file);
+
+    g_array_free(reader->tokens, TRUE);
+    g_ptr_array_free(reader->texts, TRUE);
+    g_string_chunk_free(reader->text_chunk);
+    g_free(reader->path);
+    free(reader);
+}
@@ -0,0 +1,72 @@
+/* token-trace.h
+ * This file contains token_trace_writer and token_trace_reader, which save
+ * the results the model hands to the result handler and read them back, so
+ * that a session can be replayed through the captioning path without audio
+ * or a model.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <april_api.h>
+
+// A trace is a header followed by one record per result, in host byte
+// order. Each token text is written once and referred to by index after
+// that, and each record only holds the tokens that differ from the record
+// before it, since partials mostly repeat the previous one.
+#define TOKEN_TRACE_MAGIC "LCTRACE"
+#define TOKEN_TRACE_VERSION 1
+
+struct token_trace_writer_i;
+typedef struct token_trace_writer_i * token_trace_writer;
+
+// Returns NULL if the file can't be created
+token_trace_writer token_trace_writer_new(const char *path);
+
+// Must not be called from more than one thread at a time. Stops recording
+// after the first write error.
+void token_trace_writer_add(token_trace_writer writer, AprilResultType type, size_t count, const AprilToken *tokens);
+
+// Flushes and closes the file
+void token_trace_writer_free(token_trace_writer writer);
+
+
+struct token_trace_reader_i;
+typedef struct token_trace_reader_i * token_trace_reader;
+
+struct token_trace_event {
+    AprilResultType type;
+
+    // Since the first result of the trace
+    int64_t time_us;
+
+    // Valid until the next call to token_trace_reader_next. Token texts stay
+    // valid until the reader is freed.
+    size_t count;
+    const AprilToken *tokens;
+};
+
+// Returns NULL if the file can't be opened or is not a trace
+token_trace_reader token_trace_reader_new(const char *path);
+
+// Returns false at the end of the trace, or if the rest of it is unreadable
+bool token_trace_reader_next(token_trace_reader reader, struct token_trace_event *event);
+
+void token_trace_reader_free(token_trace_reader reader);
@@ -0,0 +1,206 @@
+/* transcript-buffer.c
+ * Implements the transcript text buffer
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include <glib.h>
+
+#include "transcript-buffer.h"
+
+// How far past the end the view may be scrolled up, in pixels, and still
+// count as following the text
+#define FOLLOW_SLACK 8.0
+
+struct transcript_buffer_i {
+    GtkTextView *view;
+    GtkTextBuffer *buffer;
+    GtkAdjustment *vadjustment;
+    gulong value_changed_handler;
+
+    // Where the live tail begins, and the end of the text to scroll to
+    GtkTextMark *live_start;
+    GtkTextMark *end;
+
+    // What the live tail currently reads, to diff the next one against
+    GString *live;
+
+    size_t max_chars;
+
+    // Whether the user has left the view at the bottom
+    bool follow;
+};
+
+static void on_value_changed(GtkAdjustment *adjustment, gpointer userdata) {
+    transcript_buffer tb = userdata;
+
+    double bottom = gtk_adjustment_get_upper(adjustment) - gtk_adjustment_get_page_size(adjustment);
+    tb->follow = gtk_adjustment_get_value(adjustment) >= (bottom - FOLLOW_SLACK);
+}
+
+transcript_buffer transcript_buffer_new(GtkTextView *view, GtkScrolledWindow *scroll) {
+    transcript_buffer tb = calloc(1, sizeof(struct transcript_buffer_i));
+
+    tb->view = g_object_ref(view);
+    tb->buffer = gtk_text_view_get_buffer(view);
+    tb->live = g_string_new(NULL);
+    tb->follow = true;
+
+    GtkTextIter end_iter;
+    gtk_text_buffer_get_end_iter(tb->buffer, &end_iter);
+
+    // Text inserted at the live start goes after it, the end mark stays
+    // after anything inserted at the end
+    tb->live_start = gtk_text_buffer_create_mark(tb->buffer, NULL, &end_iter, TRUE);
+    tb->end = gtk_text_buffer_create_mark(tb->buffer, NULL, &end_iter, FALSE);
+
+    if(scroll != NULL) {
+        tb->vadjustment = g_object_ref(gtk_scrolled_window_get_vadjustment(scroll));
+        tb->value_changed_handler = g_signal_connect(tb->vadjustment, "value-changed", G_CALLBACK(on_value_changed), tb);
+    }
+
+    return tb;
+}
+
+void transcript_buffer_free(transcript_buffer tb) {
+    if(tb->vadjustment != NULL) {
+        g_signal_handler_disconnect(tb->vadjustment, tb->value_changed_handler);
+        g_object_unref(tb->vadjustment);
+    }
+
+    gtk_text_buffer_delete_mark(tb->buffer, tb->live_start);
+    gtk_text_buffer_delete_mark(tb->buffer, tb->end);
+    g_object_unref(tb->view);
+
+    g_string_free(tb->live, TRUE);
+    free(tb);
+}
+
+void transcript_buffer_set_max_chars(transcript_buffer tb, size_t max_chars) {
+    tb->max_chars = max_chars;
+}
+
+// The length in bytes of the common prefix of a and b, not splitting a
+// character
+static size_t common_prefix(const char *a, size_t a_len, const char *b, size_t b_len) {
+    size_t n = MIN(a_len, b_len);
+
+    size_t i = 0;
+    while((i < n) && (a[i] == b[i])) i++;
+
+    // Back up to the start of the character that differs
+    while((i > 0) && (i < n) && ((a[i] & 0xC0) == 0x80)) i--;
+
+    return i;
+}
+
+// The same for the common suffix, leaving at least skip bytes of both alone
+static size_t common_suffix(const char *a, size_t a_len, const char *b, size_t b_len, size_t skip) {
+    size_t n = MIN(a_len, b_len) - skip;
+
+    size_t i = 0;
+    while((i < n) && (a[a_len - 1 - i] == b[b_len - 1 - i])) i++;
+
+    // Move forward to the start of a character
+    while((i > 0) && ((a[a_len - i] & 0xC0) == 0x80)) i--;
+
+    return i;
+}
+
+// Replaces the live tail with text, leaving the characters both share at
+// the start and end of the tail untouched
+static void replace_tail(transcript_buffer tb, const char *text, size_t len) {
+    const char *old = tb->live->str;
+    size_t old_len = tb->live->len;
+
+    size_t prefix = common_prefix(old, old_len, text, len);
+    size_t suffix = common_suffix(old, old_len, text, len, prefix);
+
+    if((prefix == old_len) && (prefix == len)) return;
+
+    GtkTextIter start_iter, end_iter;
+    gtk_text_buffer_get_iter_at_mark(tb->buffer, &start_iter, tb->live_start);
+    gtk_text_iter_forward_chars(&start_iter, (gint)g_utf8_strlen(old, (gssize)prefix));
+
+    if((prefix + suffix) < old_len) {
+        end_iter = start_iter;
+        gtk_text_iter_forward_chars(&end_iter, (gint)g_utf8_strlen(old + prefix, (gssize)(old_len - prefix - suffix)));
+        gtk_text_buffer_delete(tb->buffer, &start_iter, &end_iter);
+    }
+
+    if((prefix + suffix) < len)
+        gtk_text_buffer_insert(tb->buffer, &start_iter, text + prefix, (gint)(len - prefix - suffix));
+
+    g_string_truncate(tb->live, 0);
+    g_string_append_len(tb->live, text, (gssize)len);
+}
+
+// Drops the oldest text once there is a quarter more than should be kept,
+// so that this does not happen with every update
+static void trim_head(transcript_buffer tb) {
+    if(tb->max_chars == 0) return;
+
+    size_t count = (size_t)gtk_text_buffer_get_char_count(tb->buffer);
+    if(count <= (tb->max_chars + tb->max_chars / 4)) return;
+
+    GtkTextIter start_iter, end_iter, live_iter;
+    gtk_text_buffer_get_start_iter(tb->buffer, &start_iter);
+    gtk_text_buffer_get_iter_at_offset(tb->buffer, &end_iter, (gint)(count - tb->max_chars));
+
+    // The live tail is never trimmed
+    gtk_text_buffer_get_iter_at_mark(tb->buffer, &live_iter, tb->live_start);
+    if(gtk_text_iter_compare(&end_iter, &live_iter) > 0) end_iter = live_iter;
+
+    // Do not leave half a word behind
+    if(gtk_text_iter_inside_word(&end_iter) && !gtk_text_iter_starts_word(&end_iter)) {
+        gtk_text_iter_forward_word_end(&end_iter);
+        if(gtk_text_iter_compare(&end_iter, &live_iter) > 0) end_iter = live_iter;
+    }
+
+    gtk_text_buffer_delete(tb->buffer, &start_iter, &end_iter);
+}
+
+void transcript_buffer_update(transcript_buffer tb, const char *final, size_t final_len, const char *live, size_t live_len) {
+    // Following has to be decided before the text changes size
+    bool follow = tb->follow;
+
+    if(final_len > 0) {
+        // The final result usually reads like the live tail did, so the
+        // tail is diffed against the finalized text followed by the new
+        // tail and the live start then moved past the finalized part
+        GString *tail = g_string_sized_new(final_len + live_len);
+        g_string_append_len(tail, final, (gssize)final_len);
+        g_string_append_len(tail, live, (gssize)live_len);
+
+        replace_tail(tb, tail->str, tail->len);
+        g_string_free(tail, TRUE);
+
+        GtkTextIter live_iter;
+        gtk_text_buffer_get_iter_at_mark(tb->buffer, &live_iter, tb->live_start);
+        gtk_text_iter_forward_chars(&live_iter, (gint)g_utf8_strlen(final, (gssize)final_len));
+        gtk_text_buffer_move_mark(tb->buffer, tb->live_start, &live_iter);
+
+        g_string_erase(tb->live, 0, (gssize)final_len);
+
+        trim_head(tb);
+    } else {
+        replace_tail(tb, live, live_len);
+    }
+
+    if(follow) gtk_text_view_scroll_mark_onscreen(tb->view, tb->end);
+}
@@ -0,0 +1,44 @@
+/* transcript-buffer.h
+ * This file contains the declaration for transcript_buffer, which keeps the
+ * scrolling transcript of the main window. Finalized text is locked in
+ * ahead of the live tail, which is replaced with every partial result by
+ * only touching the characters that changed. The oldest text is trimmed
+ * once the transcript grows past its retention limit.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <gtk/gtk.h>
+
+typedef struct transcript_buffer_i *transcript_buffer;
+
+// Text already in the buffer of view is kept as finalized text. scroll is
+// the scrolled window containing view. Must be used from the main thread.
+transcript_buffer transcript_buffer_new(GtkTextView *view, GtkScrolledWindow *scroll);
+void transcript_buffer_free(transcript_buffer tb);
+
+// The number of characters to keep, 0 to keep everything. Text is trimmed
+// from the start a chunk at a time, so the transcript may briefly hold a
+// quarter more than this.
+void transcript_buffer_set_max_chars(transcript_buffer tb, size_t max_chars);
+
+// Appends final to the finalized text and makes live the new live tail.
+// Either may be empty. The view only follows the end of the text if it was
+// already scrolled to the bottom.
+void transcript_buffer_update(transcript_buffer tb, const char *final, size_t final_len, const char *live, size_t live_len);
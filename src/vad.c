@@ -0,0 +1,257 @@
+/* vad.c
+ * Implements vad
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vad.h"
+#include "pcm-level.h"
+
+#include <math.h>
+#include <string.h>
+
+#define VAD_FRAME_MS 16
+#define VAD_MIN_FRAME 64
+
+// Audio fed ahead of the first loud frame, so soft onsets are not lost
+#define VAD_PREROLL_MS 200
+
+// Loud frames in a row before it counts as speech, to ignore clicks
+#define VAD_ONSET_MS 32
+
+// How long speech is kept going after the last loud frame, to cover
+// trailing consonants and short gaps between words
+#define VAD_HANGOVER_MS 400
+
+// A frame is loud when it is this many times the noise floor in energy (6 dB)
+#define VAD_SPEECH_RATIO 4.0
+
+// and above the level of an RMS of 24, which is silence whatever the floor
+#define VAD_MIN_ENERGY (24.0 * 24.0)
+
+// The floor follows quieter frames quickly and anything else slowly, so it
+// still catches up when the background gets louder for good
+#define VAD_FLOOR_FOLLOW 0.05
+#define VAD_FLOOR_RISE_DB_PER_SECOND 1.0
+
+// White noise has a flatness of about 0.56, voiced speech far below that
+#define VAD_MAX_FLATNESS 0.35
+
+// Where speech has most of its energy
+#define VAD_FLATNESS_LOW_HZ 150.0
+#define VAD_FLATNESS_HIGH_HZ 4000.0
+
+static int ms_to_frames(const struct vad *vad, int ms) {
+    int frames = (int)((double)ms * vad->sample_rate / (1000.0 * (double)vad->frame_samples) + 0.5);
+    return frames > 0 ? frames : 1;
+}
+
+void vad_init(struct vad *vad, int sample_rate, bool use_flatness) {
+    memset(vad, 0, sizeof(*vad));
+
+    vad->sample_rate = sample_rate;
+    vad->use_flatness = use_flatness;
+
+    size_t target = (size_t)sample_rate * VAD_FRAME_MS / 1000;
+    vad->frame_samples = VAD_MIN_FRAME;
+    while((vad->frame_samples * 2 <= target) && (vad->frame_samples * 2 <= VAD_MAX_FRAME))
+        vad->frame_samples *= 2;
+
+    vad->onset_frames = ms_to_frames(vad, VAD_ONSET_MS);
+    vad->hangover_frames = ms_to_frames(vad, VAD_HANGOVER_MS);
+
+    // The onset frames are held back too, so there has to be room for them
+    vad->preroll_capacity = ms_to_frames(vad, VAD_PREROLL_MS) + vad->onset_frames;
+    if(vad->preroll_capacity > VAD_MAX_PREROLL_FRAMES) vad->preroll_capacity = VAD_MAX_PREROLL_FRAMES;
+
+    for(size_t i=0; i<vad->frame_samples; i++)
+        vad->window[i] = (float)(0.5 - 0.5 * cos(2.0 * M_PI * (double)i / (double)vad->frame_samples));
+
+    double bin_hz = (double)sample_rate / (double)vad->frame_samples;
+    vad->flatness_low_bin = (size_t)(VAD_FLATNESS_LOW_HZ / bin_hz) + 1;
+    vad->flatness_high_bin = (size_t)(VAD_FLATNESS_HIGH_HZ / bin_hz);
+    if(vad->flatness_high_bin > vad->frame_samples / 2) vad->flatness_high_bin = vad->frame_samples / 2;
+}
+
+void vad_reset(struct vad *vad) {
+    vad->in_speech = false;
+    vad->loud_run = 0;
+    vad->hangover_left = 0;
+    vad->preroll_frames = 0;
+    vad->preroll_head = 0;
+}
+
+size_t vad_frame_samples(const struct vad *vad) {
+    return vad->frame_samples;
+}
+
+static double frame_energy(const short *frame, size_t count) {
+    struct pcm_level level;
+    pcm_level_scan(frame, count, &level);
+    return (double)level.sum_squares / (double)count;
+}
+
+// In-place radix-2 FFT, count must be a power of two
+static void fft(float *re, float *im, size_t count) {
+    for(size_t i=1, j=0; i<count; i++) {
+        size_t bit = count >> 1;
+        for(; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+
+        if(i < j) {
+            float t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+
+    for(size_t len=2; len<=count; len<<=1) {
+        double angle = -2.0 * M_PI / (double)len;
+        float w_re = (float)cos(angle), w_im = (float)sin(angle);
+
+        for(size_t i=0; i<count; i+=len) {
+            float cur_re = 1.0f, cur_im = 0.0f;
+
+            for(size_t k=0; k<len/2; k++) {
+                size_t a = i + k, b = i + k + len/2;
+
+                float t_re = re[b] * cur_re - im[b] * cur_im;
+                float t_im = re[b] * cur_im + im[b] * cur_re;
+
+                re[b] = re[a] - t_re;
+                im[b] = im[a] - t_im;
+                re[a] += t_re;
+                im[a] += t_im;
+
+                float next_re = cur_re * w_re - cur_im * w_im;
+                cur_im = cur_re * w_im + cur_im * w_re;
+                cur_re = next_re;
+            }
+        }
+    }
+}
+
+// Geometric over arithmetic mean of the power spectrum: near 1 for noise,
+// near 0 for harmonics
+static double spectral_flatness(const struct vad *vad, const short *frame) {
+    float re[VAD_MAX_FRAME], im[VAD_MAX_FRAME];
+
+    for(size_t i=0; i<vad->frame_samples; i++) {
+        re[i] = (float)frame[i] * vad->window[i];
+        im[i] = 0.0f;
+    }
+
+    fft(re, im, vad->frame_samples);
+
+    double log_sum = 0.0, sum = 0.0;
+    size_t bins = 0;
+    for(size_t k=vad->flatness_low_bin; k<=vad->flatness_high_bin; k++) {
+        // Keeps empty bins from sending the log to minus infinity
+        double power = (double)re[k] * re[k] + (double)im[k] * im[k] + 1.0;
+
+        log_sum += log(power);
+        sum += power;
+        bins++;
+    }
+
+    if(bins == 0) return 0.0;
+
+    return exp(log_sum / (double)bins) / (sum / (double)bins);
+}
+
+static void hold_frame(struct vad *vad, const short *frame) {
+    int slot = (vad->preroll_head + vad->preroll_frames) % vad->preroll_capacity;
+    memcpy(vad->preroll[slot], frame, vad->frame_samples * sizeof(short));
+
+    if(vad->preroll_frames < vad->preroll_capacity) {
+        vad->preroll_frames++;
+    } else {
+        // Full, the oldest frame was just overwritten
+        vad->preroll_head = (vad->preroll_head + 1) % vad->preroll_capacity;
+    }
+}
+
+size_t vad_take_preroll(struct vad *vad, short *out) {
+    size_t written = 0;
+    for(int i=0; i<vad->preroll_frames; i++) {
+        int slot = (vad->preroll_head + i) % vad->preroll_capacity;
+        memcpy(&out[written], vad->preroll[slot], vad->frame_samples * sizeof(short));
+        written += vad->frame_samples;
+    }
+
+    vad->preroll_frames = 0;
+    vad->preroll_head = 0;
+
+    return written;
+}
+
+static void update_noise_floor(struct vad *vad, double energy, bool loud) {
+    if(!vad->noise_floor_set) {
+        vad->noise_floor = energy;
+        vad->noise_floor_set = true;
+        return;
+    }
+
+    // Quiet stretches within speech are not background, so the floor is only
+    // pulled up outside of it
+    if((energy < vad->noise_floor) || (!loud && !vad->in_speech)) {
+        vad->noise_floor += (energy - vad->noise_floor) * VAD_FLOOR_FOLLOW;
+    } else {
+        double seconds = (double)vad->frame_samples / vad->sample_rate;
+        vad->noise_floor *= pow(10.0, VAD_FLOOR_RISE_DB_PER_SECOND * seconds / 10.0);
+    }
+
+    // Digital silence would otherwise pull it to 0, making every sound loud
+    if(vad->noise_floor < VAD_MIN_ENERGY / VAD_SPEECH_RATIO) vad->noise_floor = VAD_MIN_ENERGY / VAD_SPEECH_RATIO;
+}
+
+VadResult vad_process_frame(struct vad *vad, const short *frame) {
+    double energy = frame_energy(frame, vad->frame_samples);
+
+    bool loud = (energy > VAD_MIN_ENERGY)
+             && (!vad->noise_floor_set || (energy > vad->noise_floor * VAD_SPEECH_RATIO));
+
+    // The spectrum is only needed for frames that could be speech
+    if(loud && vad->use_flatness)
+        loud = spectral_flatness(vad, frame) < VAD_MAX_FLATNESS;
+
+    update_noise_floor(vad, energy, loud);
+
+    if(vad->in_speech) {
+        if(loud) {
+            vad->hangover_left = vad->hangover_frames;
+            return VAD_SPEECH;
+        }
+
+        if(vad->hangover_left > 0) {
+            vad->hangover_left--;
+            return VAD_SPEECH;
+        }
+
+        vad->in_speech = false;
+        vad->loud_run = 0;
+        hold_frame(vad, frame);
+        return VAD_SPEECH_END;
+    }
+
+    hold_frame(vad, frame);
+
+    vad->loud_run = loud ? (vad->loud_run + 1) : 0;
+    if(vad->loud_run < vad->onset_frames) return VAD_SILENCE;
+
+    vad->in_speech = true;
+    vad->hangover_left = vad->hangover_frames;
+    return VAD_SPEECH_START;
+}
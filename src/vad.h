@@ -0,0 +1,100 @@
+/* vad.h
+ * This file contains vad, which tells speech apart from background noise
+ * before audio is fed to the model. A frame counts as speech when its energy
+ * stands out from a tracked noise floor, and optionally when its spectrum is
+ * not flat like a fan or hiss. Utterances are padded with the audio just
+ * before their start and kept open for a moment after the last loud frame.
+ *
+ * Copyright 2022 abb128
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define VAD_MAX_FRAME 512
+
+// Frames held back while there is no speech, fed when speech starts
+#define VAD_MAX_PREROLL_FRAMES 32
+
+typedef enum VadResult {
+    // Not speech, the frame is held back
+    VAD_SILENCE = 0,
+
+    // Speech started. The held back frames, this one included, should be
+    // taken with vad_take_preroll and fed.
+    VAD_SPEECH_START,
+
+    // Still speech, the frame should be fed
+    VAD_SPEECH,
+
+    // The utterance ended with the frame before, which should be flushed.
+    // The frame is held back.
+    VAD_SPEECH_END
+} VadResult;
+
+struct vad {
+    int sample_rate;
+    size_t frame_samples;
+    bool use_flatness;
+
+    // Mean square of the background, in PCM16 units
+    double noise_floor;
+    bool noise_floor_set;
+
+    bool in_speech;
+    int loud_run;
+    int hangover_left;
+
+    int onset_frames;
+    int hangover_frames;
+
+    short preroll[VAD_MAX_PREROLL_FRAMES][VAD_MAX_FRAME];
+    int preroll_frames;
+    int preroll_capacity;
+    int preroll_head;
+
+    // For the spectral flatness
+    float window[VAD_MAX_FRAME];
+    size_t flatness_low_bin;
+    size_t flatness_high_bin;
+};
+
+void vad_init(struct vad *vad, int sample_rate, bool use_flatness);
+
+// Forgets any held back audio and ongoing speech, keeps the noise floor
+void vad_reset(struct vad *vad);
+
+// Frames are a power of two long, around 16 ms
+size_t vad_frame_samples(const struct vad *vad);
+
+// Takes exactly vad_frame_samples samples
+VadResult vad_process_frame(struct vad *vad, const short *frame);
+
+// Copies the held back frames into out, oldest first, and forgets them.
+// out must have room for VAD_MAX_PREROLL_FRAMES frames. Returns the number
+// of samples copied.
+size_t vad_take_preroll(struct vad *vad, short *out);
+
+// How much of the audio went to the model, for showing what was saved
+struct vad_stats {
+    bool enabled;
+
+    size_t samples_seen;
+    size_t samples_fed;
+    size_t utterances;
+};